@@ -0,0 +1,136 @@
+/*
+  captureworker.cpp
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "captureworker.h"
+
+#include <chrono>
+
+using namespace std;
+
+static bool hasSameContents(const MappedRegion &a, const MappedRegion &b)
+{
+    return a.start == b.start && a.end == b.end && a.backingFile == b.backingFile &&
+           a.runStarts == b.runStarts && a.useCounts == b.useCounts && a.combinedFlags == b.combinedFlags &&
+           a.placementStarts == b.placementStarts && a.placements == b.placements;
+}
+
+MappedRegionSnapshot shareUnchangedRegions(const vector<MappedRegion> &regions, const MappedRegionSnapshot &previous)
+{
+    MappedRegionSnapshot ret;
+    ret.reserve(regions.size());
+    auto prev = previous.begin();
+    for (const MappedRegion &region : regions) {
+        while (prev != previous.end() && (*prev)->start < region.start) {
+            ++prev;
+        }
+        if (prev != previous.end() && hasSameContents(**prev, region)) {
+            ret.push_back(*prev);
+        } else {
+            ret.push_back(make_shared<const MappedRegion>(region));
+        }
+    }
+    return ret;
+}
+
+CaptureWorker::CaptureWorker(unsigned int pid, unsigned int interval, const CaptureOptions &options,
+                             function<void()> frameAvailable)
+   : m_pid(pid),
+     m_interval(interval),
+     m_options(options),
+     m_frameAvailable(move(frameAvailable)),
+     m_stop(false),
+     m_haveFrame(false),
+     m_droppedFrames(0)
+{
+    // start the thread last, it uses the other members
+    m_thread = thread(&CaptureWorker::run, this);
+}
+
+CaptureWorker::~CaptureWorker()
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_stopRequested.notify_one();
+    m_thread.join();
+}
+
+bool CaptureWorker::takeFrame(Frame *frame)
+{
+    lock_guard<mutex> lock(m_mutex);
+    if (!m_haveFrame) {
+        return false;
+    }
+    *frame = move(m_frame);
+    frame->droppedFrames = m_droppedFrames;
+    m_frame = Frame();
+    m_haveFrame = false;
+    m_droppedFrames = 0;
+    return true;
+}
+
+void CaptureWorker::run()
+{
+    // only used in this thread
+    unique_ptr<PageInfo> pageInfo; // kept between updates, see PageInfo::update()
+    MappedRegionSnapshot previous;
+
+    chrono::steady_clock::time_point nextCapture = chrono::steady_clock::now();
+    unique_lock<mutex> lock(m_mutex);
+    while (!m_stop) {
+        lock.unlock();
+        if (pageInfo) {
+            pageInfo->update();
+        } else {
+            pageInfo.reset(new PageInfo(m_pid, m_options));
+        }
+        Frame frame;
+        frame.regions = shareUnchangedRegions(pageInfo->mappedRegions(), previous);
+        frame.stats = pageInfo->captureStats();
+        previous = frame.regions;
+
+        lock.lock();
+        const bool wasEmpty = !m_haveFrame;
+        if (!wasEmpty) {
+            m_droppedFrames++;
+        }
+        m_frame = move(frame);
+        m_haveFrame = true;
+        if (wasEmpty) {
+            lock.unlock();
+            m_frameAvailable();
+            lock.lock();
+        }
+
+        // the interval is from the start of one capture to the start of the next; captures that take
+        // longer than the interval delay the next one instead of causing a burst to catch up
+        nextCapture = max(nextCapture + chrono::milliseconds(m_interval), chrono::steady_clock::now());
+        m_stopRequested.wait_until(lock, nextCapture, [this] { return m_stop; });
+    }
+}
@@ -0,0 +1,86 @@
+/*
+  captureworker.h
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef CAPTUREWORKER_H
+#define CAPTUREWORKER_H
+
+#include "pageinfo.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Copies the regions that changed since the previous snapshot and shares the others with it, so that
+// changed regions can be found by pointer like in the snapshots of PageInfoReader and PageInfoRecording.
+MappedRegionSnapshot shareUnchangedRegions(const std::vector<MappedRegion> &regions,
+                                           const MappedRegionSnapshot &previous);
+
+// Captures the PageInfo of a local process every interval milliseconds in its own thread, so that
+// capturing a large process doesn't block the caller. Only the latest frame is kept: a frame that was
+// not taken before the next one is captured is dropped.
+class CaptureWorker
+{
+public:
+    struct Frame
+    {
+        Frame() : droppedFrames(0) {}
+        MappedRegionSnapshot regions; // shares unchanged regions with the previous frame; empty on error
+        CaptureStats stats;
+        uint64_t droppedFrames; // how many frames were dropped since the last frame that was taken
+    };
+
+    // frameAvailable is called in the worker thread when there is a frame to take after there was none
+    CaptureWorker(unsigned int pid, unsigned int interval, const CaptureOptions &options,
+                  std::function<void()> frameAvailable);
+    // waits until a running capture is finished
+    ~CaptureWorker();
+
+    // false if no frame was captured since the last call
+    bool takeFrame(Frame *frame);
+
+private:
+    void run();
+
+    const unsigned int m_pid;
+    const unsigned int m_interval;
+    const CaptureOptions m_options;
+    const std::function<void()> m_frameAvailable;
+
+    std::mutex m_mutex; // protects the members below
+    std::condition_variable m_stopRequested;
+    bool m_stop;
+    bool m_haveFrame;
+    Frame m_frame;
+    uint64_t m_droppedFrames;
+
+    std::thread m_thread;
+};
+
+#endif // CAPTUREWORKER_H
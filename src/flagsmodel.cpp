@@ -56,10 +56,10 @@ static const char *pageFlagNames[pageFlagCount] = {
     "NOPAGE",
     "KSM",
     "THP",
-    nullptr,
-    nullptr,
-    nullptr,
-    nullptr,
+    "OFFLINE",
+    "ZERO_PAGE",
+    "IDLE", // 25, see CaptureOptions::trackIdlePages
+    "PGTABLE",
     nullptr,
     // flags from /proc/<pid>/pagemap, also documented in linux/Documentation/vm/pagemap.txt -
     // we shift them around a bit to clearly group them together and away from the other group,
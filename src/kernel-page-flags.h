@@ -59,6 +59,10 @@
 
 #define KPF_KSM			21
 #define KPF_THP			22
+#define KPF_OFFLINE		23
+#define KPF_ZERO_PAGE		24
+#define KPF_IDLE		25
+#define KPF_PGTABLE		26
 
 
 #endif /* LINUX_KERNEL_PAGE_FLAGS_H */
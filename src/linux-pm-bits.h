@@ -46,6 +46,48 @@
 #define __PM_SOFT_DIRTY      (1LL)
 #define PM_PRESENT          PM_STATUS(4LL)
 #define PM_SWAP             PM_STATUS(2LL)
+#define PM_FILE             PM_STATUS(1LL)
 #define PM_SOFT_DIRTY       __PM_PSHIFT(__PM_SOFT_DIRTY)
 
+// of swapped out pages, in the bits of the PFN; the offset in the swap area follows in the bits above
+#define PM_SWAP_TYPE_BITS   5
+#define PM_SWAP_TYPE(x)     ((x) & ((1LL << PM_SWAP_TYPE_BITS) - 1))
+
+// from include/uapi/linux/fs.h, for the PAGEMAP_SCAN ioctl on pagemap files (Linux 6.7).
+// _IOWR comes from <sys/ioctl.h>.
+#define PAGEMAP_SCAN        _IOWR('f', 16, struct pm_scan_arg)
+
+#define PAGE_IS_WPALLOWED   (1 << 0)
+#define PAGE_IS_WRITTEN     (1 << 1)
+#define PAGE_IS_FILE        (1 << 2)
+#define PAGE_IS_PRESENT     (1 << 3)
+#define PAGE_IS_SWAPPED     (1 << 4)
+#define PAGE_IS_PFNZERO     (1 << 5)
+#define PAGE_IS_HUGE        (1 << 6)
+#define PAGE_IS_SOFT_DIRTY  (1 << 7)
+
+// pages from start to end (addresses) that are all in the same categories
+struct page_region
+{
+    uint64_t start;
+    uint64_t end;
+    uint64_t categories;
+};
+
+struct pm_scan_arg
+{
+    uint64_t size; // sizeof(struct pm_scan_arg)
+    uint64_t flags; // PM_SCAN_WP_MATCHING and PM_SCAN_CHECK_WPASYNC, unused here
+    uint64_t start;
+    uint64_t end;
+    uint64_t walk_end; // out: where the walk stopped, end if it got there
+    uint64_t vec; // struct page_region array
+    uint64_t vec_len;
+    uint64_t max_pages; // 0: no limit
+    uint64_t category_inverted;
+    uint64_t category_mask; // pages must be in all of these (after inverting)...
+    uint64_t category_anyof_mask; // ...and in any of these
+    uint64_t return_mask; // the categories that are reported, and that split ranges
+};
+
 #endif // LINUX_PM_BITS_H
@@ -29,21 +29,46 @@
 #include "mainwindow.h"
 
 #include "flagsmodel.h"
+#include "mappingsmodel.h"
 #include "mosaicwidget.h"
 
 #include <QBoxLayout>
+#include <QComboBox>
+#include <QHeaderView>
 #include <QLabel>
 #include <QListView>
+#include <QSlider>
+#include <QSortFilterProxyModel>
+#include <QTableView>
 #include <QTextEdit>
 
-MainWindow::MainWindow(uint pid)
-   : m_mosaicWidget(new MosaicWidget(pid))
+using namespace std;
+
+static QString memorySizeText(quint64 bytes)
+{
+    static const char *units[] = { "KiB", "MiB", "GiB", "TiB" };
+    bytes /= 1024;
+    uint unit = 0;
+    for (; bytes >= 1024 && unit < 3; unit++) {
+        bytes /= 1024;
+    }
+    return QString::fromLatin1("%1 %2").arg(bytes).arg(QString::fromLatin1(units[unit]));
+}
+
+MainWindow::MainWindow(uint pid, uint updateInterval, const CaptureOptions &options)
+   : m_mosaicWidget(new MosaicWidget(pid, updateInterval, options))
 {
     init();
 }
 
-MainWindow::MainWindow(const QByteArray &host, uint port)
-   : m_mosaicWidget(new MosaicWidget(host, port))
+MainWindow::MainWindow(const QByteArray &host, uint port, uint updateInterval, const CaptureFilter &filter)
+   : m_mosaicWidget(new MosaicWidget(host, port, updateInterval, filter))
+{
+    init();
+}
+
+MainWindow::MainWindow(unique_ptr<PageInfoRecording> recording)
+   : m_mosaicWidget(new MosaicWidget(move(recording)))
 {
     init();
 }
@@ -84,19 +109,93 @@ void MainWindow::init()
     flagsView->setModel(flagsModel);
     infoLayout->addWidget(flagsView);
 
-    mainLayout->addWidget(m_mosaicWidget);
+    infoLayout->addSpacing(10);
+    QLabel *captureStatsLabel = new QLabel();
+    captureStatsLabel->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
+    infoLayout->addWidget(captureStatsLabel);
+
+    infoLayout->addSpacing(10);
+    QLabel *zoomLabel = new QLabel(QString::fromLatin1("Memory per tile (Ctrl + mouse wheel)"));
+    zoomLabel->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
+    infoLayout->addWidget(zoomLabel);
+    QComboBox *zoomBox = new QComboBox();
+    for (int level = 0; level <= MosaicWidget::maxZoomLevel; level++) {
+        zoomBox->addItem(memorySizeText(quint64(PageInfo::pageSize) << level));
+    }
+    zoomBox->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
+    infoLayout->addWidget(zoomBox);
+
+    infoLayout->addSpacing(10);
+    QLabel *colorLabel = new QLabel(QString::fromLatin1("Colors"));
+    colorLabel->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
+    infoLayout->addWidget(colorLabel);
+    QComboBox *colorBox = new QComboBox();
+    // in the order of MosaicFrame::ColorMode
+    colorBox->addItem(QString::fromLatin1("Kind of page"));
+    colorBox->addItem(QString::fromLatin1("Changes in the last %1 frames").arg(MosaicWidget::historyFrames));
+    colorBox->addItem(QString::fromLatin1("Accessed / idle since the last update"));
+    colorBox->addItem(QString::fromLatin1("NUMA node / swap area"));
+    colorBox->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
+    infoLayout->addWidget(colorBox);
+
+    if (m_mosaicWidget->recordedFrameCount()) {
+        // replaying a recording: a slider to go to any frame below the mosaic
+        QVBoxLayout *replayLayout = new QVBoxLayout();
+        replayLayout->addWidget(m_mosaicWidget);
+        QSlider *frameSlider = new QSlider(Qt::Horizontal);
+        frameSlider->setRange(0, int(m_mosaicWidget->recordedFrameCount()) - 1);
+        replayLayout->addWidget(frameSlider);
+        QLabel *frameLabel = new QLabel();
+        replayLayout->addWidget(frameLabel);
+        mainLayout->addItem(replayLayout);
+
+        connect(frameSlider, SIGNAL(valueChanged(int)), m_mosaicWidget, SLOT(showRecordedFrame(int)));
+        connect(m_mosaicWidget, SIGNAL(showRecordedFrameInfo(QString)), frameLabel, SLOT(setText(QString)));
+        m_mosaicWidget->showRecordedFrame(0); // for the label
+    } else {
+        mainLayout->addWidget(m_mosaicWidget);
+    }
+
+    // RSS, PSS etc. per mapping or backing file, sortable by clicking the column headers
+    QVBoxLayout *mappingsLayout = new QVBoxLayout();
+    QComboBox *groupingBox = new QComboBox();
+    groupingBox->addItem(QString::fromLatin1("Per mapping"));
+    groupingBox->addItem(QString::fromLatin1("Per backing file"));
+    groupingBox->setSizePolicy(QSizePolicy::Fixed, QSizePolicy::Fixed);
+    mappingsLayout->addWidget(groupingBox);
+    m_mappingsModel = new MappingsModel();
+    m_sortedMappings = new QSortFilterProxyModel(this);
+    m_sortedMappings->setSourceModel(m_mappingsModel);
+    m_sortedMappings->setSortRole(MappingsModel::SortRole);
+    QTableView *mappingsView = new QTableView();
+    mappingsView->setModel(m_sortedMappings);
+    mappingsView->setSortingEnabled(true);
+    mappingsView->sortByColumn(MappingsModel::FirstStatsColumn + MappingStats::ResidentField, Qt::DescendingOrder);
+    mappingsView->setSelectionBehavior(QAbstractItemView::SelectRows);
+    mappingsView->horizontalHeader()->setStretchLastSection(true);
+    mappingsLayout->addWidget(mappingsView);
+    mainLayout->addItem(mappingsLayout);
 
     mainContainer->setLayout(mainLayout);
 
+    connect(m_mosaicWidget, SIGNAL(regionsChanged()), this, SLOT(updateMappings()));
+    connect(groupingBox, SIGNAL(currentIndexChanged(int)), m_mappingsModel, SLOT(setGrouping(int)));
+    connect(mappingsView, SIGNAL(clicked(QModelIndex)), this, SLOT(showMapping(QModelIndex)));
+
     connect(m_mosaicWidget, SIGNAL(showFlags(quint32)), flagsModel, SLOT(setFlags(quint32)));
     connect(m_mosaicWidget, SIGNAL(showPageInfo(quint64, quint32, QString)),
             this, SLOT(showPageInfo(quint64, quint32, QString)));
     connect(m_mosaicWidget, SIGNAL(serverConnectionBroke(bool)), this, SLOT(serverConnectionBroke(bool)));
+    connect(m_mosaicWidget, SIGNAL(showCaptureStats(QString)), captureStatsLabel, SLOT(setText(QString)));
+    connect(m_mosaicWidget, SIGNAL(showTileInfo(QString)), this, SLOT(showTileInfo(QString)));
+    connect(zoomBox, SIGNAL(currentIndexChanged(int)), m_mosaicWidget, SLOT(setZoomLevel(int)));
+    connect(m_mosaicWidget, SIGNAL(zoomLevelChanged(int)), zoomBox, SLOT(setCurrentIndex(int)));
+    connect(colorBox, SIGNAL(currentIndexChanged(int)), m_mosaicWidget, SLOT(setColorMode(int)));
 
     setCentralWidget(mainContainer);
 }
 
-void MainWindow::showPageInfo(quint64 addr, quint32 useCount, const QString &backingFile)
+void MainWindow::setInfoTextOptions()
 {
     if (!m_textOptionsSet) {
         m_textOptionsSet = true;
@@ -105,6 +204,11 @@ void MainWindow::showPageInfo(quint64 addr, quint32 useCount, const QString &bac
         to.setWrapMode(QTextOption::WrapAnywhere);
         m_pageInfoText->document()->setDefaultTextOption(to);
     }
+}
+
+void MainWindow::showPageInfo(quint64 addr, quint32 useCount, const QString &backingFile)
+{
+    setInfoTextOptions();
     if (addr) {
         QString backingFileText = backingFile.isEmpty() ? QString::fromLatin1("[none]") : backingFile;
         QString infoText = QString::fromLatin1("Address:\t0x%1\nUse count:\t%2\nBacking file:\n%3")
@@ -123,6 +227,30 @@ void MainWindow::showPageInfo(quint64 addr, quint32 useCount, const QString &bac
     }
 }
 
+void MainWindow::showTileInfo(const QString &text)
+{
+    setInfoTextOptions();
+    QString infoText = text;
+    if (m_serverConnectionBroken) {
+        infoText.prepend(QString::fromLatin1("Disconnected from server.\n"));
+    }
+    m_pageInfoText->setText(infoText);
+}
+
+void MainWindow::updateMappings()
+{
+    m_mappingsModel->setRegions(m_mosaicWidget->regions());
+}
+
+void MainWindow::showMapping(const QModelIndex &index)
+{
+    // only regions have an address, backing files can be mapped in many places
+    const quint64 addr = m_sortedMappings->data(index, MappingsModel::AddressRole).toULongLong();
+    if (addr) {
+        m_mosaicWidget->showAddress(addr);
+    }
+}
+
 void MainWindow::serverConnectionBroke(bool wasConnected)
 {
     m_serverConnectionBroken = true;
@@ -31,7 +31,15 @@
 
 #include <QMainWindow>
 
+#include <memory>
+
+struct CaptureFilter;
+struct CaptureOptions;
+class MappingsModel;
 class MosaicWidget;
+class PageInfoRecording;
+class QModelIndex;
+class QSortFilterProxyModel;
 class QTextEdit;
 
 class MainWindow : public QMainWindow
@@ -40,17 +48,24 @@ class MainWindow : public QMainWindow
 public:
     // parameters are forwarded to MosaicWidget... this is probably going to change when
     // MainWindow becomes more like a proper main window.
-    MainWindow(uint pid);
-    MainWindow(const QByteArray &host, uint port);
+    MainWindow(uint pid, uint updateInterval, const CaptureOptions &options);
+    MainWindow(const QByteArray &host, uint port, uint updateInterval, const CaptureFilter &filter);
+    explicit MainWindow(std::unique_ptr<PageInfoRecording> recording);
 
 private slots:
     void showPageInfo(quint64 addr, quint32 useCount, const QString &backingFile);
+    void showTileInfo(const QString &text);
     void serverConnectionBroke(bool);
+    void updateMappings();
+    void showMapping(const QModelIndex &index);
 
 private:
     void init();
+    void setInfoTextOptions();
 
     MosaicWidget *m_mosaicWidget;
+    MappingsModel *m_mappingsModel;
+    QSortFilterProxyModel *m_sortedMappings;
     QTextEdit *m_pageInfoText;
     bool m_textOptionsSet;
     bool m_serverConnectionBroken;
@@ -0,0 +1,141 @@
+/*
+  mappingsmodel.cpp
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "mappingsmodel.h"
+
+MappingsModel::MappingsModel()
+   : m_grouping(ByRegion)
+{
+}
+
+int MappingsModel::columnCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : ColumnCount;
+}
+
+int MappingsModel::rowCount(const QModelIndex &parent) const
+{
+    return parent.isValid() ? 0 : m_rows.count();
+}
+
+QVariant MappingsModel::data(const QModelIndex &index, int role) const
+{
+    Q_ASSERT(!index.parent().isValid());
+    Q_ASSERT(index.row() >= 0 && index.row() < m_rows.count());
+    Q_ASSERT(index.column() >= 0 && index.column() < ColumnCount);
+
+    const Row &row = m_rows.at(index.row());
+    const int column = index.column();
+    if (role == AddressRole) {
+        return m_grouping == ByRegion ? row.start : quint64(0);
+    } else if (role == Qt::TextAlignmentRole) {
+        return column == BackingFileColumn ? int(Qt::AlignLeft | Qt::AlignVCenter)
+                                           : int(Qt::AlignRight | Qt::AlignVCenter);
+    } else if (role != Qt::DisplayRole && role != SortRole) {
+        return QVariant();
+    }
+
+    if (column == AddressColumn) {
+        if (m_grouping == ByBackingFile) {
+            return row.regionCount;
+        } else if (role == SortRole) {
+            return row.start;
+        }
+        return QString::fromLatin1("%1-%2").arg(row.start, 12, 16, QLatin1Char('0'))
+                                           .arg(row.end, 12, 16, QLatin1Char('0'));
+    } else if (column == BackingFileColumn) {
+        return row.backingFile.isEmpty() ? QString::fromLatin1("[anonymous]") : row.backingFile;
+    }
+    return qulonglong(row.stats.bytes[column - FirstStatsColumn] / 1024);
+}
+
+QVariant MappingsModel::headerData(int section, Qt::Orientation orientation, int role) const
+{
+    if (orientation != Qt::Horizontal || role != Qt::DisplayRole || section < 0 || section >= ColumnCount) {
+        return QVariant();
+    }
+    if (section == AddressColumn) {
+        return QString::fromLatin1(m_grouping == ByRegion ? "Mapping" : "Regions");
+    } else if (section == BackingFileColumn) {
+        return QString::fromLatin1("Backing file");
+    }
+    return QString::fromLatin1("%1 KiB")
+               .arg(QString::fromLatin1(MappingStats::fieldName(MappingStats::Field(section - FirstStatsColumn))));
+}
+
+void MappingsModel::setRegions(const MappedRegionSnapshot &regions)
+{
+    m_regions = regions;
+    updateRows();
+}
+
+// slot
+void MappingsModel::setGrouping(int grouping)
+{
+    if (grouping == m_grouping || (grouping != ByRegion && grouping != ByBackingFile)) {
+        return;
+    }
+    beginResetModel();
+    m_grouping = Grouping(grouping);
+    m_rows.clear();
+    endResetModel();
+    emit headerDataChanged(Qt::Horizontal, AddressColumn, AddressColumn);
+    updateRows();
+}
+
+void MappingsModel::updateRows()
+{
+    QVector<Row> rows;
+    if (m_grouping == ByRegion) {
+        rows.reserve(int(m_regions.size()));
+        for (const std::shared_ptr<const MappedRegion> &region : m_regions) {
+            const Row row = { region->start, region->end, QString::fromStdString(region->backingFile), 1,
+                              region->stats };
+            rows.append(row);
+        }
+    } else {
+        for (const BackingFileStats &fileStats : statsByBackingFile(m_regions)) {
+            const Row row = { 0, 0, QString::fromStdString(fileStats.backingFile), fileStats.regionCount,
+                              fileStats.stats };
+            rows.append(row);
+        }
+    }
+
+    // Most updates only change numbers. Then keep the rows, so that views keep selection and scroll position.
+    bool sameRows = rows.count() == m_rows.count();
+    for (int i = 0; sameRows && i < rows.count(); i++) {
+        sameRows = rows[i].start == m_rows[i].start && rows[i].backingFile == m_rows[i].backingFile;
+    }
+    if (!sameRows) {
+        beginResetModel();
+        m_rows.swap(rows);
+        endResetModel();
+    } else if (!m_rows.isEmpty()) {
+        m_rows.swap(rows);
+        emit dataChanged(index(0, 0), index(m_rows.count() - 1, ColumnCount - 1));
+    }
+}
@@ -0,0 +1,87 @@
+/*
+  mappingsmodel.h
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef MAPPINGSMODEL_H
+#define MAPPINGSMODEL_H
+
+#include <QAbstractTableModel>
+#include <QString>
+#include <QVector>
+
+#include "pageinfo.h"
+
+// The MappingStats of a snapshot as a table with one row per region or per backing file, like
+// /proc/<pid>/smaps. Sizes are in KiB and returned as numbers, so views show them right-aligned and
+// a QSortFilterProxyModel with SortRole sorts every column correctly.
+class MappingsModel : public QAbstractTableModel
+{
+    Q_OBJECT
+public:
+    enum Grouping {
+        ByRegion = 0,
+        ByBackingFile
+    };
+    enum Column {
+        AddressColumn = 0, // region addresses, or the number of regions per backing file
+        FirstStatsColumn, // the MappingStats fields follow in their order
+        BackingFileColumn = FirstStatsColumn + MappingStats::FieldCount,
+        ColumnCount
+    };
+    enum Role {
+        SortRole = Qt::UserRole,
+        AddressRole // start address of the region, 0 when grouped by backing file
+    };
+
+    MappingsModel();
+
+    int columnCount(const QModelIndex &parent) const override;
+    int rowCount(const QModelIndex &parent) const override;
+    QVariant data(const QModelIndex &index, int role) const override;
+    QVariant headerData(int section, Qt::Orientation orientation, int role) const override;
+
+    void setRegions(const MappedRegionSnapshot &regions);
+
+public slots:
+    void setGrouping(int grouping);
+
+private:
+    struct Row
+    {
+        quint64 start;
+        quint64 end;
+        QString backingFile;
+        quint64 regionCount;
+        MappingStats stats;
+    };
+    void updateRows();
+
+    MappedRegionSnapshot m_regions;
+    Grouping m_grouping;
+    QVector<Row> m_rows;
+};
+
+#endif // MAPPINGSMODEL_H
@@ -28,17 +28,26 @@
 
 #include "processinfo.h"
 #include "pageinfo.h"
+#include "pageinfoexport.h"
+#include "pageinforecording.h"
+#include "pageinfoserializer.h"
+#include "pageinfoserver.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <csignal>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <iostream>
 #include <string>
+#include <vector>
 
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 // ### those two "should" be included from /usr/include/linux, but since the kernel gives an ABI
@@ -49,59 +58,427 @@
 
 using namespace std;
 
-static const uint maxProcessNameLength = 15; // with the way we use to read it
-
 static const uint defaultPort = 5550;
 
-#include "pageinfoserializer.cpp"
+static const uint defaultRecordInterval = 1000; // milliseconds
+
+void printSummary(const MemorySummary &summary)
+{
+    cout << "VSZ is " << summary.virtualBytes / 1024 / 1024 << "MiB\n";
+    cout << "RSS is " << summary.residentBytes() / 1024 / 1024 << "MiB\n";
+    cout << "PSS is " << summary.proportionalBytes() / 1024 / 1024 << "MiB\n";
+    cout << "number of pages with zero use count is " << summary.pagesWithZeroUseCount << '\n';
+}
 
-static bool isFlagSet(uint64_t flags, uint testFlagShift)
+static void printStatsHeader(const char *firstColumn)
 {
-    return flags & (1 << testFlagShift);
+    printf("%-33s", firstColumn);
+    for (int i = 0; i < MappingStats::FieldCount; i++) {
+        printf(" %10s", MappingStats::fieldName(MappingStats::Field(i)));
+    }
+    printf("  %s\n", "backing file");
 }
 
-void printSummary(const PageInfo &pageInfo)
+static void printStatsLine(const string &firstColumn, const MappingStats &stats, const string &backingFile)
 {
-    const vector<MappedRegion> &mappedRegions = pageInfo.mappedRegions();
+    printf("%-33s", firstColumn.c_str());
+    for (int i = 0; i < MappingStats::FieldCount; i++) {
+        printf(" %10" PRIu64, stats.bytes[i] / 1024);
+    }
+    printf("  %s\n", backingFile.empty() ? "[anonymous]" : backingFile.c_str());
+}
+
+// like /proc/<pid>/smaps in table form, then the same per backing file, largest RSS first. Sizes in KiB.
+static void printMappingStats(const vector<MappedRegion> &regions)
+{
+    printStatsHeader("mapping (sizes in KiB)");
+    for (const MappedRegion &region : regions) {
+        char addresses[40];
+        snprintf(addresses, sizeof(addresses), "%012" PRIx64 "-%012" PRIx64, region.start, region.end);
+        printStatsLine(addresses, region.stats, region.backingFile);
+    }
+
+    vector<BackingFileStats> files = statsByBackingFile(regions);
+    sort(files.begin(), files.end(), [](const BackingFileStats &a, const BackingFileStats &b) {
+        return a.stats.bytes[MappingStats::ResidentField] > b.stats.bytes[MappingStats::ResidentField];
+    });
+    cout << '\n';
+    printStatsHeader("mappings per file");
+    for (const BackingFileStats &file : files) {
+        printStatsLine(to_string(file.regionCount), file.stats, file.backingFile);
+    }
+}
 
-    uint64_t pagesWithZeroUseCount = 0;
-    uint64_t vsz = 0;
-    uint64_t priv = 0;
-    uint64_t sharedFull = 0;
-    uint64_t sharedProp = 0;
+static void printPlacementLine(const string &firstColumn, const PlacementStats &stats, const PlacementStats &total,
+                               const string &backingFile)
+{
+    printf("%-33s", firstColumn.c_str());
+    for (size_t i = 0; i < total.nodeBytes.size(); i++) {
+        printf(" %10" PRIu64, i < stats.nodeBytes.size() ? stats.nodeBytes[i] / 1024 : 0);
+    }
+    if (total.unknownBytes) {
+        printf(" %10" PRIu64, stats.unknownBytes / 1024);
+    }
+    for (size_t i = 0; i < total.swapTypeBytes.size(); i++) {
+        printf(" %10" PRIu64, i < stats.swapTypeBytes.size() ? stats.swapTypeBytes[i] / 1024 : 0);
+    }
+    printf("  %s\n", backingFile.c_str());
+}
 
-    for (const MappedRegion &mr : mappedRegions) {
-        vsz += mr.end - mr.start;
-        uint64_t addr = mr.start;
-        for (size_t i = 0; i < mr.useCounts.size(); i++, addr += PageInfo::pageSize) {
-            uint64_t useCount = mr.useCounts[i];
-            uint64_t pageFlags = mr.combinedFlags[i];
-            // currently, use count is misreported as 0 for transparent hugepage tail (all after the first)
-            // pages - it should be 1
-            // ### should we also copy flags from the head page to tail pages?
-            if (useCount == 1 || isFlagSet(pageFlags, KPF_THP)) {
-                // divisions are very slow even on modern CPUs
-                priv += PageInfo::pageSize;
-            } else if (useCount == 0) {
-                pagesWithZeroUseCount++;
-            } else {
-                sharedFull += PageInfo::pageSize;
-                sharedProp += PageInfo::pageSize / useCount;
+// the resident memory of each mapping per NUMA node and its swapped out memory per swap area, then the
+// totals. Only the nodes and swap areas that hold pages of the process get a column. Sizes in KiB.
+static void printPlacementStats(const vector<MappedRegion> &regions)
+{
+    vector<PlacementStats> regionStats(regions.size());
+    PlacementStats total;
+    for (size_t i = 0; i < regions.size(); i++) {
+        regionStats[i].addRegion(regions[i]);
+        total += regionStats[i];
+    }
+    printf("%-33s", "mapping (sizes in KiB)");
+    for (size_t i = 0; i < total.nodeBytes.size(); i++) {
+        printf(" %10s", ("node" + to_string(i)).c_str());
+    }
+    if (total.unknownBytes) {
+        printf(" %10s", "no node");
+    }
+    for (size_t i = 0; i < total.swapTypeBytes.size(); i++) {
+        printf(" %10s", ("swap" + to_string(i)).c_str());
+    }
+    printf("  %s\n", "backing file");
+    for (size_t i = 0; i < regions.size(); i++) {
+        const MappedRegion &region = regions[i];
+        if (region.placementStarts.empty()) {
+            continue; // nothing resident or swapped
+        }
+        char addresses[40];
+        snprintf(addresses, sizeof(addresses), "%012" PRIx64 "-%012" PRIx64, region.start, region.end);
+        printPlacementLine(addresses, regionStats[i], total,
+                           region.backingFile.empty() ? "[anonymous]" : region.backingFile.str());
+    }
+    printPlacementLine("total", total, total, "");
+}
+
+// one line per process, largest PSS first, then the totals
+static void printHostSummary(const HostMemorySummary &host, const ProcessIndex &names)
+{
+    vector<ProcessMemorySummary> processes = host.processes;
+    sort(processes.begin(), processes.end(), [](const ProcessMemorySummary &a, const ProcessMemorySummary &b) {
+        return a.summary.proportionalBytes() > b.summary.proportionalBytes();
+    });
+
+    MemorySummary total;
+    printf("%8s %12s %12s %12s %12s %12s  %s\n", "PID", "VSZ KiB", "RSS KiB", "PSS KiB", "private KiB",
+           "shared KiB", "name");
+    for (const ProcessMemorySummary &process : processes) {
+        const MemorySummary &summary = process.summary;
+        const string *const name = names.name(process.pid);
+        printf("%8u %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 "  %s\n", process.pid,
+               summary.virtualBytes / 1024, summary.residentBytes() / 1024, summary.proportionalBytes() / 1024,
+               summary.privateBytes / 1024, summary.sharedBytes / 1024, name ? name->c_str() : "");
+        total.virtualBytes += summary.virtualBytes;
+        total.privateBytes += summary.privateBytes;
+        total.sharedBytes += summary.sharedBytes;
+        total.proportionalSharedBytes += summary.proportionalSharedBytes;
+    }
+    printf("%8s %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 " %12" PRIu64 "  %s\n", "", total.virtualBytes / 1024,
+           total.residentBytes() / 1024, total.proportionalBytes() / 1024, total.privateBytes / 1024,
+           total.sharedBytes / 1024, "[sum]");
+    cout << processes.size() << " processes use " << host.residentBytes / 1024 / 1024
+         << "MiB of physical memory, counting shared pages once\n";
+}
+
+// serializes a frame like the server does, to include that in the profile
+static CaptureStats statsWithSerialization(const PageInfo &pageInfo, PageInfoSerializer *serializer,
+                                           uint64_t *frameSize)
+{
+    const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    serializer->beginFrame(pageInfo);
+    *frameSize = 0;
+    while (true) {
+        const size_t chunkSize = serializer->serializeMore().second;
+        if (!chunkSize) {
+            break;
+        }
+        *frameSize += chunkSize;
+    }
+    CaptureStats stats = pageInfo.captureStats();
+    stats.nanoseconds[CaptureStats::SerializePhase] =
+        chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+// the method that the captures with options use to read pagemap
+static void printPagemapReader(const CaptureOptions &options)
+{
+    const bool scan = options.pagemapReader != CaptureOptions::PreadPagemapReader && isPagemapScanSupported();
+    printf("Reading pagemap %s\n\n", scan ? "with PAGEMAP_SCAN" : "of all pages");
+}
+
+static void printCaptureStats(const char *title, const CaptureStats &stats, uint64_t frameSize)
+{
+    printf("%s (%s)", title, stats.incremental ? "incremental" : "full");
+    if (frameSize) {
+        printf(", serialized frame size %" PRIu64 " bytes", frameSize);
+    }
+    printf(":\n");
+    printf("    %-28s %10s %10s %12s\n", "phase", "ms", "syscalls", "bytes read");
+    for (int i = 0; i < CaptureStats::PhaseCount; i++) {
+        const CaptureStats::Phase phase = CaptureStats::Phase(i);
+        printf("    %-28s %10.3f %10" PRIu64 " %12" PRIu64 "\n", CaptureStats::phaseName(phase),
+               stats.nanoseconds[i] / 1e6, stats.syscalls[i], stats.bytesRead[i]);
+    }
+    printf("    %-28s %10.3f %10" PRIu64 " %12" PRIu64 "\n", "total", stats.totalNanoseconds() / 1e6,
+           stats.totalSyscalls(), stats.totalBytesRead());
+}
+
+static volatile sig_atomic_t s_stopRequested = 0;
+
+static void requestStop(int)
+{
+    s_stopRequested = 1;
+}
+
+// for the modes that run until interrupted by SIGINT or SIGTERM
+static void installStopHandler()
+{
+    // without SA_RESTART, so that clock_nanosleep() returns right away
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = requestStop;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+}
+
+// sleeps until interval milliseconds after *next, then advances *next by that; false if interrupted
+static bool sleepInterval(struct timespec *next, uint interval)
+{
+    next->tv_sec += interval / 1000;
+    next->tv_nsec += (interval % 1000) * 1000000;
+    if (next->tv_nsec >= 1000000000) {
+        next->tv_sec++;
+        next->tv_nsec -= 1000000000;
+    }
+    while (!s_stopRequested && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, nullptr) == EINTR) {
+    }
+    return !s_stopRequested;
+}
+
+// records until interrupted (SIGINT or SIGTERM) or until the process can't be read anymore,
+// usually because it has exited
+static int record(uint pid, const CaptureOptions &captureOptions, const string &fileName, uint interval)
+{
+    PageInfoRecorder recorder;
+    if (!recorder.open(fileName)) {
+        cerr << "Could not open " << fileName << " for writing.\n";
+        return -1;
+    }
+    installStopHandler();
+
+    PageInfo pageInfo(pid, captureOptions);
+    if (pageInfo.mappedRegions().empty()) {
+        cerr << "Could not read page information. Maybe you are not root?\n";
+        return 1;
+    }
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    uint64_t frameCount = 0;
+    while (true) {
+        const uint64_t timestamp = chrono::duration_cast<chrono::nanoseconds>(
+            chrono::system_clock::now().time_since_epoch()).count();
+        if (!recorder.addFrame(pageInfo.mappedRegions(), timestamp)) {
+            cerr << "Could not write to " << fileName << ".\n";
+            break;
+        }
+        frameCount++;
+        if (!sleepInterval(&next, interval) || !pageInfo.update()) {
+            break;
+        }
+    }
+    const bool ok = recorder.finish();
+    cerr << "recorded " << frameCount << " frames.\n";
+    return ok ? 0 : 1;
+}
+
+static void printWorkingSetLine(const string &firstColumn, const MappingStats &stats, const string &backingFile)
+{
+    const uint64_t resident = stats.bytes[MappingStats::ResidentField];
+    const uint64_t idle = stats.bytes[MappingStats::IdleField];
+    printf("%-33s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "  %s\n", firstColumn.c_str(), resident / 1024,
+           (resident - idle) / 1024, idle / 1024, backingFile.c_str());
+}
+
+// Every interval, prints which resident pages of each mapping were accessed (hot) and which were not
+// (cold) since the previous update, until interrupted or until the process can't be read anymore
+static int estimateWorkingSet(uint pid, CaptureOptions captureOptions, uint interval)
+{
+    captureOptions.trackIdlePages = true;
+    installStopHandler();
+    // marks the pages for the first update()
+    PageInfo pageInfo(pid, captureOptions);
+    if (pageInfo.mappedRegions().empty()) {
+        cerr << "Could not read page information. Maybe you are not root?\n";
+        return 1;
+    }
+    if (!pageInfo.isTrackingIdlePages()) {
+        cerr << "Could not open /sys/kernel/mm/page_idle/bitmap. Idle page tracking needs root and a kernel "
+                "with CONFIG_IDLE_PAGE_TRACKING.\n";
+        return 1;
+    }
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (uint64_t pass = 1; sleepInterval(&next, interval) && pageInfo.update(); pass++) {
+        printf("after %" PRIu64 " ms (sizes in KiB):\n", pass * interval);
+        printf("%-33s %10s %10s %10s  %s\n", "mapping", "RSS", "hot", "cold", "backing file");
+        MappingStats total;
+        for (const MappedRegion &region : pageInfo.mappedRegions()) {
+            total += region.stats;
+            if (!region.stats.bytes[MappingStats::ResidentField]) {
+                continue;
             }
+            char addresses[40];
+            snprintf(addresses, sizeof(addresses), "%012" PRIx64 "-%012" PRIx64, region.start, region.end);
+            printWorkingSetLine(addresses, region.stats,
+                                region.backingFile.empty() ? "[anonymous]" : region.backingFile.str());
+        }
+        printWorkingSetLine("total", total, "");
+        printf("\n");
+        fflush(stdout);
+    }
+    return 0;
+}
+
+static string jsonString(const string &text)
+{
+    string ret = "\"";
+    for (const char c : text) {
+        if (c == '"' || c == '\\') {
+            ret += '\\';
+            ret += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", uint(static_cast<unsigned char>(c)));
+            ret += escaped;
+        } else {
+            ret += c;
+        }
+    }
+    return ret + '"';
+}
+
+static bool writeAll(int fd, const char *data, size_t size)
+{
+    while (size) {
+        const ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
         }
-        assert(addr == mr.end);
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= written;
     }
+    return true;
+}
 
-    cout << "VSZ is " << vsz / 1024 / 1024 << "MiB\n";
-    cout << "RSS is " << (priv + sharedFull) / 1024 / 1024 << "MiB\n";
-    cout << "PSS is " << (priv + sharedProp) / 1024 / 1024 << "MiB\n";
-    cout << "number of pages with zero use count is " << pagesWithZeroUseCount << '\n';
+// Writes one capture to fileName in the format of pageinfoexport.h, chunk by chunk, and prints a summary
+// of it as a line of JSON to stdout
+static int exportSnapshot(uint pid, const CaptureOptions &captureOptions, const string &fileName, bool withRuns)
+{
+    PageInfo pageInfo(pid, captureOptions);
+    const uint64_t timestamp = chrono::duration_cast<chrono::nanoseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+    const vector<MappedRegion> &regions = pageInfo.mappedRegions();
+    if (regions.empty()) {
+        cerr << "Could not read page information. Maybe you are not root?\n";
+        return 1;
+    }
+    const int fd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        cerr << "Could not open " << fileName << " for writing: " << strerror(errno) << '\n';
+        return 1;
+    }
+    PageInfoExporter exporter;
+    exporter.begin(regions, pid, timestamp, withRuns);
+    bool ok = true;
+    for (pair<const char*, size_t> chunk = exporter.exportMore(); ok && chunk.second; chunk = exporter.exportMore()) {
+        ok = writeAll(fd, chunk.first, chunk.second);
+    }
+    ok = close(fd) == 0 && ok;
+    if (!ok) {
+        cerr << "Could not write " << fileName << ": " << strerror(errno) << '\n';
+        return 1;
+    }
+
+    MappingStats total;
+    uint64_t virtualBytes = 0;
+    for (const MappedRegion &region : regions) {
+        total += region.stats;
+        virtualBytes += region.end - region.start;
+    }
+    printf("{\"pid\":%u,\"timestamp\":%" PRIu64 ",\"file\":%s,\"bytes\":%" PRIu64 ",\"regions\":%zu,"
+           "\"backingFiles\":%zu,\"runs\":%" PRIu64 ",\"captureNs\":%" PRIu64 ",\"stats\":{\"VSZ\":%" PRIu64,
+           pid, timestamp, jsonString(fileName).c_str(), exporter.bytesExported(), regions.size(),
+           exporter.backingFileCount(), exporter.runCount(), pageInfo.captureStats().totalNanoseconds(),
+           virtualBytes);
+    for (int i = 0; i < MappingStats::FieldCount; i++) {
+        printf(",%s:%" PRIu64, jsonString(MappingStats::fieldName(MappingStats::Field(i))).c_str(), total.bytes[i]);
+    }
+    printf("}}\n");
+    return 0;
 }
 
 static void printUsage()
 {
-    cerr << "Usage: memstat <pid>/<process-name>\n"
-         << "       memstat <pid>/<process-name> [--server [<portnumber>]]\n";
+    cerr << "Usage: memstat <pid>/<process-name> [<capture options>]\n"
+         << "       memstat --all [<capture options>] [--profile]\n"
+         << "       memstat <pid>/<process-name> [<capture options>] --server [<portnumber>] [<server options>]\n"
+         << "       memstat <pid>/<process-name> [<capture options>] --record <file> [--interval <ms>]\n"
+         << "       memstat <pid>/<process-name> [<capture options>] --wss <ms>\n"
+         << "       memstat <pid>/<process-name> [<capture options>] --export <file> [--export-runs]\n"
+         << "A process name matches the first process with that name, of which the kernel keeps 15 characters.\n"
+         << "    --cmdline          also match the program or script in the command line of processes, e.g.\n"
+         << "                       server.py for \"python3 server.py\", and longer names\n"
+         << "Capture options:\n"
+         << "    --threads <count>  read page information using <count> threads\n"
+         << "    --sort-pfns        use the older sort based method to find PFN ranges, for comparison\n"
+         << "    --pread-pagemap    read the pagemap entries of all pages instead of only those of the present\n"
+         << "                       and swapped out pages that the PAGEMAP_SCAN ioctl finds, for comparison\n"
+         << "    --split-huge-pages store every 4 KiB page of huge pages as the kernel reports it, instead\n"
+         << "                       of reading only the first page of each huge page\n"
+         << "    --range <start>-<end>\n"
+         << "                       capture only the addresses in the range, in hexadecimal; can be given\n"
+         << "                       several times\n"
+         << "    --backing-file <pattern>\n"
+         << "                       capture only regions whose backing file matches the shell wildcard pattern\n"
+         << "    --anon-only        capture only regions without a backing file, including [heap] and [stack]\n"
+         << "    --file-only        capture only regions with a backing file\n"
+         << "    --idle-pages       find the pages that were not accessed between two updates, using the\n"
+         << "                       kernel's idle page tracking; marking them costs the kernel some work.\n"
+         << "                       Only with --server, --record or --wss.\n"
+         << "Local options:\n"
+         << "    --mappings         print RSS, PSS and more per mapping and per backing file, like smaps\n"
+         << "    --numa             print the resident memory of each mapping per NUMA node, and its swapped\n"
+         << "                       out memory per swap area (the order of /proc/swaps)\n"
+         << "    --profile          print what the capture cost per phase: for the summary, and for a first\n"
+         << "                       and a second full capture as in server mode\n"
+         << "    --wss <ms>         estimate the working set: every <ms> milliseconds, print the resident\n"
+         << "                       memory of each mapping that was accessed (hot) and not accessed (cold)\n"
+         << "                       since the last time, until SIGINT or SIGTERM. Implies --idle-pages.\n"
+         << "Export options:\n"
+         << "    --export-runs      also export the runs of pages with the same use count and flags, not only\n"
+         << "                       the table of mappings\n"
+         << "Exports are in a columnar format, see pageinfoexport.h; a summary is printed as JSON.\n"
+         << "Server options:\n"
+         << "    --no-delta         send all data in every frame instead of only the changes\n"
+         << "    --interval <ms>    update at most every <ms> milliseconds, default " << ServerOptions().interval << '\n'
+         << "    --max-cpu <percent>\n"
+         << "                       make updates less frequent to spend at most <percent> of one CPU core\n"
+         << "Recording options:\n"
+         << "    --interval <ms>    capture every <ms> milliseconds, default " << defaultRecordInterval << '\n'
+         << "Recordings can be viewed with qmemstat --replay <file>. Recording stops on SIGINT (Ctrl+C) or\n"
+         << "SIGTERM, or when the process exits.\n";
 }
 
 int main(int argc, char *argv[])
@@ -112,99 +489,223 @@ int main(int argc, char *argv[])
     }
 
     bool network = false;
+    bool profile = false;
+    bool mappings = false;
+    bool matchCommandLine = false;
+    bool numa = false;
+    string recordFile;
+    string exportFile;
+    bool exportRuns = false;
+    uint interval = 0;
+    uint wssInterval = 0;
     uint port = defaultPort;
-
-    if (argc > 2) {
-        network = true;
-        if (string(argv[2]) != ("--server") || argc > 4) {
-            printUsage();
-            return -1;
-        }
-
-        if (argc == 4) {
-            port = strtoul(argv[3], nullptr, 10);
-            if (!port) {
-                cerr << "Invalid port number " << argv[3] << '\n';
+    CaptureOptions captureOptions;
+    ServerOptions serverOptions;
+
+    for (int i = 2; i < argc; i++) {
+        const string arg(argv[i]);
+        if (arg == "--server") {
+            network = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                port = strtoul(argv[++i], nullptr, 10);
+                if (!port) {
+                    cerr << "Invalid port number " << argv[i] << '\n';
+                    printUsage();
+                    return -1;
+                }
+            }
+        } else if (arg == "--threads" && i + 1 < argc) {
+            captureOptions.threadCount = strtoul(argv[++i], nullptr, 10);
+            if (!captureOptions.threadCount) {
+                cerr << "Invalid thread count " << argv[i] << '\n';
                 printUsage();
                 return -1;
             }
-        }
-    }
-
-    uint pid = strtoul(argv[1], nullptr, 10);
-    if (!pid) {
-        const string procName = string(argv[1]).substr(0, maxProcessNameLength);
-        for (const ProcessPid &pp : readProcessList()) {
-            if (pp.name == procName) {
-                pid = pp.pid;
-                break;
+        } else if (arg == "--no-delta") {
+            serverOptions.useDeltas = false;
+        } else if (arg == "--record" && i + 1 < argc) {
+            recordFile = argv[++i];
+        } else if (arg == "--export" && i + 1 < argc) {
+            exportFile = argv[++i];
+        } else if (arg == "--export-runs") {
+            exportRuns = true;
+        } else if (arg == "--interval" && i + 1 < argc) {
+            interval = strtoul(argv[++i], nullptr, 10);
+            if (!interval) {
+                cerr << "Invalid interval " << argv[i] << '\n';
+                printUsage();
+                return -1;
+            }
+        } else if (arg == "--max-cpu" && i + 1 < argc) {
+            serverOptions.maxCpuPercent = strtoul(argv[++i], nullptr, 10);
+            if (!serverOptions.maxCpuPercent) {
+                cerr << "Invalid CPU percentage " << argv[i] << '\n';
+                printUsage();
+                return -1;
+            }
+        } else if (arg == "--wss" && i + 1 < argc) {
+            wssInterval = strtoul(argv[++i], nullptr, 10);
+            if (!wssInterval) {
+                cerr << "Invalid interval " << argv[i] << '\n';
+                printUsage();
+                return -1;
             }
+        } else if (arg == "--idle-pages") {
+            captureOptions.trackIdlePages = true;
+        } else if (arg == "--profile") {
+            profile = true;
+        } else if (arg == "--mappings") {
+            mappings = true;
+        } else if (arg == "--cmdline") {
+            matchCommandLine = true;
+        } else if (arg == "--numa") {
+            numa = true;
+        } else if (arg == "--sort-pfns") {
+            captureOptions.pfnCollection = CaptureOptions::SortedPfnList;
+        } else if (arg == "--pread-pagemap") {
+            captureOptions.pagemapReader = CaptureOptions::PreadPagemapReader;
+        } else if (arg == "--split-huge-pages") {
+            captureOptions.mergeHugePages = false;
+        } else if (arg == "--range" && i + 1 < argc) {
+            if (!captureOptions.filter.addAddressRange(argv[++i])) {
+                cerr << "Invalid address range " << argv[i] << '\n';
+                printUsage();
+                return -1;
+            }
+        } else if (arg == "--backing-file" && i + 1 < argc) {
+            captureOptions.filter.backingFilePattern = argv[++i];
+        } else if (arg == "--anon-only") {
+            captureOptions.filter.kind = CaptureFilter::AnonymousOnly;
+        } else if (arg == "--file-only") {
+            captureOptions.filter.kind = CaptureFilter::FileOnly;
+        } else {
+            printUsage();
+            return -1;
         }
     }
-    if (!pid) {
-        cerr << "Found no such PID or process " << argv[1] << "!\n";
+    const int modeCount = network + !recordFile.empty() + bool(wssInterval) + !exportFile.empty();
+    const bool allProcesses = string(argv[1]) == "--all";
+    if (modeCount > 1 || (exportRuns && exportFile.empty())) {
+        printUsage();
         return -1;
     }
+    // local options, of which --profile also works with --all
+    if (((mappings || numa) && (modeCount || allProcesses)) || (profile && modeCount)) {
+        printUsage();
+        return -1;
+    }
+    // idle pages are found between updates, which only these modes do
+    if (captureOptions.trackIdlePages && !network && recordFile.empty() && !wssInterval) {
+        printUsage();
+        return -1;
+    }
+    if (interval) {
+        serverOptions.interval = interval;
+    }
 
-
-    if (!network) {
-        cerr << "local mode.\n";
-        PageInfo pageInfo(pid);
-        if (pageInfo.mappedRegions().empty()) {
+    if (allProcesses) {
+        if (modeCount) {
+            printUsage();
+            return -1;
+        }
+        ProcessIndex processes;
+        if (!processes.refresh()) {
+            perror("Couldn't open the /proc directory");
+            return 1;
+        }
+        vector<uint> pids;
+        for (const ProcessPid &pp : processes.processes()) {
+            pids.push_back(pp.pid);
+        }
+        HostMemorySummary host;
+        CaptureStats stats;
+        if (!summarizeProcesses(pids, captureOptions, &host, &stats)) {
             cerr << "Could not read page information. Maybe you are not root?\n";
             return 1;
         }
-        printSummary(pageInfo);
+        printHostSummary(host, processes);
+        if (profile) {
+            cout << '\n';
+            printPagemapReader(captureOptions);
+            printCaptureStats("All processes", stats, 0);
+        }
         return 0;
     }
 
-    cerr << "server mode.\n";
-    // listen on TCP/IP port, accept one connection, and periodically send data
-
-    const int listenFd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (listenFd < 0) {
+    uint pid = strtoul(argv[1], nullptr, 10);
+    if (!pid) {
+        pid = findProcess(argv[1], matchCommandLine);
+    }
+    if (!pid) {
+        cerr << "Found no such PID or process " << argv[1] << "!\n";
         return -1;
     }
 
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-    bool ok = true;
-    ok = ok && (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
-    ok = ok && (listen(listenFd, /* max queued incoming connections */ 1) == 0);
-    if (!ok) {
-        close(listenFd);
-        return -1;
+    if (!recordFile.empty()) {
+        cerr << "record mode.\n";
+        return record(pid, captureOptions, recordFile, interval ? interval : defaultRecordInterval);
     }
 
-    const int connFd = accept(listenFd, nullptr, nullptr);
-    if (connFd < 0) {
-        return -1;
+    if (!exportFile.empty()) {
+        cerr << "export mode.\n";
+        return exportSnapshot(pid, captureOptions, exportFile, exportRuns);
     }
-    close(listenFd);
 
-    while (true) {
-        // destroy PageInfo and PageInfoSerializer when done sending to free their memory...
-        {
-            PageInfo pageInfo(pid);
-            // serialize PageInfo output (vector<MappedRegion>) while sending, to avoid using even
-            // more memory on the target system.
-            PageInfoSerializer serializer(pageInfo);
-            while (true) {
-                pair<const char*, size_t> ser = serializer.serializeMore();
-                if (ser.second == 0) {
-                    break;
-                }
-                if (write(connFd, ser.first, ser.second) < ssize_t(ser.second)) {
-                    break;
-                }
+    if (wssInterval) {
+        cerr << "working set mode.\n";
+        return estimateWorkingSet(pid, captureOptions, wssInterval);
+    }
+
+    if (!network) {
+        cerr << "local mode.\n";
+        // the summary alone doesn't need the per-page data of a PageInfo
+        MemorySummary summary;
+        CaptureStats summaryStats;
+        if (!summarizeMemory(pid, captureOptions, &summary, &summaryStats)) {
+            cerr << (captureOptions.filter.isEmpty() ? "Could not read page information. Maybe you are not root?\n"
+                                                     : "Could not read page information. Maybe you are not root, "
+                                                       "or no present pages pass the filter?\n");
+            return 1;
+        }
+        printSummary(summary);
+        if (mappings || numa) {
+            // one capture for both tables, so that they show the same moment
+            CaptureOptions tableOptions = captureOptions;
+            tableOptions.recordPlacement = numa;
+            const PageInfo pageInfo(pid, tableOptions);
+            if (mappings) {
+                cout << '\n';
+                printMappingStats(pageInfo.mappedRegions());
             }
+            if (numa) {
+                cout << '\n';
+                printPlacementStats(pageInfo.mappedRegions());
+            }
+        }
+        if (profile) {
+            cout << '\n';
+            printPagemapReader(captureOptions);
+            printCaptureStats("Summary", summaryStats, 0);
+            // the second capture shows the cost of the updates in server mode or in qmemstat
+            PageInfo pageInfo(pid, captureOptions);
+            PageInfoSerializer serializer;
+            uint64_t frameSize = 0;
+            CaptureStats stats = statsWithSerialization(pageInfo, &serializer, &frameSize);
+            printCaptureStats("First capture", stats, frameSize);
+            pageInfo.update();
+            stats = statsWithSerialization(pageInfo, &serializer, &frameSize);
+            printCaptureStats("Second capture", stats, frameSize);
         }
-        //sleep(5);
+        return 0;
     }
 
-    return 0;
+    cerr << "server mode.\n";
+    // listen on TCP/IP port, accept any number of connections, and periodically send data to them
+    PageInfoServer server(pid, captureOptions, serverOptions);
+    if (!server.listen(port)) {
+        cerr << "Could not listen on port " << port << ".\n";
+        return -1;
+    }
+    return server.run();
 }
@@ -0,0 +1,734 @@
+/*
+  memstatbench.cpp
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// memstat-bench: reproducible benchmarks of capturing (needs root), serializing, reading, summarizing and
+// keeping a history of page information, with sweeps over the tuning constants. Results are printed as one
+// JSON object per line.
+
+#include "captureworker.h"
+#include "pagecategory.h"
+#include "pagehistory.h"
+#include "pageinfo.h"
+#include "pageinforeader.h"
+#include "pageinforecording.h"
+#include "pageinfoserializer.h"
+#include "pagesummary.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+typedef vector<vector<MappedRegion>> Frames;
+
+// Builds one line of output like {"benchmark":"capture","threads":1}. Keys and string values are
+// never anything that needs escaping.
+class JsonLine
+{
+public:
+    JsonLine() {}
+    explicit JsonLine(const char *benchmark) { add("benchmark", benchmark); }
+    JsonLine &add(const char *key, const JsonLine &object) { return addRaw(key, '{' + object.m_fields + '}'); }
+    JsonLine &add(const char *key, const char *value) { return addRaw(key, string("\"") + value + '"'); }
+    JsonLine &add(const char *key, bool value) { return addRaw(key, value ? "true" : "false"); }
+    JsonLine &add(const char *key, uint64_t value) { return addRaw(key, to_string(value)); }
+    JsonLine &add(const char *key, double value)
+    {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%.1f", value);
+        return addRaw(key, buffer);
+    }
+    void print() { cout << '{' << m_fields << "}\n" << flush; }
+
+private:
+    JsonLine &addRaw(const char *key, const string &value)
+    {
+        m_fields += (m_fields.empty() ? "\"" : ",\"") + string(key) + "\":" + value;
+        return *this;
+    }
+    string m_fields;
+};
+
+// mean and best of several timed runs of the same thing
+class Timing
+{
+public:
+    Timing() : m_total(0), m_min(numeric_limits<uint64_t>::max()), m_count(0) {}
+    void start() { m_start = chrono::steady_clock::now(); }
+    void stop()
+    {
+        const uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - m_start).count();
+        m_total += ns;
+        m_min = min(m_min, ns);
+        m_count++;
+    }
+    void addTo(JsonLine *line, uint64_t unitsPerRun, const char *unit) const
+    {
+        line->add("runs", m_count);
+        line->add((string("meanNsPer") + unit).c_str(), double(m_total) / max(m_count * unitsPerRun, uint64_t(1)));
+        line->add((string("minNsPer") + unit).c_str(), double(m_min) / max(unitsPerRun, uint64_t(1)));
+    }
+
+private:
+    chrono::steady_clock::time_point m_start;
+    uint64_t m_total;
+    uint64_t m_min;
+    uint64_t m_count;
+};
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// synthetic process
+
+struct SyntheticProcessOptions
+{
+    uint64_t rssMiB = 256;
+    // share of untouched pages in the private mappings; 0 means that they are completely present
+    unsigned int fragmentationPercent = 50;
+    unsigned int thpPercent = 0; // of the RSS, in mappings with MADV_HUGEPAGE
+    unsigned int sharedPercent = 10; // of the RSS, in pages mapped by two processes
+    unsigned int regionCount = 32; // the private memory is split into this many mappings
+    unsigned int churnPages = 64; // pages dropped and touched again every 10 milliseconds
+};
+
+static const uint64_t hugePageSize = 2 * 1024 * 1024;
+
+static char *mapAnonymous(uint64_t size, int flags)
+{
+    void *const ret = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags | MAP_ANONYMOUS, -1, 0);
+    if (ret == MAP_FAILED) {
+        cerr << "synthetic process: mmap() of " << size << " bytes failed: " << strerror(errno) << '\n';
+        _exit(1);
+    }
+    return static_cast<char *>(ret);
+}
+
+// runs in the forked child, never returns
+static void runSyntheticProcess(const SyntheticProcessOptions &options, int readyFd)
+{
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    const uint64_t pageSize = PageInfo::pageSize;
+    const uint64_t totalPages = options.rssMiB * 1024 * 1024 / pageSize;
+    const uint64_t hugePagePages = hugePageSize / pageSize;
+    const uint64_t sharedPages = totalPages * options.sharedPercent / 100;
+    const uint64_t thpPages = totalPages * options.thpPercent / 100 / hugePagePages * hugePagePages;
+    const uint64_t privatePages = totalPages - min(totalPages, sharedPages + thpPages);
+    minstd_rand random(1); // the same layout every time
+
+    // Before anything else is mapped, fork a helper that holds a second reference to the shared pages.
+    // It must not share the private pages (copy-on-write), so those are only created after the fork.
+    if (sharedPages) {
+        char *const shared = mapAnonymous(sharedPages * pageSize, MAP_SHARED);
+        for (uint64_t i = 0; i < sharedPages; i++) {
+            shared[i * pageSize] = 1;
+        }
+        if (fork() == 0) {
+            prctl(PR_SET_PDEATHSIG, SIGKILL);
+            while (true) {
+                pause();
+            }
+        }
+    }
+
+    if (thpPages) {
+        // align to the huge page size so that the kernel can actually use huge pages
+        char *const mapped = mapAnonymous(thpPages * pageSize + hugePageSize, MAP_PRIVATE);
+        char *const thp = reinterpret_cast<char *>((uintptr_t(mapped) + hugePageSize - 1) & ~(hugePageSize - 1));
+        madvise(thp, thpPages * pageSize, MADV_HUGEPAGE);
+        for (uint64_t i = 0; i < thpPages; i++) {
+            thp[i * pageSize] = 1;
+        }
+    }
+
+    // The pages to touch are spread randomly over mappings that are larger by the fragmentation. The
+    // mappings are separated by inaccessible guard pages so that the kernel doesn't merge them.
+    vector<pair<char *, uint64_t>> touched; // mapping, page index
+    const unsigned int fragmentation = min(options.fragmentationPercent, 99u);
+    const unsigned int regionCount = max(options.regionCount, 1u);
+    const uint64_t regionPages = privatePages * 100 / (100 - fragmentation) / regionCount + 1;
+    char *const privateMemory = mapAnonymous(regionCount * (regionPages + 1) * pageSize, MAP_PRIVATE);
+    for (uint r = 0; r < regionCount; r++) {
+        char *const region = privateMemory + r * (regionPages + 1) * pageSize;
+        mprotect(region + regionPages * pageSize, pageSize, PROT_NONE);
+        for (uint64_t i = 0; i < regionPages && touched.size() < privatePages; i++) {
+            if (random() % 100 >= fragmentation) {
+                region[i * pageSize] = 1;
+                touched.push_back(make_pair(region, i));
+            }
+        }
+    }
+
+    const char ready = 1;
+    if (write(readyFd, &ready, 1) != 1) {
+        _exit(1);
+    }
+    close(readyFd);
+
+    while (true) {
+        usleep(10 * 1000);
+        for (uint i = 0; i < options.churnPages && !touched.empty(); i++) {
+            const pair<char *, uint64_t> &page = touched[random() % touched.size()];
+            char *const address = page.first + page.second * pageSize;
+            madvise(address, pageSize, MADV_DONTNEED);
+            *address = 1;
+        }
+    }
+}
+
+// returns the pid of the started process, or 0 on failure
+static pid_t startSyntheticProcess(const SyntheticProcessOptions &options)
+{
+    int readyPipe[2];
+    if (pipe(readyPipe) != 0) {
+        return 0;
+    }
+    const pid_t pid = fork();
+    if (pid == 0) {
+        close(readyPipe[0]);
+        runSyntheticProcess(options, readyPipe[1]);
+    }
+    close(readyPipe[1]);
+    char ready = 0;
+    const bool ok = pid > 0 && read(readyPipe[0], &ready, 1) == 1;
+    close(readyPipe[0]);
+    if (!ok && pid > 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+    }
+    return ok ? pid : 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// benchmarks
+
+static const char *pfnCollectionName(CaptureOptions::PfnCollection pfnCollection)
+{
+    return pfnCollection == CaptureOptions::PfnBitmap ? "bitmap" : "sorted";
+}
+
+static const char *pagemapReaderName(CaptureOptions::PagemapReader pagemapReader)
+{
+    const bool scan = pagemapReader != CaptureOptions::PreadPagemapReader && isPagemapScanSupported();
+    return scan ? "scan" : "pread";
+}
+
+static void addStats(JsonLine *line, const CaptureStats &stats)
+{
+    line->add("incremental", stats.incremental);
+    // of the last run
+    JsonLine phases;
+    for (int i = 0; i < CaptureStats::PhaseCount; i++) {
+        const CaptureStats::Phase phase = CaptureStats::Phase(i);
+        if (phase != CaptureStats::SerializePhase) {
+            phases.add(CaptureStats::phaseName(phase), stats.nanoseconds[i]);
+        }
+    }
+    line->add("phaseNs", phases);
+    line->add("syscalls", stats.totalSyscalls());
+    line->add("bytesRead", stats.totalBytesRead());
+}
+
+// Full captures with all combinations of the capture options, full captures with huge pages split into
+// pages, with placements recorded and with all of pagemap read, the streaming summary that memstat prints
+// with each thread count, then incremental captures with the defaults. Thread counts double from 1 up to
+// maxThreads, which is the last one.
+// Returns false if the process can't be read.
+static bool benchmarkCapture(pid_t pid, uint iterations, uint maxThreads)
+{
+    vector<uint> threadCounts = { 1 };
+    for (uint threads = 2; threads <= maxThreads; threads *= 2) {
+        threadCounts.push_back(threads);
+    }
+    if (threadCounts.back() != maxThreads) {
+        threadCounts.push_back(maxThreads);
+    }
+    const uint64_t maxPfnGaps[] = { 0, 4, 16, 64, 256, 1024 };
+    const CaptureOptions::PfnCollection pfnCollections[] = { CaptureOptions::PfnBitmap,
+                                                             CaptureOptions::SortedPfnList };
+
+    for (uint threads : threadCounts) {
+        for (CaptureOptions::PfnCollection pfnCollection : pfnCollections) {
+            for (uint64_t maxPfnGap : maxPfnGaps) {
+                CaptureOptions options;
+                options.threadCount = threads;
+                options.pfnCollection = pfnCollection;
+                options.maxPfnGap = maxPfnGap;
+                Timing timing;
+                CaptureStats stats;
+                for (uint i = 0; i < iterations; i++) {
+                    timing.start();
+                    PageInfo pageInfo(pid, options);
+                    timing.stop();
+                    if (pageInfo.mappedRegions().empty()) {
+                        return false;
+                    }
+                    stats = pageInfo.captureStats();
+                }
+                JsonLine line("capture");
+                line.add("threads", uint64_t(threads)).add("pfnCollection", pfnCollectionName(pfnCollection))
+                    .add("maxPfnGap", maxPfnGap);
+                timing.addTo(&line, 1, "Capture");
+                addStats(&line, stats);
+                line.print();
+            }
+        }
+    }
+
+    // the options that cost extra, one at a time with the defaults otherwise
+    for (uint variant = 0; variant < 3; variant++) {
+        CaptureOptions options;
+        options.mergeHugePages = variant != 0;
+        options.recordPlacement = variant == 1;
+        if (variant == 2) {
+            options.pagemapReader = CaptureOptions::PreadPagemapReader;
+        }
+        Timing timing;
+        CaptureStats stats;
+        for (uint i = 0; i < iterations; i++) {
+            timing.start();
+            PageInfo pageInfo(pid, options);
+            timing.stop();
+            stats = pageInfo.captureStats();
+        }
+        JsonLine line("capture");
+        line.add("threads", uint64_t(options.threadCount))
+            .add("pfnCollection", pfnCollectionName(options.pfnCollection))
+            .add("maxPfnGap", options.maxPfnGap).add("mergeHugePages", options.mergeHugePages)
+            .add("recordPlacement", options.recordPlacement)
+            .add("pagemapReader", pagemapReaderName(options.pagemapReader));
+        timing.addTo(&line, 1, "Capture");
+        addStats(&line, stats);
+        line.print();
+    }
+
+    for (uint threads : threadCounts) {
+        CaptureOptions options;
+        options.threadCount = threads;
+        Timing timing;
+        CaptureStats stats;
+        for (uint i = 0; i < iterations; i++) {
+            MemorySummary summary;
+            timing.start();
+            const bool ok = summarizeMemory(pid, options, &summary, &stats);
+            timing.stop();
+            if (!ok) {
+                return false;
+            }
+        }
+        JsonLine line("memorySummary");
+        line.add("threads", uint64_t(threads));
+        timing.addTo(&line, 1, "Summary");
+        addStats(&line, stats);
+        line.print();
+    }
+
+    PageInfo pageInfo(pid);
+    Timing timing;
+    for (uint i = 0; i < iterations; i++) {
+        timing.start();
+        pageInfo.update();
+        timing.stop();
+    }
+    JsonLine line("update");
+    timing.addTo(&line, 1, "Update");
+    addStats(&line, pageInfo.captureStats());
+    line.print();
+    return true;
+}
+
+static Frames captureFrames(pid_t pid, uint frameCount)
+{
+    Frames ret;
+    PageInfo pageInfo(pid);
+    for (uint i = 0; i < frameCount; i++) {
+        if (i) {
+            // give the synthetic process time to change something
+            usleep(20 * 1000);
+            pageInfo.update();
+        }
+        ret.push_back(pageInfo.mappedRegions());
+    }
+    return ret;
+}
+
+static vector<char> serializeFrames(const Frames &frames, bool useDeltas, size_t chunkSize = PageInfoProtocol::maxRecordSize)
+{
+    vector<char> ret(PageInfoProtocol::handshakeSize);
+    PageInfoProtocol::writeHandshake(ret.data());
+    PageInfoSerializer serializer(useDeltas, chunkSize);
+    for (const vector<MappedRegion> &frame : frames) {
+        serializer.beginFrame(frame);
+        while (true) {
+            const pair<const char*, size_t> chunk = serializer.serializeMore();
+            if (!chunk.second) {
+                break;
+            }
+            ret.insert(ret.end(), chunk.first, chunk.first + chunk.second);
+        }
+    }
+    return ret;
+}
+
+static void benchmarkSerializer(const Frames &frames, uint iterations)
+{
+    const size_t chunkSizes[] = { PageInfoProtocol::maxRecordSize, 64 * 1024, 256 * 1024, 1024 * 1024 };
+    for (bool useDeltas : { true, false }) {
+        for (size_t chunkSize : chunkSizes) {
+            Timing timing;
+            uint64_t bytes = 0;
+            uint64_t chunks = 0;
+            for (uint i = 0; i < iterations; i++) {
+                // only the data in the serializer's buffer is touched, like when writing to a socket
+                PageInfoSerializer serializer(useDeltas, chunkSize);
+                bytes = 0;
+                chunks = 0;
+                timing.start();
+                for (const vector<MappedRegion> &frame : frames) {
+                    serializer.beginFrame(frame);
+                    while (const size_t size = serializer.serializeMore().second) {
+                        bytes += size;
+                        chunks++;
+                    }
+                }
+                timing.stop();
+            }
+            JsonLine line("serialize");
+            line.add("deltas", useDeltas).add("chunkSize", uint64_t(chunkSize));
+            timing.addTo(&line, frames.size(), "Frame");
+            line.add("bytesPerFrame", double(bytes) / max(frames.size(), size_t(1)));
+            line.add("chunks", chunks);
+            line.print();
+        }
+    }
+}
+
+static void benchmarkReader(const Frames &frames, uint iterations)
+{
+    // how much data a read() from the socket returns varies; the reader should be fast with any
+    const size_t readSizes[] = { 1500, 16 * 1024, 64 * 1024, 1024 * 1024 };
+    for (bool useDeltas : { true, false }) {
+        const vector<char> stream = serializeFrames(frames, useDeltas);
+        for (size_t readSize : readSizes) {
+            Timing timing;
+            for (uint i = 0; i < iterations; i++) {
+                PageInfoReader reader;
+                timing.start();
+                for (size_t pos = 0; pos < stream.size() && !reader.hasError(); pos += readSize) {
+                    reader.addData(stream.data() + pos, min(readSize, stream.size() - pos));
+                }
+                timing.stop();
+                if (reader.hasError()) {
+                    cerr << "Error reading back frames: " << reader.errorString() << '\n';
+                    return;
+                }
+            }
+            JsonLine line("read");
+            line.add("deltas", useDeltas).add("readSize", uint64_t(readSize));
+            timing.addTo(&line, frames.size(), "Frame");
+            line.add("bytesPerFrame", double(stream.size()) / max(frames.size(), size_t(1)));
+            line.print();
+        }
+    }
+}
+
+// classifying all runs of a frame, as for the RSS / PSS summary of memstat; the scalar loop as a reference
+static void benchmarkClassifier(const Frames &frames, uint iterations)
+{
+    uint64_t runs = 0;
+    for (const vector<MappedRegion> &frame : frames) {
+        for (const MappedRegion &region : frame) {
+            runs += region.runCount();
+        }
+    }
+    vector<uint8_t> categories;
+    for (bool scalar : { true, false }) {
+        Timing timing;
+        for (uint i = 0; i < iterations; i++) {
+            timing.start();
+            for (const vector<MappedRegion> &frame : frames) {
+                for (const MappedRegion &region : frame) {
+                    categories.resize(region.runCount());
+                    (scalar ? classifyPagesScalar : classifyPages)(region.useCounts.data(),
+                                                                   region.combinedFlags.data(),
+                                                                   region.runCount(), categories.data());
+                }
+            }
+            timing.stop();
+        }
+        JsonLine line("classify");
+        line.add("kernel", scalar ? "scalar" : pageClassifierName());
+        timing.addTo(&line, frames.size(), "Frame");
+        line.add("runsPerFrame", double(runs) / max(frames.size(), size_t(1)));
+        line.print();
+    }
+}
+
+// building the RegionSummaries of a zoomed out qmemstat for all regions, i.e. for a keyframe
+static void benchmarkSummary(const Frames &frames, uint iterations)
+{
+    vector<MappedRegionSnapshot> snapshots;
+    uint64_t pages = 0;
+    for (const vector<MappedRegion> &frame : frames) {
+        MappedRegionSnapshot snapshot;
+        for (const MappedRegion &region : frame) {
+            snapshot.push_back(make_shared<const MappedRegion>(region));
+            pages += region.pageCount();
+        }
+        snapshots.push_back(move(snapshot));
+    }
+    Timing timing;
+    for (uint i = 0; i < iterations; i++) {
+        vector<RegionSummary> summaries;
+        timing.start();
+        for (const MappedRegionSnapshot &snapshot : snapshots) {
+            summaries.clear();
+            for (const shared_ptr<const MappedRegion> &region : snapshot) {
+                summaries.emplace_back(region);
+            }
+        }
+        timing.stop();
+    }
+    JsonLine line("summary");
+    line.add("baseLevel", uint64_t(RegionSummary::baseLevel));
+    timing.addTo(&line, frames.size(), "Frame");
+    line.add("pagesPerFrame", double(pages) / max(frames.size(), size_t(1)));
+    line.print();
+}
+
+// qmemstat's PageHistory of the frames, shared between frames where they didn't change like in CaptureWorker
+static void benchmarkHistory(const Frames &frames, uint iterations)
+{
+    vector<MappedRegionSnapshot> snapshots;
+    for (const vector<MappedRegion> &frame : frames) {
+        snapshots.push_back(shareUnchangedRegions(frame, snapshots.empty() ? MappedRegionSnapshot()
+                                                                            : snapshots.back()));
+    }
+    // half the frames, so that dropping frames is part of it
+    const size_t maxFrames = max(frames.size() / 2, size_t(1));
+    Timing timing;
+    size_t byteCount = 0;
+    for (uint i = 0; i < iterations; i++) {
+        PageHistory history(maxFrames, numeric_limits<size_t>::max());
+        timing.start();
+        for (const MappedRegionSnapshot &snapshot : snapshots) {
+            history.add(snapshot);
+        }
+        timing.stop();
+        byteCount = history.byteCount();
+    }
+    JsonLine line("history");
+    line.add("maxFrames", uint64_t(maxFrames));
+    timing.addTo(&line, frames.size(), "Frame");
+    line.add("bytesPerFrame", double(byteCount) / maxFrames);
+    line.print();
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static bool writeRecording(const string &fileName, const Frames &frames)
+{
+    PageInfoRecorder recorder;
+    if (!recorder.open(fileName)) {
+        cerr << "Could not open " << fileName << " for writing.\n";
+        return false;
+    }
+    // the frames were captured back to back; there are no meaningful timestamps
+    for (size_t i = 0; i < frames.size(); i++) {
+        if (!recorder.addFrame(frames[i], i)) {
+            return false;
+        }
+    }
+    return recorder.finish();
+}
+
+static bool readRecording(const string &fileName, Frames *frames)
+{
+    PageInfoRecording recording;
+    if (!recording.open(fileName)) {
+        cerr << "Could not open " << fileName << ": " << recording.errorString() << '\n';
+        return false;
+    }
+    MappedRegionSnapshot snapshot;
+    for (size_t i = 0; i < recording.frameCount(); i++) {
+        if (!recording.snapshot(i, &snapshot)) {
+            cerr << "Frame " << i << " of " << fileName << " is damaged.\n";
+            return false;
+        }
+        vector<MappedRegion> frame;
+        for (const shared_ptr<const MappedRegion> &region : snapshot) {
+            frame.push_back(*region);
+        }
+        frames->push_back(move(frame));
+    }
+    return true;
+}
+
+// for --max-threads, far above any core count that the sweeps are meant for
+static const uint maxThreadCount = 1024;
+
+static void printUsage()
+{
+    cerr << "Usage: memstat-bench [<options>]\n"
+         << "Benchmarks capturing (needs root), serializing, reading, classifying,\n"
+         << "summarizing (for zoomed out views) and keeping a history of page information.\n"
+         << "Without --pid or --replay, the captured process is a synthetic one with the\n"
+         << "following properties.\n"
+         << "Synthetic process options:\n"
+         << "    --rss <MiB>                 resident memory, default 256\n"
+         << "    --fragmentation <percent>   share of not present pages in private mappings, default 50\n"
+         << "    --thp <percent>             share of the RSS in mappings with MADV_HUGEPAGE, default 0\n"
+         << "    --shared <percent>          share of the RSS mapped by two processes, default 10\n"
+         << "    --regions <count>           number of private mappings, default 32\n"
+         << "    --churn <pages>             pages dropped and touched again every 10 ms, default 64\n"
+         << "Other options:\n"
+         << "    --pid <pid>                 capture this process instead of a synthetic one\n"
+         << "    --iterations <count>        runs of each benchmark, default 10\n"
+         << "    --frames <count>            frames to capture for the other benchmarks, default 20\n"
+         << "    --max-threads <count>       highest thread count of the capture benchmarks, which\n"
+         << "                                double from 1, up to " << maxThreadCount << "; default the number\n"
+         << "                                of CPUs, at most 8\n"
+         << "    --record <file>             save the captured frames in the format of memstat --record\n"
+         << "    --replay <file>             benchmark all but capturing with frames recorded\n"
+         << "                                by --record or memstat --record; doesn't need root\n";
+}
+
+int main(int argc, char *argv[])
+{
+    SyntheticProcessOptions synthetic;
+    pid_t pid = 0;
+    uint iterations = 10;
+    uint frameCount = 20;
+    uint maxThreads = max(min(thread::hardware_concurrency(), 8u), 1u);
+    string recordFile;
+    string replayFile;
+
+    for (int i = 1; i < argc; i++) {
+        const string arg(argv[i]);
+        if (arg == "--record" && i + 1 < argc) {
+            recordFile = argv[++i];
+            continue;
+        } else if (arg == "--replay" && i + 1 < argc) {
+            replayFile = argv[++i];
+            continue;
+        }
+        // all other options have a numeric value
+        if (i + 1 >= argc) {
+            printUsage();
+            return -1;
+        }
+        char *end = nullptr;
+        const uint64_t value = strtoull(argv[++i], &end, 10);
+        if (*end) {
+            cerr << "Invalid number " << argv[i] << '\n';
+            printUsage();
+            return -1;
+        }
+        if (arg == "--rss") {
+            synthetic.rssMiB = value;
+        } else if (arg == "--fragmentation" && value < 100) {
+            synthetic.fragmentationPercent = value;
+        } else if (arg == "--thp" && value <= 100) {
+            synthetic.thpPercent = value;
+        } else if (arg == "--shared" && value <= 100) {
+            synthetic.sharedPercent = value;
+        } else if (arg == "--regions" && value) {
+            synthetic.regionCount = value;
+        } else if (arg == "--churn") {
+            synthetic.churnPages = value;
+        } else if (arg == "--pid" && value) {
+            pid = value;
+        } else if (arg == "--iterations" && value) {
+            iterations = value;
+        } else if (arg == "--frames" && value) {
+            frameCount = value;
+        } else if (arg == "--max-threads" && value && value <= maxThreadCount) {
+            maxThreads = value;
+        } else {
+            printUsage();
+            return -1;
+        }
+    }
+
+    Frames frames;
+    if (!replayFile.empty()) {
+        if (!readRecording(replayFile, &frames)) {
+            return 1;
+        }
+    } else {
+        pid_t syntheticPid = 0;
+        if (!pid) {
+            syntheticPid = startSyntheticProcess(synthetic);
+            if (!syntheticPid) {
+                cerr << "Could not start the synthetic process.\n";
+                return 1;
+            }
+            pid = syntheticPid;
+        }
+        const bool ok = benchmarkCapture(pid, iterations, maxThreads);
+        if (ok) {
+            frames = captureFrames(pid, frameCount);
+        }
+        if (syntheticPid) {
+            kill(syntheticPid, SIGKILL);
+            waitpid(syntheticPid, nullptr, 0);
+        }
+        if (!ok) {
+            cerr << "Could not read page information. Maybe you are not root?\n";
+            return 1;
+        }
+        if (!recordFile.empty() && !writeRecording(recordFile, frames)) {
+            cerr << "Could not write " << recordFile << ".\n";
+            return 1;
+        }
+    }
+
+    benchmarkSerializer(frames, iterations);
+    benchmarkReader(frames, iterations);
+    benchmarkClassifier(frames, iterations);
+    benchmarkSummary(frames, iterations);
+    benchmarkHistory(frames, iterations);
+    return 0;
+}
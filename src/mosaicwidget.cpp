@@ -28,14 +28,27 @@
 
 #include "mosaicwidget.h"
 
+#include "captureworker.h"
+#include "pagecategory.h"
+#include "pageinfoprotocol.h"
+
 #include <cassert>
+#include <condition_variable>
+#include <functional>
 #include <limits>
+#include <mutex>
+#include <thread>
 #include <utility>
 
-#include <linux/kernel-page-flags.h>
-
-#include <QEvent>
+#include <QDateTime>
+#include <QMetaObject>
 #include <QMouseEvent>
+#include <QPaintEvent>
+#include <QPainter>
+#include <QResizeEvent>
+#include <QScrollBar>
+#include <QStringList>
+#include <QWheelEvent>
 
 using namespace std;
 
@@ -70,10 +83,10 @@ static const char *pageFlagNames[pageFlagCount] = {
     "NOPAGE",
     "KSM",
     "THP",
-    nullptr,
-    nullptr,
-    nullptr,
-    nullptr,
+    "OFFLINE",
+    "ZERO_PAGE",
+    "IDLE", // 25, see CaptureOptions::trackIdlePages
+    "PGTABLE",
     nullptr,
     // flags from /proc/<pid>/pagemap, also documented in linux/Documentation/vm/pagemap.txt -
     // we shift them around a bit to clearly group them together and away from the other group,
@@ -105,59 +118,32 @@ QString printablePageFlags(uint32_t flags)
     return ret;
 }
 
-///////////////////////////////////////////////////////////////////////////////////////////////////
-
-static const uint s_pixelsPerTile = 4;
-static const uint s_columnCount = 512;
-
-bool PageInfoReader::addData(const QByteArray &data)
+static QString captureStatsText(const CaptureStats &stats)
 {
-    m_buffer += data;
-    bool ret = false;
-    // is not guaranteed that there is one or less dataset per chunk of data received, so keep looping
-    while (true) {
-        if (m_length < 0 && size_t(m_buffer.length()) >= sizeof(size_t)) {
-            m_length = *reinterpret_cast<const uint64_t *>(m_buffer.constData());
-        }
-        if (m_length >= 0 && size_t(m_buffer.length()) >= m_length + sizeof(size_t)) {
-            ret = true;
-            m_mappedRegions.clear();
-
-            const size_t endPos = m_length + sizeof(m_length);
-            const char *buf = m_buffer.constData();
-
-            for (size_t pos = sizeof(size_t); pos < endPos; ) {
-                MappedRegion mr;
-                mr.start = *reinterpret_cast<const uint64_t *>(buf + pos);
-                pos += sizeof(uint64_t);
-                mr.end = *reinterpret_cast<const uint64_t *>(buf + pos);
-                pos += sizeof(uint64_t);
-
-                const uint32_t backingFileLength = *reinterpret_cast<const uint32_t *>(buf + pos);
-                pos += sizeof(uint32_t);
-                mr.backingFile = std::string(reinterpret_cast<const char *>(buf + pos), backingFileLength);
-                pos += (backingFileLength + sizeof(uint32_t) - 1) & ~0x3;
-
-                const size_t arrayLength = (mr.end - mr.start) / PageInfo::pageSize;
-
-                const uint32_t *array = reinterpret_cast<const uint32_t *>(buf + pos);
-                mr.useCounts.assign(array, array + arrayLength);
-                array += arrayLength;
-                mr.combinedFlags.assign(array, array + arrayLength);
-                pos += 2 * arrayLength * sizeof(uint32_t);
-
-                m_mappedRegions.push_back(move(mr));
-            }
-
-            m_buffer.remove(0, endPos);
-            m_length = -1;
-        } else {
-            break;
+    QString ret = QString::fromLatin1("Capture cost: %1 ms (%2)\n")
+                      .arg(stats.totalNanoseconds() / 1e6, 0, 'f', 1)
+                      .arg(QString::fromLatin1(stats.incremental ? "incremental" : "full"));
+    for (uint i = 0; i < CaptureStats::PhaseCount; i++) {
+        // e.g. serialization in local mode
+        if (stats.nanoseconds[i]) {
+            ret += QString::fromLatin1("  %1: %2 ms\n")
+                       .arg(QString::fromLatin1(CaptureStats::phaseName(CaptureStats::Phase(i))))
+                       .arg(stats.nanoseconds[i] / 1e6, 0, 'f', 1);
         }
     }
+    ret += QString::fromLatin1("%1 syscalls, %2 KiB read").arg(stats.totalSyscalls())
+                                                           .arg(stats.totalBytesRead() / 1024);
     return ret;
 }
 
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static const uint s_pixelsPerTile = 4;
+static const uint s_columnCount = 512;
+static const quint64 s_rowBytes = s_columnCount * PageInfo::pageSize;
+static const uint s_tilesPerSeparator = 2;
+static const uint s_tileBlockRows = MosaicFrame::tileBlockRows;
+
 // bypass QImage API to save cycles; it does make a difference.
 class Rgb32PixelAccess
 {
@@ -224,51 +210,929 @@ void ColorCache::paintTile(Rgb32PixelAccess *img, uint x, uint y, uint tileSize,
     }
 }
 
-MosaicWidget::MosaicWidget(uint pid)
-   : m_pid(pid)
+// for (zoomed out) tiles that don't need ColorCache
+static void paintTile(Rgb32PixelAccess *img, uint x, uint y, uint tileSize, QRgb rgb)
+{
+    for (uint py = y * tileSize; py < (y + 1) * tileSize; py++) {
+        for (uint px = x * tileSize; px < (x + 1) * tileSize; px++) {
+            img->setPixel(px, py, rgb);
+        }
+    }
+}
+
+// mixes a and b in the ratio aWeight : (total - aWeight)
+static QRgb blend(QRgb a, QRgb b, quint64 aWeight, quint64 total)
+{
+    const quint64 bWeight = total - aWeight;
+    return qRgb((qRed(a) * aWeight + qRed(b) * bWeight) / total,
+                (qGreen(a) * aWeight + qGreen(b) * bWeight) / total,
+                (qBlue(a) * aWeight + qBlue(b) * bWeight) / total);
+}
+
+// the colors of pages in the mosaic
+class PageColors
+{
+public:
+    // don't always construct QColors from enums - this would eat ~ 10% or so of frame time.
+    PageColors()
+       : gray(Qt::darkGray),
+         cyan(Qt::blue),
+         black(Qt::black),
+         m_categoryColors {
+             gray, // NotPresentPage
+             QColor(Qt::darkGreen), // FilePage
+             QColor(Qt::green), // SharedFilePage
+             QColor(Qt::magenta).lighter(150), // ThpPage
+             QColor(Qt::magenta), // AnonPage
+             QColor(Qt::yellow), // SharedAnonPage
+             QColor(Qt::darkRed), // NoPage
+             QColor(Qt::white) // UnknownPage
+         },
+         m_accessedColor(255, 96, 0),
+         m_idleColor(0, 128, 160)
+    {
+        // unchanged pages dark, then from dark red to yellow with the share of frames in which they changed
+        m_changeColors[0] = QColor(48, 48, 48);
+        for (uint i = 1; i < s_changeColorCount; i++) {
+            const uint step = i - 1;
+            const uint steps = s_changeColorCount - 2;
+            m_changeColors[i] = QColor::fromHsv(60 * step / steps, 255, 144 + (255 - 144) * step / steps);
+        }
+        // nodes in distinct hues, swap areas in darker shades of the same
+        for (uint i = 0; i < nodeColorCount; i++) {
+            m_nodeColors[i] = QColor::fromHsv(360 * i / nodeColorCount, 200, 240);
+            m_swapColors[i] = QColor::fromHsv(360 * i / nodeColorCount, 200, 112);
+        }
+    }
+
+    // nodes and swap areas beyond nodeColorCount share the colors
+    static const uint nodeColorCount = 8;
+    // the counters per tile of forPlacementSummary(): nodes modulo nodeColorCount, then swapped, unknown
+    static const uint swappedSlot = nodeColorCount;
+    static const uint unknownSlot = nodeColorCount + 1;
+    static const uint placementSlotCount = nodeColorCount + 2;
+    static uint placementSlot(quint16 placement)
+    {
+        if (PagePlacement::isSwapType(placement)) {
+            return swappedSlot;
+        }
+        return PagePlacement::isNode(placement) ? PagePlacement::node(placement) % nodeColorCount : unknownSlot;
+    }
+
+    const QColor &forCategory(PageCategory category) const { return m_categoryColors[category]; }
+
+    // resident pages by whether they were accessed; the others like forCategory()
+    const QColor &forIdle(PageCategory category, quint32 combinedFlags) const
+    {
+        if (!isResident(category)) {
+            return m_categoryColors[category];
+        }
+        return combinedFlags & (1 << KPF_IDLE) ? m_idleColor : m_accessedColor;
+    }
+
+    // resident pages by node and swapped pages by swap area; the others like forCategory(), and resident
+    // pages on no known node like UnknownPage
+    const QColor &forPlacement(PageCategory category, quint32 combinedFlags, quint16 placement) const
+    {
+        if ((combinedFlags & PageFlags::swapped) && PagePlacement::isSwapType(placement)) {
+            return m_swapColors[PagePlacement::swapType(placement) % nodeColorCount];
+        }
+        if (!isResident(category)) {
+            return m_categoryColors[category];
+        }
+        return PagePlacement::isNode(placement) ? m_nodeColors[PagePlacement::node(placement) % nodeColorCount]
+                                                : m_categoryColors[UnknownPage];
+    }
+
+    const QColor &forChanges(quint32 changes, quint32 maxChanges) const
+    {
+        if (!changes) {
+            return m_changeColors[0];
+        }
+        const quint32 index = 1 + (changes - 1) * (s_changeColorCount - 1) / qMax(maxChanges, quint32(1));
+        return m_changeColors[qMin(index, s_changeColorCount - 1)];
+    }
+
+    // the color of the most common kind of present page in a zoomed out tile, faded to gray by the share
+    // of pages that are not present
+    QRgb forSummary(const PageSummary &summary, quint64 mappedPages) const
+    {
+        const quint32 presentPages = summary.presentPages();
+        if (!presentPages) {
+            return gray.rgb();
+        }
+        uint mostCommon = NotPresentPage + 1;
+        for (uint category = mostCommon + 1; category < PageCategoryCount; category++) {
+            if (summary.pages[category] > summary.pages[mostCommon]) {
+                mostCommon = category;
+            }
+        }
+        return blend(m_categoryColors[mostCommon].rgb(), gray.rgb(), presentPages, mappedPages);
+    }
+
+    // the share of idle pages among the present pages of a zoomed out tile, faded to gray like forSummary()
+    QRgb forIdleSummary(const PageSummary &summary, quint64 mappedPages) const
+    {
+        const quint32 presentPages = summary.presentPages();
+        if (!presentPages) {
+            return gray.rgb();
+        }
+        const QRgb present = blend(m_idleColor.rgb(), m_accessedColor.rgb(), summary.idlePages, presentPages);
+        return blend(present, gray.rgb(), presentPages, mappedPages);
+    }
+
+    // the color of the most common slot of placementPages in a zoomed out tile, faded to gray like
+    // forSummary() unless most pages are swapped out. Placement runs also cover the pages that are neither
+    // present nor swapped after their start, so this is an approximation where the pages of several nodes
+    // and swap areas mix.
+    QRgb forPlacementSummary(const quint64 *placementPages, const PageSummary &summary,
+                             quint64 mappedPages) const
+    {
+        const uint mostCommon = max_element(placementPages, placementPages + placementSlotCount) - placementPages;
+        const quint32 presentPages = summary.presentPages();
+        if (mostCommon == swappedSlot && placementPages[swappedSlot]) {
+            return m_swapColors[0].rgb();
+        }
+        if (!presentPages) {
+            return gray.rgb();
+        }
+        const QColor &color = placementPages[mostCommon] && mostCommon < nodeColorCount
+                                  ? m_nodeColors[mostCommon] : m_categoryColors[UnknownPage];
+        return blend(color.rgb(), gray.rgb(), presentPages, mappedPages);
+    }
+
+    const QColor gray; // not present
+    const QColor cyan; // gaps between regions
+    const QColor black; // separators between large regions
+
+private:
+    static const uint s_changeColorCount = 16;
+    const QColor m_categoryColors[PageCategoryCount];
+    QColor m_changeColors[s_changeColorCount];
+    const QColor m_accessedColor;
+    const QColor m_idleColor;
+    QColor m_nodeColors[nodeColorCount];
+    QColor m_swapColors[nodeColorCount];
+};
+
+const uint PageColors::nodeColorCount;
+const uint PageColors::swappedSlot;
+const uint PageColors::unknownSlot;
+const uint PageColors::placementSlotCount;
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+const uint MosaicFrame::tileBlockRows;
+
+MosaicFrame::MosaicFrame()
+   : m_zoomLevel(0),
+     m_colorMode(CategoryColors),
+     m_rowCount(0)
+{
+}
+
+MosaicFrame::MosaicFrame(MappedRegionSnapshot regions, uint zoomLevel, ColorMode colorMode,
+                         shared_ptr<const PageHeat> heat, const MosaicFrame *previous)
+   : m_regions(move(regions)),
+     m_zoomLevel(zoomLevel),
+     m_colorMode(colorMode == ChangeColors && !heat ? CategoryColors : colorMode),
+     m_heat(move(heat)),
+     m_rowCount(0)
+{
+    buildSummaries(previous);
+    buildLayout();
+}
+
+void MosaicFrame::buildSummaries(const MosaicFrame *previous)
+{
+    if (!m_zoomLevel) {
+        return;
+    }
+    // only summarize regions that changed; unchanged ones are the same objects as in the previous frame
+    vector<shared_ptr<const RegionSummary>> none;
+    const vector<shared_ptr<const RegionSummary>> &previousSummaries = previous ? previous->m_summaries : none;
+    m_summaries.reserve(m_regions.size());
+    auto prev = previousSummaries.begin();
+    for (const shared_ptr<const MappedRegion> &region : m_regions) {
+        while (prev != previousSummaries.end() && (*prev)->region()->start < region->start) {
+            ++prev;
+        }
+        if (prev != previousSummaries.end() && (*prev)->region() == region) {
+            m_summaries.push_back(*prev);
+        } else {
+            m_summaries.push_back(make_shared<const RegionSummary>(region));
+        }
+    }
+}
+
+void MosaicFrame::buildLayout()
+{
+    if (m_regions.empty()) {
+        return;
+    }
+    // The difference between page count in mapped address space and page count in the "spanned"
+    // address space can be HUGE, so we must figuratively insert some (...) in the graphical
+    // representation. Find the large contiguous regions and thus the points to graphically separate
+    // them.
+    // TODO implement a separator later, be it a line, spacing, labeling....
+    {
+        LargeRegion largeRegion = { 0, 0, 0, 0, m_regions.front()->start, m_regions.front()->end };
+        const quint64 maxAllowedGap = quint64(64) * PageInfo::pageSize << m_zoomLevel; // 64 tiles
+        for (const shared_ptr<const MappedRegion> &r : m_regions) {
+            if (r->start > largeRegion.end + maxAllowedGap) {
+                m_largeRegions.push_back(largeRegion);
+                largeRegion.start = r->start;
+            }
+            largeRegion.end = r->end;
+        }
+        m_largeRegions.push_back(largeRegion);
+    }
+
+#if 0
+    // for performance tuning...
+    qDebug() << "number of large regions in the address space is" << m_largeRegions.size();
+    for (auto &r : m_largeRegions) {
+        // hex output...
+        qDebug() << "region" << QString("%1").arg(r.start, 0, 16) << QString("%1").arg(r.end, 0, 16);
+    }
+#endif
+
+    // assign rows: the tiles showing the pages of each large region, then a separator, except after
+    // the last one. Tiles start at multiples of their size, like in RegionSummary.
+    for (LargeRegion &largeRegion : m_largeRegions) {
+        if (m_rowCount) {
+            m_rowCount += s_tilesPerSeparator;
+        }
+        largeRegion.firstRow = m_rowCount;
+        largeRegion.firstTile = (largeRegion.start / PageInfo::pageSize) >> m_zoomLevel;
+        largeRegion.endTile = largeRegion.end > largeRegion.start
+                              ? ((largeRegion.end / PageInfo::pageSize - 1) >> m_zoomLevel) + 1
+                              : largeRegion.firstTile;
+        largeRegion.rowCount = (largeRegion.endTile - largeRegion.firstTile + s_columnCount - 1) / s_columnCount;
+        m_rowCount += largeRegion.rowCount;
+    }
+    //qDebug() << "row count is" << m_rowCount << " largeRegion count is" << m_largeRegions.size();
+}
+
+bool MosaicFrame::hasSameRows(const MosaicFrame &other) const
+{
+    return m_zoomLevel == other.m_zoomLevel && m_largeRegions.size() == other.m_largeRegions.size() &&
+           equal(m_largeRegions.begin(), m_largeRegions.end(), other.m_largeRegions.begin(),
+                 [](const LargeRegion &a, const LargeRegion &b) { return a.hasSameRows(b); });
+}
+
+// the large region whose rows or separator contain row
+vector<MosaicFrame::LargeRegion>::const_iterator MosaicFrame::largeRegionAtRow(quint32 row) const
+{
+    assert(!m_largeRegions.empty());
+    auto lIt = upper_bound(m_largeRegions.begin(), m_largeRegions.end(), row,
+                           [](quint32 lhs, const LargeRegion &rhs) { return lhs < rhs.firstRow; });
+    return lIt - 1; // the first large region starts at row 0
+}
+
+// the address of the first tile in the row, for separator rows the end of the rows before them
+quint64 MosaicFrame::rowAddress(quint32 row) const
+{
+    auto lIt = largeRegionAtRow(row);
+    const quint64 tile = lIt->firstTile + quint64(qMin(row - lIt->firstRow, lIt->rowCount)) * s_columnCount;
+    return (tile << m_zoomLevel) * PageInfo::pageSize;
+}
+
+// the row that shows addr, or the next row if addr is between large regions
+quint32 MosaicFrame::rowAtAddress(quint64 addr) const
+{
+    auto lIt = upper_bound(m_largeRegions.begin(), m_largeRegions.end(), addr,
+                           [](quint64 lhs, const LargeRegion &rhs) { return lhs < rhs.start; });
+    if (lIt == m_largeRegions.begin()) {
+        return 0;
+    }
+    --lIt;
+    const quint64 tile = (addr / PageInfo::pageSize) >> m_zoomLevel;
+    if (tile >= lIt->endTile) {
+        return lIt + 1 == m_largeRegions.end() ? m_rowCount - 1 : (lIt + 1)->firstRow;
+    }
+    return lIt->firstRow + (tile - lIt->firstTile) / s_columnCount;
+}
+
+bool MosaicFrame::tileAt(quint32 row, uint column, quint64 *tile) const
+{
+    if (row >= m_rowCount || column >= s_columnCount) {
+        return false;
+    }
+    auto lIt = largeRegionAtRow(row);
+    if (row >= lIt->firstRow + lIt->rowCount) {
+        return false; // separator
+    }
+    *tile = lIt->firstTile + quint64(row - lIt->firstRow) * s_columnCount + column;
+    return *tile < lIt->endTile;
+}
+
+MappedRegionSnapshot MosaicFrame::regionsInBlock(quint32 block) const
+{
+    const quint32 firstRow = block * s_tileBlockRows;
+    const quint32 endRow = qMin(firstRow + s_tileBlockRows, m_rowCount);
+    assert(firstRow < endRow);
+    const quint64 start = rowAddress(firstRow);
+    const quint64 end = rowAddress(endRow - 1) + (s_rowBytes << m_zoomLevel);
+
+    MappedRegionSnapshot ret;
+    auto rIt = upper_bound(m_regions.begin(), m_regions.end(), start,
+                           [](quint64 lhs, const shared_ptr<const MappedRegion> &rhs) { return lhs < rhs->end; });
+    for (; rIt != m_regions.end() && (*rIt)->start < end; ++rIt) {
+        ret.push_back(*rIt);
+    }
+    return ret;
+}
+
+bool MosaicFrame::isUpToDate(quint32 block, const MosaicTileBlock &tileBlock) const
+{
+    // the heat changes with every frame, also when the regions in the block don't
+    return tileBlock.colorMode == m_colorMode && tileBlock.heat == renderedHeat() &&
+           tileBlock.regions == regionsInBlock(block);
+}
+
+void MosaicFrame::renderBlock(quint32 block, MosaicTileBlock *tileBlock) const
+{
+    const quint32 firstRow = block * s_tileBlockRows;
+    const quint32 rowCount = qMin(s_tileBlockRows, m_rowCount - firstRow);
+    tileBlock->regions = regionsInBlock(block);
+    tileBlock->heat = renderedHeat();
+    tileBlock->colorMode = m_colorMode;
+    const PageHeat *const heat = tileBlock->heat.get();
+    const int width = s_columnCount * s_pixelsPerTile;
+    const int height = s_tileBlockRows * s_pixelsPerTile;
+    if (tileBlock->image.width() != width || tileBlock->image.height() != height) {
+        tileBlock->image = QImage(width, height, QImage::Format_RGB32);
+    }
+    // Theoretically we need to get the stride of the image, but in practice it is equal to width,
+    // especially with the power-of-2 widths we are using.
+    Rgb32PixelAccess pixels(tileBlock->image.width(), tileBlock->image.height(), tileBlock->image.bits());
+    const PageColors colors;
+    // cache results of QColor::darken()
+    ColorCache cc;
+    vector<uint8_t> categories; // of the runs in a row of a region
+    quint32 changes[s_columnCount]; // of the pages in a row with ChangeColors
+
+    auto lIt = largeRegionAtRow(firstRow);
+    for (uint y = 0; y < rowCount; y++) {
+        const quint32 row = firstRow + y;
+        if (lIt + 1 != m_largeRegions.end() && (lIt + 1)->firstRow <= row) {
+            ++lIt;
+        }
+        if (row >= lIt->firstRow + lIt->rowCount) {
+            for (uint x = 0 ; x < s_columnCount; x++) {
+                cc.paintTile(&pixels, x, y, s_pixelsPerTile, colors.black);
+            }
+            continue;
+        }
+        if (m_zoomLevel) {
+            renderZoomedRow(*lIt, row, y, &pixels, colors);
+            continue;
+        }
+
+        const quint64 rowStart = rowAddress(row);
+        // regions of the next large region can start less than a row after the end of this one
+        const quint64 rowEnd = qMin(rowStart + s_rowBytes, lIt->end);
+        if (heat) {
+            heat->maxChangesInTiles(0, rowStart / PageInfo::pageSize, s_columnCount, changes);
+        }
+        auto rIt = upper_bound(tileBlock->regions.cbegin(), tileBlock->regions.cend(), rowStart,
+                               [](quint64 lhs, const shared_ptr<const MappedRegion> &rhs)
+                                   { return lhs < rhs->end; });
+        uint column = 0;
+        for (; column < s_columnCount && rIt != tileBlock->regions.cend() && (*rIt)->start < rowEnd; ++rIt) {
+            const MappedRegion &region = **rIt;
+            // gap before the region
+            const uint startColumn = region.start > rowStart ? (region.start - rowStart) / PageInfo::pageSize : 0;
+            for ( ; column < startColumn; column++) {
+                cc.paintTile(&pixels, column, y, s_pixelsPerTile, colors.cyan);
+            }
+            const uint endColumn = qMin(quint64(s_columnCount), (region.end - rowStart) / PageInfo::pageSize);
+            if (column >= endColumn) {
+                continue; // empty region
+            }
+            if (heat) {
+                for ( ; column < endColumn; column++) {
+                    cc.paintTile(&pixels, column, y, s_pixelsPerTile,
+                                 colors.forChanges(changes[column], heat->maxChanges()));
+                }
+                continue;
+            }
+            uint64_t page = (rowStart + column * PageInfo::pageSize - region.start) / PageInfo::pageSize;
+            if (m_colorMode == NodeColors) {
+                // page runs and placement runs don't line up, so page by page
+                size_t run = region.runAt(page);
+                const bool hasPlacements = !region.placementStarts.empty();
+                size_t placementRun = hasPlacements && page >= region.placementStarts.front()
+                                          ? region.placementRunAt(page) : 0;
+                for ( ; column < endColumn; column++, page++) {
+                    while (region.runEnd(run) <= page) {
+                        run++;
+                    }
+                    quint16 placement = PagePlacement::unknown;
+                    if (hasPlacements && page >= region.placementStarts.front()) {
+                        while (region.placementRunEnd(placementRun) <= page) {
+                            placementRun++;
+                        }
+                        placement = region.placements[placementRun];
+                    }
+                    const quint32 flags = region.combinedFlags[run];
+                    cc.paintTile(&pixels, column, y, s_pixelsPerTile,
+                                 colors.forPlacement(pageCategory(region.useCounts[run], flags), flags, placement));
+                }
+                continue;
+            }
+            // all pages in a run have the same color; classify the runs in the row in one go
+            const size_t firstRun = region.runAt(page);
+            const size_t endRun = region.runAt(page + (endColumn - column) - 1) + 1;
+            categories.resize(endRun - firstRun);
+            classifyPages(region.useCounts.data() + firstRun, region.combinedFlags.data() + firstRun,
+                          endRun - firstRun, categories.data());
+            for (size_t run = firstRun; column < endColumn; run++) {
+                const PageCategory category = PageCategory(categories[run - firstRun]);
+                const QColor &color = m_colorMode == IdleColors ? colors.forIdle(category, region.combinedFlags[run])
+                                                                : colors.forCategory(category);
+                const uint runEndColumn = qMin(quint64(endColumn), column + (region.runEnd(run) - page));
+                page += runEndColumn - column;
+                for ( ; column < runEndColumn; column++) {
+                    cc.paintTile(&pixels, column, y, s_pixelsPerTile, color);
+                }
+            }
+        }
+        // gap after the last region in the row
+        for ( ; column < s_columnCount; column++) {
+            cc.paintTile(&pixels, column, y, s_pixelsPerTile, colors.cyan);
+        }
+    }
+}
+
+void MosaicFrame::renderZoomedRow(const LargeRegion &largeRegion, quint32 row, quint32 y,
+                                  Rgb32PixelAccess *pixels, const PageColors &colors) const
+{
+    const uint level = m_zoomLevel;
+    const quint64 firstTile = largeRegion.firstTile + quint64(row - largeRegion.firstRow) * s_columnCount;
+    const uint columns = qMin(quint64(s_columnCount), largeRegion.endTile - firstTile);
+    const quint64 endPage = (firstTile + columns) << level;
+
+    // add up the summaries of all regions in each tile
+    PageSummary summaries[s_columnCount];
+    quint64 mappedPages[s_columnCount] = {};
+    const quint64 rowStart = (firstTile << level) * PageInfo::pageSize;
+    const size_t firstRegion = upper_bound(m_regions.begin(), m_regions.end(), rowStart,
+                                           [](quint64 lhs, const shared_ptr<const MappedRegion> &rhs)
+                                               { return lhs < rhs->end; })
+                               - m_regions.begin();
+    for (size_t i = firstRegion; i < m_summaries.size() && m_regions[i]->start / PageInfo::pageSize < endPage; i++) {
+        const RegionSummary &summary = *m_summaries[i];
+        const quint64 end = qMin(summary.endTile(level), firstTile + columns);
+        for (quint64 tile = qMax(summary.firstTile(level), firstTile); tile < end; tile++) {
+            summaries[tile - firstTile] += summary.tile(level, tile);
+            mappedPages[tile - firstTile] += summary.pageCount(level, tile);
+        }
+    }
+
+    quint32 changes[s_columnCount];
+    const PageHeat *const heat = m_colorMode == ChangeColors ? m_heat.get() : nullptr;
+    if (heat) {
+        heat->maxChangesInTiles(level, firstTile, columns, changes);
+    }
+    vector<quint64> placementPages;
+    if (m_colorMode == NodeColors) {
+        placementPages.assign(columns * PageColors::placementSlotCount, 0);
+        addPlacementPages(firstRegion, firstTile, columns, placementPages.data());
+    }
+
+    for (uint column = 0; column < s_columnCount; column++) {
+        QRgb rgb = colors.cyan.rgb();
+        if (column < columns && mappedPages[column]) {
+            if (heat) {
+                rgb = colors.forChanges(changes[column], heat->maxChanges()).rgb();
+            } else if (m_colorMode == IdleColors) {
+                rgb = colors.forIdleSummary(summaries[column], mappedPages[column]);
+            } else if (m_colorMode == NodeColors) {
+                rgb = colors.forPlacementSummary(placementPages.data() + column * PageColors::placementSlotCount,
+                                                 summaries[column], mappedPages[column]);
+            } else {
+                rgb = colors.forSummary(summaries[column], mappedPages[column]);
+            }
+        }
+        paintTile(pixels, column, y, s_pixelsPerTile, rgb);
+    }
+}
+
+void MosaicFrame::addPlacementPages(size_t firstRegion, quint64 firstTile, uint tileCount,
+                                    quint64 *placementPages) const
+{
+    const uint level = m_zoomLevel;
+    const quint64 firstPage = firstTile << level;
+    const quint64 endPage = (firstTile + tileCount) << level;
+    for (size_t i = firstRegion; i < m_regions.size() && m_regions[i]->start / PageInfo::pageSize < endPage; i++) {
+        const MappedRegion &region = *m_regions[i];
+        if (region.placementStarts.empty()) {
+            continue;
+        }
+        // placement runs are numbered from the start of the region, tiles from address 0
+        const quint64 regionPage = region.start / PageInfo::pageSize;
+        const quint64 end = qMin(endPage, region.end / PageInfo::pageSize);
+        quint64 page = qMax(firstPage, regionPage + region.placementStarts.front());
+        if (page >= end) {
+            continue;
+        }
+        for (size_t run = region.placementRunAt(page - regionPage); page < end; run++) {
+            const quint64 runEnd = qMin(end, regionPage + region.placementRunEnd(run));
+            const uint slot = PageColors::placementSlot(region.placements[run]);
+            while (page < runEnd) {
+                const quint64 tile = page >> level;
+                const quint64 tileEnd = qMin(runEnd, (tile + 1) << level);
+                placementPages[(tile - firstTile) * PageColors::placementSlotCount + slot] += tileEnd - page;
+                page = tileEnd;
+            }
+        }
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Builds MosaicFrames and renders the blocks in view in a worker thread. Requests that were not started
+// when a newer one comes in are replaced by it, and so are results that were not taken: when data comes
+// in faster than it can be shown, the stale frames are dropped.
+class MosaicRenderer
+{
+public:
+    struct Request
+    {
+        MappedRegionSnapshot regions;
+        // the regions are from frames that the server made for the view of this client (see sendView()),
+        // which have runs only for the window around the view, and made up ones when zoomed out
+        bool isViewOnly;
+        uint zoomLevel;
+        MosaicFrame::ColorMode colorMode;
+        // the view: visibleRows from topRow, or if haveAnchor, from anchorRowOffset rows above the row of
+        // anchorAddress
+        quint32 topRow;
+        quint32 visibleRows;
+        bool haveAnchor;
+        quint64 anchorAddress;
+        int anchorRowOffset;
+        // blocks rendered for frame that can be kept if they are still up to date
+        std::shared_ptr<const MosaicFrame> frame;
+        std::unordered_map<quint32, MosaicTileBlock> blocks;
+        // images that are not used anymore, to render into
+        std::vector<QImage> spareImages;
+    };
+
+    struct Result
+    {
+        std::shared_ptr<const MosaicFrame> frame;
+        quint32 topRow;
+        std::unordered_map<quint32, MosaicTileBlock> blocks; // the ones in view
+    };
+
+    // resultAvailable is called in the worker thread when there is a result to take after there was none
+    explicit MosaicRenderer(function<void()> resultAvailable);
+    ~MosaicRenderer();
+
+    void request(Request request);
+    // false if there is no new result
+    bool takeResult(Result *result);
+
+private:
+    void run();
+    Result render(Request *request);
+
+    const function<void()> m_resultAvailable;
+    // only used in the worker thread: for reusing summaries, images to render into, and the frames so far
+    shared_ptr<const MosaicFrame> m_lastFrame;
+    vector<QImage> m_spareImages;
+    PageHistory m_history;
+
+    mutex m_mutex; // protects the members below
+    condition_variable m_wakeUp;
+    bool m_stop;
+    bool m_haveRequest;
+    Request m_request;
+    bool m_haveResult;
+    Result m_result;
+
+    thread m_thread;
+};
+
+// a screenful or so, at 2 MiB per image
+static const size_t s_maxSpareImages = 16;
+// usually a few KiB to a few MiB per frame, see PageHistory
+static const size_t s_maxHistoryBytes = 256 * 1024 * 1024;
+
+MosaicRenderer::MosaicRenderer(function<void()> resultAvailable)
+   : m_resultAvailable(move(resultAvailable)),
+     m_history(MosaicWidget::historyFrames, s_maxHistoryBytes),
+     m_stop(false),
+     m_haveRequest(false),
+     m_haveResult(false)
+{
+    // start the thread last, it uses the other members
+    m_thread = thread(&MosaicRenderer::run, this);
+}
+
+MosaicRenderer::~MosaicRenderer()
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_wakeUp.notify_one();
+    m_thread.join();
+}
+
+void MosaicRenderer::request(Request request)
+{
+    {
+        lock_guard<mutex> lock(m_mutex);
+        if (m_haveRequest) {
+            // the replaced request's images are still good to render into
+            for (QImage &image : m_request.spareImages) {
+                request.spareImages.push_back(move(image));
+            }
+        }
+        m_request = move(request);
+        m_haveRequest = true;
+    }
+    m_wakeUp.notify_one();
+}
+
+bool MosaicRenderer::takeResult(Result *result)
+{
+    lock_guard<mutex> lock(m_mutex);
+    if (!m_haveResult) {
+        return false;
+    }
+    *result = move(m_result);
+    m_result = Result();
+    m_haveResult = false;
+    return true;
+}
+
+void MosaicRenderer::run()
+{
+    unique_lock<mutex> lock(m_mutex);
+    while (true) {
+        m_wakeUp.wait(lock, [this] { return m_stop || m_haveRequest; });
+        if (m_stop) {
+            return;
+        }
+        Request request = move(m_request);
+        m_request = Request();
+        m_haveRequest = false;
+        lock.unlock();
+
+        Result result = render(&request);
+        // release the old frame's data here and not in the GUI thread if possible
+        request = Request();
+
+        lock.lock();
+        const bool wasEmpty = !m_haveResult;
+        m_result = move(result);
+        m_haveResult = true;
+        if (wasEmpty) {
+            lock.unlock();
+            m_resultAvailable();
+            lock.lock();
+        }
+    }
+}
+
+MosaicRenderer::Result MosaicRenderer::render(Request *request)
+{
+    for (QImage &image : request->spareImages) {
+        if (m_spareImages.size() < s_maxSpareImages) {
+            m_spareImages.push_back(move(image));
+        }
+    }
+
+    // Frames of a view don't go into the history: scrolling and zooming change their runs, which would
+    // count as changes of the pages that come into and go out of the view, and real changes within
+    // zoomed out tiles don't show. Without a heat, ChangeColors shows CategoryColors.
+    if (request->isViewOnly) {
+        if (m_history.frameCount()) {
+            m_history.clear();
+        }
+    } else if (!m_lastFrame || request->regions != m_lastFrame->regions()) {
+        // new data, not the same regions again for another zoom level or view
+        m_history.add(request->regions);
+    }
+    const shared_ptr<const PageHeat> heat = request->isViewOnly ? shared_ptr<const PageHeat>() : m_history.heat();
+    Result result;
+    result.frame = make_shared<const MosaicFrame>(move(request->regions), request->zoomLevel, request->colorMode,
+                                                  heat, m_lastFrame.get());
+    m_lastFrame = result.frame;
+    const MosaicFrame &frame = *result.frame;
+    if (!frame.rowCount()) {
+        result.topRow = 0;
+        return result;
+    }
+    qint64 topRow = request->topRow;
+    if (request->haveAnchor) {
+        topRow = qint64(frame.rowAtAddress(request->anchorAddress)) - request->anchorRowOffset;
+    }
+    result.topRow = quint32(qBound(qint64(0), topRow, qint64(frame.rowCount()) - 1));
+
+    const bool sameRows = request->frame && request->frame->hasSameRows(frame);
+    const quint32 lastRow = qMin(result.topRow + request->visibleRows, frame.rowCount() - 1);
+    for (quint32 block = result.topRow / s_tileBlockRows; block <= lastRow / s_tileBlockRows; block++) {
+        MosaicTileBlock tileBlock;
+        auto it = request->blocks.find(block);
+        if (sameRows && it != request->blocks.end() && frame.isUpToDate(block, it->second)) {
+            tileBlock = move(it->second);
+        } else {
+            if (!m_spareImages.empty()) {
+                tileBlock.image = move(m_spareImages.back());
+                m_spareImages.pop_back();
+            }
+            frame.renderBlock(block, &tileBlock);
+        }
+        result.blocks.emplace(block, move(tileBlock));
+    }
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+const int MosaicWidget::maxZoomLevel;
+const uint MosaicWidget::historyFrames;
+
+MosaicWidget::MosaicWidget(uint pid, uint updateInterval, const CaptureOptions &options)
+   : m_pid(pid),
+     m_updateInterval(updateInterval),
+     m_haveSentView(false),
+     m_renderer(new MosaicRenderer([this] { QMetaObject::invokeMethod(this, "renderFinished",
+                                                                       Qt::QueuedConnection); })),
+     m_zoomLevel(0),
+     m_colorMode(MosaicFrame::CategoryColors),
+     m_haveZoomAnchor(false),
+     m_zoomAnchorAddress(0),
+     m_zoomAnchorRowOffset(0),
+     m_frame(make_shared<const MosaicFrame>())
 {
     qDebug() << "local process";
     m_updateIntervalWatch.start();
-    // we're not usually *reaching* 50 milliseconds update interval... but trying doesn't hurt.
-    m_updateTimer.setInterval(50);
-    connect(&m_updateTimer, SIGNAL(timeout()), SLOT(localUpdateTimeout()));
-    m_updateTimer.start();
-    localUpdateTimeout();
-
-    m_mosaicWidget.installEventFilter(this);
-    setWidget(&m_mosaicWidget);
+    // we're not usually *reaching* the default 50 milliseconds update interval... but trying doesn't hurt.
+    m_captureWorker.reset(new CaptureWorker(m_pid, updateInterval, options, [this] {
+        QMetaObject::invokeMethod(this, "localFrameAvailable", Qt::QueuedConnection);
+    }));
 }
 
-MosaicWidget::MosaicWidget(const QByteArray &host, uint port)
-   : m_pid(0)
+MosaicWidget::MosaicWidget(const QByteArray &host, uint port, uint updateInterval, const CaptureFilter &filter)
+   : m_pid(0),
+     m_captureFilter(filter),
+     m_updateInterval(updateInterval),
+     m_haveSentView(false),
+     m_renderer(new MosaicRenderer([this] { QMetaObject::invokeMethod(this, "renderFinished",
+                                                                       Qt::QueuedConnection); })),
+     m_zoomLevel(0),
+     m_colorMode(MosaicFrame::CategoryColors),
+     m_haveZoomAnchor(false),
+     m_zoomAnchorAddress(0),
+     m_zoomAnchorRowOffset(0),
+     m_frame(make_shared<const MosaicFrame>())
 {
     qDebug() << "process on server:" << host << port;
+    connect(&m_socket, SIGNAL(connected()), SLOT(socketConnected()));
     connect(&m_socket, SIGNAL(readyRead()), SLOT(networkDataAvailable()));
     connect(&m_socket, SIGNAL(error(QAbstractSocket::SocketError)), SLOT(socketError()));
-    m_socket.connectToHost(QString::fromLatin1(host), port, QIODevice::ReadOnly);
+    connect(verticalScrollBar(), SIGNAL(valueChanged(int)), SLOT(sendView()));
+    // writing is for telling the server what to capture, what is in view and when we are ready for the
+    // next frame
+    m_socket.connectToHost(QString::fromLatin1(host), port, QIODevice::ReadWrite);
+}
 
-    setWidget(&m_mosaicWidget);
+MosaicWidget::MosaicWidget(unique_ptr<PageInfoRecording> recording)
+   : m_pid(0),
+     m_updateInterval(0),
+     m_haveSentView(false),
+     m_recording(move(recording)),
+     m_renderer(new MosaicRenderer([this] { QMetaObject::invokeMethod(this, "renderFinished",
+                                                                       Qt::QueuedConnection); })),
+     m_zoomLevel(0),
+     m_colorMode(MosaicFrame::CategoryColors),
+     m_haveZoomAnchor(false),
+     m_zoomAnchorAddress(0),
+     m_zoomAnchorRowOffset(0),
+     m_frame(make_shared<const MosaicFrame>())
+{
+    qDebug() << "recording with" << m_recording->frameCount() << "frames";
+    showRecordedFrame(0);
 }
 
-void MosaicWidget::localUpdateTimeout()
+MosaicWidget::~MosaicWidget()
 {
-    PageInfo pageInfo(m_pid);
-    if (!pageInfo.mappedRegions().empty()) {
-        updatePageInfo(pageInfo.mappedRegions());
+    // stop the workers before the members they use go away
+    m_captureWorker.reset();
+    m_renderer.reset();
+}
+
+void MosaicWidget::showRecordedFrame(int frame)
+{
+    if (frame < 0 || size_t(frame) >= m_recording->frameCount()) {
+        return;
+    }
+    MappedRegionSnapshot regions;
+    if (!m_recording->snapshot(frame, &regions)) {
+        qDebug() << "frame" << frame << "of the recording is damaged";
+    }
+    updatePageInfo(regions);
+    const QDateTime time = QDateTime::fromMSecsSinceEpoch(m_recording->frameTimestamp(frame) / 1000000);
+    emit showRecordedFrameInfo(QString::fromLatin1("Frame %1 of %2, %3").arg(frame + 1)
+                               .arg(m_recording->frameCount()).arg(time.toString(Qt::ISODate)));
+}
+
+void MosaicWidget::localFrameAvailable()
+{
+    CaptureWorker::Frame frame;
+    if (!m_captureWorker->takeFrame(&frame)) {
+        return;
+    }
+    updatePageInfo(frame.regions);
+    if (!frame.regions.empty()) {
+        QString text = captureStatsText(frame.stats);
+        if (frame.droppedFrames) {
+            text += QString::fromLatin1("\n%1 captures not shown, display too slow").arg(frame.droppedFrames);
+        }
+        emit showCaptureStats(text);
     } else {
         emit showPageInfo(0, 0, QString());
-        // HACK: not stopping the timer because clients expect to get regular updates, most importantly
+        // HACK: not stopping the capture because clients expect to get regular updates, most importantly
         //       they expect that missing the first update is not critical
-        // m_updateTimer.stop();
-        return;
     }
 }
 
 void MosaicWidget::networkDataAvailable()
 {
-    if (m_pageInfoReader.addData(m_socket.readAll())) {
-        updatePageInfo(m_pageInfoReader.m_mappedRegions);
+    // if several frames arrive at once, only show the last one
+    bool haveFrame = false;
+    char buffer[64 * 1024];
+    while (!m_pageInfoReader.hasError()) {
+        const qint64 size = m_socket.read(buffer, sizeof(buffer));
+        if (size <= 0) {
+            break;
+        }
+        haveFrame = m_pageInfoReader.addData(buffer, size) || haveFrame;
+    }
+    if (haveFrame) {
+        updatePageInfo(m_pageInfoReader.mappedRegions());
+        // The server doesn't send a new frame until we are done with this one, so it doesn't pile up
+        // frames that we would skip anyway.
+        char ready[PageInfoProtocol::recordHeaderSize];
+        PageInfoProtocol::writeEmptyRecord(ready, PageInfoProtocol::ReadyRecord);
+        m_socket.write(ready, sizeof(ready));
+    }
+    // the server sends them after each frame
+    if (m_pageInfoReader.hasCaptureStats()) {
+        emit showCaptureStats(captureStatsText(m_pageInfoReader.captureStats()));
+    }
+    if (m_pageInfoReader.hasError()) {
+        qDebug() << "error reading data from server:" << m_pageInfoReader.errorString().c_str();
+        m_socket.close();
+        emit serverConnectionBroke(m_regions.size());
+    }
+}
+
+void MosaicWidget::socketConnected()
+{
+    if (m_captureFilter.isEmpty()) {
+        return; // the server captures everything unless told otherwise
     }
+    vector<char> record;
+    if (!PageInfoProtocol::writeFilterRecord(m_captureFilter, &record)) {
+        qDebug() << "the capture filter is too large to send, capturing everything";
+        return;
+    }
+    m_socket.write(record.data(), record.size());
+}
+
+void MosaicWidget::sendView()
+{
+    // the first frame, which comes before the server knows the view, is complete
+    if (m_socket.state() != QAbstractSocket::ConnectedState || !m_frame->rowCount() ||
+        m_frame->zoomLevel() != m_zoomLevel) {
+        return;
+    }
+    // one screen more above and below, so that scrolling a little shows data before the next frame
+    const quint32 visibleRows = viewport()->height() / s_pixelsPerTile + 1;
+    const quint32 topRow = verticalScrollBar()->value();
+    const quint32 firstRow = topRow > visibleRows ? topRow - visibleRows : 0;
+    const quint32 lastRow = qMin(topRow + 2 * visibleRows, m_frame->rowCount() - 1);
+    PageInfoProtocol::View view;
+    view.start = m_frame->rowAddress(firstRow);
+    view.end = m_frame->rowAddress(lastRow) + (s_rowBytes << m_zoomLevel);
+    view.zoomLevel = m_zoomLevel;
+    view.interval = m_updateInterval;
+    if (m_haveSentView && view == m_sentView) {
+        return;
+    }
+    char record[PageInfoProtocol::recordHeaderSize + PageInfoProtocol::viewRecordSize];
+    PageInfoProtocol::writeViewRecord(view, record);
+    m_socket.write(record, sizeof(record));
+    m_sentView = view;
+    m_haveSentView = true;
 }
 
 void MosaicWidget::socketError()
@@ -276,225 +1140,233 @@ void MosaicWidget::socketError()
     emit serverConnectionBroke(m_regions.size());
 }
 
-void MosaicWidget::updatePageInfo(const vector<MappedRegion> &regions)
+void MosaicWidget::updatePageInfo(const MappedRegionSnapshot &regions)
 {
     //qint64 elapsed = m_updateIntervalWatch.restart();
     //qDebug() << " >> frame interval" << elapsed << "milliseconds";
 
-    m_regions = regions;
-    m_largeRegions.clear();
-
-    if (regions.empty()) {
-        m_img = QImage();
-        m_mosaicWidget.setPixmap(QPixmap::fromImage(m_img));
-        m_mosaicWidget.adjustSize();
-        return;
-    }
 #ifndef NDEBUG
-    for (const MappedRegion &mappedRegion : regions) {
-        assert(mappedRegion.end >= mappedRegion.start); // == unfortunately happens sometimes
+    for (const shared_ptr<const MappedRegion> &mappedRegion : regions) {
+        assert(mappedRegion->end >= mappedRegion->start); // == unfortunately happens sometimes
     }
 #endif
     for (size_t i = 1; i < regions.size(); i++) {
-        if (regions[i].start < regions[i - 1].end) {
-            qDebug() << "ranges.." << QString("%1").arg(regions[i - 1].start, 0, 16)
-                                   << QString("%1").arg(regions[i - 1].end, 0, 16)
-                                   << QString("%1").arg(regions[i].start, 0, 16)
-                                   << QString("%1").arg(regions[i].end, 0, 16);
+        if (regions[i]->start < regions[i - 1]->end) {
+            qDebug() << "ranges.." << QString("%1").arg(regions[i - 1]->start, 0, 16)
+                                   << QString("%1").arg(regions[i - 1]->end, 0, 16)
+                                   << QString("%1").arg(regions[i]->start, 0, 16)
+                                   << QString("%1").arg(regions[i]->end, 0, 16);
 
         }
-        assert(regions[i].start >= regions[i - 1].end);
+        assert(regions[i]->start >= regions[i - 1]->end);
     }
 
     //const quint64 totalRange = regions.back().end - regions.front().start;
     //qDebug() << "Address range covered (in pages) is" << totalRange / PageInfo::pageSize;
 
-    quint64 mappedSpace = 0;
-    for (const MappedRegion &r : regions) {
-        mappedSpace += r.end - r.start;
+    m_regions = regions;
+    requestFrame();
+    emit regionsChanged();
+}
+
+void MosaicWidget::requestFrame()
+{
+    MosaicRenderer::Request request;
+    request.regions = m_regions;
+    request.isViewOnly = m_haveSentView;
+    request.zoomLevel = m_zoomLevel;
+    request.colorMode = m_colorMode;
+    request.topRow = verticalScrollBar()->value();
+    request.visibleRows = viewport()->height() / s_pixelsPerTile + 1;
+    request.haveAnchor = m_haveZoomAnchor;
+    request.anchorAddress = m_zoomAnchorAddress;
+    request.anchorRowOffset = m_zoomAnchorRowOffset;
+    request.frame = m_frame;
+    request.blocks = m_tileBlocks; // images are implicitly shared, and not modified by the renderer
+    request.spareImages.swap(m_spareImages);
+    m_renderer->request(move(request));
+}
+
+void MosaicWidget::renderFinished()
+{
+    MosaicRenderer::Result result;
+    if (!m_renderer->takeResult(&result)) {
+        return;
+    }
+    if (result.frame->zoomLevel() != m_zoomLevel || result.frame->colorMode() != m_colorMode) {
+        // requested before the zoom level or colors changed; a request for the new ones is on the way
+        return;
     }
-    //qDebug() << "Number of pages in mapped address space (VSZ) is" << mappedSpace / PageInfo::pageSize;
 
-    // The difference between page count in mapped address space and page count in the "spanned" address
-    // space can be HUGE, so we must figuratively insert some (...) in the graphical representation. Find
-    // the large contiguous regions and thus the points to graphically separate them.
-    // TODO implement a separator later, be it a line, spacing, labeling....
-    vector<pair<quint64, quint64>> largeRegions;
-    {
-        pair<quint64, quint64> largeRegion = make_pair(regions.front().start, regions.front().end);
-        static const quint64 maxAllowedGap = 64 * PageInfo::pageSize;
-        for (const MappedRegion &r : regions) {
-            if (r.start > largeRegion.second + maxAllowedGap) {
-                largeRegions.push_back(largeRegion);
-                largeRegion.first = r.start;
+    // keep the blocks out of view that are still up to date, and reuse the images of the others
+    const bool sameRows = m_frame->hasSameRows(*result.frame);
+    for (auto &block : m_tileBlocks) {
+        auto it = result.blocks.find(block.first);
+        if (it != result.blocks.end()) {
+            if (it->second.image.cacheKey() != block.second.image.cacheKey()) {
+                recycleImage(move(block.second.image));
             }
-            largeRegion.second = r.end;
+        } else if (sameRows && result.frame->isUpToDate(block.first, block.second)) {
+            result.blocks.emplace(block.first, move(block.second));
+        } else {
+            recycleImage(move(block.second.image));
         }
-        largeRegions.push_back(largeRegion);
     }
+    m_frame = move(result.frame);
+    m_tileBlocks = move(result.blocks);
 
-#if 0
-    // for performance tuning...
-    qDebug() << "number of large regions in the address space is" << largeRegions.size();
-    for (auto &r : largeRegions) {
-        // hex output...
-        qDebug() << "region" << QString("%1").arg(r.first, 0, 16) << QString("%1").arg(r.second, 0, 16);
+    updateScrollBars();
+    if (m_haveZoomAnchor) {
+        m_haveZoomAnchor = false;
+        verticalScrollBar()->setValue(result.topRow);
     }
-#endif
+    sendView();
+    viewport()->update();
+}
 
-    static const uint tilesPerSeparator = 2;
+void MosaicWidget::recycleImage(QImage image)
+{
+    if (!image.isNull() && m_spareImages.size() < s_maxSpareImages) {
+        m_spareImages.push_back(move(image));
+    }
+}
 
-    // determine size
-    // separators between largeRegions
-    uint rowCount = (largeRegions.size() - 1) * tilesPerSeparator;
-    // space for tiles showing showing pages (corresponding to contents of largeRegions)
-    for (pair<quint64, quint64> largeRegion : largeRegions) {
-        rowCount += ((largeRegion.second - largeRegion.first) / PageInfo::pageSize + (s_columnCount - 1)) /
-                    s_columnCount;
+void MosaicWidget::setZoomLevel(int zoomLevel)
+{
+    // keep the address at the top of the view in view
+    const quint64 topAddress = m_frame->rowCount() ? m_frame->rowAddress(verticalScrollBar()->value()) : 0;
+    zoomAround(zoomLevel, topAddress, 0);
+}
+
+void MosaicWidget::setColorMode(int colorMode)
+{
+    if (colorMode == m_colorMode || colorMode < MosaicFrame::CategoryColors || colorMode > MosaicFrame::NodeColors) {
+        return;
     }
-    //qDebug() << "row count is" << rowCount << " largeRegion count is" << largeRegions.size();
+    m_colorMode = MosaicFrame::ColorMode(colorMode);
+    requestFrame();
+}
 
-    // paint!
+void MosaicWidget::zoomAround(int zoomLevel, quint64 addr, int rowOffset)
+{
+    zoomLevel = qBound(0, zoomLevel, maxZoomLevel);
+    if (uint(zoomLevel) == m_zoomLevel) {
+        return;
+    }
+    // when zooming again before the last zoom is shown, keep the first anchor; the view hasn't moved
+    if (!m_haveZoomAnchor) {
+        m_haveZoomAnchor = true;
+        m_zoomAnchorAddress = addr;
+        m_zoomAnchorRowOffset = rowOffset;
+    }
+    m_zoomLevel = zoomLevel;
+    requestFrame();
+    emit zoomLevelChanged(zoomLevel);
+}
 
-    m_img = QImage(s_columnCount * s_pixelsPerTile, rowCount * s_pixelsPerTile, QImage::Format_RGB32);
-    // Theoretically we need to get the stride of the image, but in practice it is equal to width,
-    // especially with the power-of-2 widths we are using.
-    Rgb32PixelAccess pixels(m_img.width(), m_img.height(), m_img.bits());
-    // don't always construct QColors from enums - this would eat ~ 10% or so of frame time.
-    const QColor colorWhite(Qt::white);
-    const QColor colorGray(Qt::darkGray);
-    const QColor colorMagenta(Qt::magenta);
-    const QColor colorMagentaLight = QColor(Qt::magenta).lighter(150);
-    const QColor colorYellow(Qt::yellow);
-    const QColor colorCyan(Qt::blue);
-    const QColor colorGreen(Qt::green);
-    const QColor colorGreenDark(Qt::darkGreen);
-    const QColor colorRedDark(Qt::darkRed);
-    const QColor colorBlack(Qt::black);
-    // cache results of QColor::darken()
-    ColorCache cc;
+void MosaicWidget::showAddress(quint64 addr)
+{
+    if (m_frame->rowCount()) {
+        verticalScrollBar()->setValue(int(m_frame->rowAtAddress(addr)));
+    }
+}
 
-    uint row = 0;
-    size_t iMappedRegion = 0;
-    for (pair<quint64, quint64> largeRegion : largeRegions) {
-        uint column = 0;
-        assert(iMappedRegion < regions.size());
-        const MappedRegion *region = &regions[iMappedRegion];
-
-        m_largeRegions.push_back(make_pair(row, region->start));
-
-        for ( ;region->end <= largeRegion.second; region = &regions[iMappedRegion]) {
-            assert(iMappedRegion < regions.size());
-            assert(region->end >= region->start);
-
-            size_t iPage = 0;
-            while (iPage < region->useCounts.size()) {
-                const size_t endColumn = qMin(column + region->useCounts.size() - iPage, size_t(s_columnCount));
-                //qDebug() << "painting region" << column << endColumn;
-                for ( ; column < endColumn; column++, iPage++) {
-                    //qDebug() << "magenta" << column << row;
-                    QColor color = colorWhite;
-                    if (!(region->combinedFlags[iPage] & (1 << 31))) { // TODO no magic numbers - checking if "present" flag clear here
-                        color = colorGray;
-                    } else if ((region->combinedFlags[iPage] & (1 << KPF_MMAP)) &&
-                               !(region->combinedFlags[iPage] & (1 << KPF_ANON))) {
-                        color = region->useCounts[iPage] > 1 ? colorGreen : colorGreenDark;
-                    } else if (region->combinedFlags[iPage] & (1 << KPF_THP)) {
-                        // THP implies use count 1; the kernel wrongly reports use count 0 in this case
-                        color = colorMagentaLight;
-                    } else if (region->useCounts[iPage] == 1) {
-                        color = colorMagenta;
-                    } else if (region->useCounts[iPage] > 1) {
-                        color = colorYellow;
-                    } else if (region->combinedFlags[iPage] & (1 << KPF_NOPAGE)) {
-                        color = colorRedDark;
-                    } else {
-                        // qDebug() << "white page has use count" << region->useCounts[iPage] << "and flags"
-                        //          << printablePageFlags(region->combinedFlags[iPage]);
-                    }
-                    cc.paintTile(&pixels, column, row, s_pixelsPerTile, color);
-                }
-                if (column == s_columnCount) {
-                    column = 0;
-                    row++;
-                }
-            }
-            assert(region->start + iPage * PageInfo::pageSize == region->end);
-
-            // fill tiles up to either next MappedRegion or (if at end of current largeRegion) end of row
-
-            // why increase it here? a) convenience, otherwise there'd be a lot of "iMappedRegion + 1" below
-            // b) correctness, we need to fill up the current row if we're at end of region. this could be
-            //    done differently, but i don't think it's worth it if you think about how to do it.
-            iMappedRegion++;
-
-            assert(column <= s_columnCount);
-            size_t gapPages = column ? (s_columnCount - column) : 0;
-            if (iMappedRegion < regions.size() && regions[iMappedRegion].start < largeRegion.second) {
-                //qDebug() << "doing it..." << QString("%1").arg(region->end, 0, 16)
-                //                          << QString("%1").arg(regions[iMappedRegion].start, 0, 16);
-                assert(regions[iMappedRegion].start >= region->end);
-                // region still points to previous MappedRegion...
-                gapPages = (regions[iMappedRegion].start - region->end) / PageInfo::pageSize;
-            }
-            assert(gapPages < s_columnCount);
-            while (gapPages) {
-                const size_t endColumn = qMin(size_t(s_columnCount), column + gapPages);
-                gapPages -= (endColumn - column);
-                //qDebug() << "painting gap" << column << endColumn << gapPages;
-                for ( ; column < endColumn; column++) {
-                    cc.paintTile(&pixels, column, row, s_pixelsPerTile, colorCyan);
-                }
-                if (column == s_columnCount) {
-                    column = 0;
-                    row++;
-                }
-            }
+void MosaicWidget::updateScrollBars()
+{
+    // the vertical scroll bar counts rows, which allows for more than INT_MAX pixels
+    const int visibleRows = viewport()->height() / int(s_pixelsPerTile);
+    verticalScrollBar()->setRange(0, qMax(0, int(m_frame->rowCount()) - visibleRows));
+    verticalScrollBar()->setPageStep(visibleRows);
+    verticalScrollBar()->setSingleStep(4);
+
+    const int width = s_columnCount * s_pixelsPerTile;
+    horizontalScrollBar()->setRange(0, qMax(0, width - viewport()->width()));
+    horizontalScrollBar()->setPageStep(viewport()->width());
+    horizontalScrollBar()->setSingleStep(4 * s_pixelsPerTile);
+}
+
+void MosaicWidget::paintEvent(QPaintEvent *event)
+{
+    QPainter painter(viewport());
+    const QRect rect = event->rect();
+    painter.fillRect(rect, palette().color(QPalette::Window));
+    const MosaicFrame &frame = *m_frame;
+    if (!frame.rowCount()) {
+        return;
+    }
 
-            assert(region->end <= largeRegion.second);
-            // loop control snippet "region = &regions[iMappedRegion]" would access out of bounds otherwise
-            if (iMappedRegion >= regions.size()) {
-                break;
+    const quint32 topRow = verticalScrollBar()->value();
+    const int left = -horizontalScrollBar()->value();
+    const quint32 firstRow = topRow + qMax(0, rect.top()) / s_pixelsPerTile;
+    const quint32 endRow = qMin(frame.rowCount(), topRow + qMax(0, rect.bottom()) / s_pixelsPerTile + 1);
+    if (firstRow < endRow) {
+        for (quint32 block = firstRow / s_tileBlockRows; block <= (endRow - 1) / s_tileBlockRows; block++) {
+            auto it = m_tileBlocks.find(block);
+            if (it == m_tileBlocks.end()) {
+                // scrolled into view; the worker only renders what was in view when a frame was requested
+                it = m_tileBlocks.emplace(block, MosaicTileBlock()).first;
+                if (!m_spareImages.empty()) {
+                    it->second.image = move(m_spareImages.back());
+                    m_spareImages.pop_back();
+                }
+                frame.renderBlock(block, &it->second);
             }
+            const quint32 blockFirstRow = block * s_tileBlockRows;
+            const int y = (int(blockFirstRow) - int(topRow)) * int(s_pixelsPerTile);
+            const int height = qMin(s_tileBlockRows, frame.rowCount() - blockFirstRow) * s_pixelsPerTile;
+            painter.drawImage(left, y, it->second.image, 0, 0, -1, height);
         }
-        assert(column == 0);
-        // draw separator line; we avoid a line after the last largeRegion via the "&& y < rowCount"
-        // condition and decreasing rowCount by the height (thickness) of a line.
-        for (uint y = row; y < row + tilesPerSeparator && y < rowCount; y++) {
-            for (uint x = 0 ; x < s_columnCount; x++) {
-                cc.paintTile(&pixels, x, y, s_pixelsPerTile, colorBlack);
-            }
+    }
+
+    // forget blocks that are far out of view; keep some to make scrolling back and forth cheap
+    const quint32 firstVisibleBlock = topRow / s_tileBlockRows;
+    const quint32 lastVisibleBlock = (topRow + viewport()->height() / s_pixelsPerTile) / s_tileBlockRows;
+    const quint32 margin = lastVisibleBlock - firstVisibleBlock + 1;
+    for (auto it = m_tileBlocks.begin(); it != m_tileBlocks.end(); ) {
+        if (it->first + margin < firstVisibleBlock || it->first > lastVisibleBlock + margin) {
+            recycleImage(move(it->second.image));
+            it = m_tileBlocks.erase(it);
+        } else {
+            ++it;
         }
-        row += tilesPerSeparator;
     }
+}
 
-    m_mosaicWidget.setPixmap(QPixmap::fromImage(m_img));
-    m_mosaicWidget.adjustSize();
+void MosaicWidget::resizeEvent(QResizeEvent *event)
+{
+    QAbstractScrollArea::resizeEvent(event);
+    updateScrollBars();
 }
 
-void MosaicWidget::printPageFlagsAtPos(const QPoint &widgetPos)
+void MosaicWidget::printPageFlagsAtPos(const QPoint &viewportPos)
 {
-    printPageFlagsAtAddr(addressAtPos(widgetPos));
+    if (m_frame->zoomLevel()) {
+        quint64 tile;
+        if (tileAtPos(viewportPos, &tile)) {
+            printTileInfo(tile);
+        }
+        return;
+    }
+    printPageFlagsAtAddr(addressAtPos(viewportPos));
 }
 
-quint64 MosaicWidget::addressAtPos(const QPoint &widgetPos)
+bool MosaicWidget::tileAtPos(const QPoint &viewportPos, quint64 *tile) const
 {
-    // widgetPos can be outside of the widget when the mouse button goes down inside the widget rect,
-    // the with button still down is moved outside the widget. Like a drag, but we don't implement DnD.
-    quint32 row = qMax(0, widgetPos.y()) / s_pixelsPerTile;
-    quint32 column = qBound(0, widgetPos.x() / int(s_pixelsPerTile), int(s_columnCount));
+    // viewportPos can be outside of the viewport when the mouse button goes down inside the viewport,
+    // then with button still down is moved outside. Like a drag, but we don't implement DnD.
+    const quint32 row = verticalScrollBar()->value() + qMax(0, viewportPos.y()) / s_pixelsPerTile;
+    const quint32 column = qBound(0, (viewportPos.x() + horizontalScrollBar()->value()) / int(s_pixelsPerTile),
+                                  int(s_columnCount) - 1);
+    return m_frame->tileAt(row, column, tile);
+}
 
-    auto lIt = upper_bound(m_largeRegions.begin(), m_largeRegions.end(), row,
-                           [](quint32 lhs, const pair<quint32, quint64> &rhs)
-                               { return lhs < rhs.first; });
-    if (lIt == m_largeRegions.begin()) {
-        // qDebug() << "out of range (row too small)";
+quint64 MosaicWidget::addressAtPos(const QPoint &viewportPos) const
+{
+    quint64 tile;
+    if (!tileAtPos(viewportPos, &tile)) {
         return 0;
     }
-    --lIt; // now lIt is at the next less or equal element
-           // (unless row > last row, which should not trip up callers)
-
-    return lIt->second + ((row - lIt->first) * s_columnCount + column) * PageInfo::pageSize;
+    return (tile << m_frame->zoomLevel()) * PageInfo::pageSize;
 }
 
 void MosaicWidget::printPageFlagsAtAddr(quint64 addr)
@@ -503,36 +1375,176 @@ void MosaicWidget::printPageFlagsAtAddr(quint64 addr)
         return;
     }
 
-    const auto rIt = upper_bound(m_regions.begin(), m_regions.end(), addr,
-                                 [](quint64 lhs, const MappedRegion &rhs)
-                                     { return lhs < rhs.end; });
-    if (rIt == m_regions.end()) {
+    const MappedRegionSnapshot &regions = m_frame->regions();
+    const auto rIt = upper_bound(regions.begin(), regions.end(), addr,
+                                 [](quint64 lhs, const shared_ptr<const MappedRegion> &rhs)
+                                     { return lhs < rhs->end; });
+    if (rIt == regions.end()) {
         // qDebug() << "out of range (addr/row/column too large)";
         return;
     }
-    if (rIt->start > addr) {
-        Q_ASSERT(rIt != m_regions.begin()); // this can only happen when input data is inconsistent
+    const MappedRegion &region = **rIt;
+    if (region.start > addr) {
+        Q_ASSERT(rIt != regions.begin()); // this can only happen when input data is inconsistent
         //qDebug() << QString("%1").arg(addr, 0, 16) // hex format
         //         << "in a gap between"
-        //         << QString("%1").arg(rIt->start, 0, 16) << "and"
-        //         << QString("%1").arg((rIt - 1)->end, 0, 16) << "!";
+        //         << QString("%1").arg(region.start, 0, 16) << "and"
+        //         << QString("%1").arg((*(rIt - 1))->end, 0, 16) << "!";
         return;
     }
 
-    const size_t index = (addr - rIt->start) / PageInfo::pageSize;
-
-    emit showFlags(rIt->combinedFlags[index]);
-    emit showPageInfo(addr, rIt->useCounts[index], QString::fromStdString(rIt->backingFile));
+    const size_t run = region.runAt((addr - region.start) / PageInfo::pageSize);
+
+    emit showFlags(region.combinedFlags[run]);
+    if (m_frame->colorMode() == MosaicFrame::NodeColors) {
+        const quint64 page = (addr - region.start) / PageInfo::pageSize;
+        const bool hasPlacement = !region.placementStarts.empty() && page >= region.placementStarts.front();
+        const quint16 placement = hasPlacement ? region.placements[region.placementRunAt(page)]
+                                               : PagePlacement::unknown;
+        const quint32 flags = region.combinedFlags[run];
+        QString where;
+        if ((flags & PageFlags::swapped) && PagePlacement::isSwapType(placement)) {
+            where = QString::fromLatin1("swap area %1").arg(PagePlacement::swapType(placement));
+        } else if (!isResident(pageCategory(region.useCounts[run], flags))) {
+            where = QString::fromLatin1("[not present]");
+        } else if (PagePlacement::isNode(placement)) {
+            where = QString::fromLatin1("node %1").arg(PagePlacement::node(placement));
+        } else {
+            where = QString::fromLatin1("[unknown]");
+        }
+        emit showTileInfo(QString::fromLatin1("Address:\t0x%1\nUse count:\t%2\nPlacement:\t%3\nBacking file:\n%4\n")
+                              .arg(addr, 0, 16).arg(region.useCounts[run]).arg(where)
+                              .arg(region.backingFile.empty() ? QString::fromLatin1("[none]")
+                                                              : QString::fromStdString(region.backingFile)));
+        return;
+    }
+    if (m_frame->colorMode() != MosaicFrame::ChangeColors) {
+        emit showPageInfo(addr, region.useCounts[run], QString::fromStdString(region.backingFile));
+        return;
+    }
+    // what the colors show, and what the page was in the frames that they are from
+    const PageHeat &heat = *m_frame->heat();
+    QString text = QString::fromLatin1("Address:\t0x%1\nUse count:\t%2\nBacking file:\n%3\n"
+                                       "Changed in %4 of the last %5 frames, oldest first:\n")
+                       .arg(addr, 0, 16).arg(region.useCounts[run])
+                       .arg(region.backingFile.empty() ? QString::fromLatin1("[none]")
+                                                       : QString::fromStdString(region.backingFile))
+                       .arg(heat.changesAt(addr / PageInfo::pageSize)).arg(heat.frameCount());
+    const vector<uint8_t> states = heat.statesAt(addr);
+    for (size_t i = 0; i < states.size(); ) {
+        size_t end = i + 1;
+        while (end < states.size() && states[end] == states[i]) {
+            end++;
+        }
+        text += QString::fromLatin1("%1 x %2\n").arg(end - i).arg(QString::fromStdString(PageState::name(states[i])));
+        i = end;
+    }
+    emit showTileInfo(text);
 }
 
-bool MosaicWidget::eventFilter(QObject *obj, QEvent *event)
+void MosaicWidget::printTileInfo(quint64 tile)
 {
-    if (event->type() == QEvent::MouseButtonPress || event->type() == QEvent::MouseMove) {
-        QMouseEvent *me = static_cast<QMouseEvent *>(event);
-        if (me->buttons() & Qt::LeftButton) {
-            printPageFlagsAtPos(me->pos());
-            return true;
+    const MappedRegionSnapshot &regions = m_frame->regions();
+    const vector<shared_ptr<const RegionSummary>> &summaries = m_frame->summaries();
+    const uint level = m_frame->zoomLevel();
+    const quint64 firstPage = tile << level;
+    const quint64 endPage = (tile + 1) << level;
+    PageSummary summary;
+    quint64 mappedPages = 0;
+    QStringList backingFiles;
+    size_t regionCount = 0;
+    const size_t firstRegion = upper_bound(regions.begin(), regions.end(), firstPage * PageInfo::pageSize,
+                                           [](quint64 lhs, const shared_ptr<const MappedRegion> &rhs)
+                                               { return lhs < rhs->end; })
+                               - regions.begin();
+    for (size_t i = firstRegion; i < summaries.size() && regions[i]->start / PageInfo::pageSize < endPage; i++) {
+        const RegionSummary &regionSummary = *summaries[i];
+        if (regionSummary.endTile(level) <= regionSummary.firstTile(level)) {
+            continue; // empty region
         }
+        summary += regionSummary.tile(level, tile);
+        mappedPages += regionSummary.pageCount(level, tile);
+        regionCount++;
+        const QString backingFile = QString::fromStdString(regions[i]->backingFile);
+        if (!backingFile.isEmpty() && !backingFiles.contains(backingFile)) {
+            backingFiles.append(backingFile);
+        }
+    }
+
+    auto percent = [mappedPages](quint32 pages) { return QString::number(pages * 100.0 / mappedPages, 'f', 1); };
+    QString text = QString::fromLatin1("Addresses:\t0x%1 - 0x%2\n")
+                       .arg(firstPage * PageInfo::pageSize, 0, 16).arg(endPage * PageInfo::pageSize, 0, 16);
+    if (mappedPages) {
+        text += QString::fromLatin1("Mapped:\t%1 pages in %2 regions\n"
+                                    "Present:\t%3 %\n")
+                    .arg(mappedPages).arg(regionCount).arg(percent(summary.presentPages()));
+        for (uint category = NotPresentPage + 1; category < PageCategoryCount; category++) {
+            if (summary.pages[category]) {
+                text += QString::fromLatin1("- %1:\t%2 %\n")
+                            .arg(QString::fromLatin1(pageCategoryName(PageCategory(category))))
+                            .arg(percent(summary.pages[category]));
+            }
+        }
+    } else {
+        text += QString::fromLatin1("Not mapped\n");
+    }
+    if (mappedPages && m_frame->colorMode() == MosaicFrame::ChangeColors) {
+        quint32 changes;
+        m_frame->heat()->maxChangesInTiles(level, tile, 1, &changes);
+        text += QString::fromLatin1("Most changes of a page:\t%1 in the last %2 frames\n")
+                    .arg(changes).arg(m_frame->heat()->frameCount());
+    }
+    if (mappedPages && m_frame->colorMode() == MosaicFrame::IdleColors) {
+        text += QString::fromLatin1("Idle:\t%1 %\n").arg(percent(summary.idlePages));
+    }
+    if (mappedPages && m_frame->colorMode() == MosaicFrame::NodeColors) {
+        // of the pages in placement runs, see PageColors::forPlacementSummary()
+        // ### Nodes from PageColors::nodeColorCount on count as the node that shares their color
+        quint64 placementPages[PageColors::placementSlotCount] = {};
+        m_frame->addPlacementPages(firstRegion, tile, 1, placementPages);
+        for (uint slot = 0; slot < PageColors::nodeColorCount; slot++) {
+            if (placementPages[slot]) {
+                text += QString::fromLatin1("Node %1:\t%2 %\n").arg(slot).arg(percent(placementPages[slot]));
+            }
+        }
+        if (placementPages[PageColors::swappedSlot]) {
+            text += QString::fromLatin1("Swap:\t%1 %\n").arg(percent(placementPages[PageColors::swappedSlot]));
+        }
+    }
+    text += QString::fromLatin1("Backing files:\n%1").arg(backingFiles.isEmpty() ? QString::fromLatin1("[none]")
+                                                                                 : backingFiles.join("\n"));
+    emit showFlags(0);
+    emit showTileInfo(text);
+}
+
+void MosaicWidget::mousePressEvent(QMouseEvent *event)
+{
+    if (event->buttons() & Qt::LeftButton) {
+        printPageFlagsAtPos(event->pos());
+    }
+}
+
+void MosaicWidget::mouseMoveEvent(QMouseEvent *event)
+{
+    if (event->buttons() & Qt::LeftButton) {
+        printPageFlagsAtPos(event->pos());
+    }
+}
+
+void MosaicWidget::wheelEvent(QWheelEvent *event)
+{
+    // Ctrl + wheel zooms, keeping the address under the mouse cursor in place if possible
+    if (!(event->modifiers() & Qt::ControlModifier) || !event->angleDelta().y()) {
+        QAbstractScrollArea::wheelEvent(event);
+        return;
+    }
+    event->accept();
+    quint64 addr = addressAtPos(event->pos());
+    int rowOffset = event->pos().y() / int(s_pixelsPerTile);
+    if (!addr) {
+        // not over a tile, keep the top
+        addr = m_frame->rowCount() ? m_frame->rowAddress(verticalScrollBar()->value()) : 0;
+        rowOffset = 0;
     }
-    return QScrollArea::eventFilter(obj, event);
+    zoomAround(m_zoomLevel + (event->angleDelta().y() < 0 ? 1 : -1), addr, rowOffset);
 }
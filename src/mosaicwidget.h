@@ -29,72 +29,230 @@
 #ifndef MOSAICWIDGET_H
 #define MOSAICWIDGET_H
 
+#include <QAbstractScrollArea>
 #include <QByteArray>
 #include <QElapsedTimer>
 #include <QImage>
-#include <QLabel>
-#include <QScrollArea>
-#include <QTimer>
 #include <QTcpSocket>
 
-#include <utility>
+#include <memory>
+#include <unordered_map>
 #include <vector>
+#include "pagehistory.h"
 #include "pageinfo.h"
+#include "pageinfoprotocol.h"
+#include "pageinforeader.h"
+#include "pageinforecording.h"
+#include "pagesummary.h"
 
-class PageInfoReader
+class CaptureWorker;
+class MosaicRenderer;
+class PageColors;
+class Rgb32PixelAccess;
+
+// a block of MosaicFrame::tileBlockRows rows of the mosaic
+struct MosaicTileBlock
+{
+    QImage image;
+    // the regions that were rendered; the block must be rendered again when one of them changes
+    MappedRegionSnapshot regions;
+    // the heat that was rendered with ChangeColors, otherwise null
+    std::shared_ptr<const PageHeat> heat;
+    unsigned int colorMode = 0; // the MosaicFrame::ColorMode that was rendered
+};
+
+// A snapshot laid out as rows of tiles at a zoom level. It is immutable once built, so that it can be
+// built and rendered in a worker thread and then handed to the GUI thread.
+class MosaicFrame
 {
 public:
-    // returns true when a new dataset was just completed
-    bool addData(const QByteArray &data);
-    std::vector<MappedRegion> m_mappedRegions;
+    static const uint tileBlockRows = 64; // 256 pixels high, 2 MiB of pixels
+
+    enum ColorMode {
+        CategoryColors, // the PageCategory of each page
+        ChangeColors, // how often each page changed in the frames of the PageHeat
+        IdleColors, // whether present pages were accessed, see KPF_IDLE and CaptureOptions::trackIdlePages
+        NodeColors // the NUMA node or swap area of each page, see MappedRegion::placements
+    };
+
+    // contiguous (up to small gaps) parts of the address space, separated by a black bar in the mosaic
+    struct LargeRegion
+    {
+        quint32 firstRow;
+        quint32 rowCount; // not including the separator
+        quint64 firstTile; // at the zoom level, see RegionSummary
+        quint64 endTile;
+        quint64 start;
+        quint64 end;
+        bool hasSameRows(const LargeRegion &other) const
+        {
+            return firstRow == other.firstRow && rowCount == other.rowCount && firstTile == other.firstTile;
+        }
+    };
+
+    MosaicFrame(); // no regions
+    // the RegionSummaries of regions that are shared with previous, which can be null, are reused; heat is
+    // of the history up to regions, and can be null unless with ChangeColors
+    MosaicFrame(MappedRegionSnapshot regions, uint zoomLevel, ColorMode colorMode,
+                std::shared_ptr<const PageHeat> heat, const MosaicFrame *previous);
+
+    const MappedRegionSnapshot &regions() const { return m_regions; }
+    // one per region while zoomed out, otherwise empty
+    const std::vector<std::shared_ptr<const RegionSummary>> &summaries() const { return m_summaries; }
+    uint zoomLevel() const { return m_zoomLevel; }
+    ColorMode colorMode() const { return m_colorMode; }
+    const std::shared_ptr<const PageHeat> &heat() const { return m_heat; }
+    quint32 rowCount() const { return m_rowCount; }
+    // whether the rows show the same tiles, so that blocks rendered for one can be kept for the other
+    bool hasSameRows(const MosaicFrame &other) const;
+
+    std::vector<LargeRegion>::const_iterator largeRegionAtRow(quint32 row) const;
+    quint64 rowAddress(quint32 row) const;
+    quint32 rowAtAddress(quint64 addr) const;
+    // the tile at zoomLevel, false if there is none
+    bool tileAt(quint32 row, uint column, quint64 *tile) const;
+    MappedRegionSnapshot regionsInBlock(quint32 block) const;
+    // whether tileBlock, rendered for this or another frame with the same rows, shows what this one would
+    bool isUpToDate(quint32 block, const MosaicTileBlock &tileBlock) const;
+    // renders into tileBlock->image, which is reused if it has the right size
+    void renderBlock(quint32 block, MosaicTileBlock *tileBlock) const;
+    // adds the pages in the placement runs of the regions from firstRegion on to placementPages, which
+    // has PageColors::placementSlotCount counters per tile from firstTile at zoomLevel
+    void addPlacementPages(size_t firstRegion, quint64 firstTile, uint tileCount, quint64 *placementPages) const;
 
 private:
-    int64_t m_length = -1;
-    QByteArray m_buffer;
+    void buildSummaries(const MosaicFrame *previous);
+    void buildLayout();
+    void renderZoomedRow(const LargeRegion &largeRegion, quint32 row, quint32 y, Rgb32PixelAccess *pixels,
+                         const PageColors &colors) const;
+    // what renderBlock() colors the pages by, null for CategoryColors
+    std::shared_ptr<const PageHeat> renderedHeat() const
+    {
+        return m_colorMode == ChangeColors ? m_heat : std::shared_ptr<const PageHeat>();
+    }
+
+    MappedRegionSnapshot m_regions;
+    std::vector<std::shared_ptr<const RegionSummary>> m_summaries;
+    uint m_zoomLevel;
+    ColorMode m_colorMode;
+    std::shared_ptr<const PageHeat> m_heat;
+    std::vector<LargeRegion> m_largeRegions;
+    quint32 m_rowCount;
 };
 
-class MosaicWidget : public QScrollArea
+// Shows the address space as rows of tiles, one tile per page, or 2 ^ zoomLevel pages when zoomed out.
+// Only the rows in view are rendered, in blocks of rows that are cached until the regions they show
+// change, so the cost of an update depends on the size of the window, not on the size of the address
+// space. Zoomed out tiles are colored from RegionSummaries, which are only built for changed regions.
+// Capturing (in local mode), summarizing and rendering the blocks in view happen in worker threads; the
+// GUI thread only swaps in finished frames, so it stays responsive with large processes.
+// The renderer also keeps a PageHistory of the last historyFrames frames, for coloring pages by how often
+// they changed (ChangeColors). Frames that come in faster than they can be shown are not in it; their
+// changes count in the next frame that is. In client mode, only the complete frames before the first
+// sendView() are, so ChangeColors shows the categories from then on. IdleColors only shows something if
+// the capture tracks idle pages: locally with CaptureOptions::trackIdlePages, from a server started with
+// memstat --idle-pages.
+// NodeColors only shows something in local mode with CaptureOptions::recordPlacement.
+class MosaicWidget : public QAbstractScrollArea
 {
     Q_OBJECT
 public:
-    MosaicWidget(uint pid);
-    MosaicWidget(const QByteArray &host, uint port);
+    // updateInterval is in milliseconds. Only what passes the filter is captured, in client mode by
+    // the server. In client mode, the server sends data only for what is in view (see sendView()), and
+    // an updateInterval of 0 means as often as the server updates.
+    MosaicWidget(uint pid, uint updateInterval, const CaptureOptions &options);
+    MosaicWidget(const QByteArray &host, uint port, uint updateInterval, const CaptureFilter &filter);
+    // the recording must be open
+    explicit MosaicWidget(std::unique_ptr<PageInfoRecording> recording);
+    ~MosaicWidget() override;
+
+    size_t recordedFrameCount() const { return m_recording ? m_recording->frameCount() : 0; }
+
+    static const int maxZoomLevel = 24; // 64 GiB per tile
+    int zoomLevel() const { return m_zoomLevel; }
+    static const uint historyFrames = 64;
+    // the latest data, possibly not shown yet; see regionsChanged()
+    const MappedRegionSnapshot &regions() const { return m_regions; }
+
+public slots:
+    void showRecordedFrame(int frame);
+    void setZoomLevel(int zoomLevel);
+    // a MosaicFrame::ColorMode
+    void setColorMode(int colorMode);
+    // scrolls so that the row of the address is at the top
+    void showAddress(quint64 addr);
 
 signals:
     void showPageInfo(quint64 addr, quint32 useCount, const QString &backingFile);
     // value ~0 / (all bits set) on combinedFlags parameter means invalid page
     void showFlags(quint32 combinedFlags);
+    // what the pages of a tile are when zoomed out
+    void showTileInfo(const QString &text);
+    void zoomLevelChanged(int zoomLevel);
     void serverConnectionBroke(bool);
+    void showCaptureStats(const QString &text);
+    void showRecordedFrameInfo(const QString &text);
+    void regionsChanged();
 
 private slots:
+    void socketConnected();
     void socketError();
+    // tells the server the address window around the view and the zoom level, if they changed
+    void sendView();
 
 protected:
-    bool eventFilter(QObject *, QEvent *) override;
+    void paintEvent(QPaintEvent *) override;
+    void resizeEvent(QResizeEvent *) override;
+    void mousePressEvent(QMouseEvent *) override;
+    void mouseMoveEvent(QMouseEvent *) override;
+    void wheelEvent(QWheelEvent *) override;
 
 private slots:
-    void localUpdateTimeout();
+    // called through the event loop when the workers have something new
+    void localFrameAvailable();
+    void renderFinished();
     void networkDataAvailable();
 
 private:
-    void updatePageInfo(const std::vector<MappedRegion> &regions);
+    void updatePageInfo(const MappedRegionSnapshot &regions);
+    // asks the renderer for a frame of m_regions at m_zoomLevel
+    void requestFrame();
+    // changes the zoom level so that addr ends up rowOffset rows below the top of the view
+    void zoomAround(int zoomLevel, quint64 addr, int rowOffset);
+    void updateScrollBars();
+    void recycleImage(QImage image);
 
-    void printPageFlagsAtPos(const QPoint &widgetPos);
-    quint64 addressAtPos(const QPoint &widgetPos);
+    void printPageFlagsAtPos(const QPoint &viewportPos);
+    // the tile at the zoom level of the frame shown, false if there is none
+    bool tileAtPos(const QPoint &viewportPos, quint64 *tile) const;
+    quint64 addressAtPos(const QPoint &viewportPos) const;
     void printPageFlagsAtAddr(quint64 addr);
+    void printTileInfo(quint64 tile);
 
     uint m_pid;
-    QTimer m_updateTimer;
+    std::unique_ptr<CaptureWorker> m_captureWorker;
     QElapsedTimer m_updateIntervalWatch;
     QTcpSocket m_socket;
+    CaptureFilter m_captureFilter; // to send to the server
+    uint m_updateInterval; // to send to the server
+    bool m_haveSentView;
+    PageInfoProtocol::View m_sentView;
     PageInfoReader m_pageInfoReader;
+    std::unique_ptr<PageInfoRecording> m_recording;
+    std::unique_ptr<MosaicRenderer> m_renderer;
 
-    std::vector<MappedRegion> m_regions; // for tooltips and other mouseover info
-    // v meaning:  line, address (of the start of each largeRegion)
-    std::vector<std::pair<quint32, quint64>> m_largeRegions; // needed for picking the right info
+    MappedRegionSnapshot m_regions; // the latest data, possibly not shown yet
+    uint m_zoomLevel; // requested, possibly not shown yet
+    MosaicFrame::ColorMode m_colorMode; // requested, possibly not shown yet
+    // where to scroll when the renderer delivers a frame at m_zoomLevel, see zoomAround()
+    bool m_haveZoomAnchor;
+    quint64 m_zoomAnchorAddress;
+    int m_zoomAnchorRowOffset;
 
-    QLabel m_mosaicWidget;
-    QImage m_img;
+    // shown, for painting, tooltips and other mouseover info
+    std::shared_ptr<const MosaicFrame> m_frame;
+    std::unordered_map<quint32, MosaicTileBlock> m_tileBlocks; // key: block index
+    std::vector<QImage> m_spareImages; // of dropped blocks, for rendering new ones
 };
 
 #endif // MOSAICWIDGET_H
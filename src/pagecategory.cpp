@@ -0,0 +1,231 @@
+/*
+  pagecategory.cpp
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pagecategory.h"
+
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_KERNEL
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+const char *pageCategoryName(PageCategory category)
+{
+    static const char *names[PageCategoryCount] = {
+        "not present",
+        "file",
+        "shared file",
+        "anonymous in THP",
+        "anonymous",
+        "shared anonymous",
+        "no page",
+        "unknown"
+    };
+    return category < PageCategoryCount ? names[category] : "invalid";
+}
+
+void classifyPagesScalar(const uint32_t *useCounts, const uint32_t *combinedFlags, size_t count,
+                         uint8_t *categories)
+{
+    for (size_t i = 0; i < count; i++) {
+        categories[i] = pageCategory(useCounts[i], combinedFlags[i]);
+    }
+}
+
+// The vector kernels compute all conditions of pageCategory() as lane masks and then apply the
+// decisions from the last to the first, so that the first matching decision wins. That is branch-free,
+// which matters because the categories of consecutive runs are hard to predict.
+
+#if defined(__SSE2__)
+static inline __m128i select128(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static inline __m128i isSet128(__m128i flags, uint32_t bit)
+{
+    const __m128i bitVector = _mm_set1_epi32(int(bit));
+    return _mm_cmpeq_epi32(_mm_and_si128(flags, bitVector), bitVector);
+}
+
+static inline __m128i classify128(__m128i useCounts, __m128i flags)
+{
+    const __m128i present = _mm_srai_epi32(flags, 31); // PageFlags::present is the sign bit
+    const __m128i file = _mm_andnot_si128(isSet128(flags, 1 << KPF_ANON), isSet128(flags, 1 << KPF_MMAP));
+    const __m128i onceUsed = _mm_cmpeq_epi32(useCounts, _mm_set1_epi32(1));
+    // there is no unsigned comparison in SSE2: > 1 is neither 0 nor 1
+    const __m128i shared = _mm_andnot_si128(_mm_or_si128(onceUsed, _mm_cmpeq_epi32(useCounts, _mm_setzero_si128())),
+                                            _mm_set1_epi32(-1));
+    __m128i ret = _mm_set1_epi32(UnknownPage);
+    ret = select128(isSet128(flags, 1 << KPF_NOPAGE), _mm_set1_epi32(NoPage), ret);
+    ret = select128(shared, _mm_set1_epi32(SharedAnonPage), ret);
+    ret = select128(onceUsed, _mm_set1_epi32(AnonPage), ret);
+    ret = select128(isSet128(flags, 1 << KPF_THP), _mm_set1_epi32(ThpPage), ret);
+    ret = select128(file, select128(shared, _mm_set1_epi32(SharedFilePage), _mm_set1_epi32(FilePage)), ret);
+    return select128(present, ret, _mm_set1_epi32(NotPresentPage));
+}
+
+static void classifyPagesSse2(const uint32_t *useCounts, const uint32_t *combinedFlags, size_t count,
+                              uint8_t *categories)
+{
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m128i u = _mm_loadu_si128(reinterpret_cast<const __m128i *>(useCounts + i));
+        const __m128i f = _mm_loadu_si128(reinterpret_cast<const __m128i *>(combinedFlags + i));
+        const __m128i c = classify128(u, f);
+        // 32 -> 16 -> 8 bits per lane; the values are small, so there is no saturation
+        const __m128i packed = _mm_packus_epi16(_mm_packs_epi32(c, c), c);
+        const uint32_t bytes = uint32_t(_mm_cvtsi128_si32(packed));
+        memcpy(categories + i, &bytes, sizeof(bytes));
+    }
+    classifyPagesScalar(useCounts + i, combinedFlags + i, count - i, categories + i);
+}
+#endif
+
+#ifdef HAVE_AVX2_KERNEL
+// compiled for AVX2 regardless of the compiler flags; only called when the CPU supports it
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+
+AVX2_FUNCTION static inline __m256i select256(__m256i mask, __m256i a, __m256i b)
+{
+    return _mm256_blendv_epi8(b, a, mask);
+}
+
+AVX2_FUNCTION static inline __m256i isSet256(__m256i flags, uint32_t bit)
+{
+    const __m256i bitVector = _mm256_set1_epi32(int(bit));
+    return _mm256_cmpeq_epi32(_mm256_and_si256(flags, bitVector), bitVector);
+}
+
+AVX2_FUNCTION static void classifyPagesAvx2(const uint32_t *useCounts, const uint32_t *combinedFlags,
+                                            size_t count, uint8_t *categories)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const __m256i u = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(useCounts + i));
+        const __m256i f = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(combinedFlags + i));
+
+        const __m256i present = _mm256_srai_epi32(f, 31);
+        const __m256i file = _mm256_andnot_si256(isSet256(f, 1 << KPF_ANON), isSet256(f, 1 << KPF_MMAP));
+        const __m256i onceUsed = _mm256_cmpeq_epi32(u, _mm256_set1_epi32(1));
+        const __m256i shared = _mm256_cmpgt_epi32(_mm256_xor_si256(u, _mm256_set1_epi32(INT32_MIN)),
+                                                  _mm256_set1_epi32(INT32_MIN + 1)); // unsigned u > 1
+        __m256i c = _mm256_set1_epi32(UnknownPage);
+        c = select256(isSet256(f, 1 << KPF_NOPAGE), _mm256_set1_epi32(NoPage), c);
+        c = select256(shared, _mm256_set1_epi32(SharedAnonPage), c);
+        c = select256(onceUsed, _mm256_set1_epi32(AnonPage), c);
+        c = select256(isSet256(f, 1 << KPF_THP), _mm256_set1_epi32(ThpPage), c);
+        c = select256(file, select256(shared, _mm256_set1_epi32(SharedFilePage), _mm256_set1_epi32(FilePage)), c);
+        c = select256(present, c, _mm256_set1_epi32(NotPresentPage));
+
+        // packing works within each 128 bit half, so the 4 bytes of each half end up in its low 32 bits
+        const __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(c, c), c);
+        const uint32_t bytes[2] = { uint32_t(_mm_cvtsi128_si32(_mm256_castsi256_si128(packed))),
+                                    uint32_t(_mm_cvtsi128_si32(_mm256_extracti128_si256(packed, 1))) };
+        memcpy(categories + i, bytes, sizeof(bytes));
+    }
+    classifyPagesScalar(useCounts + i, combinedFlags + i, count - i, categories + i);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+static inline uint32x4_t classifyNeon(uint32x4_t useCounts, uint32x4_t flags)
+{
+    const uint32x4_t present = vtstq_u32(flags, vdupq_n_u32(PageFlags::present));
+    const uint32x4_t file = vbicq_u32(vtstq_u32(flags, vdupq_n_u32(1 << KPF_MMAP)),
+                                      vtstq_u32(flags, vdupq_n_u32(1 << KPF_ANON)));
+    const uint32x4_t onceUsed = vceqq_u32(useCounts, vdupq_n_u32(1));
+    const uint32x4_t shared = vcgtq_u32(useCounts, vdupq_n_u32(1));
+    uint32x4_t ret = vdupq_n_u32(UnknownPage);
+    ret = vbslq_u32(vtstq_u32(flags, vdupq_n_u32(1 << KPF_NOPAGE)), vdupq_n_u32(NoPage), ret);
+    ret = vbslq_u32(shared, vdupq_n_u32(SharedAnonPage), ret);
+    ret = vbslq_u32(onceUsed, vdupq_n_u32(AnonPage), ret);
+    ret = vbslq_u32(vtstq_u32(flags, vdupq_n_u32(1 << KPF_THP)), vdupq_n_u32(ThpPage), ret);
+    ret = vbslq_u32(file, vbslq_u32(shared, vdupq_n_u32(SharedFilePage), vdupq_n_u32(FilePage)), ret);
+    return vbslq_u32(present, ret, vdupq_n_u32(NotPresentPage));
+}
+
+static void classifyPagesNeon(const uint32_t *useCounts, const uint32_t *combinedFlags, size_t count,
+                              uint8_t *categories)
+{
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        const uint32x4_t low = classifyNeon(vld1q_u32(useCounts + i), vld1q_u32(combinedFlags + i));
+        const uint32x4_t high = classifyNeon(vld1q_u32(useCounts + i + 4), vld1q_u32(combinedFlags + i + 4));
+        vst1_u8(categories + i, vmovn_u16(vcombine_u16(vmovn_u32(low), vmovn_u32(high))));
+    }
+    classifyPagesScalar(useCounts + i, combinedFlags + i, count - i, categories + i);
+}
+#endif
+
+typedef void (*Classifier)(const uint32_t *, const uint32_t *, size_t, uint8_t *);
+
+struct ClassifierChoice
+{
+    Classifier function;
+    const char *name;
+};
+
+static ClassifierChoice chooseClassifier()
+{
+#ifdef HAVE_AVX2_KERNEL
+    if (__builtin_cpu_supports("avx2")) {
+        return { classifyPagesAvx2, "avx2" };
+    }
+#endif
+#if defined(__SSE2__)
+    return { classifyPagesSse2, "sse2" };
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    return { classifyPagesNeon, "neon" };
+#else
+    return { classifyPagesScalar, "scalar" };
+#endif
+}
+
+static const ClassifierChoice &classifier()
+{
+    static const ClassifierChoice choice = chooseClassifier();
+    return choice;
+}
+
+void classifyPages(const uint32_t *useCounts, const uint32_t *combinedFlags, size_t count, uint8_t *categories)
+{
+    classifier().function(useCounts, combinedFlags, count, categories);
+}
+
+const char *pageClassifierName()
+{
+    return classifier().name;
+}
@@ -0,0 +1,102 @@
+/*
+  pagecategory.h
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PAGECATEGORY_H
+#define PAGECATEGORY_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "kernel-page-flags.h"
+
+// What kind of memory a page is, by its use count and combined flags (see MappedRegion). This is the one
+// place that decides it: MosaicWidget has a color per category, RegionSummary and memstat's RSS / PSS
+// summary count pages per category.
+enum PageCategory : uint8_t {
+    NotPresentPage = 0, // not in RAM: not touched yet, swapped out, or reserved
+    FilePage, // from a file, mapped at most once
+    SharedFilePage, // from a file, mapped more than once
+    ThpPage, // anonymous, in a transparent huge page (some kernels report use count 0 for all but the first)
+    AnonPage, // anonymous, mapped once
+    SharedAnonPage, // anonymous, mapped more than once
+    NoPage, // KPF_NOPAGE: there is no page frame at the PFN
+    UnknownPage, // present, but none of the above
+    PageCategoryCount
+};
+
+namespace PageFlags
+{
+    // bits of combined flags that are copied from /proc/<pid>/pagemap, see pagemapFlags() in pageinfo.cpp;
+    // the other bits are KPF_* flags from /proc/kpageflags
+    static const uint32_t softDirty = 1u << 28;
+    static const uint32_t fileOrSharedAnon = 1u << 29;
+    static const uint32_t swapped = 1u << 30;
+    static const uint32_t present = 1u << 31;
+}
+
+// the classification rules; the vectorized kernels behind classifyPages() implement the same decisions
+inline PageCategory pageCategory(uint32_t useCount, uint32_t flags)
+{
+    if (!(flags & PageFlags::present)) {
+        return NotPresentPage;
+    } else if ((flags & (1 << KPF_MMAP)) && !(flags & (1 << KPF_ANON))) {
+        return useCount > 1 ? SharedFilePage : FilePage;
+    } else if (flags & (1 << KPF_THP)) {
+        return ThpPage;
+    } else if (useCount == 1) {
+        return AnonPage;
+    } else if (useCount > 1) {
+        return SharedAnonPage;
+    } else if (flags & (1 << KPF_NOPAGE)) {
+        return NoPage;
+    }
+    return UnknownPage;
+}
+
+const char *pageCategoryName(PageCategory category);
+
+// whether pages of the category count as resident (RSS), and whether they are shared with other
+// processes, i.e. count only proportionally for PSS
+inline bool isResident(PageCategory category)
+{
+    return category != NotPresentPage && category != NoPage && category != UnknownPage;
+}
+inline bool isShared(PageCategory category)
+{
+    return category == SharedFilePage || category == SharedAnonPage;
+}
+
+// categories[i] = pageCategory(useCounts[i], combinedFlags[i]) for i < count, using the fastest kernel
+// that the CPU supports: AVX2, SSE2 or NEON, or the plain loop of classifyPagesScalar()
+void classifyPages(const uint32_t *useCounts, const uint32_t *combinedFlags, size_t count, uint8_t *categories);
+void classifyPagesScalar(const uint32_t *useCounts, const uint32_t *combinedFlags, size_t count,
+                         uint8_t *categories);
+// the name of the kernel that classifyPages() uses, e.g. for benchmark output
+const char *pageClassifierName();
+
+#endif // PAGECATEGORY_H
@@ -0,0 +1,401 @@
+/*
+  pagehistory.cpp
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pagehistory.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+using namespace std;
+
+static_assert(PageCategoryCount <= PageState::categoryMask + 1, "PageState has no room for the categories");
+
+uint8_t PageState::of(uint32_t useCount, uint32_t combinedFlags)
+{
+    uint8_t ret = pageCategory(useCount, combinedFlags);
+    if (combinedFlags & PageFlags::swapped) {
+        ret |= swapped;
+    }
+    if (combinedFlags & PageFlags::softDirty) {
+        ret |= softDirty;
+    }
+    if (combinedFlags & (1 << KPF_REFERENCED)) {
+        ret |= referenced;
+    }
+    if (combinedFlags & (1 << KPF_DIRTY)) {
+        ret |= dirty;
+    }
+    return ret;
+}
+
+string PageState::name(uint8_t state)
+{
+    if (state == unmapped) {
+        return "not mapped";
+    }
+    string ret = pageCategoryName(PageCategory(state & categoryMask));
+    static const uint8_t flags[] = { swapped, softDirty, dirty, referenced };
+    static const char *flagNames[] = { "swapped", "soft-dirty", "dirty", "referenced" };
+    for (size_t i = 0; i < sizeof(flags); i++) {
+        if (state & flags[i]) {
+            ret += ", ";
+            ret += flagNames[i];
+        }
+    }
+    return ret;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void appendCompactRun(vector<uint8_t> *runs, uint64_t pageCount, uint8_t state)
+{
+    do {
+        const uint8_t low = pageCount & 0x7f;
+        pageCount >>= 7;
+        runs->push_back(pageCount ? low | 0x80 : low);
+    } while (pageCount);
+    runs->push_back(state);
+}
+
+CompactRegion::CompactRegion(const MappedRegion &region)
+   : m_start(region.start),
+     m_end(region.end)
+{
+    uint64_t runStart = 0;
+    uint8_t state = 0;
+    for (size_t run = 0; run < region.runCount(); run++) {
+        const uint8_t runState = PageState::of(region.useCounts[run], region.combinedFlags[run]);
+        if (run && runState != state) {
+            appendCompactRun(&m_runs, region.runStarts[run] - runStart, state);
+            runStart = region.runStarts[run];
+        }
+        state = runState;
+    }
+    if (region.runCount()) {
+        appendCompactRun(&m_runs, region.pageCount() - runStart, state);
+    }
+    m_runs.shrink_to_fit();
+}
+
+// the run at runs[*i], moving *i to the next run
+static uint64_t readCompactRun(const vector<uint8_t> &runs, size_t *i, uint8_t *state)
+{
+    uint64_t pageCount = 0;
+    for (uint shift = 0; ; shift += 7) {
+        const uint8_t byte = runs[(*i)++];
+        pageCount |= uint64_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    *state = runs[(*i)++];
+    return pageCount;
+}
+
+uint8_t CompactRegion::stateAt(uint64_t addr) const
+{
+    assert(addr >= m_start && addr < m_end);
+    const uint64_t page = (addr - m_start) / PageInfo::pageSize;
+    uint64_t runEnd = 0;
+    for (size_t i = 0; i < m_runs.size(); ) {
+        uint8_t state;
+        runEnd += readCompactRun(m_runs, &i, &state);
+        if (page < runEnd) {
+            return state;
+        }
+    }
+    return PageState::unmapped;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+PageHeat::PageHeat()
+   : m_runs(1, Run{ 0, 0 }),
+     m_maxChanges(0)
+{
+}
+
+// the run that contains page
+static vector<PageHeat::Run>::const_iterator heatRunAt(const vector<PageHeat::Run> &runs, uint64_t page)
+{
+    return upper_bound(runs.begin(), runs.end(), page,
+                       [](uint64_t lhs, const PageHeat::Run &rhs) { return lhs < rhs.firstPage; }) - 1;
+}
+
+uint32_t PageHeat::changesAt(uint64_t page) const
+{
+    return heatRunAt(m_runs, page)->changes;
+}
+
+void PageHeat::maxChangesInTiles(unsigned int level, uint64_t firstTile, size_t tileCount, uint32_t *out) const
+{
+    fill(out, out + tileCount, 0);
+    const uint64_t firstPage = firstTile << level;
+    const uint64_t endPage = (firstTile + tileCount) << level;
+    for (auto it = heatRunAt(m_runs, firstPage); it != m_runs.end() && it->firstPage < endPage; ++it) {
+        if (!it->changes) {
+            continue;
+        }
+        const uint64_t runFirst = max(it->firstPage, firstPage);
+        const uint64_t runEnd = it + 1 != m_runs.end() ? min((it + 1)->firstPage, endPage) : endPage;
+        // the tiles of two runs overlap in at most one tile, so this takes O(runs + tiles)
+        for (uint64_t tile = runFirst >> level; tile <= (runEnd - 1) >> level; tile++) {
+            out[tile - firstTile] = max(out[tile - firstTile], it->changes);
+        }
+    }
+}
+
+vector<uint8_t> PageHeat::statesAt(uint64_t addr) const
+{
+    vector<uint8_t> ret;
+    ret.reserve(m_frames.size());
+    for (const shared_ptr<const HistoryFrame> &frame : m_frames) {
+        auto it = upper_bound(frame->regions.begin(), frame->regions.end(), addr,
+                              [](uint64_t lhs, const shared_ptr<const CompactRegion> &rhs)
+                                  { return lhs < rhs->end(); });
+        ret.push_back(it != frame->regions.end() && (*it)->start() <= addr ? (*it)->stateAt(addr)
+                                                                           : PageState::unmapped);
+    }
+    return ret;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+// the state changes that make a page count as changed, see HistoryFrame::changes
+static bool isChange(uint32_t oldUseCount, uint32_t oldFlags, uint32_t useCount, uint32_t flags)
+{
+    const uint8_t oldState = PageState::of(oldUseCount, oldFlags);
+    const uint8_t state = PageState::of(useCount, flags);
+    const uint8_t kindMask = PageState::categoryMask | PageState::swapped;
+    const uint8_t dirtiedMask = PageState::softDirty | PageState::dirty;
+    return oldUseCount != useCount || (oldState & kindMask) != (state & kindMask) ||
+           (state & ~oldState & dirtiedMask);
+}
+
+// appends the pages to changes, which must only have pages before them
+static void addChange(vector<PageRange> *changes, uint64_t firstPage, uint64_t endPage)
+{
+    assert(changes->empty() || changes->back().endPage <= firstPage);
+    if (!changes->empty() && changes->back().endPage == firstPage) {
+        changes->back().endPage = endPage;
+    } else {
+        changes->push_back(PageRange{ firstPage, endPage });
+    }
+}
+
+// the changes in the pages that oldRegion and region have in common
+static void addRegionChanges(const MappedRegion &oldRegion, const MappedRegion &region, vector<PageRange> *changes)
+{
+    const uint64_t oldFirstPage = oldRegion.start / PageInfo::pageSize;
+    const uint64_t firstPage = region.start / PageInfo::pageSize;
+    const uint64_t overlapFirst = max(oldFirstPage, firstPage);
+    const uint64_t overlapEnd = min(oldRegion.end, region.end) / PageInfo::pageSize;
+    if (overlapFirst >= overlapEnd || oldRegion.runStarts.empty() || region.runStarts.empty()) {
+        return; // nothing to compare
+    }
+    // go through the parts of the overlap in which neither region starts a new run
+    size_t oldRun = oldRegion.runAt(overlapFirst - oldFirstPage);
+    size_t run = region.runAt(overlapFirst - firstPage);
+    for (uint64_t page = overlapFirst; page < overlapEnd; ) {
+        const uint64_t oldRunEnd = oldFirstPage + oldRegion.runEnd(oldRun);
+        const uint64_t runEnd = firstPage + region.runEnd(run);
+        const uint64_t partEnd = min(min(oldRunEnd, runEnd), overlapEnd);
+        if (isChange(oldRegion.useCounts[oldRun], oldRegion.combinedFlags[oldRun],
+                     region.useCounts[run], region.combinedFlags[run])) {
+            addChange(changes, page, partEnd);
+        }
+        page = partEnd;
+        if (page == oldRunEnd) {
+            oldRun++;
+        }
+        if (page == runEnd) {
+            run++;
+        }
+    }
+}
+
+static void findChanges(const MappedRegionSnapshot &oldRegions, const MappedRegionSnapshot &regions,
+                        vector<PageRange> *changes)
+{
+    size_t first = 0; // the first old region that doesn't end before the current region
+    for (const shared_ptr<const MappedRegion> &region : regions) {
+        while (first < oldRegions.size() && oldRegions[first]->end <= region->start) {
+            first++;
+        }
+        uint64_t page = region->start / PageInfo::pageSize; // the pages before are done
+        const uint64_t endPage = region->end / PageInfo::pageSize;
+        for (size_t i = first; i < oldRegions.size() && oldRegions[i]->start < region->end; i++) {
+            const MappedRegion &oldRegion = *oldRegions[i];
+            const uint64_t oldFirstPage = oldRegion.start / PageInfo::pageSize;
+            if (oldFirstPage > page) {
+                addChange(changes, page, oldFirstPage); // newly mapped
+            }
+            // unchanged regions are the same objects, shared between snapshots
+            if (oldRegions[i] != region) {
+                addRegionChanges(oldRegion, *region, changes);
+            }
+            page = max(page, min(oldRegion.end / PageInfo::pageSize, endPage));
+        }
+        if (page < endPage) {
+            addChange(changes, page, endPage);
+        }
+    }
+}
+
+static void appendHeatRun(vector<PageHeat::Run> *runs, uint64_t firstPage, uint32_t changes)
+{
+    if (runs->empty() || runs->back().changes != changes) {
+        runs->push_back(PageHeat::Run{ firstPage, changes });
+    }
+}
+
+// out = runs with delta added to the changes of the pages in ranges
+static void addToHeatRuns(const vector<PageHeat::Run> &runs, const vector<PageRange> &ranges, int delta,
+                          vector<PageHeat::Run> *out)
+{
+    out->clear();
+    const uint64_t infinity = numeric_limits<uint64_t>::max();
+    size_t run = 0;
+    size_t range = 0;
+    uint64_t page = 0;
+    while (true) {
+        const uint64_t runEnd = run + 1 < runs.size() ? runs[run + 1].firstPage : infinity;
+        const bool inRange = range < ranges.size() && ranges[range].firstPage <= page;
+        const uint64_t rangeBoundary = range >= ranges.size() ? infinity
+                                       : inRange ? ranges[range].endPage : ranges[range].firstPage;
+        assert(!inRange || delta > 0 || runs[run].changes >= uint32_t(-delta));
+        appendHeatRun(out, page, inRange ? runs[run].changes + delta : runs[run].changes);
+        page = min(runEnd, rangeBoundary);
+        if (page == infinity) {
+            break;
+        }
+        if (page == runEnd) {
+            run++;
+        }
+        if (inRange && page == ranges[range].endPage) {
+            range++;
+        }
+    }
+}
+
+PageHistory::PageHistory(size_t maxFrames, size_t maxBytes)
+   : m_maxFrames(max(maxFrames, size_t(1))),
+     m_maxBytes(maxBytes),
+     m_byteCount(0),
+     m_heat(make_shared<const PageHeat>())
+{
+}
+
+shared_ptr<const PageHeat> PageHistory::add(const MappedRegionSnapshot &regions)
+{
+    shared_ptr<HistoryFrame> frame = make_shared<HistoryFrame>();
+    size_t byteCount = sizeof(HistoryFrame);
+
+    // reuse the CompactRegions of regions that didn't change, or whose pages are in the same states
+    frame->regions.reserve(regions.size());
+    static const vector<shared_ptr<const CompactRegion>> none;
+    const vector<shared_ptr<const CompactRegion>> &lastCompactRegions = m_frames.empty()
+                                                                        ? none : m_frames.back().frame->regions;
+    size_t last = 0;
+    for (const shared_ptr<const MappedRegion> &region : regions) {
+        while (last < m_lastRegions.size() && m_lastRegions[last]->start < region->start) {
+            last++;
+        }
+        const bool haveLast = last < m_lastRegions.size() && m_lastRegions[last]->start == region->start;
+        if (haveLast && m_lastRegions[last] == region) {
+            frame->regions.push_back(lastCompactRegions[last]);
+            continue;
+        }
+        shared_ptr<const CompactRegion> compactRegion = make_shared<const CompactRegion>(*region);
+        if (haveLast && *lastCompactRegions[last] == *compactRegion) {
+            frame->regions.push_back(lastCompactRegions[last]);
+            continue;
+        }
+        byteCount += compactRegion->byteCount();
+        frame->regions.push_back(move(compactRegion));
+    }
+    byteCount += frame->regions.capacity() * sizeof(shared_ptr<const CompactRegion>);
+
+    // the first frame has nothing to compare with
+    if (!m_frames.empty()) {
+        findChanges(m_lastRegions, regions, &frame->changes);
+        frame->changes.shrink_to_fit();
+    }
+    byteCount += frame->changes.capacity() * sizeof(PageRange);
+
+    vector<PageHeat::Run> runs;
+    addToHeatRuns(m_heat->m_runs, frame->changes, 1, &runs);
+    m_frames.push_back(Frame{ move(frame), byteCount });
+    m_byteCount += byteCount;
+    m_lastRegions = regions;
+    while (m_frames.size() > m_maxFrames || (m_byteCount > m_maxBytes && m_frames.size() > 1)) {
+        dropOldestFrame(&runs);
+    }
+
+    shared_ptr<PageHeat> heat = make_shared<PageHeat>();
+    heat->m_runs = move(runs);
+    heat->m_frames.reserve(m_frames.size());
+    for (const Frame &kept : m_frames) {
+        heat->m_frames.push_back(kept.frame);
+    }
+    heat->m_maxChanges = m_maxFrames;
+    m_heat = move(heat);
+    return m_heat;
+}
+
+void PageHistory::dropOldestFrame(vector<PageHeat::Run> *runs)
+{
+    const Frame &oldest = m_frames.front();
+    addToHeatRuns(*runs, oldest.frame->changes, -1, &m_scratchRuns);
+    runs->swap(m_scratchRuns);
+    m_byteCount -= oldest.byteCount;
+
+    // the next frame now owns the CompactRegions that it shares with the oldest one
+    Frame &next = m_frames[1];
+    const vector<shared_ptr<const CompactRegion>> &oldRegions = oldest.frame->regions;
+    size_t i = 0;
+    for (const shared_ptr<const CompactRegion> &region : next.frame->regions) {
+        while (i < oldRegions.size() && oldRegions[i]->start() < region->start()) {
+            i++;
+        }
+        if (i < oldRegions.size() && oldRegions[i] == region) {
+            next.byteCount += region->byteCount();
+            m_byteCount += region->byteCount();
+        }
+    }
+    m_frames.pop_front();
+}
+
+void PageHistory::clear()
+{
+    m_frames.clear();
+    m_byteCount = 0;
+    m_lastRegions.clear();
+    m_heat = make_shared<const PageHeat>();
+}
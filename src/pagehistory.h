@@ -0,0 +1,167 @@
+/*
+  pagehistory.h
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PAGEHISTORY_H
+#define PAGEHISTORY_H
+
+#include "pagecategory.h"
+#include "pageinfo.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+// What a page was in one frame, in one byte: its PageCategory and a few of its flags
+namespace PageState
+{
+    static const uint8_t categoryMask = 0x7;
+    static const uint8_t swapped = 1 << 3;
+    static const uint8_t softDirty = 1 << 4;
+    static const uint8_t referenced = 1 << 5;
+    static const uint8_t dirty = 1 << 6;
+    static const uint8_t unmapped = 0xff; // no state: the page wasn't mapped
+
+    uint8_t of(uint32_t useCount, uint32_t combinedFlags);
+    // e.g. "anonymous, dirty, referenced"
+    std::string name(uint8_t state);
+}
+
+// The PageStates of the pages of a region in one frame. The runs of pages with the same state are stored
+// as their length, a variable length integer of 7 bits per byte starting with the low bits, followed by
+// the state: usually 2 or 3 bytes per run, and fewer runs than the region has, which also differ in use
+// count and the other flags.
+class CompactRegion
+{
+public:
+    explicit CompactRegion(const MappedRegion &region);
+
+    uint64_t start() const { return m_start; }
+    uint64_t end() const { return m_end; }
+    // of the page that contains addr; PageState::unmapped if the region has no page information
+    uint8_t stateAt(uint64_t addr) const;
+    size_t byteCount() const { return sizeof(*this) + m_runs.capacity(); }
+    bool operator==(const CompactRegion &other) const
+    {
+        return m_start == other.m_start && m_end == other.m_end && m_runs == other.m_runs;
+    }
+
+private:
+    uint64_t m_start;
+    uint64_t m_end;
+    std::vector<uint8_t> m_runs;
+};
+
+// pages from firstPage to (not including) endPage, numbered from address 0
+struct PageRange
+{
+    uint64_t firstPage;
+    uint64_t endPage;
+};
+
+// a frame of a PageHistory, immutable once added
+struct HistoryFrame
+{
+    // one per MappedRegion of the frame; the same objects as in the frame before where nothing changed
+    std::vector<std::shared_ptr<const CompactRegion>> regions;
+    // The pages that changed since the frame before, sorted, with no two ranges touching. A page changed
+    // when it was mapped, when its category, use count or swapped flag changed, and when it was dirtied,
+    // i.e. its soft-dirty or dirty flag was set. Unmapped pages are not in any frame, so not in changes.
+    std::vector<PageRange> changes;
+};
+
+// A PageHistory as of one frame: the frames it keeps, and for each page in how many of them it changed.
+// Immutable, so it can be handed between threads, like MappedRegionSnapshot.
+class PageHeat
+{
+public:
+    PageHeat();
+
+    size_t frameCount() const { return m_frames.size(); }
+    // the most changes that a page can have, one per frame of the history when it is full
+    uint32_t maxChanges() const { return m_maxChanges; }
+    uint32_t changesAt(uint64_t page) const;
+    // out[i] = the most changes of a page in tile firstTile + i, for i < tileCount; at level, tile t covers
+    // the pages from t << level to (t + 1) << level like in RegionSummary
+    void maxChangesInTiles(unsigned int level, uint64_t firstTile, size_t tileCount, uint32_t *out) const;
+    // the state of the page that contains addr in each frame, oldest first
+    std::vector<uint8_t> statesAt(uint64_t addr) const;
+
+    // the pages from firstPage up to the firstPage of the next run changed in changes frames
+    struct Run
+    {
+        uint64_t firstPage;
+        uint32_t changes;
+    };
+
+private:
+    friend class PageHistory;
+    std::vector<Run> m_runs; // starting at page 0 and ending at infinity, adjacent runs differ in changes
+    std::vector<std::shared_ptr<const HistoryFrame>> m_frames; // oldest first
+    uint32_t m_maxChanges;
+};
+
+// A history of the last frames of a process, e.g. the updates of a PageInfo, in bounded memory. Frames
+// are stored as CompactRegions that are shared between frames where they didn't change, so a frame costs
+// about as much as the regions that changed in it. The change count of each page (see PageHeat) is kept
+// up to date from the changes of the frame that is added and of the frames that are dropped, so adding
+// a frame takes time in proportion to the runs of what changed and of the PageHeat, not to the history.
+class PageHistory
+{
+public:
+    // keeps at most maxFrames frames, and as many as fit into maxBytes but at least one
+    PageHistory(size_t maxFrames, size_t maxBytes);
+
+    // adds the next frame, which regions that didn't change should share with the frame before
+    std::shared_ptr<const PageHeat> add(const MappedRegionSnapshot &regions);
+    const std::shared_ptr<const PageHeat> &heat() const { return m_heat; }
+    size_t frameCount() const { return m_frames.size(); }
+    size_t byteCount() const { return m_byteCount; }
+    void clear();
+
+private:
+    struct Frame
+    {
+        std::shared_ptr<const HistoryFrame> frame;
+        // of the CompactRegions that it doesn't share with the frame before, and of the changes
+        size_t byteCount;
+    };
+    void dropOldestFrame(std::vector<PageHeat::Run> *runs);
+
+    const size_t m_maxFrames;
+    const size_t m_maxBytes;
+    std::deque<Frame> m_frames; // oldest first
+    size_t m_byteCount;
+    MappedRegionSnapshot m_lastRegions; // of the newest frame, to find its changes in the next one
+    std::shared_ptr<const PageHeat> m_heat;
+    std::vector<PageHeat::Run> m_scratchRuns;
+};
+
+#endif // PAGEHISTORY_H
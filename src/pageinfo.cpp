@@ -28,14 +28,24 @@
 
 #include "pageinfo.h"
 
+#include "pagecategory.h"
+
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
 #include <cinttypes>
 #include <cstdio>
-#include <fstream>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <numeric>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <utility>
 
 // POSIX specific, but this whole program only works on Linux anyway!
@@ -43,6 +53,8 @@
 #include <dirent.h>
 
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -54,334 +66,2317 @@ using namespace std;
 
 static const uint pageFlagsSize = sizeof(uint64_t); // aka 64 bits aka 8 bytes
 
-struct MappedRegionInternal : MappedRegion
+CaptureStats::CaptureStats()
+   : incremental(false)
 {
-    // we only need this while we're connecting the different data sources, not afterwards
-    vector<uint64_t> pagemapEntries;
-};
+    fill(nanoseconds, nanoseconds + PhaseCount, 0);
+    fill(syscalls, syscalls + PhaseCount, 0);
+    fill(bytesRead, bytesRead + PhaseCount, 0);
+}
 
-static vector<MappedRegionInternal> readMappedRegions(uint pid)
+const char *CaptureStats::phaseName(Phase phase)
 {
-    vector<MappedRegionInternal> ret;
-    ostringstream mapsName;
-    mapsName << "/proc/" << pid << "/maps";
+    static const char *const names[PhaseCount] = {
+        "read maps",
+        "correct overlaps",
+        "read pagemap",
+        "clear soft-dirty",
+        "read/mark page_idle",
+        "rangify PFNs",
+        "read kpagecount/kpageflags",
+        "join",
+        "serialize"
+    };
+    return phase < PhaseCount ? names[phase] : "";
+}
+
+uint64_t CaptureStats::totalNanoseconds() const
+{
+    return accumulate(nanoseconds, nanoseconds + PhaseCount, uint64_t(0));
+}
+
+uint64_t CaptureStats::totalSyscalls() const
+{
+    return accumulate(syscalls, syscalls + PhaseCount, uint64_t(0));
+}
+
+uint64_t CaptureStats::totalBytesRead() const
+{
+    return accumulate(bytesRead, bytesRead + PhaseCount, uint64_t(0));
+}
+
+const char *MappingStats::fieldName(Field field)
+{
+    static const char *const names[FieldCount] = {
+        "RSS",
+        "PSS",
+        "anonymous",
+        "file",
+        "dirty",
+        "swapped",
+        "THP",
+        "soft-dirty",
+        "idle"
+    };
+    return field < FieldCount ? names[field] : "";
+}
+
+void MappingStats::addPages(uint64_t count, uint32_t useCount, uint32_t flags)
+{
+    const uint64_t size = count * PageInfo::pageSize;
+    const PageCategory category = pageCategory(useCount, flags);
+    if (isResident(category)) {
+        bytes[ResidentField] += size;
+        // per page like memstat's summary, so that the numbers add up exactly
+        bytes[ProportionalField] += isShared(category) ? count * (PageInfo::pageSize / useCount) : size;
+        const bool isFile = category == FilePage || category == SharedFilePage;
+        bytes[isFile ? FileField : AnonymousField] += size;
+        if (category == ThpPage) {
+            bytes[ThpField] += size;
+        }
+        if (flags & (1 << KPF_DIRTY)) {
+            bytes[DirtyField] += size;
+        }
+        if (flags & (1 << KPF_IDLE)) {
+            bytes[IdleField] += size;
+        }
+    }
+    if (flags & PageFlags::swapped) {
+        bytes[SwappedField] += size;
+    }
+    if (flags & PageFlags::softDirty) {
+        bytes[SoftDirtyField] += size;
+    }
+}
 
-    ifstream mapsFile(mapsName.str());
-    if (!mapsFile.is_open()) {
-        return ret; // TODO error msg
+void MappedRegion::computeStats()
+{
+    stats = MappingStats();
+    for (size_t i = 0; i < runCount(); i++) {
+        stats.addPages(runEnd(i) - runStarts[i], useCounts[i], combinedFlags[i]);
     }
-    string mapLine;
+}
 
-    while (getline(mapsFile, mapLine)) {
-        // cout << mapLine << '\n';
-        MappedRegionInternal region;
+static void addBytes(vector<uint64_t> *bytes, size_t index, uint64_t size)
+{
+    if (bytes->size() <= index) {
+        bytes->resize(index + 1);
+    }
+    (*bytes)[index] += size;
+}
 
-        region.start = 0;
-        region.end = 0;
-        char filename[PATH_MAX];
-        filename[0] = '\0';
+void PlacementStats::addRegion(const MappedRegion &region)
+{
+    if (region.placementStarts.empty()) {
+        return; // no present or swapped pages, or placements weren't recorded
+    }
+    size_t placementRun = 0;
+    for (size_t i = 0; i < region.runCount(); i++) {
+        const bool isSwapped = region.combinedFlags[i] & PageFlags::swapped;
+        if (!isResident(pageCategory(region.useCounts[i], region.combinedFlags[i])) && !isSwapped) {
+            continue;
+        }
+        // both kinds of runs are in page order, and no present or swapped page is before the first placement run
+        const uint64_t end = region.runEnd(i);
+        for (uint64_t page = max(region.runStarts[i], region.placementStarts.front()); page < end;) {
+            while (region.placementRunEnd(placementRun) <= page) {
+                placementRun++;
+            }
+            const uint64_t partEnd = min(end, region.placementRunEnd(placementRun));
+            const uint64_t size = (partEnd - page) * PageInfo::pageSize;
+            const uint16_t placement = region.placements[placementRun];
+            if (PagePlacement::isSwapType(placement)) {
+                addBytes(&swapTypeBytes, PagePlacement::swapType(placement), size);
+            } else if (PagePlacement::isNode(placement)) {
+                addBytes(&nodeBytes, PagePlacement::node(placement), size);
+            } else {
+                unknownBytes += size;
+            }
+            page = partEnd;
+        }
+    }
+}
 
-        sscanf(mapLine.c_str(), "%" SCNx64 "-%" SCNx64 " %*4s %*x %*5s %*d %*d %s",     
-            &region.start, &region.end, filename);
-        region.backingFile = string(filename);
+PlacementStats &PlacementStats::operator+=(const PlacementStats &other)
+{
+    for (size_t i = 0; i < other.nodeBytes.size(); i++) {
+        addBytes(&nodeBytes, i, other.nodeBytes[i]);
+    }
+    for (size_t i = 0; i < other.swapTypeBytes.size(); i++) {
+        addBytes(&swapTypeBytes, i, other.swapTypeBytes[i]);
+    }
+    unknownBytes += other.unknownBytes;
+    return *this;
+}
 
-        ret.push_back(region);
+template<typename RegionIterator, typename RegionFunc>
+static vector<BackingFileStats> statsByBackingFile(RegionIterator begin, RegionIterator end, RegionFunc region)
+{
+    map<string, BackingFileStats> byFile;
+    for (RegionIterator it = begin; it != end; ++it) {
+        const MappedRegion &mr = region(*it);
+        BackingFileStats &fileStats = byFile[mr.backingFile.str()];
+        fileStats.regionCount++;
+        fileStats.stats += mr.stats;
+    }
+    vector<BackingFileStats> ret;
+    ret.reserve(byFile.size());
+    for (auto &entry : byFile) {
+        entry.second.backingFile = entry.first;
+        ret.push_back(move(entry.second));
     }
     return ret;
 }
 
-static uint64_t pfnForPagemapEntry(uint64_t pmEntry)
+vector<BackingFileStats> statsByBackingFile(const vector<MappedRegion> &regions)
 {
-    return (pmEntry & PM_PRESENT) ? PM_PFRAME(pmEntry) : 0;
+    return statsByBackingFile(regions.begin(), regions.end(), [](const MappedRegion &mr) -> const MappedRegion & {
+        return mr;
+    });
 }
 
-// return value: unsorted list of all seen and present PFNs
-static vector<uint64_t> readPagemap(uint pid, vector<MappedRegionInternal> *mappedRegions)
+vector<BackingFileStats> statsByBackingFile(const MappedRegionSnapshot &regions)
 {
-    vector<uint64_t> ret;
+    return statsByBackingFile(regions.begin(), regions.end(),
+                              [](const shared_ptr<const MappedRegion> &mr) -> const MappedRegion & { return *mr; });
+}
 
-    ostringstream pagemapNameStream;
-    pagemapNameStream << "/proc/" << pid << "/pagemap";
-    string pagemapName = pagemapNameStream.str();
+// adds the time since the end of the previous phase to the phase that just ended
+class PhaseTimer
+{
+public:
+    PhaseTimer(CaptureStats *stats)
+       : m_stats(stats),
+         m_phaseStart(chrono::steady_clock::now())
+    {}
 
-    // using Linux API for reading isn't a huge win here, but it's somewhat faster and easier on
-    // the eyes than fstream API, too, so...
-    int pagemapFd = open(pagemapName.c_str(), O_RDONLY);
-    if (pagemapFd < 0) {
-        return ret; // TODO error reporting
+    void endPhase(CaptureStats::Phase phase)
+    {
+        const chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        m_stats->nanoseconds[phase] += chrono::duration_cast<chrono::nanoseconds>(now - m_phaseStart).count();
+        m_phaseStart = now;
     }
 
-    for (MappedRegionInternal &region : *mappedRegions) {
-        const size_t pageCount = (region.end - region.start) / PageInfo::pageSize;
-        region.pagemapEntries.resize(pageCount);
-        region.useCounts.resize(pageCount);
-        region.combinedFlags.resize(pageCount);
-
-        pread64(pagemapFd, &region.pagemapEntries[0],
-                (region.end - region.start) / PageInfo::pageSize * pageFlagsSize,
-                region.start / PageInfo::pageSize * pageFlagsSize);
-
-        for (size_t i = 0; i < pageCount; i++) {
-            const uint64_t pageBits = region.pagemapEntries[i];
-            const uint64_t pfn = pfnForPagemapEntry(pageBits);
-            if (pfn) {
-                ret.push_back(pfn);
-            }
-            // copy pagemap flag bits into combined flags as follows:
-            // 55-> 28 ; 61 -> 29 ; 62 -> 30 ; 63 -> 31
-            region.combinedFlags[i] = ((pageBits >> 27) & 0x10000000) | // shift and mask bit 55 to bit 28
-                                      ((pageBits >> 32) & 0xe0000000); // shift and mask upper 3 bits
-            // flags from /proc/kpageflags are added later
+private:
+    CaptureStats *m_stats;
+    chrono::steady_clock::time_point m_phaseStart;
+};
+
+// system calls and bytes read, counted separately by each thread so that they don't need to synchronize
+struct IoCounter
+{
+    uint64_t syscalls = 0;
+    uint64_t bytesRead = 0;
+};
+
+static void addIoCounters(const vector<IoCounter> &counters, CaptureStats::Phase phase, CaptureStats *stats)
+{
+    for (const IoCounter &counter : counters) {
+        stats->syscalls[phase] += counter.syscalls;
+        stats->bytesRead[phase] += counter.bytesRead;
+    }
+}
+
+// The items [begin, end) of a phase that one thread works on, and what it counts and collects
+struct Slice
+{
+    size_t begin = 0;
+    size_t end = 0;
+    IoCounter io;
+    uint64_t count = 0; // the phase's choice, e.g. present pages
+    bool ok = false;
+    // the phase's choice, e.g. scratch space for reading. Not cleared between phases, so that its memory
+    // is reused.
+    vector<uint64_t> buffer;
+};
+
+static void addIoCounters(const vector<Slice> &slices, size_t sliceCount, CaptureStats::Phase phase,
+                          CaptureStats *stats)
+{
+    for (size_t i = 0; i < sliceCount; i++) {
+        stats->syscalls[phase] += slices[i].io.syscalls;
+        stats->bytesRead[phase] += slices[i].io.bytesRead;
+    }
+}
+
+// Don't bother starting a thread for less work than that (in pages / PFNs to read)
+static const uint64_t minPagesPerThread = 16 * 1024;
+
+// Split items [0, itemCount) into at most sliceCount contiguous slices of roughly equal total weight.
+// Returns the number of slices, which are the first ones of *slices. *slices keeps the others, so that
+// their buffers can be reused by the next call with more slices.
+template<typename WeightFunc>
+static size_t splitIntoSlices(size_t itemCount, uint sliceCount, WeightFunc weight, vector<Slice> *slices)
+{
+    uint64_t totalWeight = 0;
+    for (size_t i = 0; i < itemCount; i++) {
+        totalWeight += weight(i);
+    }
+    const uint64_t targetWeight = max(minPagesPerThread, totalWeight / max(sliceCount, 1u) + 1);
+
+    size_t ret = 0;
+    auto addSlice = [slices, &ret](size_t begin, size_t end) {
+        if (ret == slices->size()) {
+            slices->emplace_back();
+        }
+        Slice &slice = (*slices)[ret++];
+        slice.begin = begin;
+        slice.end = end;
+        slice.io = IoCounter();
+        slice.count = 0;
+        slice.ok = false;
+    };
+    size_t sliceStart = 0;
+    uint64_t sliceWeight = 0;
+    for (size_t i = 0; i < itemCount; i++) {
+        sliceWeight += weight(i);
+        if (sliceWeight >= targetWeight && ret + 1 < sliceCount) {
+            addSlice(sliceStart, i + 1);
+            sliceStart = i + 1;
+            sliceWeight = 0;
         }
     }
-    close(pagemapFd);
+    if (sliceStart < itemCount || !ret) {
+        addSlice(sliceStart, itemCount);
+    }
     return ret;
 }
 
-// PFN: page frame number, a kind of unique identifier inside the kernel paging subsystem
-struct PfnRange
+// Run work(sliceIndex) for all slices, all but the last one in their own thread
+template<typename WorkFunc>
+static void runSlices(size_t sliceCount, WorkFunc work)
 {
-    uint64_t useCount(uint64_t *buffer, uint64_t pfn) const
-    {
-        assert(pfn >= start && pfn <= last);
-        return buffer[m_useCountsBufferOffset + pfn - start];
+    vector<thread> threads;
+    for (size_t i = 0; i + 1 < sliceCount; i++) {
+        threads.push_back(thread(work, i));
     }
+    if (sliceCount) {
+        work(sliceCount - 1);
+    }
+    for (thread &t : threads) {
+        t.join();
+    }
+}
 
-    uint64_t flags(uint64_t *buffer, uint64_t pfn) const
-    {
-        assert(pfn >= start && pfn <= last);
-        return buffer[m_flagsBufferOffset + pfn - start];
+bool CaptureFilter::matchesBackingFile(const string &backingFile) const
+{
+    const bool isAnonymous = backingFile.empty() || backingFile[0] == '[' || backingFile == "/dev/zero (deleted)";
+    if ((kind == AnonymousOnly && !isAnonymous) || (kind == FileOnly && isAnonymous)) {
+        return false;
     }
+    return backingFilePattern.empty() || fnmatch(backingFilePattern.c_str(), backingFile.c_str(), 0) == 0;
+}
 
-    bool operator<(const PfnRange &other) const { return last < other.last; }
-    // comparing pfn to last so lower_bound immediately finds the right range; same above for consistency
-    bool operator<(uint64_t pfn) const { return last < pfn; }
+bool CaptureFilter::addAddressRange(const string &range)
+{
+    const char *const text = range.c_str();
+    char *end = nullptr;
+    errno = 0;
+    const uint64_t start = strtoull(text, &end, 16);
+    if (end == text || *end != '-') {
+        return false;
+    }
+    const char *const endText = end + 1;
+    const uint64_t rangeEnd = strtoull(endText, &end, 16);
+    if (end == endText || *end != '\0' || errno || rangeEnd <= start) {
+        return false;
+    }
+    addressRanges.push_back(make_pair(start, rangeEnd));
+    return true;
+}
 
-    void allocBufferSpace(size_t *bufferPos)
-    {
-        const size_t count = last - start + 1;
-        m_useCountsBufferOffset = *bufferPos;
-        *bufferPos += count;
-        m_flagsBufferOffset = *bufferPos;
-        *bufferPos += count;
-    }
-
-    // maxGapSize has been determined empirically (basically watching "time" output when mapping some
-    // largish process) - one would think that much larger values help because every read() is a syscall
-    // and therefore expensive... but no, so let's just waste a little less memory from uselessly reading
-    // gaps between PFN entries that we want.
-    // Note: one possible speed advantage of not reading too much is that the kernel must generate output
-    //       even for inexistent PFNs, which looks kind of but not very expensive to do. See Linux kernel
-    //       functions: kpagecount_read(), kpageflags_read() in linux/fs/proc/page.c
-    //       - note that copy_to_user also has a (not very large, some flag tests and memcpy) cost
-    static const uint64_t maxGapSize = 16;
+// FNV-1a
+static uint64_t hashName(const char *name, size_t length)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ uint8_t(name[i])) * 0x100000001b3;
+    }
+    return hash;
+}
 
-    uint64_t start;
-    uint64_t last;
-    size_t m_useCountsBufferOffset;
-    size_t m_flagsBufferOffset;
+BackingFileName BackingFileNames::intern(const char *name, size_t length)
+{
+    if (!length) {
+        return BackingFileName();
+    }
+    const uint64_t hash = hashName(name, length);
+    const auto range = m_names.equal_range(hash);
+    for (auto it = range.first; it != range.second; ++it) {
+        const string &known = *it->second;
+        if (known.length() == length && memcmp(known.data(), name, length) == 0) {
+            return BackingFileName(it->second);
+        }
+    }
+    return BackingFileName(m_names.emplace(hash, make_shared<const string>(name, length))->second);
+}
+
+void BackingFileNames::purge()
+{
+    for (auto it = m_names.begin(); it != m_names.end();) {
+        if (it->second.use_count() == 1) {
+            it = m_names.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// A region's part of one of the pagemap arenas of CaptureBuffers
+struct PagemapEntries
+{
+    uint64_t *data = nullptr;
+    size_t count = 0;
+
+    uint64_t operator[](size_t i) const { return data[i]; }
+    size_t size() const { return count; }
+    bool empty() const { return !count; }
 };
 
-static vector<PfnRange> rangifyPfns(vector<uint64_t> pfns)
-{
-    vector<PfnRange> ret;
-    if (pfns.empty()) {
-        return ret; // pfns.front() would blow up
-    }
-
-    sort(pfns.begin(), pfns.end());
-    // remove duplicates
-    pfns.erase(unique(pfns.begin(), pfns.end()), pfns.end());
-
-    // create reasonably sized ranges to read
-    // ### Optimization: allocate memory for all ranges en bloc and store offsets into the
-    //     allocated memory in the ranges. This is a surprisingly large performance win -
-    //     it reduces the time for the whole PageInfo generation by roughly 40%.
-    //     Benefits are cache locality, one less layer of indirection, avoidance of malloc() and
-    //     free() calls, and avoidance of vector<uint64_t>::resize() uselessly initializing data.
-    size_t rangesStoragePos = 0;
-    PfnRange range;
-    range.start = pfns.front();
-    range.last = pfns.front();
-    for (uint64_t pfn : pfns) {
-        if (pfn > range.last + PfnRange::maxGapSize) {
-            // found a big gap, store previous range and start a new one
-            range.allocBufferSpace(&rangesStoragePos);
-            ret.push_back(range);
-            range.start = pfn;
-         }
-         range.last = pfn;
+struct MappedRegionInternal : MappedRegion
+{
+    // we only need these while we're connecting the different data sources, not afterwards
+    // (except PageInfo::update() keeps the maps line and pagemapEntries to compare against)
+    // the region's line in the text of /proc/<pid>/maps that it was parsed from
+    size_t mapsLineOffset = 0;
+    size_t mapsLineLength = 0;
+    PagemapEntries pagemapEntries;
+    // if the region is unchanged since the previous pass: its pagemap entries and the region as
+    // published in that pass. Otherwise empty and null.
+    PagemapEntries previousPagemapEntries;
+    const MappedRegion *previous = nullptr;
+    // whether pagemapEntries were read with PAGEMAP_SCAN, which tells pages that are mapped huge
+    bool hugeMappingsKnown = false;
+};
+
+// Reads /proc/<pid>/maps into *text, reusing its allocation from earlier calls. Like all seq_file
+// based files, maps returns no more than about a page per read(), so this takes (size / 4 KiB) + 1
+// reads however large the buffer is; what it saves over std::ifstream and std::getline is the copying
+// and allocating per line. Leaves *text empty if maps could not be read.
+static bool readMapsText(uint pid, vector<char> *text, CaptureStats *stats)
+{
+    static const size_t minBufferSize = 64 * 1024;
+    char mapsName[32];
+    snprintf(mapsName, sizeof(mapsName), "/proc/%u/maps", pid);
+    const int fd = open(mapsName, O_RDONLY | O_CLOEXEC);
+    stats->syscalls[CaptureStats::ReadMapsPhase]++;
+    if (fd < 0) {
+        text->clear();
+        return false; // TODO error msg
+    }
+    // Not cleared first: resizing from the text of the last call to the capacity only zeroes the part
+    // that it didn't use. The old text is overwritten by the reads below.
+    text->resize(max(minBufferSize, text->capacity()));
+    size_t size = 0;
+    bool ok = true;
+    while (true) {
+        if (size == text->size()) {
+            text->resize(2 * size);
+        }
+        const ssize_t readSize = read(fd, text->data() + size, text->size() - size);
+        stats->syscalls[CaptureStats::ReadMapsPhase]++;
+        if (readSize > 0) {
+            size += readSize;
+        } else if (readSize == 0) {
+            break;
+        } else if (errno != EINTR) {
+            size = 0;
+            ok = false;
+            break;
+        }
+    }
+    close(fd);
+    stats->syscalls[CaptureStats::ReadMapsPhase]++;
+    stats->bytesRead[CaptureStats::ReadMapsPhase] += size;
+    text->resize(size);
+    return ok;
+}
+
+static const char *skipSpaces(const char *it, const char *end)
+{
+    while (it < end && *it == ' ') {
+        it++;
     }
-    range.allocBufferSpace(&rangesStoragePos);
-    ret.push_back(range);
+    return it;
+}
 
+static uint64_t parseHex(const char **it, const char *end)
+{
+    uint64_t ret = 0;
+    for (; *it < end; ++*it) {
+        const char c = **it;
+        if (c >= '0' && c <= '9') {
+            ret = (ret << 4) | uint64_t(c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            ret = (ret << 4) | uint64_t(c - 'a' + 10);
+        } else {
+            break;
+        }
+    }
     return ret;
 }
 
-class PfnInfos
+// The lines of maps look like this:
+// 7f6e1c021000-7f6e1c1b6000 r-xp 00022000 fe:01 1838418                    /usr/lib/libc.so.6
+// The backing file is everything after the inode field, so names with spaces and the " (deleted)"
+// of unlinked files are kept. The kernel escapes newlines in names. Without names, backing files are
+// not stored. Replaces the contents of *regions.
+static void parseMappedRegions(const vector<char> &text, BackingFileNames *names,
+                               vector<MappedRegionInternal> *regions)
 {
-public:
-    PfnInfos(vector<PfnRange> data)
-       : m_ranges(data),
-         m_buffer(nullptr),
-         m_cachedRange(m_ranges.begin())
-    {
-        readUseCountsAndFlags();
+    vector<MappedRegionInternal> &ret = *regions;
+    ret.clear();
+    const char *const begin = text.data();
+    const char *const end = begin + text.size();
+    ret.reserve(count(begin, end, '\n'));
+
+    const char *lineEnd = nullptr;
+    for (const char *line = begin; line < end; line = lineEnd + 1) {
+        lineEnd = static_cast<const char *>(memchr(line, '\n', end - line));
+        if (!lineEnd) {
+            lineEnd = end;
+        }
+        MappedRegionInternal region;
+        const char *it = line;
+        region.start = parseHex(&it, lineEnd);
+        if (it < lineEnd && *it == '-') {
+            it++;
+        }
+        region.end = parseHex(&it, lineEnd);
+        // skip permissions, offset, device and inode
+        for (int field = 0; field < 4; field++) {
+            it = skipSpaces(it, lineEnd);
+            while (it < lineEnd && *it != ' ') {
+                it++;
+            }
+        }
+        it = skipSpaces(it, lineEnd);
+        if (names) {
+            region.backingFile = names->intern(it, lineEnd - it);
+        }
+        region.mapsLineOffset = line - begin;
+        region.mapsLineLength = lineEnd - line;
+        ret.push_back(move(region));
     }
+}
 
-    ~PfnInfos() { if (m_buffer) free(m_buffer); }
+// For the users that only need the regions once. Backing files are only stored if the filter needs them.
+static vector<MappedRegionInternal> readMappedRegions(uint pid, const CaptureFilter &filter, vector<char> *text,
+                                                      CaptureStats *stats)
+{
+    vector<MappedRegionInternal> ret;
+    if (!readMapsText(pid, text, stats)) {
+        return ret;
+    }
+    BackingFileNames names;
+    const bool needNames = !filter.backingFilePattern.empty() || filter.kind != CaptureFilter::AnyKind;
+    parseMappedRegions(*text, needNames ? &names : nullptr, &ret);
+    return ret;
+}
 
-    uint64_t useCount(uint64_t pfn) const;
-    uint64_t flags(uint64_t pfn) const;
+// ### regions can sometimes overlap(!), presumably due to data races in the kernel when watching
+// a running process. Just assign any overlapping area to the first region to "claim" it, i.e. the
+// one with the smallest start address.
+// This runs before any per-page data is read, so the overlapping pages are neither read twice nor
+// need to be cut out of the per-page arrays later.
+static void correctOverlaps(vector<MappedRegionInternal> *mappedRegions)
+{
+    vector<MappedRegionInternal> &regions = *mappedRegions;
+    for (size_t i = 1; i < regions.size(); i++) {
+        if (regions[i].start < regions[i - 1].end) {
+            cout << "correcting " << hex << regions[i - 1].start << " " << hex << regions[i - 1].end << " "
+                                  << regions[i].start << " " << hex << regions[i].end << endl;
+            regions[i].start = regions[i - 1].end;
+            if (regions[i].start >= regions[i].end) {
+                // This renders the range inert... might be better to remove it altogether.
+                // Note that we move the end instead of the start, to maintain the invariant that the
+                // start address of region n+1 is >= end address of region n.
+                regions[i].end = regions[i].start;
+            }
+            cout << "corrected  " << hex << regions[i - 1].start << hex << " " << regions[i - 1].end << " "
+                 << regions[i].start << " " << hex << regions[i].end << endl;
+        }
+    }
+}
 
-private:
-    void readUseCountsAndFlags();
-    void findRange(uint64_t pfn) const;
-    vector<PfnRange> m_ranges;
-    uint64_t *m_buffer;
-    mutable vector<PfnRange>::const_iterator m_cachedRange;
+// what applyFilter() needs besides the regions, kept by callers that filter repeatedly
+struct FilterScratch
+{
+    vector<pair<uint64_t, uint64_t>> ranges;
+    vector<MappedRegionInternal> passed;
 };
 
-void PfnInfos::findRange(uint64_t pfn) const
+// Drops the regions that don't pass the filter, and cuts the others to its address ranges. Runs
+// before pagemap is read, like correctOverlaps(), and keeps the regions sorted.
+// the address ranges of the filter, page aligned, sorted and merged, so that the parts of a region don't
+// overlap and come out in order
+static void normalizedRanges(const CaptureFilter &filter, vector<pair<uint64_t, uint64_t>> *ranges)
 {
-    // we're making the assumption that the pfn *is* contained in one of the ranges!
-    if (pfn >= m_cachedRange->start && pfn <= m_cachedRange->last) {
-        // fast path: it's in the same range as last PFN we were asked for
+    const uint64_t pageMask = PageInfo::pageSize - 1;
+    ranges->clear();
+    for (const pair<uint64_t, uint64_t> &range : filter.addressRanges) {
+        const uint64_t end = min(range.second, numeric_limits<uint64_t>::max() - pageMask) + pageMask;
+        ranges->push_back(make_pair(range.first & ~pageMask, end & ~pageMask));
+    }
+    sort(ranges->begin(), ranges->end());
+    size_t merged = 0;
+    for (size_t i = 1; i < ranges->size(); i++) {
+        if ((*ranges)[i].first <= (*ranges)[merged].second) {
+            (*ranges)[merged].second = max((*ranges)[merged].second, (*ranges)[i].second);
+        } else {
+            (*ranges)[++merged] = (*ranges)[i];
+        }
+    }
+    ranges->resize(min(ranges->size(), merged + 1));
+}
+
+static void applyFilter(const CaptureFilter &filter, vector<MappedRegionInternal> *mappedRegions,
+                        FilterScratch *scratch)
+{
+    if (filter.isEmpty()) {
         return;
     }
-    // binary search
-    m_cachedRange = lower_bound(m_ranges.begin(), m_ranges.end(), pfn);
-    assert(m_cachedRange != m_ranges.end());
+    vector<pair<uint64_t, uint64_t>> &ranges = scratch->ranges;
+    normalizedRanges(filter, &ranges);
+
+    vector<MappedRegionInternal> &passed = scratch->passed;
+    passed.clear();
+    for (MappedRegionInternal &region : *mappedRegions) {
+        if (!filter.matchesBackingFile(region.backingFile)) {
+            continue;
+        }
+        if (ranges.empty()) {
+            passed.push_back(move(region));
+            continue;
+        }
+        for (const pair<uint64_t, uint64_t> &range : ranges) {
+            if (range.first < region.end && range.second > region.start) {
+                passed.push_back(region);
+                passed.back().start = max(region.start, range.first);
+                passed.back().end = min(region.end, range.second);
+            }
+        }
+    }
+    swap(*mappedRegions, passed);
 }
 
-uint64_t PfnInfos::useCount(uint64_t pfn) const
+// The pages from firstPage to endPage (relative to the start) of a captured region, as a region of its own
+static MappedRegion partOfRegion(const MappedRegion &region, uint64_t firstPage, uint64_t endPage)
 {
-    findRange(pfn);
-    return m_cachedRange->useCount(m_buffer, pfn);
+    MappedRegion ret;
+    ret.start = region.start + firstPage * PageInfo::pageSize;
+    ret.end = region.start + endPage * PageInfo::pageSize;
+    ret.backingFile = region.backingFile;
+    for (size_t run = region.runAt(firstPage); run < region.runCount() && region.runStarts[run] < endPage; run++) {
+        ret.runStarts.push_back(max(region.runStarts[run], firstPage) - firstPage);
+        ret.useCounts.push_back(region.useCounts[run]);
+        ret.combinedFlags.push_back(region.combinedFlags[run]);
+    }
+    if (!region.placementStarts.empty()) {
+        const size_t first = firstPage >= region.placementStarts.front() ? region.placementRunAt(firstPage) : 0;
+        for (size_t run = first; run < region.placements.size() && region.placementStarts[run] < endPage; run++) {
+            ret.addPlacement(max(region.placementStarts[run], firstPage) - firstPage, region.placements[run]);
+        }
+    }
+    ret.computeStats();
+    return ret;
 }
 
-uint64_t PfnInfos::flags(uint64_t pfn) const
+vector<MappedRegion> filterRegions(const vector<MappedRegion> &regions, const CaptureFilter &filter)
 {
-    findRange(pfn);
-    return m_cachedRange->flags(m_buffer, pfn);
+    vector<pair<uint64_t, uint64_t>> ranges;
+    normalizedRanges(filter, &ranges);
+    vector<MappedRegion> ret;
+    for (const MappedRegion &region : regions) {
+        if (!filter.matchesBackingFile(region.backingFile)) {
+            continue;
+        }
+        if (ranges.empty()) {
+            ret.push_back(region);
+            continue;
+        }
+        for (const pair<uint64_t, uint64_t> &range : ranges) {
+            if (range.first < region.end && range.second > region.start && region.end > region.start) {
+                const uint64_t start = max(region.start, range.first);
+                const uint64_t end = min(region.end, range.second);
+                ret.push_back(partOfRegion(region, (start - region.start) / PageInfo::pageSize,
+                                           (end - region.start) / PageInfo::pageSize));
+            }
+        }
+    }
+    return ret;
 }
 
-// read kpagemap and kpagecount
-void PfnInfos::readUseCountsAndFlags()
+// Not a kernel bit: scanPagemap() sets this bit, which pagemap leaves clear, in the entries of pages that
+// PAGEMAP_SCAN reports as mapped huge (PAGE_IS_HUGE), i.e. by a PMD or as a hugetlb page.
+static const uint64_t pmMappedHuge = 1ull << 60;
+
+static uint64_t pfnForPagemapEntry(uint64_t pmEntry)
 {
-    assert(!m_buffer);
-    if (m_ranges.empty()) {
-        return;
+    return (pmEntry & PM_PRESENT) ? PM_PFRAME(pmEntry) : 0;
+}
+
+// whether use count and flags of page number i in the region from the previous pass are still valid
+static bool isPageUnchanged(const MappedRegionInternal &region, size_t i)
+{
+    if (region.previousPagemapEntries.empty()) {
+        return false;
     }
+    // The old data is still good if the page is still mapped to the same PFN with the same flags, and
+    // if it hasn't been written to (which would change e.g. the dirty flag) since the soft-dirty bits
+    // were cleared.
+    const uint64_t pageBits = region.pagemapEntries[i];
+    return pageBits == region.previousPagemapEntries[i] && !(pageBits & PM_SOFT_DIRTY);
+}
 
-    // Extract buffer size from m_ranges using a little shortcut
-    const PfnRange &lastRange = m_ranges.back();
-    const size_t allocSize = (lastRange.m_flagsBufferOffset +
-                               (lastRange.m_flagsBufferOffset - lastRange.m_useCountsBufferOffset)) *
-                             pageFlagsSize;
-    m_buffer = static_cast<uint64_t *>(malloc(allocSize));
+// whether use count and flags of page number i in the region need to be read from /proc/kpage*
+static bool needsPfnInfo(const MappedRegionInternal &region, size_t i)
+{
+    return pfnForPagemapEntry(region.pagemapEntries[i]) && !isPageUnchanged(region, i);
+}
 
-    // ### this function takes about half the CPU time of a whole data gathering pass when using
-    //     std::ifstream, and since we're tied to Linux anyway, just use Linux API (note: it only
-    //     shaves off about 30% of this function's execution time - syscalls take the longest time!!)
-    int kpagecountFd = open("/proc/kpagecount", O_RDONLY);
-    int kpageflagsFd = open("/proc/kpageflags", O_RDONLY);
-    if (kpagecountFd < 0 || kpageflagsFd < 0) {
-        return; // TODO error reporting
+// A huge page that is mapped as one (by a PMD, the page table level above the last) shows up in pagemap
+// as hugePagePages present pages with consecutive PFNs, from a virtual address and a PFN that are both
+// aligned to its size. 1 GiB hugetlb pages look like several of them.
+static const uint64_t hugePagePages = (2 * 1024 * 1024) / PageInfo::pageSize;
+static const uint32_t compoundPageFlags = (1 << KPF_COMPOUND_HEAD) | (1 << KPF_COMPOUND_TAIL);
+
+// whether the hugePagePages pages from page number i of the region can be a huge page, none of which is
+// isPageUnchanged(). Only the flags of its first page in /proc/kpageflags tell whether it is one.
+// Those flags can't tell a 2 MiB transparent huge page from a smaller one (multi-size THP, or a large
+// folio of the page cache) that physical and virtual neighbors happen to continue, so candidates need
+// pmMappedHuge where PAGEMAP_SCAN read the region. Otherwise, only anonymous pages are candidates, which
+// merging allows only if the kernel has no smaller THPs, see mergesHugePages().
+static bool isHugePageCandidate(const MappedRegionInternal &region, size_t i)
+{
+    if ((region.start / PageInfo::pageSize + i) % hugePagePages ||
+        i + hugePagePages > region.pagemapEntries.size()) {
+        return false;
+    }
+    const uint64_t firstPfn = pfnForPagemapEntry(region.pagemapEntries[i]);
+    if (!firstPfn || firstPfn % hugePagePages) {
+        return false;
+    }
+    const uint64_t requiredBits = region.hugeMappingsKnown ? pmMappedHuge : 0;
+    const uint64_t excludedBits = region.hugeMappingsKnown ? 0 : PM_FILE;
+    for (size_t j = 0; j < hugePagePages; j++) {
+        const uint64_t pageBits = region.pagemapEntries[i + j];
+        if (pfnForPagemapEntry(pageBits) != firstPfn + j || (pageBits & requiredBits) != requiredBits ||
+            (pageBits & excludedBits) || isPageUnchanged(region, i + j)) {
+            return false;
+        }
     }
+    return true;
+}
 
-    uint64_t readTotal = 0;
+// Calls func with the PFN of each page of the region that needsPfnInfo(). With mergeHugePages
+// (CaptureOptions), only with the first PFN of each huge page candidate.
+template<typename PfnFunc>
+static void forEachNeededPfn(const MappedRegionInternal &region, bool mergeHugePages, PfnFunc func)
+{
+    const size_t pageCount = region.pagemapEntries.size();
+    for (size_t i = 0; i < pageCount; i++) {
+        if (mergeHugePages && isHugePageCandidate(region, i)) {
+            func(pfnForPagemapEntry(region.pagemapEntries[i]));
+            i += hugePagePages - 1;
+        } else if (needsPfnInfo(region, i)) {
+            func(pfnForPagemapEntry(region.pagemapEntries[i]));
+        }
+    }
+}
 
-    for (PfnRange &range : m_ranges) {
-        size_t count = range.last - range.start + 1;
-        readTotal += count * 2 * pageFlagsSize;
+// the part of combined flags that comes from pagemap; flags from /proc/kpageflags are added later
+static uint32_t pagemapFlags(uint64_t pageBits)
+{
+    // copy pagemap flag bits into combined flags as follows (see PageFlags in pagecategory.h):
+    // 55-> 28 ; 61 -> 29 ; 62 -> 30 ; 63 -> 31
+    return ((pageBits >> 27) & 0x10000000) | // shift and mask bit 55 to bit 28
+           ((pageBits >> 32) & 0xe0000000); // shift and mask upper 3 bits
+}
 
-        pread64(kpagecountFd, m_buffer + range.m_useCountsBufferOffset,
-                count * pageFlagsSize, range.start * pageFlagsSize);
-        pread64(kpageflagsFd, m_buffer + range.m_flagsBufferOffset,
-                count * pageFlagsSize, range.start * pageFlagsSize);
+// Reads the pagemap entries of count pages from firstPage on into entries. Entries that can't be read
+// are zero: their region went away since reading maps, so their pages are not present. (The arena of
+// PageInfo still holds the data of an earlier pass there.)
+static void preadPagemap(int pagemapFd, uint64_t firstPage, size_t count, uint64_t *entries, IoCounter *io)
+{
+    const size_t bytes = count * pageFlagsSize;
+    const ssize_t bytesRead = pread64(pagemapFd, entries, bytes, firstPage * pageFlagsSize);
+    io->syscalls++;
+    io->bytesRead += max(bytesRead, ssize_t(0));
+    if (bytesRead < ssize_t(bytes)) {
+        fill(entries + max(bytesRead, ssize_t(0)) / pageFlagsSize, entries + count, 0);
     }
+}
 
-    assert(readTotal == allocSize);
-    // cout << "PFN ranges total read bytes: " << readTotal << '\n';
+// PAGEMAP_SCAN returns ranges of pages in any of these categories. It walks only the page tables that
+// exist, so it takes time in proportion to the populated part of a range, while reading pagemap takes
+// time in proportion to its size. It returns no PFNs (nor swap entries) though, so the entries of the
+// pages that it finds still need to be read from pagemap.
+static const uint64_t scannedCategories = PAGE_IS_PRESENT | PAGE_IS_SWAPPED;
+// how many ranges one PAGEMAP_SCAN call returns at most; the walk continues where the last one stopped
+static const size_t scanBatchRanges = 256;
+// Ranges with at most this many pages between them are read from pagemap in one piece: reading the
+// entries of a few pages too many is cheaper than another system call.
+static const uint64_t scanMaxGapPages = 64;
 
-    close(kpagecountFd);
-    close(kpageflagsFd);
+static pm_scan_arg scanArgs(uint64_t start, uint64_t end, page_region *ranges, size_t rangeCount)
+{
+    pm_scan_arg args;
+    memset(&args, 0, sizeof(args));
+    args.size = sizeof(args);
+    args.start = start;
+    args.end = end;
+    args.vec = uintptr_t(ranges);
+    args.vec_len = rangeCount;
+    args.category_anyof_mask = scannedCategories;
+    args.return_mask = scannedCategories | PAGE_IS_HUGE;
+    return args;
 }
 
-PageInfo::PageInfo(uint pid)
+// Probing rather than checking the kernel version, because the ioctl may have been backported. Older
+// kernels fail with ENOTTY.
+bool isPagemapScanSupported()
 {
-    // - read information about mapped ranges, from /proc/<pid>/maps
-    // - read mapping of addresses to (PFNs and certain flags), from /proc/<pid>/pagemap
-    // - read flags (from /proc/kpageflags) and use counts (from /proc/kpagecount) for PFNs
-    // - using the mapping of addresses to PFNs, store use counts and flags under addresses
-    //   because PFNs are rather kernel-internal and of little interest outside
-    // - we can now retrieve flags and use count for a page at a given (virtual) address
-    // - profit!
+    static const bool supported = [] {
+        volatile uint64_t probe = 0;
+        probe = probe + 1;
+        const int pagemapFd = open("/proc/self/pagemap", O_RDONLY);
+        if (pagemapFd < 0) {
+            return false;
+        }
+        const uint64_t start = uintptr_t(&probe) & ~uint64_t(PageInfo::pageSize - 1);
+        page_region range;
+        pm_scan_arg args = scanArgs(start, start + PageInfo::pageSize, &range, 1);
+        const bool ok = ioctl(pagemapFd, PAGEMAP_SCAN, &args) == 1 && (range.categories & PAGE_IS_PRESENT);
+        close(pagemapFd);
+        return ok;
+    }();
+    return supported;
+}
 
-    {
-        vector<MappedRegionInternal> mappedRegions = readMappedRegions(pid);
-        vector<uint64_t> pagemap = readPagemap(pid, &mappedRegions);
-        if (pagemap.empty()) {
-            // usual cause: couldn't read pagemap due to lack of permissions (user is not root)
-            return;
-        }
-        vector<PfnRange> pfnRanges = rangifyPfns(move(pagemap));
-        PfnInfos pfnInfos(move(pfnRanges));
-
-        for (MappedRegionInternal &mappedRegion : mappedRegions) {
-            for (size_t i = 0; i < mappedRegion.pagemapEntries.size(); i++) {
-                const uint64_t pfn = pfnForPagemapEntry(mappedRegion.pagemapEntries[i]);
-                if (pfn) {
-                    mappedRegion.useCounts[i] = uint32_t(pfnInfos.useCount(pfn));
-                    mappedRegion.combinedFlags[i] = mappedRegion.combinedFlags[i] |
-                                                    uint32_t(pfnInfos.flags(pfn));
-                }
-            }
+// Like preadPagemap(), but reads only the entries of the pages that PAGEMAP_SCAN finds to be present or
+// swapped out (and of short gaps between them); the others are zero. Unlike with preadPagemap(), they
+// then lack the flags that pagemap reports for pages that were never populated, e.g. PM_SOFT_DIRTY of a
+// mapping that was created since the last clear_refs. Those matter only with a PFN, though. Entries of
+// pages that are mapped huge get pmMappedHuge.
+static void scanPagemap(int pagemapFd, uint64_t firstPage, size_t count, uint64_t *entries, IoCounter *io)
+{
+    fill(entries, entries + count, 0);
+    const uint64_t end = (firstPage + count) * PageInfo::pageSize;
+    page_region ranges[scanBatchRanges];
+    pm_scan_arg args = scanArgs(firstPage * PageInfo::pageSize, end, ranges, scanBatchRanges);
 
-            // don't need them anymore - this reduces peak memory allocation a bit
-            mappedRegion.pagemapEntries.clear();
+    // the pages, from readStart to readEnd, to read together with the next range if it is close enough
+    uint64_t readStart = firstPage;
+    uint64_t readEnd = firstPage;
+    auto readPending = [&]() {
+        if (readEnd > readStart) {
+            preadPagemap(pagemapFd, readStart, readEnd - readStart, entries + (readStart - firstPage), io);
+        }
+    };
 
-            MappedRegion publicMappedRegion = { mappedRegion.start, mappedRegion.end,
-                                                move(mappedRegion.backingFile),
-                                                move(mappedRegion.useCounts),
-                                                move(mappedRegion.combinedFlags) };
-            m_mappedRegions.push_back(move(publicMappedRegion));
+    while (args.start < end) {
+        const int rangeCount = ioctl(pagemapFd, PAGEMAP_SCAN, &args);
+        io->syscalls++;
+        if (rangeCount < 0) {
+            // e.g. the process exited, or its memory map is being torn down; let pread decide what's left
+            readPending();
+            readStart = args.start / PageInfo::pageSize;
+            readEnd = firstPage + count;
+            break;
+        }
+        io->bytesRead += rangeCount * sizeof(page_region);
+        for (int i = 0; i < rangeCount; i++) {
+            const uint64_t rangeStart = ranges[i].start / PageInfo::pageSize;
+            const uint64_t rangeEnd = ranges[i].end / PageInfo::pageSize;
+            if (readEnd > readStart && rangeStart <= readEnd + scanMaxGapPages) {
+                readEnd = rangeEnd;
+            } else {
+                readPending();
+                readStart = rangeStart;
+                readEnd = rangeEnd;
+            }
+            if (ranges[i].categories & PAGE_IS_HUGE) {
+                // the entries must be there to mark them; consecutive huge pages come in one range
+                readPending();
+                readStart = readEnd;
+                for (uint64_t page = rangeStart; page < rangeEnd; page++) {
+                    entries[page - firstPage] |= pmMappedHuge;
+                }
+            }
         }
+        if (args.walk_end <= args.start) {
+            break; // no progress, which the kernel doesn't do
+        }
+        args.start = args.walk_end;
     }
+    readPending();
+}
 
-    // this should be a no-op, but why not make sure... it make little performance difference.
-    sort(m_mappedRegions.begin(), m_mappedRegions.end());
-#ifndef NDEBUG
-    for (const MappedRegion &mappedRegion : m_mappedRegions) {
-        assert(mappedRegion.start < mappedRegion.end);
+static void readPagemapEntries(int pagemapFd, bool scan, uint64_t firstPage, size_t count, uint64_t *entries,
+                               IoCounter *io)
+{
+    if (scan) {
+        scanPagemap(pagemapFd, firstPage, count, entries, io);
+    } else {
+        preadPagemap(pagemapFd, firstPage, count, entries, io);
     }
-#endif
-    // ### regions can sometimes overlap(!), presumably due to data races in the kernel when watching
-    // a running process. Just assign any overlapping area to the first region to "claim" it, i.e. the
-    // one with the smallest start address.
-    for (size_t i = 1; i < m_mappedRegions.size(); i++) {
-        if (m_mappedRegions[i].start < m_mappedRegions[i - 1].end) {
-            cout << "correcting " << hex << m_mappedRegions[i - 1].start << " " << hex << m_mappedRegions[i - 1].end << " "
-                                  << m_mappedRegions[i].start << " " << hex << m_mappedRegions[i].end << endl;
-            uint32_t prevStart = m_mappedRegions[i].start;
-            m_mappedRegions[i].start = m_mappedRegions[i - 1].end;
-            if (m_mappedRegions[i].start >= m_mappedRegions[i].end) {
-                // This renders the range inert... might be better to remove it altogether.
-                // Note that we move the end instead of the start, to maintain the invariant that the
-                // start address of region n+1 is >= end address of region n.
-                m_mappedRegions[i].end = m_mappedRegions[i].start;
-                m_mappedRegions[i].useCounts.clear();
-                m_mappedRegions[i].combinedFlags.clear();
-            } else if (!m_mappedRegions[i].useCounts.empty()) {
-                const size_t delCount = (m_mappedRegions[i].start - prevStart) / pageSize;
-                m_mappedRegions[i].useCounts.erase(m_mappedRegions[i].useCounts.begin(),
-                                                   m_mappedRegions[i].useCounts.begin() + delCount);
-                m_mappedRegions[i].combinedFlags.erase(m_mappedRegions[i].combinedFlags.begin(),
-                                                       m_mappedRegions[i].combinedFlags.begin() + delCount);
+}
+
+static bool usePagemapScan(const CaptureOptions &options)
+{
+    return options.pagemapReader != CaptureOptions::PreadPagemapReader && isPagemapScanSupported();
+}
+
+// Whether anonymous transparent huge pages smaller than 2 MiB (multi-size THP, Linux 6.8) are enabled
+// for any size, in /sys/kernel/mm/transparent_hugepage/hugepages-<size>kB/enabled. Read once.
+static bool areSmallThpSizesEnabled()
+{
+    static const bool enabled = [] {
+        static const char *const thpDir = "/sys/kernel/mm/transparent_hugepage";
+        DIR *const sizes = opendir(thpDir);
+        if (!sizes) {
+            return false;
+        }
+        bool ret = false;
+        while (const dirent *entry = readdir(sizes)) {
+            uint sizeKiB = 0;
+            char kB[3] = {};
+            if (sscanf(entry->d_name, "hugepages-%u%2s", &sizeKiB, kB) != 2 || strcmp(kB, "kB") != 0 ||
+                uint64_t(sizeKiB) * 1024 >= hugePagePages * PageInfo::pageSize) {
+                continue;
+            }
+            const string enabledName = string(thpDir) + '/' + entry->d_name + "/enabled";
+            if (FILE *enabledFile = fopen(enabledName.c_str(), "r")) {
+                // e.g. "always inherit madvise [never]"; "inherit" may well mean "never", too
+                char setting[128] = {};
+                if (fgets(setting, sizeof(setting), enabledFile) && !strstr(setting, "[never]")) {
+                    ret = true;
+                }
+                fclose(enabledFile);
             }
-            cout << "corrected  " << hex << m_mappedRegions[i - 1].start << hex << " " << m_mappedRegions[i - 1].end << " "
-                 << m_mappedRegions[i].start << " " << hex << m_mappedRegions[i].end << endl;
         }
+        closedir(sizes);
+        return ret;
+    }();
+    return enabled;
+}
+
+// CaptureOptions::mergeHugePages as far as huge pages can be told apart from smaller THPs, see
+// isHugePageCandidate()
+static bool mergesHugePages(const CaptureOptions &options)
+{
+    return options.mergeHugePages && (usePagemapScan(options) || !areSmallThpSizesEnabled());
+}
+
+// appends the present PFNs of the region that needsPfnInfo() to *pfns if pfns is not null, see
+// forEachNeededPfn()
+// return value: number of present pages in the region
+static uint64_t readRegionPagemap(int pagemapFd, bool scan, MappedRegionInternal *region, vector<uint64_t> *pfns,
+                                  bool mergeHugePages, IoCounter *io)
+{
+    uint64_t presentPages = 0;
+
+    const size_t pageCount = region->pageCount();
+    assert(region->pagemapEntries.size() == pageCount);
+    readPagemapEntries(pagemapFd, scan, region->start / PageInfo::pageSize, pageCount, region->pagemapEntries.data,
+                       io);
+    region->hugeMappingsKnown = scan;
+
+    for (size_t i = 0; i < pageCount; i++) {
+        if (pfnForPagemapEntry(region->pagemapEntries[i])) {
+            presentPages++;
+        }
+    }
+    if (pfns) {
+        forEachNeededPfn(*region, mergeHugePages, [pfns](uint64_t pfn) { pfns->push_back(pfn); });
+    }
+    return presentPages;
+}
+
+// appends an unsorted list of the present PFNs that needsPfnInfo() to *pfns, if pfns is not null
+// return value: number of present pages, zero if pagemap couldn't be read
+static uint64_t readPagemap(uint pid, vector<MappedRegionInternal> *mappedRegions, vector<uint64_t> *pfns,
+                            const CaptureOptions &options, vector<Slice> *slices, CaptureStats *stats)
+{
+    char pagemapName[32];
+    snprintf(pagemapName, sizeof(pagemapName), "/proc/%u/pagemap", pid);
+
+    const bool scan = usePagemapScan(options);
+    const bool mergeHugePages = mergesHugePages(options);
+    vector<MappedRegionInternal> &regions = *mappedRegions;
+    const size_t sliceCount = splitIntoSlices(regions.size(), options.threadCount,
+        [&regions](size_t i) { return (regions[i].end - regions[i].start) / PageInfo::pageSize; }, slices);
+
+    runSlices(sliceCount, [&](size_t sliceIndex) {
+        Slice &slice = (*slices)[sliceIndex];
+        // using Linux API for reading isn't a huge win here, but it's somewhat faster and easier on
+        // the eyes than fstream API, too, so...
+        // Each thread gets its own file descriptor so that the threads don't contend on anything in
+        // user space or in the kernel's file handling.
+        int pagemapFd = open(pagemapName, O_RDONLY);
+        slice.io.syscalls++;
+        if (pagemapFd < 0) {
+            return; // TODO error reporting
+        }
+        // the PFNs of the slice; the last slice is done in this thread and appends directly to *pfns
+        slice.buffer.clear();
+        vector<uint64_t> *out = !pfns ? nullptr : sliceIndex + 1 < sliceCount ? &slice.buffer : pfns;
+        for (size_t i = slice.begin; i < slice.end; i++) {
+            slice.count += readRegionPagemap(pagemapFd, scan, &regions[i], out, mergeHugePages, &slice.io);
+        }
+        close(pagemapFd);
+        slice.io.syscalls++;
+    });
+    addIoCounters(*slices, sliceCount, CaptureStats::ReadPagemapPhase, stats);
+
+    uint64_t ret = 0;
+    for (size_t i = 0; i < sliceCount; i++) {
+        const Slice &slice = (*slices)[i];
+        ret += slice.count;
+        if (pfns && i + 1 < sliceCount) {
+            pfns->insert(pfns->end(), slice.buffer.begin(), slice.buffer.end());
+        }
+    }
+    return ret;
+}
+
+// Clear the soft-dirty bits of all pages of the process, so that the next readPagemap() can tell which
+// pages have been written to in the meantime. This is not free for the watched process: the kernel
+// write-protects its pages, so that the next write to each page takes a minor fault.
+static bool clearSoftDirtyBits(uint pid, CaptureStats *stats)
+{
+    ostringstream clearRefsName;
+    clearRefsName << "/proc/" << pid << "/clear_refs";
+
+    int clearRefsFd = open(clearRefsName.str().c_str(), O_WRONLY);
+    stats->syscalls[CaptureStats::ClearSoftDirtyPhase]++;
+    if (clearRefsFd < 0) {
+        return false;
+    }
+    // see linux/Documentation/admin-guide/mm/soft-dirty.rst
+    const bool ok = write(clearRefsFd, "4", 1) == 1;
+    close(clearRefsFd);
+    stats->syscalls[CaptureStats::ClearSoftDirtyPhase] += 2;
+    return ok;
+}
+
+// Without CONFIG_MEM_SOFT_DIRTY, clear_refs accepts "4" but does nothing, and pagemap never reports
+// pages as soft-dirty. So check that a page which this process has just written to (and never cleared
+// the soft-dirty bits of) is reported as soft-dirty.
+static bool isSoftDirtySupported()
+{
+    static const bool supported = [] {
+        volatile uint64_t probe = 0;
+        probe = probe + 1;
+        const int pagemapFd = open("/proc/self/pagemap", O_RDONLY);
+        if (pagemapFd < 0) {
+            return false;
+        }
+        uint64_t pmEntry = 0;
+        const uint64_t offset = (uintptr_t(&probe) >> PageInfo::pageShift) * sizeof(uint64_t);
+        const bool ok = pread64(pagemapFd, &pmEntry, sizeof(pmEntry), offset) == sizeof(pmEntry);
+        close(pagemapFd);
+        return ok && (pmEntry & PM_PRESENT) && (pmEntry & PM_SOFT_DIRTY);
+    }();
+    return supported;
+}
+
+// PFN: page frame number, a kind of unique identifier inside the kernel paging subsystem
+// what we keep per PFN from /proc/kpagecount and /proc/kpageflags. The kernel gives us 64 bits for
+// each, but MappedRegion only stores 32 bits of each anyway, and keeping both together means that one
+// lookup (and usually one cache miss) gets both.
+struct PfnInfo
+{
+    uint32_t useCount;
+    uint32_t flags;
+};
+
+struct PfnRange
+{
+    const PfnInfo &info(const PfnInfo *buffer, uint64_t pfn) const
+    {
+        assert(pfn >= start && pfn <= last);
+        return buffer[m_bufferOffset + pfn - start];
+    }
+
+    size_t count() const { return last - start + 1; }
+
+    bool operator<(const PfnRange &other) const { return last < other.last; }
+    // comparing pfn to last so lower_bound immediately finds the right range; same above for consistency
+    bool operator<(uint64_t pfn) const { return last < pfn; }
+
+    void allocBufferSpace(size_t *bufferPos)
+    {
+        m_bufferOffset = *bufferPos;
+        *bufferPos += count();
+    }
+
+    uint64_t start;
+    uint64_t last;
+    size_t m_bufferOffset; // in units of PfnInfo
+};
+
+// Creates reasonably sized ranges to read from PFNs added in ascending order; duplicates are fine.
+// The ranges replace the contents of the given vector, reusing its memory.
+// The default maxGap (CaptureOptions::maxPfnGap) has been determined empirically (basically watching
+// "time" output when mapping some largish process) - one would think that much larger values help
+// because every read() is a syscall and therefore expensive... but no, so let's just waste a little
+// less memory from uselessly reading gaps between PFN entries that we want. memstat-bench can sweep it.
+// Note: one possible speed advantage of not reading too much is that the kernel must generate output
+//       even for inexistent PFNs, which looks kind of but not very expensive to do. See Linux kernel
+//       functions: kpagecount_read(), kpageflags_read() in linux/fs/proc/page.c
+//       - note that copy_to_user also has a (not very large, some flag tests and memcpy) cost
+// ### Optimization: allocate memory for all ranges en bloc and store offsets into the
+//     allocated memory in the ranges. This is a surprisingly large performance win -
+//     it reduces the time for the whole PageInfo generation by roughly 40%.
+//     Benefits are cache locality, one less layer of indirection, avoidance of malloc() and
+//     free() calls, and avoidance of vector<uint64_t>::resize() uselessly initializing data.
+class PfnRangeBuilder
+{
+public:
+    PfnRangeBuilder(uint64_t maxGap, vector<PfnRange> *ranges)
+       : m_maxGap(maxGap),
+         m_ranges(ranges),
+         m_rangesStoragePos(0),
+         m_pfnCount(0),
+         m_haveRange(false)
+    {
+        m_ranges->clear();
+    }
+
+    void add(uint64_t pfn) { addRange(pfn, pfn); }
+
+    void addRange(uint64_t start, uint64_t last)
+    {
+        if (!m_haveRange || start > m_range.last) {
+            m_pfnCount += last - start + 1; // not a duplicate
+        }
+        if (!m_haveRange) {
+            m_range.start = start;
+            m_haveRange = true;
+        } else if (start > m_range.last + m_maxGap) {
+            // found a big gap, store previous range and start a new one
+            m_range.allocBufferSpace(&m_rangesStoragePos);
+            m_ranges->push_back(m_range);
+            m_range.start = start;
+        }
+        m_range.last = last;
+    }
+
+    void finish()
+    {
+        if (m_haveRange) {
+            m_range.allocBufferSpace(&m_rangesStoragePos);
+            m_ranges->push_back(m_range);
+            m_haveRange = false;
+        }
+    }
+
+    // number of distinct PFNs added, not counting those in the gaps between them
+    uint64_t pfnCount() const { return m_pfnCount; }
+
+private:
+    const uint64_t m_maxGap;
+    vector<PfnRange> *m_ranges;
+    size_t m_rangesStoragePos;
+    uint64_t m_pfnCount;
+    PfnRange m_range;
+    bool m_haveRange;
+};
+
+// Sorts *pfns and puts ranges to read into *ranges. If pfnCount is not null, it is set to the number of
+// distinct PFNs.
+static void rangifyPfns(vector<uint64_t> *pfns, uint64_t maxGap, vector<PfnRange> *ranges,
+                        uint64_t *pfnCount = nullptr)
+{
+    sort(pfns->begin(), pfns->end());
+    PfnRangeBuilder builder(maxGap, ranges);
+    for (uint64_t pfn : *pfns) {
+        builder.add(pfn);
+    }
+    if (pfnCount) {
+        *pfnCount = builder.pfnCount();
+    }
+    builder.finish();
+}
+
+// The PFNs to rangify come from a "PFN source": a function object that calls its argument with each PFN,
+// in any order and with any number of duplicates. This one produces the PFNs of a capture that
+// needsPfnInfo(), see forEachNeededPfn().
+struct NeededPfns
+{
+    const vector<MappedRegionInternal> &mappedRegions;
+    bool mergeHugePages;
+
+    template<typename PfnFunc>
+    void operator()(PfnFunc func) const
+    {
+        for (const MappedRegionInternal &region : mappedRegions) {
+            forEachNeededPfn(region, mergeHugePages, func);
+        }
+    }
+};
+
+template<typename PfnSource>
+static void collectPfns(const PfnSource &pfnSource, vector<uint64_t> *pfns)
+{
+    pfns->clear();
+    pfnSource([pfns](uint64_t pfn) { pfns->push_back(pfn); });
+}
+
+// Instead of sorting a list of PFNs, which is O(n log n) and needs the list in the first place, mark the
+// PFNs of pfnSource in a bitmap covering the range between the smallest and largest one, and create
+// ranges in one linear scan. The bitmap size is bounded by physical memory size, with one bit per page
+// it's 32 MiB per TiB of RAM. The bitmap, or the list to sort in the fallback below, is kept in *scratch.
+// Puts the ranges into *ranges. If pfnCount is not null, it is set to the number of distinct PFNs.
+template<typename PfnSource>
+static void rangifyPfnsBitmap(const PfnSource &pfnSource, uint64_t maxGap, vector<uint64_t> *scratch,
+                              vector<PfnRange> *ranges, uint64_t *pfnCount = nullptr)
+{
+    uint64_t sourcePfnCount = 0;
+    uint64_t minPfn = numeric_limits<uint64_t>::max();
+    uint64_t maxPfn = 0;
+    pfnSource([&](uint64_t pfn) {
+        minPfn = min(minPfn, pfn);
+        maxPfn = max(maxPfn, pfn);
+        sourcePfnCount++;
+    });
+    if (pfnCount) {
+        *pfnCount = 0;
+    }
+    if (!sourcePfnCount) {
+        ranges->clear();
+        return;
+    }
+
+    static const uint bitsPerWord = 64;
+    const uint64_t base = minPfn & ~uint64_t(bitsPerWord - 1);
+    const uint64_t wordCount = (maxPfn - base) / bitsPerWord + 1;
+
+    // ### Mappings of device memory (e.g. PCI BARs of graphics cards) can have PFNs far above those of
+    //     RAM, making the bitmap mostly empty and potentially huge. Fall back to sorting when the bitmap
+    //     would take (noticeably) more memory than the list of PFNs to sort.
+    static const uint64_t minBitmapBudget = 4 * 1024 * 1024;
+    if (wordCount * sizeof(uint64_t) > max(sourcePfnCount * sizeof(uint64_t), minBitmapBudget)) {
+        collectPfns(pfnSource, scratch);
+        rangifyPfns(scratch, maxGap, ranges, pfnCount);
+        return;
+    }
+
+    vector<uint64_t> &bitmap = *scratch;
+    bitmap.assign(wordCount, 0);
+    pfnSource([&bitmap, base](uint64_t pfn) {
+        const uint64_t bit = pfn - base;
+        bitmap[bit / bitsPerWord] |= uint64_t(1) << (bit % bitsPerWord);
+    });
+
+    PfnRangeBuilder builder(maxGap, ranges);
+    for (uint64_t w = 0; w < wordCount; w++) {
+        uint64_t word = bitmap[w];
+        const uint64_t wordBase = base + w * bitsPerWord;
+        if (word == ~uint64_t(0)) {
+            // common case for larger chunks of physically contiguous memory, e.g. transparent huge pages
+            builder.addRange(wordBase, wordBase + bitsPerWord - 1);
+            continue;
+        }
+        while (word) {
+            builder.add(wordBase + __builtin_ctzll(word));
+            word &= word - 1; // clear lowest set bit
+        }
+    }
+    if (pfnCount) {
+        *pfnCount = builder.pfnCount();
+    }
+    builder.finish();
+}
+
+// Use counts and flags of ranges of PFNs. Reading again reuses the memory of the previous read.
+class PfnInfos
+{
+public:
+    PfnInfos()
+       : m_indexBase(0),
+         m_cachedRange(0)
+    {}
+
+    // the ranges to read(), for rangifyPfns() or rangifyPfnsBitmap() to fill in
+    vector<PfnRange> *ranges() { return &m_ranges; }
+    void read(uint threadCount, CaptureStats *stats)
+    {
+        readUseCountsAndFlags(threadCount, stats);
+        buildRangeIndex();
+    }
+
+    const PfnInfo &info(uint64_t pfn) const;
+
+private:
+    void readUseCountsAndFlags(uint threadCount, CaptureStats *stats);
+    void buildRangeIndex();
+    size_t findRange(uint64_t pfn) const;
+
+    // Blocks of 2^rangeIndexShift PFNs for m_rangeIndex. With the default CaptureOptions::maxPfnGap,
+    // ranges are more than 16 PFNs apart, so there are at most a handful of them in a block, and usually
+    // just one.
+    static const uint rangeIndexShift = 8;
+
+    vector<PfnRange> m_ranges;
+    // Only grows: shrinking and growing it again would initialize the memory again, which the reads
+    // overwrite anyway.
+    vector<PfnInfo> m_buffer;
+    vector<Slice> m_slices;
+    // Direct-indexed replacement for a binary search over m_ranges: for each block of PFNs starting at
+    // m_indexBase, the index of the first range that ends in or after the block.
+    vector<uint32_t> m_rangeIndex;
+    uint64_t m_indexBase;
+    mutable size_t m_cachedRange;
+};
+
+size_t PfnInfos::findRange(uint64_t pfn) const
+{
+    // we're making the assumption that the pfn *is* contained in one of the ranges!
+    const PfnRange &cached = m_ranges[m_cachedRange];
+    if (pfn >= cached.start && pfn <= cached.last) {
+        // fast path: it's in the same range as last PFN we were asked for
+        return m_cachedRange;
+    }
+    if (!m_rangeIndex.empty()) {
+        assert(pfn >= m_indexBase && (pfn - m_indexBase) >> rangeIndexShift < m_rangeIndex.size());
+        size_t i = m_rangeIndex[(pfn - m_indexBase) >> rangeIndexShift];
+        while (m_ranges[i].last < pfn) {
+            i++;
+        }
+        m_cachedRange = i;
+    } else {
+        // binary search
+        m_cachedRange = lower_bound(m_ranges.begin(), m_ranges.end(), pfn) - m_ranges.begin();
+    }
+    assert(m_cachedRange < m_ranges.size());
+    return m_cachedRange;
+}
+
+const PfnInfo &PfnInfos::info(uint64_t pfn) const
+{
+    return m_ranges[findRange(pfn)].info(m_buffer.data(), pfn);
+}
+
+void PfnInfos::buildRangeIndex()
+{
+    m_rangeIndex.clear();
+    if (m_ranges.empty()) {
+        return;
+    }
+    m_indexBase = m_ranges.front().start;
+    const uint64_t blockCount = ((m_ranges.back().last - m_indexBase) >> rangeIndexShift) + 1;
+    // Like the PFN bitmap in rangifyPfnsBitmap(), the index can get large in a sparse physical address
+    // space; binary search is good enough then. Also, range indices must fit into uint32_t.
+    static const uint64_t minIndexBudget = 1024 * 1024;
+    if (blockCount > max(uint64_t(m_ranges.size()) * 4, minIndexBudget) ||
+        m_ranges.size() > numeric_limits<uint32_t>::max()) {
+        return;
+    }
+
+    m_rangeIndex.resize(blockCount);
+    size_t range = 0;
+    for (uint64_t block = 0; block < blockCount; block++) {
+        const uint64_t blockStart = m_indexBase + (block << rangeIndexShift);
+        while (m_ranges[range].last < blockStart) {
+            range++;
+        }
+        m_rangeIndex[block] = uint32_t(range);
+    }
+}
+
+// read kpagemap and kpagecount
+void PfnInfos::readUseCountsAndFlags(uint threadCount, CaptureStats *stats)
+{
+    m_cachedRange = 0;
+    if (m_ranges.empty()) {
+        return;
+    }
+
+    // Extract buffer size from m_ranges using a little shortcut
+    const PfnRange &lastRange = m_ranges.back();
+    const size_t pfnCount = lastRange.m_bufferOffset + lastRange.count();
+    if (m_buffer.size() < pfnCount) {
+        m_buffer.resize(pfnCount);
+    }
+
+    // ### this function takes about half the CPU time of a whole data gathering pass when using
+    //     std::ifstream, and since we're tied to Linux anyway, just use Linux API (note: it only
+    //     shaves off about 30% of this function's execution time - syscalls take the longest time!!)
+    //     Since the syscalls are the expensive part, spread them over several threads if so configured.
+    //     The ranges write to disjoint parts of m_buffer, so the threads don't need to synchronize.
+    const size_t sliceCount = splitIntoSlices(m_ranges.size(), threadCount,
+        [this](size_t i) { return m_ranges[i].count(); }, &m_slices);
+
+    runSlices(sliceCount, [&](size_t sliceIndex) {
+        Slice &slice = m_slices[sliceIndex];
+        int kpagecountFd = open("/proc/kpagecount", O_RDONLY);
+        int kpageflagsFd = open("/proc/kpageflags", O_RDONLY);
+        slice.io.syscalls += 2;
+        if (kpagecountFd >= 0 && kpageflagsFd >= 0) {
+            // The kernel's 64 bit values are read into a bounded scratch buffer, then narrowed into
+            // m_buffer in one simple loop that the compiler can vectorize. That halves the memory used
+            // for PFN data compared to keeping the raw values. Chunks are large enough that splitting a
+            // range into several reads costs practically nothing.
+            static const size_t chunkPfns = 64 * 1024;
+            size_t scratchPfns = 0;
+            for (size_t i = slice.begin; i < slice.end; i++) {
+                scratchPfns = max(scratchPfns, min(chunkPfns, m_ranges[i].count()));
+            }
+            if (slice.buffer.size() < 2 * scratchPfns) {
+                slice.buffer.resize(2 * scratchPfns);
+            }
+            uint64_t *const useCounts = slice.buffer.data();
+            uint64_t *const flags = slice.buffer.data() + scratchPfns;
+
+            for (size_t i = slice.begin; i < slice.end; i++) {
+                const PfnRange &range = m_ranges[i];
+                for (uint64_t chunkStart = range.start; chunkStart <= range.last; chunkStart += chunkPfns) {
+                    const size_t count = min(uint64_t(chunkPfns), range.last - chunkStart + 1);
+                    const size_t bytes = count * pageFlagsSize;
+                    slice.count += 2 * bytes;
+
+                    const ssize_t countRead = pread64(kpagecountFd, useCounts, bytes, chunkStart * pageFlagsSize);
+                    const ssize_t flagsRead = pread64(kpageflagsFd, flags, bytes, chunkStart * pageFlagsSize);
+                    slice.io.syscalls += 2;
+                    slice.io.bytesRead += max(countRead, ssize_t(0)) + max(flagsRead, ssize_t(0));
+                    if (countRead < ssize_t(bytes) || flagsRead < ssize_t(bytes)) {
+                        // should not happen, but don't leave garbage in the output if it does
+                        memset(useCounts, 0, bytes);
+                        memset(flags, 0, bytes);
+                    }
+
+                    PfnInfo *const out = m_buffer.data() + range.m_bufferOffset + (chunkStart - range.start);
+                    for (size_t j = 0; j < count; j++) {
+                        out[j].useCount = uint32_t(useCounts[j]);
+                        out[j].flags = uint32_t(flags[j]);
+                    }
+                }
+            }
+            slice.ok = true;
+        } // else TODO error reporting
+        if (kpagecountFd >= 0) {
+            close(kpagecountFd);
+            slice.io.syscalls++;
+        }
+        if (kpageflagsFd >= 0) {
+            close(kpageflagsFd);
+            slice.io.syscalls++;
+        }
+    });
+    addIoCounters(m_slices, sliceCount, CaptureStats::ReadUseCountsAndFlagsPhase, stats);
+
+    uint64_t readTotal = 0;
+    bool ok = true;
+    for (size_t i = 0; i < sliceCount; i++) {
+        readTotal += m_slices[i].count;
+        ok = ok && m_slices[i].ok;
+    }
+    assert(!ok || readTotal == 2 * pfnCount * sizeof(PfnInfo));
+    (void)readTotal;
+    (void)ok;
+}
+
+// The present PFNs of all regions, also of the pages that needsPfnInfo() leaves out
+struct PresentPfns
+{
+    const vector<MappedRegionInternal> &mappedRegions;
+
+    template<typename PfnFunc>
+    void operator()(PfnFunc func) const
+    {
+        for (const MappedRegionInternal &region : mappedRegions) {
+            for (size_t i = 0; i < region.pagemapEntries.size(); i++) {
+                if (const uint64_t pfn = pfnForPagemapEntry(region.pagemapEntries[i])) {
+                    func(pfn);
+                }
+            }
+        }
+    }
+};
+
+// Reads and marks the idle bits of /sys/kernel/mm/page_idle/bitmap for CaptureOptions::trackIdlePages,
+// see linux/Documentation/admin-guide/mm/idle_page_tracking.rst. The bitmap has a bit per PFN and can
+// only be read and written in whole 64 bit words. Reading a word makes the kernel check the page tables of
+// all processes that map its pages, so only the words with PFNs of the process are read, in one system
+// call per run of consecutive such words. The runs are the PFN ranges of rangifyPfnsBitmap() with a
+// maximum gap of less than a word, extended to whole words and merged where they meet.
+class IdlePageTracker
+{
+public:
+    IdlePageTracker();
+    ~IdlePageTracker();
+
+    bool isOpen() const { return m_fd >= 0; }
+    // Reads the idle bits of the present pages of the regions, then marks all of them idle again
+    void update(const vector<MappedRegionInternal> &mappedRegions, CaptureStats *stats);
+    // KPF_IDLE if the page at pfn, usually one of the present pages of the last update(), was not
+    // accessed since the update() before, otherwise 0. Always 0 after the first update().
+    uint32_t idleFlag(uint64_t pfn) const
+    {
+        if (!m_haveIdleBits) {
+            return 0;
+        }
+        const size_t word = findWord(pfn);
+        return word != noWord && (m_idleBits[word] >> (pfn % bitsPerWord)) & 1 ? 1u << KPF_IDLE : 0;
+    }
+
+private:
+    static const uint bitsPerWord = 64;
+    static const size_t noWord = numeric_limits<size_t>::max();
+
+    // bitmap words from firstWord, at offset in m_idleBits and m_marks
+    struct WordRange
+    {
+        uint64_t firstWord;
+        size_t count;
+        size_t offset;
+        // like PfnRange, so that lower_bound() finds the range that contains a word
+        bool operator<(uint64_t word) const { return firstWord + count <= word; }
+    };
+    // the index of the word with pfn in m_idleBits and m_marks, noWord if no present page is in the word
+    size_t findWord(uint64_t pfn) const;
+
+    int m_fd;
+    bool m_marked; // since the previous update()
+    bool m_haveIdleBits;
+    vector<uint64_t> m_scratch; // for rangifyPfnsBitmap()
+    vector<PfnRange> m_pfnRanges;
+    vector<WordRange> m_wordRanges;
+    vector<uint64_t> m_idleBits; // as read
+    vector<uint64_t> m_marks; // the bits of the present pages, to write
+    mutable size_t m_cachedRange;
+};
+
+const uint IdlePageTracker::bitsPerWord;
+const size_t IdlePageTracker::noWord;
+
+IdlePageTracker::IdlePageTracker()
+   : m_fd(open("/sys/kernel/mm/page_idle/bitmap", O_RDWR)),
+     m_marked(false),
+     m_haveIdleBits(false),
+     m_cachedRange(0)
+{
+}
+
+IdlePageTracker::~IdlePageTracker()
+{
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+size_t IdlePageTracker::findWord(uint64_t pfn) const
+{
+    const uint64_t word = pfn / bitsPerWord;
+    const WordRange *range = &m_wordRanges[m_cachedRange];
+    if (word < range->firstWord || word >= range->firstWord + range->count) {
+        // pages that are next to each other virtually are usually also physically, so this is rare
+        const auto it = lower_bound(m_wordRanges.begin(), m_wordRanges.end(), word);
+        if (it == m_wordRanges.end() || word < it->firstWord) {
+            return noWord;
+        }
+        m_cachedRange = it - m_wordRanges.begin();
+        range = &*it;
+    }
+    return range->offset + (word - range->firstWord);
+}
+
+void IdlePageTracker::update(const vector<MappedRegionInternal> &mappedRegions, CaptureStats *stats)
+{
+    const PresentPfns presentPfns = { mappedRegions };
+    rangifyPfnsBitmap(presentPfns, bitsPerWord - 1, &m_scratch, &m_pfnRanges);
+    m_wordRanges.clear();
+    size_t wordCount = 0;
+    for (const PfnRange &pfnRange : m_pfnRanges) {
+        const uint64_t firstWord = pfnRange.start / bitsPerWord;
+        const size_t count = pfnRange.last / bitsPerWord - firstWord + 1;
+        if (!m_wordRanges.empty() && m_wordRanges.back().firstWord + m_wordRanges.back().count == firstWord) {
+            m_wordRanges.back().count += count;
+        } else {
+            const WordRange range = { firstWord, count, wordCount };
+            m_wordRanges.push_back(range);
+        }
+        wordCount += count;
+    }
+    m_haveIdleBits = false;
+    m_cachedRange = 0;
+    if (!wordCount) {
+        return;
+    }
+    m_marks.assign(wordCount, 0);
+    presentPfns([this](uint64_t pfn) { m_marks[findWord(pfn)] |= uint64_t(1) << (pfn % bitsPerWord); });
+
+    m_idleBits.resize(wordCount);
+    for (const WordRange &range : m_wordRanges) {
+        const size_t bytes = range.count * sizeof(uint64_t);
+        const off64_t offset = range.firstWord * sizeof(uint64_t);
+        // read and mark right after each other, because accesses in between are missed
+        const ssize_t bytesRead = pread64(m_fd, m_idleBits.data() + range.offset, bytes, offset);
+        const ssize_t bytesWritten = pwrite64(m_fd, m_marks.data() + range.offset, bytes, offset);
+        // ### Fails for PFNs beyond the end of RAM, e.g. of device memory, which is never idle anyway
+        (void)bytesWritten;
+        stats->syscalls[CaptureStats::IdlePagesPhase] += 2;
+        stats->bytesRead[CaptureStats::IdlePagesPhase] += max(bytesRead, ssize_t(0));
+        if (bytesRead < ssize_t(bytes)) {
+            const size_t validWords = max(bytesRead, ssize_t(0)) / sizeof(uint64_t);
+            fill(m_idleBits.begin() + range.offset + validWords, m_idleBits.begin() + range.offset + range.count, 0);
+        }
+    }
+    m_haveIdleBits = m_marked;
+    m_marked = true;
+}
+
+// The NUMA node of each PFN for CaptureOptions::recordPlacement. Memory of a node is in memory blocks of
+// /sys/devices/system/memory/block_size_bytes each, and /sys/devices/system/node/node<n>/ links to the
+// blocks of node n as memory<m>, which starts at byte m * block size. Consecutive blocks of the same node
+// become one range of the table, so there are usually only a few ranges per node.
+// ### Read once; memory hot-plugged later is not found, hot-unplugged memory is still found.
+class NumaNodeMap
+{
+public:
+    NumaNodeMap();
+
+    // the PagePlacement of a present page
+    uint16_t placement(uint64_t pfn) const
+    {
+        if (m_ranges.empty()) {
+            return m_fallback;
+        }
+        const NodeRange *range = &m_ranges[m_cachedRange];
+        if (pfn < range->start || pfn >= range->end) {
+            const auto it = lower_bound(m_ranges.begin(), m_ranges.end(), pfn);
+            if (it == m_ranges.end() || pfn < it->start) {
+                return PagePlacement::unknown;
+            }
+            m_cachedRange = it - m_ranges.begin();
+            range = &*it;
+        }
+        return range->placement;
+    }
+
+private:
+    struct NodeRange
+    {
+        uint64_t start;
+        uint64_t end;
+        uint16_t placement;
+        bool operator<(uint64_t pfn) const { return end <= pfn; }
+    };
+
+    vector<NodeRange> m_ranges;
+    // without memory blocks in sysfs: the only node, or node 0 on kernels without NUMA support
+    uint16_t m_fallback;
+    mutable size_t m_cachedRange;
+};
+
+// the number after prefix in name, e.g. 12 in "memory12"; false for other names like "memory_failure"
+static bool parseIndex(const char *name, const char *prefix, uint *index)
+{
+    const size_t prefixLength = strlen(prefix);
+    if (strncmp(name, prefix, prefixLength) != 0 || name[prefixLength] < '0' || name[prefixLength] > '9') {
+        return false;
+    }
+    char *end = nullptr;
+    *index = strtoul(name + prefixLength, &end, 10);
+    return *end == '\0';
+}
+
+NumaNodeMap::NumaNodeMap()
+   : m_fallback(PagePlacement::forNode(0)),
+     m_cachedRange(0)
+{
+    uint64_t blockSize = 0;
+    if (FILE *blockSizeFile = fopen("/sys/devices/system/memory/block_size_bytes", "r")) {
+        if (fscanf(blockSizeFile, "%" SCNx64, &blockSize) != 1) {
+            blockSize = 0;
+        }
+        fclose(blockSizeFile);
+    }
+    static const char *const nodesDir = "/sys/devices/system/node";
+    DIR *const nodes = opendir(nodesDir);
+    if (!nodes) {
+        return;
+    }
+    vector<pair<uint64_t, uint>> blockNodes; // memory block index, node
+    size_t nodeCount = 0;
+    while (const dirent *nodeEntry = readdir(nodes)) {
+        uint node = 0;
+        if (!parseIndex(nodeEntry->d_name, "node", &node)) {
+            continue;
+        }
+        nodeCount++;
+        m_fallback = PagePlacement::forNode(node);
+        const string nodeDir = string(nodesDir) + '/' + nodeEntry->d_name;
+        DIR *const nodeContents = blockSize ? opendir(nodeDir.c_str()) : nullptr;
+        if (!nodeContents) {
+            continue;
+        }
+        while (const dirent *entry = readdir(nodeContents)) {
+            uint block = 0;
+            if (parseIndex(entry->d_name, "memory", &block)) {
+                blockNodes.emplace_back(block, node);
+            }
+        }
+        closedir(nodeContents);
+    }
+    closedir(nodes);
+    if (nodeCount != 1) {
+        m_fallback = PagePlacement::unknown;
+    }
+
+    sort(blockNodes.begin(), blockNodes.end());
+    const uint64_t blockPages = blockSize / PageInfo::pageSize;
+    for (const pair<uint64_t, uint> &blockNode : blockNodes) {
+        const uint64_t start = blockNode.first * blockPages;
+        const uint16_t placement = PagePlacement::forNode(blockNode.second);
+        if (!m_ranges.empty() && m_ranges.back().end == start && m_ranges.back().placement == placement) {
+            m_ranges.back().end += blockPages;
+        } else {
+            const NodeRange range = { start, start + blockPages, placement };
+            m_ranges.push_back(range);
+        }
+    }
+}
+
+// The placement runs of a region from its pagemap entries
+static void addPlacements(MappedRegionInternal *region, const NumaNodeMap &nodeMap)
+{
+    const PagemapEntries &entries = region->pagemapEntries;
+    for (size_t i = 0; i < entries.size(); i++) {
+        const uint64_t pageBits = entries[i];
+        if (const uint64_t pfn = pfnForPagemapEntry(pageBits)) {
+            region->addPlacement(i, nodeMap.placement(pfn));
+        } else if (pageBits & PM_SWAP) {
+            region->addPlacement(i, PagePlacement::forSwapType(PM_SWAP_TYPE(pageBits)));
+        }
+    }
+}
+
+// Whether use count and flags of the first page of a huge page candidate are those of all of its pages:
+// it is the head of a transparent huge page or of a hugetlb page, or inside a larger hugetlb page.
+// KPF_THP is also set on the heads of smaller THPs; isHugePageCandidate() keeps those out.
+static bool isHugePage(const PfnInfo &first)
+{
+    const uint32_t hugeKinds = (1 << KPF_THP) | (1 << KPF_HUGE);
+    return ((first.flags & (1 << KPF_COMPOUND_HEAD)) && (first.flags & hugeKinds)) ||
+           ((first.flags & (1 << KPF_COMPOUND_TAIL)) && (first.flags & (1 << KPF_HUGE)));
+}
+
+// Puts the PFNs after the first of each huge page candidate that turns out not to be a huge page into
+// *ranges. Only the first PFNs were read into firstPfnInfos, so the others need to be read, too.
+static void rangifyFalseHugePages(const vector<MappedRegionInternal> &mappedRegions,
+                                  const PfnInfos &firstPfnInfos, uint64_t maxGap, vector<uint64_t> *scratch,
+                                  vector<PfnRange> *ranges)
+{
+    vector<uint64_t> &firstPfns = *scratch;
+    firstPfns.clear();
+    for (const MappedRegionInternal &region : mappedRegions) {
+        // candidates are only at aligned addresses
+        const uint64_t startPage = region.start / PageInfo::pageSize;
+        const size_t firstAligned = (hugePagePages - startPage % hugePagePages) % hugePagePages;
+        for (size_t i = firstAligned; i < region.pagemapEntries.size(); i += hugePagePages) {
+            if (isHugePageCandidate(region, i)) {
+                const uint64_t firstPfn = pfnForPagemapEntry(region.pagemapEntries[i]);
+                if (!isHugePage(firstPfnInfos.info(firstPfn))) {
+                    firstPfns.push_back(firstPfn);
+                }
+            }
+        }
+    }
+    sort(firstPfns.begin(), firstPfns.end());
+    PfnRangeBuilder builder(maxGap, ranges);
+    for (uint64_t firstPfn : firstPfns) {
+        builder.addRange(firstPfn + 1, firstPfn + hugePagePages - 1);
+    }
+    builder.finish();
+}
+
+// Everything that PageInfo::capture() needs besides its results. PageInfo keeps it between update()s,
+// so that passes over an address space that doesn't grow reuse all of this memory instead of allocating
+// and freeing it again. In total, it takes about twice the memory of the largest pass, mostly 8 bytes
+// per page of the size of the address space for the two pagemap arenas.
+struct CaptureBuffers
+{
+    vector<MappedRegionInternal> regions;
+    FilterScratch filterScratch;
+    // The pagemap entries of all regions of the current and of the previous pass, which
+    // MappedRegionInternal::pagemapEntries and RegionState::pagemapOffset point into
+    vector<uint64_t> pagemapArena;
+    vector<uint64_t> previousPagemapArena;
+    // The regions of the pass before the previous one; their run vectors are reused for the regions at
+    // the same index in the next pass, which usually need about the same number of runs. Then they take
+    // the results of the current pass, which become PageInfo::m_mappedRegions.
+    vector<MappedRegion> spareRegions;
+    vector<Slice> pagemapSlices;
+    // the PFN list to sort, the PFN bitmap (see rangifyPfnsBitmap()) or the list of false huge pages
+    vector<uint64_t> pfns;
+    PfnInfos pfnInfos;
+    PfnInfos falseHugePageInfos;
+};
+
+// Run vectors that are much larger than needed, e.g. after a region shrank or took over the vectors of
+// a busier one, would keep memory use at its high-water mark
+static void trimRuns(MappedRegion *region)
+{
+    static const size_t slackRuns = 1024;
+    if (region->runStarts.capacity() > 4 * region->runStarts.size() + slackRuns) {
+        region->runStarts.shrink_to_fit();
+        region->useCounts.shrink_to_fit();
+        region->combinedFlags.shrink_to_fit();
+    }
+    if (region->placementStarts.capacity() > 4 * region->placementStarts.size() + slackRuns) {
+        region->placementStarts.shrink_to_fit();
+        region->placements.shrink_to_fit();
+    }
+}
+
+PageInfo::PageInfo(uint pid, const CaptureOptions &options)
+   : m_pid(pid),
+     m_options(options),
+     m_keepState(false),
+     m_softDirtyCleared(false),
+     m_filterChanged(false),
+     m_updatesSinceFullUpdate(0)
+{
+    capture(false);
+}
+
+PageInfo::~PageInfo()
+{
+}
+
+// ### Incremental updates work roughly like this:
+// - regions whose line in /proc/<pid>/maps is unchanged keep their data from the last pass. If all of
+//   maps is unchanged, which is the common case, it isn't even parsed again.
+// - pagemap is read completely every time - it is where we learn what changed
+// - pages that map to the same PFN with the same pagemap flags as before and that have not been
+//   written to since the last pass, which we know from the soft-dirty bit cleared via
+//   /proc/<pid>/clear_refs after each pass, keep their use count and flags. Only the PFNs of the
+//   remaining pages are looked up in /proc/kpagecount and /proc/kpageflags.
+// Things that can change without a write or remapping are covered by a full pass every
+// fullUpdateInterval updates, and if clearing soft-dirty bits fails, every update is a full pass.
+bool PageInfo::update()
+{
+    const bool incremental = m_keepState && m_softDirtyCleared && !m_mappedRegions.empty() &&
+                             ++m_updatesSinceFullUpdate < fullUpdateInterval;
+    if (!incremental) {
+        m_updatesSinceFullUpdate = 0;
+    }
+    m_keepState = true;
+    return capture(incremental);
+}
+
+bool PageInfo::isTrackingIdlePages() const
+{
+    return m_idlePages && m_idlePages->isOpen();
+}
+
+void PageInfo::setFilter(const CaptureFilter &filter)
+{
+    if (filter != m_options.filter) {
+        m_options.filter = filter;
+        m_filterChanged = true;
+    }
+}
+
+bool PageInfo::capture(bool incremental)
+{
+    // - read information about mapped ranges, from /proc/<pid>/maps
+    // - read mapping of addresses to (PFNs and certain flags), from /proc/<pid>/pagemap
+    // - read flags (from /proc/kpageflags) and use counts (from /proc/kpagecount) for PFNs
+    // - using the mapping of addresses to PFNs, store use counts and flags under addresses
+    //   because PFNs are rather kernel-internal and of little interest outside
+    // - we can now retrieve flags and use count for a page at a given (virtual) address
+    // - profit!
+
+    m_captureStats = CaptureStats();
+    m_captureStats.incremental = incremental;
+    PhaseTimer timer(&m_captureStats);
+    if (!m_buffers) {
+        m_buffers.reset(new CaptureBuffers);
+    }
+    CaptureBuffers &buffers = *m_buffers;
+
+    readMapsText(m_pid, &m_mapsBuffer, &m_captureStats);
+    vector<MappedRegionInternal> &mappedRegions = buffers.regions;
+    if (!m_regionStates.empty() && !m_filterChanged && m_mapsBuffer == m_mapsText) {
+        // nothing was mapped, unmapped or changed - no need to parse and correct the regions again.
+        // Also on full passes, which only re-read the pages.
+        mappedRegions.clear();
+        mappedRegions.resize(m_mappedRegions.size());
+        for (size_t i = 0; i < mappedRegions.size(); i++) {
+            MappedRegionInternal &region = mappedRegions[i];
+            region.start = m_mappedRegions[i].start;
+            region.end = m_mappedRegions[i].end;
+            region.backingFile = m_mappedRegions[i].backingFile;
+            region.mapsLineOffset = m_regionStates[i].mapsLineOffset;
+            region.mapsLineLength = m_regionStates[i].mapsLineLength;
+        }
+    } else {
+        parseMappedRegions(m_mapsBuffer, &m_backingFileNames, &mappedRegions);
+    }
+    timer.endPhase(CaptureStats::ReadMapsPhase);
+    // this should be a no-op, but why not make sure... it make little performance difference.
+    sort(mappedRegions.begin(), mappedRegions.end());
+    correctOverlaps(&mappedRegions);
+    applyFilter(m_options.filter, &mappedRegions, &buffers.filterScratch);
+    m_filterChanged = false;
+#ifndef NDEBUG
+    for (const MappedRegion &mappedRegion : mappedRegions) {
+        assert(mappedRegion.start <= mappedRegion.end);
+    }
+#endif
+    timer.endPhase(CaptureStats::CorrectOverlapsPhase);
+
+    // hand out the memory for the per-page and per-run data of this pass
+    size_t arenaSize = 0;
+    for (const MappedRegionInternal &region : mappedRegions) {
+        arenaSize += region.pageCount();
+    }
+    buffers.pagemapArena.resize(arenaSize);
+    size_t arenaOffset = 0;
+    for (size_t i = 0; i < mappedRegions.size(); i++) {
+        MappedRegionInternal &region = mappedRegions[i];
+        region.pagemapEntries.data = buffers.pagemapArena.data() + arenaOffset;
+        region.pagemapEntries.count = region.pageCount();
+        arenaOffset += region.pageCount();
+        if (i < buffers.spareRegions.size()) {
+            MappedRegion &spare = buffers.spareRegions[i];
+            region.runStarts.swap(spare.runStarts);
+            region.useCounts.swap(spare.useCounts);
+            region.combinedFlags.swap(spare.combinedFlags);
+            region.placementStarts.swap(spare.placementStarts);
+            region.placements.swap(spare.placements);
+            region.clearPages();
+        }
+    }
+    buffers.spareRegions.clear();
+
+    if (incremental) {
+        assert(m_regionStates.size() == m_mappedRegions.size());
+        // both lists are sorted by start address, so there is no need to search
+        size_t iOld = 0;
+        for (MappedRegionInternal &region : mappedRegions) {
+            while (iOld < m_mappedRegions.size() && m_mappedRegions[iOld].start < region.start) {
+                iOld++;
+            }
+            if (iOld >= m_mappedRegions.size()) {
+                break;
+            }
+            const MappedRegion &oldRegion = m_mappedRegions[iOld];
+            const RegionState &oldState = m_regionStates[iOld];
+            if (oldRegion.start == region.start && oldRegion.end == region.end &&
+                oldState.mapsLineLength == region.mapsLineLength &&
+                memcmp(m_mapsText.data() + oldState.mapsLineOffset, m_mapsBuffer.data() + region.mapsLineOffset,
+                       region.mapsLineLength) == 0) {
+                region.previous = &oldRegion;
+                region.previousPagemapEntries.data = buffers.previousPagemapArena.data() + oldState.pagemapOffset;
+                region.previousPagemapEntries.count = region.pageCount();
+                iOld++;
+            }
+        }
+    }
+    m_regionStates.clear();
+    timer.endPhase(CaptureStats::JoinPhase);
+
+    const bool sortPfns = m_options.pfnCollection == CaptureOptions::SortedPfnList;
+    buffers.pfns.clear();
+    const uint64_t presentPages = readPagemap(m_pid, &mappedRegions, sortPfns ? &buffers.pfns : nullptr,
+                                              m_options, &buffers.pagemapSlices, &m_captureStats);
+    timer.endPhase(CaptureStats::ReadPagemapPhase);
+    if (m_keepState) {
+        // as soon as possible after reading pagemap, to keep the window for missed writes small
+        m_softDirtyCleared = isSoftDirtySupported() && clearSoftDirtyBits(m_pid, &m_captureStats);
+        timer.endPhase(CaptureStats::ClearSoftDirtyPhase);
+    }
+    if (!presentPages) {
+        // usual cause: couldn't read pagemap due to lack of permissions (user is not root)
+        m_mappedRegions.clear();
+        return false;
+    }
+    if (m_options.trackIdlePages) {
+        if (!m_idlePages) {
+            m_idlePages.reset(new IdlePageTracker);
+        }
+        if (m_idlePages->isOpen()) {
+            m_idlePages->update(mappedRegions, &m_captureStats);
+        }
+        timer.endPhase(CaptureStats::IdlePagesPhase);
+    }
+    const bool mergeHugePages = mergesHugePages(m_options);
+    PfnInfos &pfnInfos = buffers.pfnInfos;
+    if (sortPfns) {
+        rangifyPfns(&buffers.pfns, m_options.maxPfnGap, pfnInfos.ranges());
+    } else {
+        const NeededPfns neededPfns = { mappedRegions, mergeHugePages };
+        rangifyPfnsBitmap(neededPfns, m_options.maxPfnGap, &buffers.pfns, pfnInfos.ranges());
+    }
+    timer.endPhase(CaptureStats::RangifyPfnsPhase);
+    pfnInfos.read(m_options.threadCount, &m_captureStats);
+    timer.endPhase(CaptureStats::ReadUseCountsAndFlagsPhase);
+    // usually none; the attempt to find them is part of the cost of merging
+    PfnInfos &falseHugePageInfos = buffers.falseHugePageInfos;
+    falseHugePageInfos.ranges()->clear();
+    if (mergeHugePages) {
+        rangifyFalseHugePages(mappedRegions, pfnInfos, m_options.maxPfnGap, &buffers.pfns,
+                              falseHugePageInfos.ranges());
+    }
+    timer.endPhase(CaptureStats::RangifyPfnsPhase);
+    falseHugePageInfos.read(m_options.threadCount, &m_captureStats);
+    timer.endPhase(CaptureStats::ReadUseCountsAndFlagsPhase);
+
+    // With idle page tracking, KPF_IDLE of present pages is what this pass found, not what kpageflags
+    // or (for unchanged pages) the previous pass said. The kernel tracks a compound page (a huge page or
+    // a smaller folio) by its head page; the bits of the tail pages always read as not idle. Compound
+    // pages are usually mapped in order, so the last head page of the region stands in for its tails,
+    // and the pages of a merged huge page, which have no compound flags, use its first page.
+    const IdlePageTracker *const idlePages = isTrackingIdlePages() ? m_idlePages.get() : nullptr;
+    uint64_t headPfn = 0;
+    auto withIdleFlag = [idlePages, &headPfn](uint32_t flags, uint64_t pfn) -> uint32_t {
+        if (!idlePages) {
+            return flags;
+        }
+        if (flags & (1 << KPF_COMPOUND_HEAD)) {
+            headPfn = pfn;
+        } else if (flags & (1 << KPF_COMPOUND_TAIL)) {
+            pfn = headPfn && headPfn < pfn ? headPfn : pfn;
+        } else if (flags & (1 << KPF_THP)) {
+            pfn -= pfn % hugePagePages;
+        }
+        return (flags & ~(1u << KPF_IDLE)) | idlePages->idleFlag(pfn);
+    };
+    if (m_options.recordPlacement && !m_nodeMap) {
+        m_nodeMap.reset(new NumaNodeMap);
+    }
+    for (MappedRegionInternal &mappedRegion : mappedRegions) {
+        headPfn = 0;
+        const MappedRegion *const previous = mappedRegion.previous;
+        size_t previousRun = 0;
+        for (size_t i = 0; i < mappedRegion.pagemapEntries.size(); i++) {
+            const uint64_t pageBits = mappedRegion.pagemapEntries[i];
+            if (mergeHugePages && isHugePageCandidate(mappedRegion, i)) {
+                // all pages of a huge page get the use count and flags of the first, without the
+                // compound head / tail distinction, so that consecutive huge pages can share a run
+                const uint64_t firstPfn = pfnForPagemapEntry(pageBits);
+                const PfnInfo &first = pfnInfos.info(firstPfn);
+                const bool isHuge = isHugePage(first);
+                for (size_t j = 0; j < hugePagePages; j++) {
+                    const PfnInfo &info = isHuge || j == 0 ? first : falseHugePageInfos.info(firstPfn + j);
+                    const uint32_t flags = isHuge ? first.flags & ~compoundPageFlags : info.flags;
+                    mappedRegion.addPage(i + j, info.useCount,
+                                         pagemapFlags(mappedRegion.pagemapEntries[i + j]) |
+                                             withIdleFlag(flags, firstPfn + j));
+                }
+                i += hugePagePages - 1;
+            } else if (isPageUnchanged(mappedRegion, i)) {
+                // pages are visited in order, so the run is the same as or after the previous one
+                while (previous->runEnd(previousRun) <= i) {
+                    previousRun++;
+                }
+                mappedRegion.addPage(i, previous->useCounts[previousRun],
+                                     withIdleFlag(previous->combinedFlags[previousRun], pfnForPagemapEntry(pageBits)));
+            } else if (const uint64_t pfn = pfnForPagemapEntry(pageBits)) {
+                const PfnInfo &info = pfnInfos.info(pfn);
+                mappedRegion.addPage(i, info.useCount, pagemapFlags(pageBits) | withIdleFlag(info.flags, pfn));
+            } else {
+                mappedRegion.addPage(i, 0, pagemapFlags(pageBits));
+            }
+        }
+        if (m_options.recordPlacement) {
+            // a second pass over the pagemap entries, which are still in cache for all but huge regions
+            addPlacements(&mappedRegion, *m_nodeMap);
+        }
+        // from the runs, which are still in cache and usually far fewer than the pages
+        mappedRegion.computeStats();
+        trimRuns(&mappedRegion);
+
+        if (m_keepState) {
+            const RegionState state = { mappedRegion.mapsLineOffset, mappedRegion.mapsLineLength,
+                                        size_t(mappedRegion.pagemapEntries.data - buffers.pagemapArena.data()) };
+            m_regionStates.push_back(state);
+        }
+        buffers.spareRegions.push_back(move(static_cast<MappedRegion &>(mappedRegion)));
+    }
+    // the old regions, which nothing points to anymore, become the spares of the next pass
+    swap(m_mappedRegions, buffers.spareRegions);
+    if (m_keepState) {
+        // m_regionStates refer to them now
+        swap(m_mapsText, m_mapsBuffer);
+        swap(buffers.pagemapArena, buffers.previousPagemapArena);
+    } else {
+        // one-shot users don't pay for keeping the buffers
+        m_buffers.reset();
+    }
+    if (!incremental) {
+        m_backingFileNames.purge();
+    }
+    timer.endPhase(CaptureStats::JoinPhase);
+    return true;
+}
+
+// 512 KiB of PFNs, and at most a few MiB of use counts and flags read for them
+static const size_t summaryBatchPages = 64 * 1024;
+
+// present pages of summarizeMemory() whose use counts and flags are read together, or all present pages
+// of a process in summarizeProcesses()
+struct SummaryBatch
+{
+    vector<uint64_t> pfns;
+    vector<uint64_t> sortedPfns; // the PFNs to rangify; pfns must stay in page order
+    PfnInfos pfnInfos;
+    vector<uint32_t> flags; // combined flags, initially only the part from pagemap
+    vector<uint32_t> useCounts;
+    vector<uint8_t> categories;
+    uint64_t presentPages = 0; // all that were added, including those of earlier batches
+};
+
+// Reads the pagemap entries of the regions in chunks, with scanPagemap() if scan, counts VSZ and not
+// present pages into summary, and appends PFN and pagemap flags of present pages to batch. batchFull() is
+// called whenever the batch has maxBatchPages pages; it must empty the batch. Returns false if pagemap
+// could not be opened.
+template<typename BatchFullFunc>
+static bool readPresentPages(uint pid, const vector<MappedRegionInternal> &mappedRegions, bool scan,
+                             size_t maxBatchPages, SummaryBatch *batch, MemorySummary *summary, IoCounter *io,
+                             BatchFullFunc batchFull)
+{
+    ostringstream pagemapName;
+    pagemapName << "/proc/" << pid << "/pagemap";
+    const int pagemapFd = open(pagemapName.str().c_str(), O_RDONLY);
+    io->syscalls++;
+    if (pagemapFd < 0) {
+        return false;
+    }
+
+    vector<uint64_t> pagemapEntries(summaryBatchPages);
+    for (const MappedRegionInternal &region : mappedRegions) {
+        summary->virtualBytes += region.end - region.start;
+        const uint64_t endPage = region.end / PageInfo::pageSize;
+        for (uint64_t page = region.start / PageInfo::pageSize; page < endPage; ) {
+            // never more than fits into the batch, so that it can be summarized whenever it is full
+            const size_t count = min(min(summaryBatchPages, maxBatchPages - batch->pfns.size()), endPage - page);
+            readPagemapEntries(pagemapFd, scan, page, count, pagemapEntries.data(), io);
+            for (size_t i = 0; i < count; i++) {
+                const uint64_t pageBits = pagemapEntries[i];
+                if (const uint64_t pfn = pfnForPagemapEntry(pageBits)) {
+                    batch->pfns.push_back(pfn);
+                    batch->flags.push_back(pagemapFlags(pageBits));
+                    batch->presentPages++;
+                } else {
+                    summary->pagesWithZeroUseCount++;
+                }
+            }
+            page += count;
+            if (batch->pfns.size() == maxBatchPages) {
+                batchFull();
+            }
+        }
+    }
+    close(pagemapFd);
+    io->syscalls++;
+    return true;
+}
+
+// Looks up use counts and flags of the pages in batch, classifies them, adds them to summary and clears
+// the batch
+static void addBatchToSummary(SummaryBatch *batch, const PfnInfos &pfnInfos, MemorySummary *summary)
+{
+    const size_t count = batch->pfns.size();
+    batch->useCounts.resize(count);
+    batch->categories.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        const PfnInfo &info = pfnInfos.info(batch->pfns[i]);
+        batch->useCounts[i] = info.useCount;
+        batch->flags[i] |= info.flags;
+    }
+    classifyPages(batch->useCounts.data(), batch->flags.data(), count, batch->categories.data());
+    for (size_t i = 0; i < count; i++) {
+        const PageCategory category = PageCategory(batch->categories[i]);
+        if (!isResident(category)) {
+            summary->pagesWithZeroUseCount++;
+        } else if (!isShared(category)) {
+            summary->privateBytes += PageInfo::pageSize;
+        } else {
+            summary->sharedBytes += PageInfo::pageSize;
+            summary->proportionalSharedBytes += PageInfo::pageSize / batch->useCounts[i];
+        }
+    }
+    batch->pfns.clear();
+    batch->flags.clear();
+}
+
+static void summarizeBatch(SummaryBatch *batch, const CaptureOptions &options, MemorySummary *summary,
+                           PhaseTimer *timer, CaptureStats *stats)
+{
+    if (batch->pfns.empty()) {
+        return;
+    }
+    // rangifyPfns() sorts a copy; the PFNs are needed in page order in addBatchToSummary()
+    batch->sortedPfns.assign(batch->pfns.begin(), batch->pfns.end());
+    rangifyPfns(&batch->sortedPfns, options.maxPfnGap, batch->pfnInfos.ranges());
+    timer->endPhase(CaptureStats::RangifyPfnsPhase);
+    batch->pfnInfos.read(options.threadCount, stats);
+    timer->endPhase(CaptureStats::ReadUseCountsAndFlagsPhase);
+    addBatchToSummary(batch, batch->pfnInfos, summary);
+    timer->endPhase(CaptureStats::JoinPhase);
+}
+
+bool summarizeMemory(uint pid, const CaptureOptions &options, MemorySummary *summary, CaptureStats *stats)
+{
+    CaptureStats localStats;
+    if (!stats) {
+        stats = &localStats;
+    }
+    *stats = CaptureStats();
+    *summary = MemorySummary();
+    PhaseTimer timer(stats);
+
+    vector<char> mapsText;
+    vector<MappedRegionInternal> mappedRegions = readMappedRegions(pid, options.filter, &mapsText, stats);
+    timer.endPhase(CaptureStats::ReadMapsPhase);
+    sort(mappedRegions.begin(), mappedRegions.end());
+    correctOverlaps(&mappedRegions);
+    FilterScratch filterScratch;
+    applyFilter(options.filter, &mappedRegions, &filterScratch);
+    timer.endPhase(CaptureStats::CorrectOverlapsPhase);
+
+    SummaryBatch batch;
+    batch.pfns.reserve(summaryBatchPages);
+    batch.flags.reserve(summaryBatchPages);
+    vector<IoCounter> io(1);
+    const bool scan = usePagemapScan(options);
+    const bool ok = readPresentPages(pid, mappedRegions, scan, summaryBatchPages, &batch, summary, &io[0], [&]() {
+        timer.endPhase(CaptureStats::ReadPagemapPhase);
+        summarizeBatch(&batch, options, summary, &timer, stats);
+    });
+    timer.endPhase(CaptureStats::ReadPagemapPhase);
+    addIoCounters(io, CaptureStats::ReadPagemapPhase, stats);
+    summarizeBatch(&batch, options, summary, &timer, stats);
+    // no present pages: usually, we weren't allowed to read PFNs from pagemap (user is not root)
+    return ok && batch.presentPages > 0;
+}
+
+// what summarizeProcesses() keeps per process between reading pagemap and reading /proc/kpage*
+struct ProcessPages
+{
+    bool ok = false;
+    MemorySummary summary;
+    SummaryBatch pages;
+};
+
+// the PFN source (see NeededPfns) of summarizeProcesses()
+struct ProcessPfns
+{
+    const vector<ProcessPages> &processes;
+
+    template<typename PfnFunc>
+    void operator()(PfnFunc func) const
+    {
+        for (const ProcessPages &process : processes) {
+            for (uint64_t pfn : process.pages.pfns) {
+                func(pfn);
+            }
+        }
+    }
+};
+
+// Three passes: read the pagemaps of all processes, then /proc/kpage* for the union of their PFNs, then
+// summarize each process. Pages that several processes share, e.g. of shared libraries, are read from
+// /proc/kpage* only once, so the cost of that part is bounded by the size of physical memory, not by the
+// sum of the RSS of all processes.
+// ### Between the first and the last pass, the PFNs and pagemap flags of all processes are kept, 12 bytes
+//     per resident page per process. Reading pagemap twice would avoid that, at the cost of more syscalls
+//     and of possibly inconsistent data for processes that change in between.
+bool summarizeProcesses(const vector<uint> &pids, const CaptureOptions &options, HostMemorySummary *host,
+                        CaptureStats *stats)
+{
+    CaptureStats localStats;
+    if (!stats) {
+        stats = &localStats;
+    }
+    *stats = CaptureStats();
+    *host = HostMemorySummary();
+    PhaseTimer timer(stats);
+
+    // Processes differ wildly in size, so instead of splitting them into slices, the threads take the next
+    // one to read until none are left.
+    vector<ProcessPages> processes(pids.size());
+    const uint threadCount = max(1u, min(options.threadCount, uint(pids.size())));
+    vector<CaptureStats> threadStats(threadCount);
+    atomic<size_t> nextProcess(0);
+    runSlices(threadCount, [&](size_t threadIndex) {
+        CaptureStats *const threadStat = &threadStats[threadIndex];
+        PhaseTimer threadTimer(threadStat);
+        vector<IoCounter> io(1);
+        vector<char> mapsText;
+        FilterScratch filterScratch;
+        for (size_t i = nextProcess++; i < processes.size(); i = nextProcess++) {
+            vector<MappedRegionInternal> mappedRegions = readMappedRegions(pids[i], options.filter, &mapsText,
+                                                                           threadStat);
+            threadTimer.endPhase(CaptureStats::ReadMapsPhase);
+            sort(mappedRegions.begin(), mappedRegions.end());
+            correctOverlaps(&mappedRegions);
+            applyFilter(options.filter, &mappedRegions, &filterScratch);
+            threadTimer.endPhase(CaptureStats::CorrectOverlapsPhase);
+            ProcessPages &process = processes[i];
+            // kernel threads have no mappings, and processes that just exited have no maps to read
+            process.ok = !mappedRegions.empty() &&
+                         readPresentPages(pids[i], mappedRegions, usePagemapScan(options),
+                                          numeric_limits<size_t>::max(), &process.pages, &process.summary, &io[0],
+                                          []() {});
+            threadTimer.endPhase(CaptureStats::ReadPagemapPhase);
+        }
+        addIoCounters(io, CaptureStats::ReadPagemapPhase, threadStat);
+    });
+
+    // The threads' times add up to more than the wall time that passed; split the wall time between the
+    // phases in proportion to the threads' times.
+    timer.endPhase(CaptureStats::ReadPagemapPhase);
+    const uint64_t wallNanoseconds = stats->nanoseconds[CaptureStats::ReadPagemapPhase];
+    uint64_t threadNanoseconds = 0;
+    for (const CaptureStats &threadStat : threadStats) {
+        threadNanoseconds += threadStat.totalNanoseconds();
+    }
+    for (int phase = 0; phase < CaptureStats::PhaseCount; phase++) {
+        uint64_t phaseNanoseconds = 0;
+        for (const CaptureStats &threadStat : threadStats) {
+            phaseNanoseconds += threadStat.nanoseconds[phase];
+            stats->syscalls[phase] += threadStat.syscalls[phase];
+            stats->bytesRead[phase] += threadStat.bytesRead[phase];
+        }
+        if (threadNanoseconds) {
+            stats->nanoseconds[phase] = uint64_t(double(wallNanoseconds) * phaseNanoseconds / threadNanoseconds);
+        }
+    }
+
+    uint64_t pfnCount = 0;
+    const ProcessPfns pfnSource = { processes };
+    PfnInfos pfnInfos;
+    vector<uint64_t> pfns;
+    if (options.pfnCollection == CaptureOptions::SortedPfnList) {
+        collectPfns(pfnSource, &pfns);
+        rangifyPfns(&pfns, options.maxPfnGap, pfnInfos.ranges(), &pfnCount);
+    } else {
+        rangifyPfnsBitmap(pfnSource, options.maxPfnGap, &pfns, pfnInfos.ranges(), &pfnCount);
+    }
+    vector<uint64_t>().swap(pfns);
+    timer.endPhase(CaptureStats::RangifyPfnsPhase);
+    pfnInfos.read(options.threadCount, stats);
+    timer.endPhase(CaptureStats::ReadUseCountsAndFlagsPhase);
+
+    for (size_t i = 0; i < processes.size(); i++) {
+        ProcessPages &process = processes[i];
+        if (process.ok) {
+            addBatchToSummary(&process.pages, pfnInfos, &process.summary);
+            const ProcessMemorySummary processSummary = { pids[i], process.summary };
+            host->processes.push_back(processSummary);
+        }
+        process.pages = SummaryBatch(); // free the memory as early as possible
     }
+    host->residentBytes = pfnCount * PageInfo::pageSize;
+    timer.endPhase(CaptureStats::JoinPhase);
+    // no present pages at all: we weren't allowed to read PFNs from pagemap (user is not root)
+    return pfnCount > 0;
 }
@@ -29,33 +29,449 @@
 #ifndef PAGEINFO_H
 #define PAGEINFO_H
 
+#include <algorithm>
+#include <cassert>
 #include <cstdint>
+#include <memory>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 // TODO
 // - tell the backing file for each MappedRegion in case there is one (mmap!)
 
+// Totals of the pages of a region, like the per-mapping lines of /proc/<pid>/smaps, but computed from
+// the captured page data. Pages are counted by their PageCategory (pagecategory.h).
+struct MappingStats
+{
+    enum Field {
+        ResidentField = 0, // RSS
+        ProportionalField, // PSS
+        AnonymousField, // resident and anonymous, including THP
+        FileField, // resident and from a file
+        DirtyField, // resident and KPF_DIRTY
+        SwappedField,
+        ThpField, // resident in transparent huge pages
+        SoftDirtyField, // written since soft-dirty bits were last cleared, or newly mapped
+        IdleField, // resident and KPF_IDLE: not accessed since the previous pass, see CaptureOptions::trackIdlePages
+        FieldCount
+    };
+    static const char *fieldName(Field field);
+
+    MappingStats() { std::fill(bytes, bytes + FieldCount, 0); }
+    // count pages with the same use count and combined flags, e.g. a run
+    void addPages(uint64_t count, uint32_t useCount, uint32_t flags);
+    MappingStats &operator+=(const MappingStats &other)
+    {
+        for (int i = 0; i < FieldCount; i++) {
+            bytes[i] += other.bytes[i];
+        }
+        return *this;
+    }
+    bool operator==(const MappingStats &other) const { return std::equal(bytes, bytes + FieldCount, other.bytes); }
+    bool operator!=(const MappingStats &other) const { return !(*this == other); }
+
+    uint64_t bytes[FieldCount];
+};
+
+// Where a page is, with CaptureOptions::recordPlacement: the NUMA node of a present page, or the swap
+// area (the swap type in pagemap, the index of the area in /proc/swaps) of a swapped out page
+namespace PagePlacement
+{
+    static const uint16_t unknown = 0; // e.g. device memory, which belongs to no node
+    static const uint16_t swapped = 0x8000;
+
+    inline uint16_t forNode(unsigned int node) { return uint16_t(node + 1); }
+    inline uint16_t forSwapType(unsigned int swapType) { return uint16_t(swapped | swapType); }
+    inline bool isNode(uint16_t placement) { return placement && !(placement & swapped); }
+    inline bool isSwapType(uint16_t placement) { return placement & swapped; }
+    inline unsigned int node(uint16_t placement) { return placement - 1u; }
+    inline unsigned int swapType(uint16_t placement) { return placement & ~swapped; }
+}
+
+// The name of a region's backing file, as the last field of /proc/<pid>/maps shows it, spaces and
+// suffixes like " (deleted)" included. It is shared between all copies - names come from
+// BackingFileNames, which hands out the same string for each occurrence of a name, so many regions of
+// the same file (or [heap], [stack], ...) take no memory of their own.
+class BackingFileName
+{
+public:
+    BackingFileName() {}
+    explicit BackingFileName(std::shared_ptr<const std::string> name) : m_name(std::move(name)) {}
+
+    const std::string &str() const { return m_name ? *m_name : emptyString(); }
+    operator const std::string &() const { return str(); }
+    bool empty() const { return str().empty(); }
+    size_t length() const { return str().length(); }
+    const char *c_str() const { return str().c_str(); }
+    // not interned; for names that don't come from PageInfo
+    void assign(const char *name, size_t length)
+    {
+        m_name = length ? std::make_shared<const std::string>(name, length) : nullptr;
+    }
+
+    bool operator==(const BackingFileName &other) const { return m_name == other.m_name || str() == other.str(); }
+    bool operator!=(const BackingFileName &other) const { return !(*this == other); }
+
+private:
+    static const std::string &emptyString()
+    {
+        static const std::string empty;
+        return empty;
+    }
+    std::shared_ptr<const std::string> m_name; // null if empty
+};
+
+// Interns backing file names. Looking up a name that is already known neither allocates nor copies.
+class BackingFileNames
+{
+public:
+    BackingFileName intern(const char *name, size_t length);
+    // forgets the names that are not used by any BackingFileName anymore
+    void purge();
+
+private:
+    // keyed by a hash of the name, because std::unordered_map can't look up a std::string by a pointer
+    // and a length without first constructing the string
+    std::unordered_multimap<uint64_t, std::shared_ptr<const std::string>> m_names;
+};
+
+// The pages of a region are stored as runs of consecutive pages with the same use count and flags.
+// Large parts of most address spaces are not present (reserved heaps, guard pages, thread stacks),
+// and each such stretch takes only one run.
 struct MappedRegion
 {
     uint64_t start;
     uint64_t end;
-    std::string backingFile;
-    std::vector<uint32_t> useCounts;
-    std::vector<uint32_t> combinedFlags;
+    BackingFileName backingFile;
+    // Run i covers the pages from runStarts[i] (relative to start) up to the start of the next run, or
+    // up to pageCount() for the last run. Adjacent runs never have the same use count and flags.
+    std::vector<uint64_t> runStarts;
+    std::vector<uint32_t> useCounts; // per run
+    std::vector<uint32_t> combinedFlags; // per run
+    // Of all pages. PageInfo fills it in while capturing, PageInfoReader receives it; other code that
+    // builds runs calls computeStats().
+    MappingStats stats;
+    // With CaptureOptions::recordPlacement, the PagePlacement of the pages, in runs like the ones above;
+    // otherwise empty. Pages that are neither present nor swapped continue the run before them, so
+    // there are usually only a few runs, one per node and swap area that the pages are in.
+    // ### Only for local use; placements are not sent to clients or recorded.
+    std::vector<uint64_t> placementStarts;
+    std::vector<uint16_t> placements;
+
     bool operator<(const MappedRegion &other) const { return start < other.start; }
+
+    inline uint64_t pageCount() const;
+    size_t runCount() const { return runStarts.size(); }
+    uint64_t runEnd(size_t run) const { return run + 1 < runStarts.size() ? runStarts[run + 1] : pageCount(); }
+    // the run that contains the page with the given index (relative to start)
+    size_t runAt(uint64_t page) const
+    {
+        assert(page < pageCount());
+        return std::upper_bound(runStarts.begin(), runStarts.end(), page) - runStarts.begin() - 1;
+    }
+    // Sets use count and flags of a page. Pages must be added in order, starting from page 0.
+    void addPage(uint64_t page, uint32_t useCount, uint32_t flags)
+    {
+        assert(page < pageCount() && (runStarts.empty() ? page == 0 : page > runStarts.back()));
+        if (runStarts.empty() || useCounts.back() != useCount || combinedFlags.back() != flags) {
+            runStarts.push_back(page);
+            useCounts.push_back(useCount);
+            combinedFlags.push_back(flags);
+        }
+    }
+    void clearPages()
+    {
+        runStarts.clear();
+        useCounts.clear();
+        combinedFlags.clear();
+        stats = MappingStats();
+        placementStarts.clear();
+        placements.clear();
+    }
+    // like addPage(), in order but not necessarily for every page
+    void addPlacement(uint64_t page, uint16_t placement)
+    {
+        assert(page < pageCount() && (placementStarts.empty() || page > placementStarts.back()));
+        if (placements.empty() || placements.back() != placement) {
+            placementStarts.push_back(page);
+            placements.push_back(placement);
+        }
+    }
+    // the placement run that contains the page, which must be at or after the first placement run
+    size_t placementRunAt(uint64_t page) const
+    {
+        assert(!placementStarts.empty() && page >= placementStarts.front());
+        return std::upper_bound(placementStarts.begin(), placementStarts.end(), page) - placementStarts.begin() - 1;
+    }
+    uint64_t placementRunEnd(size_t run) const
+    {
+        return run + 1 < placementStarts.size() ? placementStarts[run + 1] : pageCount();
+    }
+    // sets stats from the runs
+    void computeStats();
 };
 
+// Resident memory per NUMA node and swapped memory per swap area, from MappedRegion::placements
+struct PlacementStats
+{
+    void addRegion(const MappedRegion &region);
+    PlacementStats &operator+=(const PlacementStats &other);
+
+    std::vector<uint64_t> nodeBytes; // indexed by node
+    std::vector<uint64_t> swapTypeBytes; // indexed by swap type
+    uint64_t unknownBytes = 0; // resident, but no node is known
+};
+
+// MappingStats of all regions with the same backing file; anonymous regions have an empty backingFile
+struct BackingFileStats
+{
+    std::string backingFile;
+    size_t regionCount = 0;
+    MappingStats stats;
+};
+
+// Regions of one update. Regions are shared, not copied, between snapshots of consecutive updates
+// in which they didn't change.
+typedef std::vector<std::shared_ptr<const MappedRegion>> MappedRegionSnapshot;
+
+// sorted by backing file
+std::vector<BackingFileStats> statsByBackingFile(const std::vector<MappedRegion> &regions);
+std::vector<BackingFileStats> statsByBackingFile(const MappedRegionSnapshot &regions);
+
+// Restricts a capture to some regions, or parts of regions, of the address space. Pagemap and
+// /proc/kpage* are only read for what passes the filter, so capturing a small part of a large process
+// costs correspondingly less. The default filter passes everything.
+struct CaptureFilter
+{
+    enum Kind {
+        AnyKind = 0,
+        // no backing file, a pseudo file like [heap], [stack] or [anon:<name>], or "/dev/zero (deleted)",
+        // which is how shared anonymous mappings show up
+        AnonymousOnly,
+        FileOnly
+    };
+
+    bool isEmpty() const { return addressRanges.empty() && backingFilePattern.empty() && kind == AnyKind; }
+    bool matchesBackingFile(const std::string &backingFile) const;
+    // parses "<start>-<end>", hexadecimal with or without 0x, and adds it to addressRanges
+    bool addAddressRange(const std::string &range);
+    bool operator==(const CaptureFilter &other) const
+    {
+        return addressRanges == other.addressRanges && backingFilePattern == other.backingFilePattern &&
+               kind == other.kind;
+    }
+    bool operator!=(const CaptureFilter &other) const { return !(*this == other); }
+
+    // Regions are cut to these [start, end) ranges, extended to page boundaries. Empty: all addresses.
+    std::vector<std::pair<uint64_t, uint64_t>> addressRanges;
+    // shell wildcard pattern (fnmatch(3)) that the backing file must match, empty for any
+    std::string backingFilePattern;
+    Kind kind = AnyKind;
+};
+
+// The parts of captured regions that pass the filter, as if they had been captured with it (and with the
+// filter of the capture): regions whose backing file doesn't match are left out, the others are cut to
+// the address ranges, with stats computed from the runs. For narrowing down one capture for several
+// receivers, e.g. the clients of a server.
+std::vector<MappedRegion> filterRegions(const std::vector<MappedRegion> &regions, const CaptureFilter &filter);
+
+struct CaptureOptions
+{
+    // how to find the PFN ranges to read from /proc/kpagecount and /proc/kpageflags
+    enum PfnCollection {
+        PfnBitmap, // mark PFNs in a bitmap, then scan it. Faster and lighter on memory.
+        SortedPfnList // collect, sort and deduplicate a list of PFNs; the original method
+    };
+    // how to read /proc/<pid>/pagemap
+    enum PagemapReader {
+        AutoPagemapReader, // ScanPagemapReader if the kernel supports it, see isPagemapScanSupported()
+        PreadPagemapReader, // read the entries of all pages of each region; the original method
+        // Find the present and swapped out pages with the PAGEMAP_SCAN ioctl, then read only their entries.
+        // The kernel skips the parts of the address space without page tables, so sparse address spaces
+        // cost time in proportion to their pages instead of to their size. Falls back to
+        // PreadPagemapReader where the kernel doesn't support it.
+        ScanPagemapReader
+    };
+
+    // number of threads that read /proc/<pid>/pagemap, /proc/kpagecount and /proc/kpageflags
+    unsigned int threadCount = 1;
+    PfnCollection pfnCollection = PfnBitmap;
+    PagemapReader pagemapReader = AutoPagemapReader;
+    // PFN ranges to read are merged when at most this many unneeded PFNs are between them; see
+    // PfnRangeBuilder in pageinfo.cpp. Only worth changing for benchmarking.
+    uint64_t maxPfnGap = 16;
+    // Store all pages of a huge page (a 2 MiB transparent huge page, or a hugetlb page) like its first
+    // page, and read /proc/kpage* only for that page. Pages of a huge page then differ neither in use
+    // count nor in flags, so consecutive huge pages take one run instead of two per huge page, and
+    // reading them costs 1/512 of the I/O. Off: every page as the kernel reports it.
+    // Only pages that PAGEMAP_SCAN reports as mapped huge are merged. Without it (PreadPagemapReader, or
+    // an older kernel), only anonymous huge pages are, and only if no smaller THP sizes are enabled in
+    // /sys/kernel/mm/transparent_hugepage, because their first pages look like those of huge pages.
+    bool mergeHugePages = true;
+    // Working set estimation: after reading pagemap, each pass reads the idle bits of the process's
+    // pages from /sys/kernel/mm/page_idle/bitmap and then marks them idle again, so pages that were not
+    // accessed (read or written, by any process) since the previous pass get KPF_IDLE in their combined
+    // flags. Needs CONFIG_IDLE_PAGE_TRACKING and root. Nothing is idle in the first pass. Pages that
+    // the kernel doesn't track, i.e. that are not on an LRU list (e.g. hugetlb pages), never are.
+    // Marking clears the accessed bits in the page tables of all processes that map the pages, which
+    // costs the kernel a reverse mapping walk per page and can make reclaim a little less accurate.
+    bool trackIdlePages = false;
+    // Record the NUMA node of each present page and the swap area of each swapped page, see
+    // MappedRegion::placements. Nodes are looked up by PFN in the memory blocks of each node in
+    // /sys/devices/system/node, which are read once per PageInfo.
+    bool recordPlacement = false;
+    CaptureFilter filter;
+};
+
+// Whether the pagemap files of this kernel have the PAGEMAP_SCAN ioctl (Linux 6.7 and later, unless
+// backported). Tried once, on pagemap of this process.
+bool isPagemapScanSupported();
+
+// What the last capture cost, per phase. Measuring it only takes two clock reads per phase, so it is
+// always done. Times are wall clock time, which is what matters for the update rate; with several
+// capture threads, they are not CPU time.
+struct CaptureStats
+{
+    enum Phase {
+        ReadMapsPhase = 0, // reading /proc/<pid>/maps
+        CorrectOverlapsPhase, // and applying CaptureOptions::filter
+        ReadPagemapPhase,
+        ClearSoftDirtyPhase,
+        IdlePagesPhase, // reading and marking the idle bits with CaptureOptions::trackIdlePages
+        RangifyPfnsPhase, // turning the PFNs from pagemap into ranges to read
+        ReadUseCountsAndFlagsPhase, // from /proc/kpagecount and /proc/kpageflags
+        JoinPhase, // matching regions with the previous update, combining the data per page
+        SerializePhase, // not part of PageInfo; filled in by the server
+        PhaseCount
+    };
+    static const char *phaseName(Phase phase);
+
+    CaptureStats();
+    uint64_t totalNanoseconds() const;
+    uint64_t totalSyscalls() const;
+    uint64_t totalBytesRead() const;
+
+    bool incremental;
+    uint64_t nanoseconds[PhaseCount];
+    uint64_t syscalls[PhaseCount]; // the system calls we make directly
+    uint64_t bytesRead[PhaseCount];
+};
+
+// The totals of a process that memstat prints, see summarizeMemory()
+struct MemorySummary
+{
+    uint64_t virtualBytes = 0; // VSZ
+    uint64_t privateBytes = 0; // resident and used only once
+    uint64_t sharedBytes = 0; // resident and used more than once, in this or other processes
+    uint64_t proportionalSharedBytes = 0; // the shared pages, each divided by its use count
+    uint64_t pagesWithZeroUseCount = 0; // mapped but not resident
+
+    uint64_t residentBytes() const { return privateBytes + sharedBytes; } // RSS
+    uint64_t proportionalBytes() const { return privateBytes + proportionalSharedBytes; } // PSS
+};
+
+// Computes a MemorySummary in one pass through /proc/<pid>/pagemap and /proc/kpage*, in batches of a
+// bounded number of present pages. Unlike PageInfo, it keeps no per-page data, so its memory use depends
+// only on the number of mappings, not on the size of the process. Pages are counted by their
+// PageCategory, like in summaries of a PageInfo. options.pfnCollection does not apply; of the
+// address space, only what passes options.filter is counted, VSZ included.
+// Returns false if the process could not be read.
+bool summarizeMemory(unsigned int pid, const CaptureOptions &options, MemorySummary *summary,
+                     CaptureStats *stats = nullptr);
+
+struct ProcessMemorySummary
+{
+    unsigned int pid;
+    MemorySummary summary;
+};
+
+// The result of summarizeProcesses()
+struct HostMemorySummary
+{
+    std::vector<ProcessMemorySummary> processes; // those that could be read, in the order of the given PIDs
+    // Physical memory mapped by any of the processes, each page counted once. Unlike the sum of their RSS,
+    // pages shared between them are not counted several times; unlike the sum of their PSS, it includes
+    // the shares of users that were not scanned.
+    uint64_t residentBytes = 0;
+};
+
+// Like summarizeMemory() for each of the processes, but /proc/kpagecount and /proc/kpageflags are
+// read only once for the union of the pages of all processes. options.threadCount threads read the
+// pagemaps of different processes in parallel. Returns false if no page information could be read at all.
+bool summarizeProcesses(const std::vector<unsigned int> &pids, const CaptureOptions &options,
+                        HostMemorySummary *host, CaptureStats *stats = nullptr);
+
+struct CaptureBuffers; // pageinfo.cpp
+class IdlePageTracker; // pageinfo.cpp
+class NumaNodeMap; // pageinfo.cpp
+
 class PageInfo
 {
 public:
     static const unsigned int pageShift = 12;
     static const unsigned int pageSize = 1 << pageShift; // the well-known 4096 bytes
 
-    PageInfo(unsigned int pid);
+    // Every fullUpdateInterval-th update() is a full pass, to pick up changes that soft-dirty tracking
+    // can't see: use counts of shared pages and the referenced / active / LRU flags of pages that were
+    // only read.
+    static const unsigned int fullUpdateInterval = 16;
+
+    PageInfo(unsigned int pid, const CaptureOptions &options = CaptureOptions());
+    ~PageInfo();
+    // Re-read the address space, only re-reading /proc/kpagecount and /proc/kpageflags for pages that
+    // were written or (re)mapped since the last update(). See the comment in the implementation for
+    // the side effects on the watched process. Without kernel support for soft-dirty tracking
+    // (CONFIG_MEM_SOFT_DIRTY), every update() is a full pass. Returns false if the process could not
+    // be read.
+    // The memory that a pass needs is kept for the next update(), so updates of an address space
+    // that doesn't grow don't allocate (with one capture thread; more threads are started per pass).
+    bool update();
+    // takes effect with the next update()
+    void setFilter(const CaptureFilter &filter);
+    const CaptureFilter &filter() const { return m_options.filter; }
+    // whether the idle bits could be read and marked in the constructor's capture or the last update();
+    // false if CaptureOptions::trackIdlePages is off
+    bool isTrackingIdlePages() const;
     const std::vector<MappedRegion> &mappedRegions() const { return m_mappedRegions; }
+    // statistics of the constructor's capture or the last update()
+    const CaptureStats &captureStats() const { return m_captureStats; }
 private:
+    bool capture(bool incremental);
+
+    // the part of a MappedRegion's internal state that we keep around between updates; one entry per
+    // entry in m_mappedRegions.
+    struct RegionState
+    {
+        // the region's line in m_mapsText
+        size_t mapsLineOffset;
+        size_t mapsLineLength;
+        size_t pagemapOffset; // of its pagemap entries in the arena of the last pass, see CaptureBuffers
+    };
+
+    unsigned int m_pid;
+    CaptureOptions m_options;
+    bool m_keepState; // set when update() is called; one-shot users don't pay for RegionState
+    bool m_softDirtyCleared;
+    bool m_filterChanged; // since the last pass, which means that maps must be parsed again
+    unsigned int m_updatesSinceFullUpdate;
     std::vector<MappedRegion> m_mappedRegions;
+    std::vector<RegionState> m_regionStates;
+    // the contents of /proc/<pid>/maps in the last pass if m_keepState, and the buffer to read it into
+    std::vector<char> m_mapsText;
+    std::vector<char> m_mapsBuffer;
+    BackingFileNames m_backingFileNames;
+    std::unique_ptr<CaptureBuffers> m_buffers; // kept if m_keepState
+    // kept even by one-shot users, so that the constructor's capture marks the pages for update()
+    std::unique_ptr<IdlePageTracker> m_idlePages; // if CaptureOptions::trackIdlePages
+    std::unique_ptr<NumaNodeMap> m_nodeMap; // if CaptureOptions::recordPlacement
+    CaptureStats m_captureStats;
 };
 
+inline uint64_t MappedRegion::pageCount() const
+{
+    return (end - start) / PageInfo::pageSize;
+}
+
 #endif // PAGEINFO_H
@@ -0,0 +1,293 @@
+/*
+  pageinfoexport.cpp
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pageinfoexport.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+using namespace std;
+
+template<typename T>
+static void writeValue(char *dest, T value)
+{
+    memcpy(dest, &value, sizeof(T));
+}
+
+static size_t padded(size_t size)
+{
+    return (size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+}
+
+// writes one column of a block at *out, padded with zeros, and advances *out past it
+template<typename T, typename ValueFunc>
+static void writeColumn(char **out, size_t rowCount, ValueFunc value)
+{
+    for (size_t i = 0; i < rowCount; i++) {
+        writeValue(*out + i * sizeof(T), T(value(i)));
+    }
+    const size_t size = rowCount * sizeof(T);
+    memset(*out + size, 0, padded(size) - size);
+    *out += padded(size);
+}
+
+const size_t PageInfoExporter::defaultChunkSize;
+
+PageInfoExporter::PageInfoExporter(size_t chunkSize)
+   : m_stage(IdleStage),
+     m_regions(nullptr),
+     m_pid(0),
+     m_timestamp(0),
+     m_withRuns(false),
+     m_region(0),
+     m_run(0),
+     m_runCount(0),
+     m_bytesExported(0),
+     m_buffer(max(chunkSize, defaultChunkSize / 4))
+{}
+
+void PageInfoExporter::begin(const vector<MappedRegion> &regions, uint32_t pid, uint64_t timestamp, bool withRuns)
+{
+    assert(m_stage == IdleStage);
+    m_stage = HeaderStage;
+    m_regions = &regions;
+    m_pid = pid;
+    m_timestamp = timestamp;
+    m_withRuns = withRuns;
+    m_region = 0;
+    m_run = 0;
+    m_runCount = 0;
+    m_bytesExported = 0;
+    m_backingFileIds.clear();
+}
+
+// return value: where to write the payload, or nullptr if the block doesn't fit into the buffer
+char *PageInfoExporter::beginBlock(PageInfoExport::BlockType type, uint32_t rowCount, size_t payloadSize,
+                                   size_t *bufPos)
+{
+    using namespace PageInfoExport;
+    assert(payloadSize % sizeof(uint64_t) == 0);
+    if (*bufPos + blockHeaderSize + payloadSize > chunkSize()) {
+        return nullptr;
+    }
+    char *const block = m_buffer.data() + *bufPos;
+    writeValue(block, uint32_t(type));
+    writeValue(block + sizeof(uint32_t), rowCount);
+    writeValue(block + 2 * sizeof(uint32_t), uint64_t(payloadSize));
+    *bufPos += blockHeaderSize + payloadSize;
+    return block + blockHeaderSize;
+}
+
+// A StringsBlock with the names that the regions of the RegionsBlock after it need first, if any, then as
+// many regions as fit into the rest of the chunk
+bool PageInfoExporter::writeRegions(size_t *bufPos)
+{
+    using namespace PageInfoExport;
+    const vector<MappedRegion> &regions = *m_regions;
+    // paths are limited to PATH_MAX, so this is just a sanity check
+    const size_t maxStringLength = chunkSize() / 4;
+    static const size_t rowSize = 3 * sizeof(uint64_t) + sizeof(uint32_t) + MappingStats::FieldCount * sizeof(uint64_t);
+    // both block headers and the padding of the columns with uint32_t and char values
+    static const size_t overhead = 2 * blockHeaderSize + 3 * sizeof(uint64_t);
+    const size_t space = chunkSize() - *bufPos;
+
+    m_blockIds.clear();
+    m_blockNames.clear();
+    size_t size = overhead;
+    while (m_region + m_blockIds.size() < regions.size()) {
+        const string &name = regions[m_region + m_blockIds.size()].backingFile;
+        auto it = name.empty() ? m_backingFileIds.end() : m_backingFileIds.find(name);
+        const bool isNew = !name.empty() && it == m_backingFileIds.end();
+        const size_t regionSize = rowSize + (isNew ? sizeof(uint32_t) + min(name.length(), maxStringLength) : 0);
+        if (size + regionSize > space) {
+            break;
+        }
+        size += regionSize;
+        if (isNew) {
+            it = m_backingFileIds.emplace(name, uint32_t(m_backingFileIds.size() + 1)).first;
+            m_blockNames.push_back(&it->first);
+        }
+        m_blockIds.push_back(name.empty() ? 0 : it->second);
+    }
+    if (m_blockIds.empty()) {
+        return false;
+    }
+
+    if (!m_blockNames.empty()) {
+        size_t charCount = 0;
+        for (const string *name : m_blockNames) {
+            charCount += min(name->length(), maxStringLength);
+        }
+        const size_t nameCount = m_blockNames.size();
+        char *out = beginBlock(StringsBlock, nameCount, padded(nameCount * sizeof(uint32_t)) + padded(charCount),
+                               bufPos);
+        assert(out);
+        writeColumn<uint32_t>(&out, nameCount, [this, maxStringLength](size_t i) {
+            return min(m_blockNames[i]->length(), maxStringLength);
+        });
+        for (const string *name : m_blockNames) {
+            const size_t length = min(name->length(), maxStringLength);
+            memcpy(out, name->data(), length);
+            out += length;
+        }
+        memset(out, 0, padded(charCount) - charCount);
+    }
+
+    const size_t count = m_blockIds.size();
+    const MappedRegion *const first = regions.data() + m_region;
+    const size_t payloadSize = 3 * count * sizeof(uint64_t) + padded(count * sizeof(uint32_t)) +
+                               MappingStats::FieldCount * count * sizeof(uint64_t);
+    char *out = beginBlock(RegionsBlock, count, payloadSize, bufPos);
+    assert(out);
+    writeColumn<uint64_t>(&out, count, [first](size_t i) { return first[i].start; });
+    writeColumn<uint64_t>(&out, count, [first](size_t i) { return first[i].end; });
+    writeColumn<uint64_t>(&out, count, [first](size_t i) { return first[i].runCount(); });
+    writeColumn<uint32_t>(&out, count, [this](size_t i) { return m_blockIds[i]; });
+    for (size_t field = 0; field < MappingStats::FieldCount; field++) {
+        writeColumn<uint64_t>(&out, count, [first, field](size_t i) { return first[i].stats.bytes[field]; });
+    }
+    m_region += count;
+    return true;
+}
+
+// as many runs as fit into the rest of the chunk, from the runs of one or more regions
+bool PageInfoExporter::writeRuns(size_t *bufPos)
+{
+    using namespace PageInfoExport;
+    const vector<MappedRegion> &regions = *m_regions;
+    static const size_t rowSize = sizeof(uint64_t) + 2 * sizeof(uint32_t);
+    // and the padding of the uint32_t columns
+    static const size_t overhead = blockHeaderSize + 2 * sizeof(uint64_t);
+    const size_t space = chunkSize() - *bufPos;
+    if (space < overhead + rowSize) {
+        return false;
+    }
+    // which runs of which regions go into the block
+    const size_t firstRegion = m_region;
+    const size_t firstRun = m_run;
+    size_t count = 0;
+    const size_t maxCount = (space - overhead) / rowSize;
+    while (m_region < regions.size() && count < maxCount) {
+        const size_t take = min(regions[m_region].runCount() - m_run, maxCount - count);
+        count += take;
+        m_run += take;
+        if (m_run >= regions[m_region].runCount()) {
+            m_region++;
+            m_run = 0;
+        }
+    }
+    if (!count) {
+        return true; // only empty regions were left
+    }
+
+    char *const out = beginBlock(RunsBlock, count,
+                                 count * sizeof(uint64_t) + 2 * padded(count * sizeof(uint32_t)), bufPos);
+    assert(out);
+    // the columns are written side by side in one walk over the runs, then padded
+    char *const pageCounts = out;
+    char *const useCounts = pageCounts + count * sizeof(uint64_t);
+    char *const flags = useCounts + padded(count * sizeof(uint32_t));
+    size_t region = firstRegion;
+    size_t run = firstRun;
+    for (size_t i = 0; i < count; i++, run++) {
+        while (run >= regions[region].runCount()) {
+            region++;
+            run = 0;
+        }
+        const MappedRegion &mr = regions[region];
+        writeValue(pageCounts + i * sizeof(uint64_t), uint64_t(mr.runEnd(run) - mr.runStarts[run]));
+        writeValue(useCounts + i * sizeof(uint32_t), mr.useCounts[run]);
+        writeValue(flags + i * sizeof(uint32_t), mr.combinedFlags[run]);
+    }
+    const size_t columnSize = count * sizeof(uint32_t);
+    memset(useCounts + columnSize, 0, padded(columnSize) - columnSize);
+    memset(flags + columnSize, 0, padded(columnSize) - columnSize);
+    m_runCount += count;
+    return true;
+}
+
+pair<const char*, size_t> PageInfoExporter::exportMore()
+{
+    using namespace PageInfoExport;
+    size_t bufPos = 0;
+
+    // fill the buffer with whole blocks until it is full or there is nothing more to write
+    while (true) {
+        bool wrote = true;
+        switch (m_stage) {
+        case HeaderStage: {
+            char *const header = m_buffer.data();
+            memcpy(header, magic, magicLength);
+            writeValue(header + magicLength, version);
+            writeValue(header + magicLength + 4, uint32_t(PageInfo::pageSize));
+            writeValue(header + magicLength + 8, m_pid);
+            writeValue(header + magicLength + 12, uint32_t(MappingStats::FieldCount));
+            writeValue(header + magicLength + 16, m_timestamp);
+            bufPos = headerSize;
+            m_stage = RegionsStage;
+            break;
+        }
+        case RegionsStage:
+            if (m_region >= m_regions->size()) {
+                m_region = 0;
+                m_run = 0;
+                m_stage = m_withRuns ? RunsStage : EndStage;
+                break;
+            }
+            wrote = writeRegions(&bufPos);
+            break;
+        case RunsStage:
+            if (m_region >= m_regions->size()) {
+                m_stage = EndStage;
+                break;
+            }
+            wrote = writeRuns(&bufPos);
+            break;
+        case EndStage:
+            if (char *const payload = beginBlock(EndBlock, 0, 2 * sizeof(uint64_t), &bufPos)) {
+                writeValue(payload, uint64_t(m_regions->size()));
+                writeValue(payload + sizeof(uint64_t), m_runCount);
+                m_regions = nullptr;
+                m_stage = IdleStage;
+            } else {
+                wrote = false;
+            }
+            break;
+        case IdleStage:
+            m_bytesExported += bufPos;
+            return make_pair(m_buffer.data(), bufPos);
+        }
+        if (!wrote) {
+            // buffer is full (enough)
+            assert(bufPos);
+            m_bytesExported += bufPos;
+            return make_pair(m_buffer.data(), bufPos);
+        }
+    }
+}
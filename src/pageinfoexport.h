@@ -0,0 +1,153 @@
+/*
+  pageinfoexport.h
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PAGEINFOEXPORT_H
+#define PAGEINFOEXPORT_H
+
+#include "pageinfo.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ Export format (memstat --export), for analysing snapshots of many processes with other tools
+
+ A snapshot is stored column by column in blocks of rows, so that a reader can load one column, e.g.
+ the RSS of all regions, without parsing the rest. Blocks are written one chunk at a time, so exporting
+ takes a fixed amount of memory on top of the capture however large the process is.
+
+ All values are little endian and aligned to their size. The file starts with a header:
+    char magic[8] = "QMSTCOL" (including the terminating zero)
+    uint32_t version
+    uint32_t page size
+    uint32_t PID
+    uint32_t number f of MappingStats fields, MappingStats::FieldCount
+    uint64_t time of capture in nanoseconds since the Unix epoch
+ followed by blocks:
+    uint32_t BlockType
+    uint32_t number n of rows
+    uint64_t payload size in bytes, a multiple of 8 (header not included)
+    payload: one column after the other, each padded to a multiple of 8 bytes
+
+ Block payloads:
+    StringsBlock - backing file names, numbered from 1 on in order over all StringsBlocks. Each name
+                   comes before the first region that uses it, and only once.
+        uint32_t length[n]
+        char[sum of lengths], not zero terminated
+    RegionsBlock - regions in ascending address order, continuing the previous RegionsBlock
+        uint64_t MappedRegion::start[n]
+        uint64_t MappedRegion::end[n]
+        uint64_t number of runs[n]
+        uint32_t backing file number[n], 0 for none
+        f times, in the order of MappingStats::Field
+            uint64_t MappingStats::bytes[n]
+    RunsBlock - only with runs: the runs of all regions (see MappedRegion), in the order of the
+                regions and continuing the previous RunsBlock. Each run is a run-length encoded
+                combination of use count and flags, with as many runs per region as its run count.
+        uint64_t number of pages[n]
+        uint32_t use count[n]
+        uint32_t combined flags[n]
+    EndBlock - the last block; files without one are incomplete
+        uint64_t number of regions
+        uint64_t number of runs, 0 without runs
+
+ All RegionsBlocks come before the first RunsBlock.
+ */
+
+namespace PageInfoExport
+{
+    static const char magic[] = "QMSTCOL";
+    static const size_t magicLength = 8;
+    static const uint32_t version = 1;
+    static const size_t headerSize = magicLength + 4 * sizeof(uint32_t) + sizeof(uint64_t);
+    static const size_t blockHeaderSize = 2 * sizeof(uint32_t) + sizeof(uint64_t);
+
+    enum BlockType {
+        StringsBlock = 1,
+        RegionsBlock,
+        RunsBlock,
+        EndBlock
+    };
+}
+
+// Writes the export format like PageInfoSerializer writes frames: in chunks of at most chunkSize bytes,
+// each with whole blocks, which the caller writes out before asking for the next one
+class PageInfoExporter
+{
+public:
+    static const size_t defaultChunkSize = 64 * 1024;
+
+    // chunkSize is at least defaultChunkSize / 4, so that the longest backing file name fits
+    explicit PageInfoExporter(size_t chunkSize = defaultChunkSize);
+
+    // regions must stay unchanged until exportMore() returns an empty chunk. timestamp: nanoseconds since
+    // the Unix epoch. With withRuns false, only the regions and their stats are exported.
+    void begin(const std::vector<MappedRegion> &regions, uint32_t pid, uint64_t timestamp, bool withRuns);
+    // The export is done when the returned chunk is empty
+    std::pair<const char*, size_t> exportMore();
+
+    // what was exported so far
+    size_t backingFileCount() const { return m_backingFileIds.size(); }
+    uint64_t runCount() const { return m_runCount; }
+    uint64_t bytesExported() const { return m_bytesExported; }
+
+private:
+    enum Stage {
+        HeaderStage,
+        RegionsStage,
+        RunsStage,
+        EndStage,
+        IdleStage
+    };
+
+    char *beginBlock(PageInfoExport::BlockType type, uint32_t rowCount, size_t payloadSize, size_t *bufPos);
+    bool writeRegions(size_t *bufPos);
+    bool writeRuns(size_t *bufPos);
+    size_t chunkSize() const { return m_buffer.size(); }
+
+    Stage m_stage;
+    const std::vector<MappedRegion> *m_regions;
+    uint32_t m_pid;
+    uint64_t m_timestamp;
+    bool m_withRuns;
+    size_t m_region; // next region to write in RegionsStage, region of the next run in RunsStage
+    size_t m_run; // next run of m_region to write
+    uint64_t m_runCount;
+    uint64_t m_bytesExported;
+    std::map<std::string, uint32_t> m_backingFileIds;
+    // of the regions in the block being written, and the names that it adds
+    std::vector<uint32_t> m_blockIds;
+    std::vector<const std::string *> m_blockNames;
+    std::vector<char> m_buffer; // blocks are never split between chunks
+};
+
+#endif // PAGEINFOEXPORT_H
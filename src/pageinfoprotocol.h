@@ -0,0 +1,310 @@
+/*
+  pageinfoprotocol.h
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PAGEINFOPROTOCOL_H
+#define PAGEINFOPROTOCOL_H
+
+#include "pageinfo.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+/*
+ Wire format between memstat --server (PageInfoSerializer) and qmemstat --client (PageInfoReader)
+
+ The connection starts with a handshake:
+    char magic[8] = "QMEMSTAT" (no terminating zero)
+    uint32_t version
+    uint32_t reserved, zero
+
+ followed by records, each of which is at most maxRecordSize bytes long:
+    uint32_t type (RecordType)
+    uint32_t payload length in bytes (always a multiple of 4, header not included)
+    payload
+
+ The pages of a region are sent as runs like in MappedRegion, each run taking runSize bytes:
+    uint64_t number of pages in the run
+    uint32_t use count
+    uint32_t combined flags
+
+ Record payloads:
+    FrameStartRecord
+        uint32_t FrameKind. A keyframe has only RegionRecords, i.e. it doesn't depend on previous frames.
+        uint32_t number of regions in the frame
+    RegionRecord - a region that is not in the previous frame, its runs follow in RunDataRecords
+        uint32_t region id
+        uint32_t reserved, zero
+        uint64_t MappedRegion::start
+        uint64_t MappedRegion::end
+        uint64_t number of runs
+        uint32_t backingFile.length()
+        char[backingFile.length()]
+        padding to next uint32_t (4 byte boundary)
+    RegionRefRecord - a region with the same id, start, end and backing file as in the previous frame.
+                      Changes to its runs follow in RunEditRecords; no RunEditRecords: no changes.
+        uint32_t region id
+        uint32_t reserved, zero
+        uint64_t number of runs after the changes
+    RunDataRecord - runs of a region from a RegionRecord, appended to the runs received so far
+        uint32_t region id
+        uint32_t reserved, zero
+        runs[]
+    RunEditRecord - changes to the runs of a region from a RegionRefRecord
+        uint32_t region id
+        uint32_t reserved, zero
+        repeat
+            uint32_t count of runs from the previous frame to keep
+            uint32_t count of runs from the previous frame to drop after those
+            uint32_t count n of new runs to insert after those
+            runs[n]
+        The edits of all RunEditRecords of a region are applied in sequence, and the runs of the
+        previous frame that remain after the last edit are kept.
+    MappingStatsRecord - the MappedRegion::stats of a region, after its runs. Always sent for regions
+                         from a RegionRecord; for those from a RegionRefRecord only when they changed,
+                         which can only happen together with RunEditRecords.
+        uint32_t region id
+        uint32_t number n of fields, MappingStats::FieldCount
+        uint64_t bytes[n], in the order of MappingStats::Field
+    FrameEndRecord - empty; all regions of the frame have been sent
+    StatsRecord - between frames: what capturing and serializing the previous frame cost
+        uint32_t number n of phases, CaptureStats::PhaseCount
+        uint32_t 1 if the capture was incremental, else 0
+        n times, in the order of CaptureStats::Phase
+            uint64_t nanoseconds
+            uint64_t system calls
+            uint64_t bytes read
+
+ Data records apply to the region of the last RegionRecord or RegionRefRecord. Regions of a frame are
+ sent in ascending address order; regions that are not sent in a frame are gone. The region and run
+ counts allow the receiver to allocate memory up front.
+
+ The client sends records with the same header to the server:
+    ReadyRecord - empty; the client is done with (e.g. has displayed) the last frame it received.
+                  The server sends the next frame only after that, so a client that is slow to
+                  render doesn't get frames queued up.
+    FilterRecord - send only what passes this CaptureFilter from the next frame on, instead of what
+                   passes the filter that the server was started with. From then on, the client
+                   gets frames of its own, like with a ViewRecord. The server captures what all
+                   clients want if they want the same, otherwise everything, and cuts it down with
+                   filterRegions() (pageinfo.h) for each client. The last one applies.
+        uint32_t CaptureFilter::Kind
+        uint32_t number n of address ranges
+        n times
+            uint64_t start
+            uint64_t end
+        uint32_t backingFilePattern.length()
+        char[backingFilePattern.length()]
+        padding to next uint32_t (4 byte boundary)
+    ViewRecord - the client shows only part of the address space, at a zoom level (see RegionSummary),
+                 and wants a frame at most every interval milliseconds. From the next frame on, the
+                 client gets frames of its own, made with viewOfRegion() (pagesummary.h): all regions
+                 with their exact MappingStatsRecords, but with runs only for the tiles in the window.
+                 Sent again whenever the view changes; the last one applies.
+        uint64_t start of the address window
+        uint64_t end of the address window
+        uint32_t zoom level
+        uint32_t interval in milliseconds, 0 for as often as the server updates
+ Unknown record types from clients are ignored.
+
+ there is no endianness flag - little endian is used because it's the only endianness of x86 and
+ the default endianness on ARM
+ */
+
+namespace PageInfoProtocol
+{
+    static const char magic[] = "QMEMSTAT";
+    static const size_t magicLength = 8;
+    static const size_t handshakeSize = magicLength + 2 * sizeof(uint32_t);
+    // version 1 was the unversioned format of QMemstat 1.0, version 2 sent a value for each page,
+    // version 3 had no run counts, version 4 had no ReadyRecord, version 5 had no StatsRecord,
+    // version 6 had no MappingStatsRecord, version 7 had no FilterRecord, version 8 had no ViewRecord,
+    // version 9 had no idle page phase and field in StatsRecord and MappingStatsRecord
+    static const uint32_t version = 10;
+
+    enum RecordType {
+        FrameStartRecord = 1,
+        RegionRecord,
+        RegionRefRecord,
+        RunDataRecord,
+        RunEditRecord,
+        FrameEndRecord,
+        StatsRecord,
+        MappingStatsRecord
+    };
+
+    // sent from client to server
+    enum ClientRecordType {
+        ReadyRecord = 1,
+        FilterRecord,
+        ViewRecord
+    };
+
+    enum FrameKind {
+        Keyframe = 0,
+        DeltaFrame
+    };
+
+    static const size_t recordHeaderSize = 2 * sizeof(uint32_t);
+    static const size_t maxRecordSize = 16 * 1024; // must be > size of RegionRecord with longest string
+    // region id, reserved
+    static const size_t dataRecordHeaderSize = 2 * sizeof(uint32_t);
+    static const size_t runSize = sizeof(uint64_t) + 2 * sizeof(uint32_t);
+    // keep, drop and insert counts
+    static const size_t runEditSize = 3 * sizeof(uint32_t);
+    static const size_t statsRecordSize = 2 * sizeof(uint32_t) + CaptureStats::PhaseCount * 3 * sizeof(uint64_t);
+    static const size_t mappingStatsRecordSize = 2 * sizeof(uint32_t) + MappingStats::FieldCount * sizeof(uint64_t);
+    static const size_t viewRecordSize = 2 * sizeof(uint64_t) + 2 * sizeof(uint32_t);
+
+    // the payload of a ViewRecord
+    struct View
+    {
+        uint64_t start = 0;
+        uint64_t end = 0;
+        uint32_t zoomLevel = 0;
+        uint32_t interval = 0;
+        bool operator==(const View &other) const
+        {
+            return start == other.start && end == other.end && zoomLevel == other.zoomLevel &&
+                   interval == other.interval;
+        }
+        bool operator!=(const View &other) const { return !(*this == other); }
+    };
+
+    inline void writeHandshake(char *buffer)
+    {
+        const uint32_t versionAndReserved[2] = { version, 0 };
+        memcpy(buffer, magic, magicLength);
+        memcpy(buffer + magicLength, versionAndReserved, sizeof(versionAndReserved));
+    }
+
+    // writes a record without payload, i.e. just the record header
+    inline void writeEmptyRecord(char *buffer, uint32_t type)
+    {
+        const uint32_t header[2] = { type, 0 };
+        memcpy(buffer, header, sizeof(header));
+    }
+
+    inline size_t paddedStringSize(size_t length)
+    {
+        // length field, then characters rounded up to next multiple of 4 / sizeof(uint32_t)
+        return sizeof(uint32_t) + ((length + sizeof(uint32_t) - 1) & ~size_t(0x3));
+    }
+
+    // appends a complete FilterRecord; false if it would be larger than maxRecordSize
+    inline bool writeFilterRecord(const CaptureFilter &filter, std::vector<char> *buffer)
+    {
+        const size_t rangesSize = filter.addressRanges.size() * 2 * sizeof(uint64_t);
+        const size_t payloadSize = 2 * sizeof(uint32_t) + rangesSize + paddedStringSize(filter.backingFilePattern.length());
+        if (recordHeaderSize + payloadSize > maxRecordSize) {
+            return false;
+        }
+        const size_t pos = buffer->size();
+        buffer->resize(pos + recordHeaderSize + payloadSize, 0);
+        char *out = buffer->data() + pos;
+        const uint32_t header[4] = { FilterRecord, uint32_t(payloadSize), uint32_t(filter.kind),
+                                     uint32_t(filter.addressRanges.size()) };
+        memcpy(out, header, sizeof(header));
+        out += sizeof(header);
+        for (const std::pair<uint64_t, uint64_t> &range : filter.addressRanges) {
+            const uint64_t startAndEnd[2] = { range.first, range.second };
+            memcpy(out, startAndEnd, sizeof(startAndEnd));
+            out += sizeof(startAndEnd);
+        }
+        const uint32_t patternLength = filter.backingFilePattern.length();
+        memcpy(out, &patternLength, sizeof(patternLength));
+        memcpy(out + sizeof(patternLength), filter.backingFilePattern.data(), patternLength);
+        return true;
+    }
+
+    // writes a complete ViewRecord, recordHeaderSize + viewRecordSize bytes
+    inline void writeViewRecord(const View &view, char *buffer)
+    {
+        const uint32_t header[2] = { ViewRecord, uint32_t(viewRecordSize) };
+        const uint64_t window[2] = { view.start, view.end };
+        const uint32_t zoomAndInterval[2] = { view.zoomLevel, view.interval };
+        memcpy(buffer, header, sizeof(header));
+        memcpy(buffer + sizeof(header), window, sizeof(window));
+        memcpy(buffer + sizeof(header) + sizeof(window), zoomAndInterval, sizeof(zoomAndInterval));
+    }
+
+    // returns false if the payload of a ViewRecord is invalid
+    inline bool readViewRecord(const char *payload, size_t size, View *view)
+    {
+        if (size != viewRecordSize) {
+            return false;
+        }
+        uint64_t window[2];
+        uint32_t zoomAndInterval[2];
+        memcpy(window, payload, sizeof(window));
+        memcpy(zoomAndInterval, payload + sizeof(window), sizeof(zoomAndInterval));
+        if (window[1] < window[0]) {
+            return false;
+        }
+        view->start = window[0];
+        view->end = window[1];
+        view->zoomLevel = zoomAndInterval[0];
+        view->interval = zoomAndInterval[1];
+        return true;
+    }
+
+    // returns false if the payload of a FilterRecord is invalid
+    inline bool readFilterRecord(const char *payload, size_t size, CaptureFilter *filter)
+    {
+        uint32_t kindAndCount[2];
+        if (size < sizeof(kindAndCount)) {
+            return false;
+        }
+        memcpy(kindAndCount, payload, sizeof(kindAndCount));
+        const size_t rangesSize = size_t(kindAndCount[1]) * 2 * sizeof(uint64_t);
+        if (kindAndCount[0] > CaptureFilter::FileOnly || size < sizeof(kindAndCount) + rangesSize + sizeof(uint32_t)) {
+            return false;
+        }
+        CaptureFilter ret;
+        ret.kind = CaptureFilter::Kind(kindAndCount[0]);
+        const char *in = payload + sizeof(kindAndCount);
+        for (uint32_t i = 0; i < kindAndCount[1]; i++) {
+            uint64_t startAndEnd[2];
+            memcpy(startAndEnd, in, sizeof(startAndEnd));
+            in += sizeof(startAndEnd);
+            ret.addressRanges.push_back(std::make_pair(startAndEnd[0], startAndEnd[1]));
+        }
+        uint32_t patternLength;
+        memcpy(&patternLength, in, sizeof(patternLength));
+        if (size < size_t(in - payload) + paddedStringSize(patternLength)) {
+            return false;
+        }
+        ret.backingFilePattern.assign(in + sizeof(patternLength), patternLength);
+        *filter = std::move(ret);
+        return true;
+    }
+}
+
+#endif // PAGEINFOPROTOCOL_H
@@ -0,0 +1,420 @@
+/*
+  pageinforeader.cpp
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pageinforeader.h"
+
+#include "pageinfoprotocol.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+using namespace std;
+
+template<typename T>
+static T readValue(const char *src)
+{
+    T ret;
+    memcpy(&ret, src, sizeof(T));
+    return ret;
+}
+
+PageInfoReader::PageInfoReader()
+   : m_handshakeDone(false),
+     m_hasCaptureStats(false),
+     m_inFrame(false),
+     m_nextRefSearchPos(0),
+     m_regionIsRef(false),
+     m_regionRunCount(0),
+     m_builtPages(0),
+     m_previousRun(0)
+{
+    m_partial.reserve(PageInfoProtocol::maxRecordSize);
+}
+
+void PageInfoReader::setError(const string &error)
+{
+    if (m_error.empty()) {
+        m_error = error;
+    }
+    m_partial.clear();
+}
+
+// the size of the handshake or record starting at unit; if not enough is available to tell, the size
+// that is needed to tell. Zero on error.
+size_t PageInfoReader::unitSize(const char *unit, size_t available)
+{
+    using namespace PageInfoProtocol;
+    if (!m_handshakeDone) {
+        return handshakeSize;
+    }
+    if (available < recordHeaderSize) {
+        return recordHeaderSize;
+    }
+    const uint32_t length = readValue<uint32_t>(unit + sizeof(uint32_t));
+    if (length % sizeof(uint32_t) || length > maxRecordSize - recordHeaderSize) {
+        setError("Invalid record size received.");
+        return 0;
+    }
+    return recordHeaderSize + length;
+}
+
+bool PageInfoReader::addData(const char *data, size_t size)
+{
+    using namespace PageInfoProtocol;
+    const char *const end = data + size;
+    bool ret = false;
+
+    // Process complete records where they are, only collect records that arrive in pieces in m_partial.
+    // It is not guaranteed that there is one or less record per chunk of data received, so keep looping.
+    while (!hasError()) {
+        if (m_partial.empty() && data == end) {
+            break;
+        }
+        const bool isPartial = !m_partial.empty();
+        const char *const unit = isPartial ? m_partial.data() : data;
+        const size_t available = isPartial ? m_partial.size() : size_t(end - data);
+        const size_t needed = unitSize(unit, available);
+        if (!needed) {
+            break;
+        }
+        if (available < needed) {
+            if (data == end) {
+                break;
+            }
+            const size_t take = isPartial ? min(needed - available, size_t(end - data)) : available;
+            m_partial.insert(m_partial.end(), data, data + take);
+            data += take;
+            continue;
+        }
+
+        if (!m_handshakeDone) {
+            if (memcmp(unit, magic, magicLength) != 0) {
+                setError("Server does not speak the QMemstat protocol, or an older version of it.");
+                break;
+            }
+            const uint32_t serverVersion = readValue<uint32_t>(unit + magicLength);
+            if (serverVersion != version) {
+                setError("Server protocol version is " + to_string(serverVersion) + ", expected "
+                         + to_string(version) + ".");
+                break;
+            }
+            m_handshakeDone = true;
+        } else {
+            ret = processRecord(readValue<uint32_t>(unit), unit + recordHeaderSize,
+                                needed - recordHeaderSize) || ret;
+        }
+
+        if (isPartial) {
+            m_partial.clear();
+        } else {
+            data += needed;
+        }
+    }
+    return ret;
+}
+
+shared_ptr<MappedRegion> PageInfoReader::newRegion(uint64_t runCount)
+{
+    shared_ptr<MappedRegion> ret;
+    if (m_spareRegions.empty()) {
+        ret = make_shared<MappedRegion>();
+    } else {
+        ret = move(m_spareRegions.back());
+        m_spareRegions.pop_back();
+    }
+    ret->runStarts.reserve(runCount);
+    ret->useCounts.reserve(runCount);
+    ret->combinedFlags.reserve(runCount);
+    return ret;
+}
+
+bool PageInfoReader::processRecord(uint32_t type, const char *payload, size_t length)
+{
+    using namespace PageInfoProtocol;
+
+    if (!m_inFrame && type != FrameStartRecord && type != StatsRecord) {
+        setError("Received data outside of a frame.");
+        return false;
+    }
+    if ((type == RegionRecord || type == RegionRefRecord || type == FrameEndRecord) && !finishRegion()) {
+        setError("Received inconsistent region data.");
+        return false;
+    }
+
+    switch (type) {
+    case FrameStartRecord: {
+        if (m_inFrame || length < 2 * sizeof(uint32_t)) {
+            break;
+        }
+        m_inFrame = true;
+        if (readValue<uint32_t>(payload) == Keyframe) {
+            m_regionIds.clear(); // a keyframe must not refer to previous frames
+        }
+        // Regions of the frame before the previous one that didn't make it into the previous one
+        // are now only used by us if the snapshot user has switched to the previous frame.
+        m_spareRegions.clear();
+        for (shared_ptr<const MappedRegion> &retired : m_retiredRegions) {
+            if (retired.use_count() == 1) {
+                // we have created all regions as non-const, so this is safe
+                shared_ptr<MappedRegion> spare = const_pointer_cast<MappedRegion>(move(retired));
+                spare->clearPages();
+                m_spareRegions.push_back(move(spare));
+            }
+        }
+        m_retiredRegions.clear();
+
+        const uint32_t regionCount = readValue<uint32_t>(payload + sizeof(uint32_t));
+        m_frameRegions.clear();
+        m_frameRegionIds.clear();
+        m_frameRegions.reserve(regionCount);
+        m_frameRegionIds.reserve(regionCount);
+        m_nextRefSearchPos = 0;
+        return false;
+    }
+    case RegionRecord: {
+        if (length < 2 * sizeof(uint32_t) + 3 * sizeof(uint64_t) + sizeof(uint32_t)) {
+            break;
+        }
+        const uint32_t id = readValue<uint32_t>(payload);
+        const uint64_t start = readValue<uint64_t>(payload + 8);
+        const uint64_t end = readValue<uint64_t>(payload + 16);
+        m_regionRunCount = readValue<uint64_t>(payload + 24);
+        const uint32_t stringLength = readValue<uint32_t>(payload + 32);
+        if (end < start || m_regionRunCount > (end - start) / PageInfo::pageSize ||
+            paddedStringSize(stringLength) > length - 32) {
+            break;
+        }
+        m_region = newRegion(m_regionRunCount);
+        m_region->start = start;
+        m_region->end = end;
+        m_region->backingFile.assign(payload + 36, stringLength);
+        m_frameRegions.push_back(m_region);
+        m_frameRegionIds.push_back(id);
+        m_regionIsRef = false;
+        m_builtPages = 0;
+        return false;
+    }
+    case RegionRefRecord: {
+        if (length < 2 * sizeof(uint32_t) + sizeof(uint64_t)) {
+            break;
+        }
+        const uint32_t id = readValue<uint32_t>(payload);
+        m_regionRunCount = readValue<uint64_t>(payload + 8);
+        size_t i = m_nextRefSearchPos;
+        while (i < m_regionIds.size() && m_regionIds[i] != id) {
+            i++;
+        }
+        if (i >= m_regionIds.size()) {
+            setError("Received reference to unknown region.");
+            return false;
+        }
+        m_previousRegion = m_mappedRegions[i];
+        m_previousRun = 0;
+        if (m_regionRunCount > m_previousRegion->pageCount()) {
+            break;
+        }
+        // shared with the previous frame unless there are RunEditRecords
+        m_frameRegions.push_back(m_previousRegion);
+        m_frameRegionIds.push_back(id);
+        m_nextRefSearchPos = i + 1;
+        m_regionIsRef = true;
+        return false;
+    }
+    case RunDataRecord:
+    case RunEditRecord:
+        if (length < dataRecordHeaderSize || m_frameRegions.empty() ||
+            readValue<uint32_t>(payload) != m_frameRegionIds.back() ||
+            m_regionIsRef != (type == RunEditRecord)) {
+            break;
+        }
+        payload += dataRecordHeaderSize;
+        length -= dataRecordHeaderSize;
+        if (!(type == RunDataRecord ? addRuns(payload, length) : editRuns(payload, length))) {
+            break;
+        }
+        return false;
+    case MappingStatsRecord:
+        // only for regions whose runs have been received, see pageinfoprotocol.h
+        if (!m_region || length != mappingStatsRecordSize ||
+            readValue<uint32_t>(payload) != m_frameRegionIds.back() || !readMappingStats(payload, length)) {
+            break;
+        }
+        return false;
+    case FrameEndRecord:
+        m_inFrame = false;
+        m_retiredRegions.swap(m_mappedRegions);
+        m_mappedRegions.swap(m_frameRegions);
+        m_regionIds.swap(m_frameRegionIds);
+        m_frameRegions.clear();
+        m_frameRegionIds.clear();
+        return true;
+    case StatsRecord:
+        if (m_inFrame || !readCaptureStats(payload, length)) {
+            break;
+        }
+        return false;
+    default:
+        // unknown record types are reserved for compatible extensions, ignore them
+        return false;
+    }
+
+    if (!hasError()) {
+        setError("Received invalid record.");
+    }
+    return false;
+}
+
+bool PageInfoReader::readCaptureStats(const char *payload, size_t length)
+{
+    using namespace PageInfoProtocol;
+    if (length != statsRecordSize || readValue<uint32_t>(payload) != CaptureStats::PhaseCount) {
+        return false;
+    }
+    m_captureStats.incremental = readValue<uint32_t>(payload + 4) != 0;
+    payload += 2 * sizeof(uint32_t);
+    for (size_t i = 0; i < CaptureStats::PhaseCount; i++) {
+        m_captureStats.nanoseconds[i] = readValue<uint64_t>(payload);
+        m_captureStats.syscalls[i] = readValue<uint64_t>(payload + 8);
+        m_captureStats.bytesRead[i] = readValue<uint64_t>(payload + 16);
+        payload += 3 * sizeof(uint64_t);
+    }
+    m_hasCaptureStats = true;
+    return true;
+}
+
+bool PageInfoReader::readMappingStats(const char *payload, size_t length)
+{
+    using namespace PageInfoProtocol;
+    if (length != mappingStatsRecordSize || readValue<uint32_t>(payload + 4) != MappingStats::FieldCount) {
+        return false;
+    }
+    payload += 2 * sizeof(uint32_t);
+    for (size_t i = 0; i < MappingStats::FieldCount; i++) {
+        m_region->stats.bytes[i] = readValue<uint64_t>(payload + i * sizeof(uint64_t));
+    }
+    return true;
+}
+
+bool PageInfoReader::appendRun(uint64_t pageCount, uint32_t useCount, uint32_t flags)
+{
+    if (!pageCount || pageCount > m_region->pageCount() - m_builtPages ||
+        m_region->runCount() >= m_regionRunCount) {
+        return false;
+    }
+    m_region->runStarts.push_back(m_builtPages);
+    m_region->useCounts.push_back(useCount);
+    m_region->combinedFlags.push_back(flags);
+    m_builtPages += pageCount;
+    return true;
+}
+
+bool PageInfoReader::keepPreviousRuns(uint64_t count)
+{
+    const MappedRegion &previous = *m_previousRegion;
+    if (count > previous.runCount() - m_previousRun) {
+        return false;
+    }
+    for (const size_t end = m_previousRun + count; m_previousRun < end; m_previousRun++) {
+        if (!appendRun(previous.runEnd(m_previousRun) - previous.runStarts[m_previousRun],
+                       previous.useCounts[m_previousRun], previous.combinedFlags[m_previousRun])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// reads runs, see pageinfoprotocol.h
+bool PageInfoReader::addRuns(const char *payload, size_t length)
+{
+    using namespace PageInfoProtocol;
+    if (length % runSize) {
+        return false;
+    }
+    for (const char *in = payload; in < payload + length; in += runSize) {
+        if (!appendRun(readValue<uint64_t>(in), readValue<uint32_t>(in + sizeof(uint64_t)),
+                       readValue<uint32_t>(in + sizeof(uint64_t) + sizeof(uint32_t)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PageInfoReader::editRuns(const char *payload, size_t length)
+{
+    using namespace PageInfoProtocol;
+    if (!m_region) {
+        // first edit of the region: build a new version from the previous one and the edits
+        m_region = newRegion(m_regionRunCount);
+        m_region->start = m_previousRegion->start;
+        m_region->end = m_previousRegion->end;
+        m_region->backingFile = m_previousRegion->backingFile;
+        m_region->stats = m_previousRegion->stats; // unless a MappingStatsRecord follows
+        m_frameRegions.back() = m_region;
+        m_builtPages = 0;
+    }
+
+    const char *in = payload;
+    const char *const end = payload + length;
+    while (in < end) {
+        if (size_t(end - in) < runEditSize) {
+            return false;
+        }
+        const uint32_t keep = readValue<uint32_t>(in);
+        const uint32_t drop = readValue<uint32_t>(in + sizeof(uint32_t));
+        const uint32_t count = readValue<uint32_t>(in + 2 * sizeof(uint32_t));
+        in += runEditSize;
+        if (!keepPreviousRuns(keep) || drop > m_previousRegion->runCount() - m_previousRun ||
+            size_t(end - in) < count * runSize) {
+            return false;
+        }
+        m_previousRun += drop;
+        if (!addRuns(in, count * runSize)) {
+            return false;
+        }
+        in += count * runSize;
+    }
+    return true;
+}
+
+// completes the region received last, if any; returns false if its data is inconsistent
+bool PageInfoReader::finishRegion()
+{
+    bool ok = true;
+    if (m_region) {
+        if (m_regionIsRef) {
+            ok = keepPreviousRuns(m_previousRegion->runCount() - m_previousRun);
+        }
+        ok = ok && m_builtPages == m_region->pageCount() && m_region->runCount() == m_regionRunCount;
+    } else if (m_previousRegion) {
+        ok = m_previousRegion->runCount() == m_regionRunCount;
+    }
+    m_region.reset();
+    m_previousRegion.reset();
+    return ok;
+}
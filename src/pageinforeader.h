@@ -0,0 +1,101 @@
+/*
+  pageinforeader.h
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PAGEINFOREADER_H
+#define PAGEINFOREADER_H
+
+#include "pageinfo.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Reads the output of PageInfoSerializer, see pageinfoprotocol.h
+// Data is parsed directly from the buffers passed to addData(), and the storage of regions that are
+// not used anymore is reused, so there is little copying and allocation in the steady state.
+class PageInfoReader
+{
+public:
+    PageInfoReader();
+    // returns true when a new frame was just completed
+    bool addData(const char *data, size_t size);
+    // the last complete frame; adding data doesn't change the regions of a snapshot
+    const MappedRegionSnapshot &mappedRegions() const { return m_mappedRegions; }
+    // the cost of capturing the last frame on the server, if the server has sent it yet
+    bool hasCaptureStats() const { return m_hasCaptureStats; }
+    const CaptureStats &captureStats() const { return m_captureStats; }
+    // after an error, no more data is accepted
+    bool hasError() const { return !m_error.empty(); }
+    const std::string &errorString() const { return m_error; }
+
+private:
+    size_t unitSize(const char *unit, size_t available);
+    // returns true when a frame was completed
+    bool processRecord(uint32_t type, const char *payload, size_t length);
+    std::shared_ptr<MappedRegion> newRegion(uint64_t runCount);
+    bool addRuns(const char *payload, size_t length);
+    bool editRuns(const char *payload, size_t length);
+    bool appendRun(uint64_t pageCount, uint32_t useCount, uint32_t flags);
+    bool keepPreviousRuns(uint64_t count);
+    bool finishRegion();
+    bool readCaptureStats(const char *payload, size_t length);
+    bool readMappingStats(const char *payload, size_t length);
+    void setError(const std::string &error);
+
+    bool m_handshakeDone;
+    std::string m_error;
+    std::vector<char> m_partial; // the handshake or a record that has been received partially
+
+    MappedRegionSnapshot m_mappedRegions;
+    std::vector<uint32_t> m_regionIds; // of m_mappedRegions
+    bool m_hasCaptureStats;
+    CaptureStats m_captureStats;
+
+    // the frame being received
+    bool m_inFrame;
+    MappedRegionSnapshot m_frameRegions;
+    std::vector<uint32_t> m_frameRegionIds;
+    size_t m_nextRefSearchPos; // region references are in address order, so search from the last one
+
+    // the last region of the frame, if its runs are being received from RunData- or RunEditRecords
+    std::shared_ptr<MappedRegion> m_region;
+    bool m_regionIsRef; // whether the last region came from a RegionRefRecord
+    uint64_t m_regionRunCount;
+    uint64_t m_builtPages;
+    // for RegionRefRecords: the region in the previous frame, and the next run of it to keep or drop
+    std::shared_ptr<const MappedRegion> m_previousRegion;
+    size_t m_previousRun;
+
+    // regions of earlier frames; their storage is reused once no snapshot contains them anymore
+    std::vector<std::shared_ptr<const MappedRegion>> m_retiredRegions;
+    std::vector<std::shared_ptr<MappedRegion>> m_spareRegions;
+};
+
+#endif // PAGEINFOREADER_H
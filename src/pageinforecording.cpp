@@ -0,0 +1,488 @@
+/*
+  pageinforecording.cpp
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pageinforecording.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+static const char magic[] = "QMSTREC";
+static const uint32_t version = 1;
+
+enum BlockType {
+    RunsBlock = 1,
+    StringBlock,
+    FrameBlock,
+    IndexBlock
+};
+
+static const size_t fileHeaderSize = sizeof(magic) + 2 * sizeof(uint32_t) + sizeof(uint64_t);
+static const size_t indexOffsetPos = sizeof(magic) + 2 * sizeof(uint32_t);
+static const size_t blockHeaderSize = 2 * sizeof(uint32_t) + sizeof(uint64_t);
+static const size_t regionEntrySize = 4 * sizeof(uint64_t);
+
+template<typename T>
+static void appendValue(vector<char> *buffer, T value)
+{
+    const char *const data = reinterpret_cast<const char *>(&value);
+    buffer->insert(buffer->end(), data, data + sizeof(T));
+}
+
+template<typename T>
+static void appendArray(vector<char> *buffer, const vector<T> &values)
+{
+    const char *const data = reinterpret_cast<const char *>(values.data());
+    buffer->insert(buffer->end(), data, data + values.size() * sizeof(T));
+}
+
+static void padTo8(vector<char> *buffer)
+{
+    buffer->resize((buffer->size() + 7) & ~size_t(7), 0);
+}
+
+template<typename T>
+static T readValue(const char *source)
+{
+    T ret;
+    memcpy(&ret, source, sizeof(T));
+    return ret;
+}
+
+static bool writeAll(int fd, const char *data, size_t size)
+{
+    while (size) {
+        const ssize_t written = write(fd, data, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+PageInfoRecorder::PageInfoRecorder()
+   : m_fd(-1),
+     m_ok(false),
+     m_fileSize(0)
+{
+}
+
+PageInfoRecorder::~PageInfoRecorder()
+{
+    finish();
+}
+
+bool PageInfoRecorder::open(const string &fileName)
+{
+    assert(m_fd < 0);
+    m_fd = ::open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+        return false;
+    }
+    vector<char> header(magic, magic + sizeof(magic));
+    appendValue(&header, version);
+    appendValue(&header, uint32_t(PageInfo::pageSize));
+    appendValue(&header, uint64_t(0)); // no index yet
+    assert(header.size() == fileHeaderSize);
+    m_ok = writeAll(m_fd, header.data(), header.size());
+    m_fileSize = header.size();
+    return m_ok;
+}
+
+bool PageInfoRecorder::writeBlock(uint32_t type, const vector<char> &payload, uint64_t *offset)
+{
+    assert(payload.size() % 8 == 0);
+    char header[blockHeaderSize];
+    const uint32_t typeAndReserved[2] = { type, 0 };
+    const uint64_t size = payload.size();
+    memcpy(header, typeAndReserved, sizeof(typeAndReserved));
+    memcpy(header + sizeof(typeAndReserved), &size, sizeof(size));
+    m_ok = m_ok && writeAll(m_fd, header, sizeof(header)) && writeAll(m_fd, payload.data(), payload.size());
+    *offset = m_fileSize;
+    m_fileSize += sizeof(header) + payload.size();
+    return m_ok;
+}
+
+uint64_t PageInfoRecorder::writeBackingFile(const string &backingFile)
+{
+    if (backingFile.empty()) {
+        return 0;
+    }
+    auto it = m_backingFileOffsets.find(backingFile);
+    if (it != m_backingFileOffsets.end()) {
+        return it->second;
+    }
+    m_payload.clear();
+    appendValue(&m_payload, uint64_t(backingFile.size()));
+    m_payload.insert(m_payload.end(), backingFile.begin(), backingFile.end());
+    padTo8(&m_payload);
+    uint64_t offset = 0;
+    writeBlock(StringBlock, m_payload, &offset);
+    m_backingFileOffsets[backingFile] = offset;
+    return offset;
+}
+
+uint64_t PageInfoRecorder::writeRuns(const MappedRegion &region)
+{
+    m_payload.clear();
+    appendValue(&m_payload, uint64_t(region.runCount()));
+    appendArray(&m_payload, region.runStarts);
+    appendArray(&m_payload, region.useCounts);
+    appendArray(&m_payload, region.combinedFlags);
+    padTo8(&m_payload);
+    uint64_t offset = 0;
+    writeBlock(RunsBlock, m_payload, &offset);
+    return offset;
+}
+
+static bool haveSameRuns(const MappedRegion &a, const MappedRegion &b)
+{
+    return a.runStarts == b.runStarts && a.useCounts == b.useCounts && a.combinedFlags == b.combinedFlags;
+}
+
+bool PageInfoRecorder::addFrame(const vector<MappedRegion> &regions, uint64_t timestamp)
+{
+    if (m_fd < 0 || !m_ok) {
+        return false;
+    }
+    // both lists are sorted by start address, so there is no need to search
+    m_current.resize(regions.size());
+    size_t iPrevious = 0;
+    for (size_t i = 0; i < regions.size(); i++) {
+        const MappedRegion &region = regions[i];
+        WrittenRegion &written = m_current[i];
+        while (iPrevious < m_previous.size() && m_previous[iPrevious].region.start < region.start) {
+            iPrevious++;
+        }
+        const WrittenRegion *previous = iPrevious < m_previous.size() ? &m_previous[iPrevious] : nullptr;
+        if (previous && previous->region.start == region.start && previous->region.end == region.end &&
+            previous->region.backingFile == region.backingFile && haveSameRuns(previous->region, region)) {
+            written.backingFileOffset = previous->backingFileOffset;
+            written.runsOffset = previous->runsOffset;
+        } else {
+            written.backingFileOffset = writeBackingFile(region.backingFile);
+            written.runsOffset = writeRuns(region);
+        }
+        // assignment instead of copy construction reuses the memory of the vectors
+        written.region = region;
+    }
+
+    m_payload.clear();
+    appendValue(&m_payload, timestamp);
+    appendValue(&m_payload, uint64_t(regions.size()));
+    for (const WrittenRegion &written : m_current) {
+        appendValue(&m_payload, written.region.start);
+        appendValue(&m_payload, written.region.end);
+        appendValue(&m_payload, written.backingFileOffset);
+        appendValue(&m_payload, written.runsOffset);
+    }
+    uint64_t offset = 0;
+    if (writeBlock(FrameBlock, m_payload, &offset)) {
+        m_frameOffsets.push_back(offset);
+    }
+    m_previous.swap(m_current);
+    return m_ok;
+}
+
+bool PageInfoRecorder::finish()
+{
+    if (m_fd < 0) {
+        return m_ok;
+    }
+    m_payload.clear();
+    appendValue(&m_payload, uint64_t(m_frameOffsets.size()));
+    appendArray(&m_payload, m_frameOffsets);
+    uint64_t indexOffset = 0;
+    if (writeBlock(IndexBlock, m_payload, &indexOffset)) {
+        m_ok = pwrite(m_fd, &indexOffset, sizeof(indexOffset), indexOffsetPos) == sizeof(indexOffset);
+    }
+    m_ok = (::close(m_fd) == 0) && m_ok;
+    m_fd = -1;
+    return m_ok;
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+
+PageInfoRecording::PageInfoRecording()
+   : m_data(nullptr),
+     m_size(0)
+{
+}
+
+PageInfoRecording::~PageInfoRecording()
+{
+    close();
+}
+
+void PageInfoRecording::close()
+{
+    if (m_data) {
+        munmap(const_cast<char *>(m_data), m_size);
+    }
+    m_data = nullptr;
+    m_size = 0;
+    m_frameOffsets.clear();
+    m_lastSnapshot.clear();
+    m_lastRunsOffsets.clear();
+}
+
+bool PageInfoRecording::open(const string &fileName)
+{
+    close();
+    m_error.clear();
+    const int fd = ::open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        m_error = "Could not open " + fileName + ": " + strerror(errno);
+        if (fd >= 0) {
+            ::close(fd);
+        }
+        return false;
+    }
+    if (size_t(st.st_size) < fileHeaderSize) {
+        ::close(fd);
+        m_error = fileName + " is not a QMemstat recording.";
+        return false;
+    }
+    void *const mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd); // the mapping keeps the file open
+    if (mapped == MAP_FAILED) {
+        m_error = "Could not map " + fileName + ": " + strerror(errno);
+        return false;
+    }
+    m_data = static_cast<const char *>(mapped);
+    m_size = st.st_size;
+
+    if (memcmp(m_data, magic, sizeof(magic)) != 0) {
+        m_error = fileName + " is not a QMemstat recording.";
+    } else if (readValue<uint32_t>(m_data + sizeof(magic)) != version) {
+        m_error = fileName + " was recorded by an incompatible version of QMemstat.";
+    } else if (readValue<uint32_t>(m_data + sizeof(magic) + sizeof(uint32_t)) != PageInfo::pageSize) {
+        m_error = fileName + " was recorded on a system with a different page size.";
+    } else if (!findFrames(readValue<uint64_t>(m_data + indexOffsetPos))) {
+        m_error = fileName + " is damaged.";
+    }
+    if (!m_error.empty()) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool PageInfoRecording::findFrames(uint64_t indexOffset)
+{
+    uint64_t size = 0;
+    if (indexOffset) {
+        const char *const index = block(indexOffset, IndexBlock, sizeof(uint64_t), &size);
+        if (!index) {
+            return false;
+        }
+        const uint64_t count = readValue<uint64_t>(index);
+        if (count > (size - sizeof(uint64_t)) / sizeof(uint64_t)) {
+            return false;
+        }
+        const uint64_t *const offsets = reinterpret_cast<const uint64_t *>(index + sizeof(uint64_t));
+        m_frameOffsets.assign(offsets, offsets + count);
+        return true;
+    }
+
+    // not finished, e.g. because memstat was killed: find the frames the slow way
+    uint64_t offset = fileHeaderSize;
+    while (offset + blockHeaderSize <= m_size) {
+        const uint32_t type = readValue<uint32_t>(m_data + offset);
+        if (!block(offset, type, 0, &size)) {
+            break; // incomplete, the recording ended while writing it
+        }
+        if (type == FrameBlock) {
+            m_frameOffsets.push_back(offset);
+        }
+        offset += blockHeaderSize + size;
+    }
+    return true;
+}
+
+// returns the payload of the block at offset, or nullptr if it isn't a complete block of that type
+const char *PageInfoRecording::block(uint64_t offset, uint32_t type, uint64_t minSize, uint64_t *size) const
+{
+    if (offset % 8 || offset > m_size || m_size - offset < blockHeaderSize ||
+        readValue<uint32_t>(m_data + offset) != type) {
+        return nullptr;
+    }
+    const uint64_t payloadSize = readValue<uint64_t>(m_data + offset + 2 * sizeof(uint32_t));
+    if (payloadSize % 8 || payloadSize < minSize || payloadSize > m_size - offset - blockHeaderSize) {
+        return nullptr;
+    }
+    if (size) {
+        *size = payloadSize;
+    }
+    return m_data + offset + blockHeaderSize;
+}
+
+uint64_t PageInfoRecording::frameTimestamp(size_t frame) const
+{
+    const char *const payload = frame < m_frameOffsets.size()
+                                ? block(m_frameOffsets[frame], FrameBlock, 2 * sizeof(uint64_t)) : nullptr;
+    return payload ? readValue<uint64_t>(payload) : 0;
+}
+
+const PageInfoRecording::RegionEntry *PageInfoRecording::regionEntries(size_t frame, size_t *count) const
+{
+    uint64_t size = 0;
+    const char *const payload = frame < m_frameOffsets.size()
+                                ? block(m_frameOffsets[frame], FrameBlock, 2 * sizeof(uint64_t), &size) : nullptr;
+    if (!payload) {
+        return nullptr;
+    }
+    const uint64_t regionCount = readValue<uint64_t>(payload + sizeof(uint64_t));
+    if (regionCount > (size - 2 * sizeof(uint64_t)) / regionEntrySize) {
+        return nullptr;
+    }
+    *count = regionCount;
+    return reinterpret_cast<const RegionEntry *>(payload + 2 * sizeof(uint64_t));
+}
+
+size_t PageInfoRecording::regionCount(size_t frame) const
+{
+    size_t count = 0;
+    regionEntries(frame, &count);
+    return count;
+}
+
+bool PageInfoRecording::region(size_t frame, size_t i, RegionView *view) const
+{
+    size_t count = 0;
+    const RegionEntry *const entries = regionEntries(frame, &count);
+    if (!entries || i >= count) {
+        return false;
+    }
+    const RegionEntry &entry = entries[i];
+    if (entry.end < entry.start) {
+        return false;
+    }
+    view->start = entry.start;
+    view->end = entry.end;
+
+    uint64_t size = 0;
+    view->backingFile = "";
+    view->backingFileLength = 0;
+    if (entry.backingFileOffset) {
+        const char *const string = block(entry.backingFileOffset, StringBlock, sizeof(uint64_t), &size);
+        if (!string || readValue<uint64_t>(string) > size - sizeof(uint64_t)) {
+            return false;
+        }
+        view->backingFile = string + sizeof(uint64_t);
+        view->backingFileLength = readValue<uint64_t>(string);
+    }
+
+    const char *const runs = block(entry.runsOffset, RunsBlock, sizeof(uint64_t), &size);
+    if (!runs) {
+        return false;
+    }
+    const uint64_t runCount = readValue<uint64_t>(runs);
+    // per run: a uint64_t run start and two uint32_t
+    if (runCount > (size - sizeof(uint64_t)) / (2 * sizeof(uint64_t))) {
+        return false;
+    }
+    view->runCount = runCount;
+    view->runStarts = reinterpret_cast<const uint64_t *>(runs + sizeof(uint64_t));
+    view->useCounts = reinterpret_cast<const uint32_t *>(view->runStarts + runCount);
+    view->combinedFlags = view->useCounts + runCount;
+    return true;
+}
+
+bool PageInfoRecording::hasValidRuns(const RegionView &view)
+{
+    const uint64_t pageCount = (view.end - view.start) / PageInfo::pageSize;
+    if (view.runCount == 0 || view.runStarts[0] != 0) {
+        return pageCount == 0 && view.runCount == 0;
+    }
+    for (size_t i = 1; i < view.runCount; i++) {
+        if (view.runStarts[i] <= view.runStarts[i - 1]) {
+            return false;
+        }
+    }
+    return view.runStarts[view.runCount - 1] < pageCount;
+}
+
+bool PageInfoRecording::snapshot(size_t frame, MappedRegionSnapshot *regions)
+{
+    regions->clear();
+    size_t count = 0;
+    const RegionEntry *const entries = regionEntries(frame, &count);
+    if (!entries) {
+        return false;
+    }
+    regions->reserve(count);
+    vector<uint64_t> runsOffsets;
+    runsOffsets.reserve(count);
+
+    // both the last snapshot and the frame are sorted by start address
+    size_t iLast = 0;
+    for (size_t i = 0; i < count; i++) {
+        const RegionEntry &entry = entries[i];
+        while (iLast < m_lastSnapshot.size() && m_lastSnapshot[iLast]->start < entry.start) {
+            iLast++;
+        }
+        if (iLast < m_lastSnapshot.size() && m_lastRunsOffsets[iLast] == entry.runsOffset &&
+            m_lastSnapshot[iLast]->start == entry.start && m_lastSnapshot[iLast]->end == entry.end) {
+            // the recorder only shares RunsBlocks between regions with the same backing file, too
+            regions->push_back(m_lastSnapshot[iLast]);
+        } else {
+            RegionView view;
+            if (!region(frame, i, &view) || !hasValidRuns(view) || (i && entry.start < entries[i - 1].end)) {
+                regions->clear();
+                return false;
+            }
+            shared_ptr<MappedRegion> region = make_shared<MappedRegion>();
+            region->start = view.start;
+            region->end = view.end;
+            region->backingFile.assign(view.backingFile, view.backingFileLength);
+            region->runStarts.assign(view.runStarts, view.runStarts + view.runCount);
+            region->useCounts.assign(view.useCounts, view.useCounts + view.runCount);
+            region->combinedFlags.assign(view.combinedFlags, view.combinedFlags + view.runCount);
+            region->computeStats(); // not stored in the file, they follow from the runs
+            regions->push_back(move(region));
+        }
+        runsOffsets.push_back(entry.runsOffset);
+    }
+    m_lastSnapshot = *regions;
+    m_lastRunsOffsets.swap(runsOffsets);
+    return true;
+}
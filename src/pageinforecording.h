@@ -0,0 +1,185 @@
+/*
+  pageinforecording.h
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PAGEINFORECORDING_H
+#define PAGEINFORECORDING_H
+
+#include "pageinfo.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ File format of recordings (memstat --record, qmemstat --replay)
+
+ Unlike the network protocol, any frame can be read without looking at the frames before it, and the
+ run arrays are stored like in MappedRegion, so reading a region is one bounds check and one copy per
+ array, straight from a memory mapping of the file. Regions that didn't change between frames are
+ stored only once and referenced by offset.
+
+ All offsets are from the start of the file, all values are little endian and aligned to their size.
+ The file starts with a header:
+    char magic[8] = "QMSTREC" (including the terminating zero)
+    uint32_t version
+    uint32_t page size
+    uint64_t offset of the IndexBlock, or 0 if the recording wasn't finished, e.g. due to a crash
+ followed by blocks:
+    uint32_t BlockType
+    uint32_t reserved, zero
+    uint64_t payload size in bytes, a multiple of 8 (header not included)
+    payload
+
+ Block payloads:
+    RunsBlock - the runs of a region, see MappedRegion
+        uint64_t number n of runs
+        uint64_t runStarts[n]
+        uint32_t useCounts[n]
+        uint32_t combinedFlags[n]
+        padding to a multiple of 8 bytes
+    StringBlock - a backing file name
+        uint64_t length
+        char[length], not zero terminated
+        padding to a multiple of 8 bytes
+    FrameBlock
+        uint64_t time of capture in nanoseconds since the Unix epoch
+        uint64_t number n of regions
+        n times, in ascending address order
+            uint64_t MappedRegion::start
+            uint64_t MappedRegion::end
+            uint64_t offset of the StringBlock with the backing file name, 0 for none
+            uint64_t offset of the RunsBlock
+    IndexBlock - the last block of a finished recording
+        uint64_t number n of frames
+        uint64_t offsets of the FrameBlocks[n]
+
+ Without an IndexBlock, the reader finds the frames by skipping from block to block, ignoring an
+ incomplete last block.
+ */
+
+// Writes recordings. Each frame is written completely when it's added, so a recording that ends
+// unexpectedly is readable up to the last frame.
+class PageInfoRecorder
+{
+public:
+    PageInfoRecorder();
+    ~PageInfoRecorder(); // calls finish()
+    bool open(const std::string &fileName);
+    // timestamp: nanoseconds since the Unix epoch
+    bool addFrame(const std::vector<MappedRegion> &regions, uint64_t timestamp);
+    // writes the index; no more frames can be added after that
+    bool finish();
+
+private:
+    struct WrittenRegion
+    {
+        MappedRegion region;
+        uint64_t backingFileOffset;
+        uint64_t runsOffset;
+    };
+
+    bool writeBlock(uint32_t type, const std::vector<char> &payload, uint64_t *offset);
+    uint64_t writeBackingFile(const std::string &backingFile);
+    uint64_t writeRuns(const MappedRegion &region);
+
+    int m_fd;
+    bool m_ok;
+    uint64_t m_fileSize;
+    std::vector<uint64_t> m_frameOffsets;
+    // the regions of the last frame, to find regions that didn't change
+    std::vector<WrittenRegion> m_previous;
+    std::vector<WrittenRegion> m_current;
+    std::map<std::string, uint64_t> m_backingFileOffsets;
+    std::vector<char> m_payload; // to avoid allocating for every block
+};
+
+// Reads recordings through a read-only memory mapping of the file. The runs of regions are copied out of
+// the mapping into MappedRegions, but only for regions that changed since the frame read before.
+class PageInfoRecording
+{
+public:
+    PageInfoRecording();
+    ~PageInfoRecording();
+    bool open(const std::string &fileName);
+    const std::string &errorString() const { return m_error; }
+
+    size_t frameCount() const { return m_frameOffsets.size(); }
+    // nanoseconds since the Unix epoch
+    uint64_t frameTimestamp(size_t frame) const;
+    size_t regionCount(size_t frame) const;
+    // The regions of a frame as MappedRegions, with their runs copied from the file. Regions that are
+    // the same in the frame of the previous call are shared with its result instead of copied again,
+    // which makes stepping through frames cheap. Returns false if the frame data in the file is
+    // inconsistent.
+    bool snapshot(size_t frame, MappedRegionSnapshot *regions);
+
+private:
+    // a region of a frame as stored in the file, pointing into the mapping
+    struct RegionView
+    {
+        uint64_t start;
+        uint64_t end;
+        const char *backingFile;
+        size_t backingFileLength;
+        size_t runCount;
+        const uint64_t *runStarts;
+        const uint32_t *useCounts;
+        const uint32_t *combinedFlags;
+    };
+
+    // Returns false if the region can't be read from the file. For speed, the runs are not checked
+    // for consistency with each other and the region size; snapshot() does that.
+    bool region(size_t frame, size_t i, RegionView *view) const;
+    // whether the runs cover the pages of the region like in MappedRegion
+    static bool hasValidRuns(const RegionView &view);
+
+    struct RegionEntry
+    {
+        uint64_t start;
+        uint64_t end;
+        uint64_t backingFileOffset;
+        uint64_t runsOffset;
+    };
+
+    const char *block(uint64_t offset, uint32_t type, uint64_t minSize, uint64_t *size = nullptr) const;
+    const RegionEntry *regionEntries(size_t frame, size_t *count) const;
+    bool findFrames(uint64_t indexOffset);
+    void close();
+
+    std::string m_error;
+    const char *m_data;
+    size_t m_size;
+    std::vector<uint64_t> m_frameOffsets;
+    // the result of the last snapshot() call, and the RunsBlock offset of each region in it
+    MappedRegionSnapshot m_lastSnapshot;
+    std::vector<uint64_t> m_lastRunsOffsets;
+};
+
+#endif // PAGEINFORECORDING_H
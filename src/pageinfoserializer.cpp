@@ -1,186 +1,418 @@
 /*
- serialized format:
-    uint64_t length (in bytes, length field not included in length)
-    repeat
-        // note this is one MappedRegion entry
-        uint64_t MappedRegion::start
-        uint64_t MappedRegion::end
-        uint32_t backingFile.length()
-        char[backingFile.length()]
-        padding to next uint32_t (4 byte boundary)
-        uint32_t useCounts[(MappedRegion::end - MappedRegion::start) / PageInfo::pageSize]
-        uint32_t combinedFlags[(MappedRegion::end - MappedRegion::start) / PageInfo::pageSize]
-    until read position == length + sizeof(length)
-    ... at exactly which point the last MappedRegion must also end, obviously
-
-  there is no endianness flag - little endian is used because it's the only endianness of x86 and
-  the default endianness on ARM
- */
-
-class PageInfoSerializer
-{
-public:
-    PageInfoSerializer(const PageInfo &pageInfo)
-       : m_mappedRegions(pageInfo.mappedRegions()),
-         m_region(-1),
-         m_posInRegion(0)
-    {}
-    pair<const char*, size_t> serializeMore();
-
-private:
-    bool nextRegionIf(bool cond);
-    template<typename T>
-    bool placePrimitiveTypeAt(T value, size_t *bufPos, size_t *staticMemberOffset = nullptr);
-    bool placeStringAt(const std::string &value, size_t *bufPos, size_t *staticMemberOffset);
-    static size_t chunkSize() { return sizeof(m_buffer); }
-
-    const std::vector<MappedRegion> &m_mappedRegions;
-    int m_region;
-    size_t m_posInRegion;
-    char m_buffer[16 * 1024]; // must be >= padded size of longest string we're going to have
-                              // (we don't split strings)
-};
+  pageinfoserializer.cpp
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pageinfoserializer.h"
+
+#include <cassert>
+#include <cstring>
+#include <limits>
+
+using namespace std;
 
 template<typename T>
-bool PageInfoSerializer::placePrimitiveTypeAt(T value, size_t *bufPos, size_t *staticMemberOffset)
+static void writeValue(char *dest, T value)
 {
-    bool ok = true;
-    if (staticMemberOffset) {
-        // is this the right "struct" position to put the value?
-        ok = ok && *staticMemberOffset == m_posInRegion;
-        // always update *staticMemberOffset!! - it's used for *static* position bookkeeping
-        *staticMemberOffset += sizeof(value);
-    }
-    ok = ok && *bufPos + sizeof(value) <= chunkSize();
-    if (ok) {
-        *reinterpret_cast<T *>(m_buffer + *bufPos) = value;
-        *bufPos += sizeof(value);
-        m_posInRegion += sizeof(value);
-    }
-    return ok;
+    memcpy(dest, &value, sizeof(T));
 }
 
-static size_t stringStorageSize(const std::string &str)
+PageInfoSerializer::PageInfoSerializer(bool useDeltas, size_t chunkSize)
+   : m_useDeltas(useDeltas),
+     m_keyframe(true),
+     m_frameIsKeyframe(false),
+     m_replaying(false),
+     m_stage(IdleStage),
+     m_mappedRegions(nullptr),
+     m_nextRegionId(0),
+     m_region(0),
+     m_regionId(0),
+     m_run(0),
+     m_previousRun(0),
+     m_editEnd(0),
+     m_buffer(max(chunkSize, PageInfoProtocol::maxRecordSize))
+{}
+
+void PageInfoSerializer::beginFrame(const vector<MappedRegion> &mappedRegions)
 {
-    return sizeof(uint32_t) + str.length();
+    assert(m_stage == IdleStage);
+    m_mappedRegions = &mappedRegions;
+    m_replaying = false;
+    m_stage = FrameStartStage;
+    m_frameIsKeyframe = m_keyframe || !m_useDeltas;
+    m_keyframe = false;
+    if (m_frameIsKeyframe) {
+        m_sent.clear();
+    }
+
+    // find the regions that were in the previous frame; both lists are sorted by start address
+    m_previous.assign(m_mappedRegions->size(), -1);
+    size_t iSent = 0;
+    for (size_t i = 0; i < m_mappedRegions->size(); i++) {
+        const MappedRegion &mr = (*m_mappedRegions)[i];
+        while (iSent < m_sent.size() && m_sent[iSent].region.start < mr.start) {
+            iSent++;
+        }
+        if (iSent >= m_sent.size()) {
+            break;
+        }
+        const MappedRegion &sent = m_sent[iSent].region;
+        if (sent.start == mr.start && sent.end == mr.end && sent.backingFile == mr.backingFile) {
+            m_previous[i] = iSent++;
+        }
+    }
+    m_newSent.clear();
+    m_region = 0;
 }
 
-static size_t padStringStorageSize(size_t size)
+void PageInfoSerializer::beginKeyframeReplay()
 {
-    // round to next multiple of 4 / sizeof(uint32_t)
-    size += sizeof(uint32_t) - 1;
-    size &= ~0x3;
-    return size;
+    assert(m_stage == IdleStage && m_useDeltas);
+    m_mappedRegions = nullptr;
+    m_replaying = true;
+    m_stage = FrameStartStage;
+    m_frameIsKeyframe = true;
+    m_previous.assign(m_sent.size(), -1);
+    m_region = 0;
 }
 
-bool PageInfoSerializer::placeStringAt(const std::string &str, size_t *bufPos, size_t *staticMemberOffset)
+// return value: where to write the payload, or nullptr if the record doesn't fit into the buffer
+char *PageInfoSerializer::beginRecord(PageInfoProtocol::RecordType type, size_t payloadSize, size_t *bufPos)
 {
-    const size_t strSize = stringStorageSize(str);
-    const size_t paddedSize = padStringStorageSize(strSize);
-
-    bool ok = *staticMemberOffset == m_posInRegion;
-    *staticMemberOffset += paddedSize;
-
-    const size_t finalBufPos = *bufPos + paddedSize;
-    ok = ok && finalBufPos <= chunkSize();
-    if (ok) {
-        // write length
-        *reinterpret_cast<uint32_t *>(m_buffer + *bufPos) = str.length();
-        // write chars (assuming utf-8 or or other <= 8 bit format)
-        memcpy(m_buffer + *bufPos + sizeof(uint32_t), str.c_str(), str.length());
-        // pad to next 4-byte boundary
-        memset(m_buffer + *bufPos + strSize, 0, paddedSize - strSize);
-
-        *bufPos += paddedSize;
-        assert(*bufPos == finalBufPos);
-        m_posInRegion += paddedSize;
-    }
-    return ok;
+    assert(payloadSize % sizeof(uint32_t) == 0);
+    if (*bufPos + PageInfoProtocol::recordHeaderSize + payloadSize > chunkSize()) {
+        return nullptr;
+    }
+    assert(PageInfoProtocol::recordHeaderSize + payloadSize <= PageInfoProtocol::maxRecordSize);
+    char *const record = m_buffer.data() + *bufPos;
+    writeValue(record, uint32_t(type));
+    writeValue(record + sizeof(uint32_t), uint32_t(payloadSize));
+    *bufPos += PageInfoProtocol::recordHeaderSize + payloadSize;
+    return record + PageInfoProtocol::recordHeaderSize;
 }
 
-bool PageInfoSerializer::nextRegionIf(bool cond)
+bool PageInfoSerializer::writeRegionRecord(size_t *bufPos)
 {
-    if (cond) {
-        m_posInRegion = 0;
-        m_region++;
+    using namespace PageInfoProtocol;
+    const MappedRegion &mr = region(m_region);
+
+    if (m_previous[m_region] >= 0) {
+        char *const payload = beginRecord(RegionRefRecord, 2 * sizeof(uint32_t) + sizeof(uint64_t), bufPos);
+        if (!payload) {
+            return false;
+        }
+        m_regionId = m_sent[m_previous[m_region]].id;
+        writeValue(payload, m_regionId);
+        writeValue(payload + 4, uint32_t(0));
+        writeValue(payload + 8, uint64_t(mr.runCount()));
+        return true;
+    }
+
+    // paths are limited to PATH_MAX, so this is just a sanity check
+    static const size_t maxStringLength = maxRecordSize / 2;
+    const size_t stringLength = min(mr.backingFile.length(), maxStringLength);
+    const size_t stringSize = paddedStringSize(stringLength);
+
+    char *const payload = beginRecord(RegionRecord, 2 * sizeof(uint32_t) + 3 * sizeof(uint64_t) + stringSize,
+                                      bufPos);
+    if (!payload) {
+        return false;
     }
-    return cond;
+    m_regionId = m_replaying ? m_sent[m_region].id : m_nextRegionId++;
+    writeValue(payload, m_regionId);
+    writeValue(payload + 4, uint32_t(0));
+    writeValue(payload + 8, mr.start);
+    writeValue(payload + 16, mr.end);
+    writeValue(payload + 24, uint64_t(mr.runCount()));
+    writeValue(payload + 32, uint32_t(stringLength));
+    memcpy(payload + 36, mr.backingFile.c_str(), stringLength);
+    // pad to next 4-byte boundary
+    memset(payload + 36 + stringLength, 0, stringSize - sizeof(uint32_t) - stringLength);
+    return true;
 }
 
-pair<const char*, size_t> PageInfoSerializer::serializeMore()
+static void writeRun(char *dest, const MappedRegion &mr, size_t run)
 {
-    size_t bufPos = 0;
-    if (m_region == -1) {
-        // write the size of the whole list of MappedRegions into the output as a framing header
-        uint64_t size = m_mappedRegions.size() * 2 * sizeof(uint64_t); // all the "start" and "end" members
-
-        for (const MappedRegion &mr : m_mappedRegions) {
-            // useCounts and combinedFlags
-            size += (mr.end - mr.start) / PageInfo::pageSize * 2 * sizeof(uint32_t);
-            // backingFile strings
-            size += padStringStorageSize(stringStorageSize(mr.backingFile));
-        }
-        placePrimitiveTypeAt(size, &bufPos);
-        nextRegionIf(true);
+    writeValue(dest, uint64_t(mr.runEnd(run) - mr.runStarts[run]));
+    writeValue(dest + sizeof(uint64_t), mr.useCounts[run]);
+    writeValue(dest + sizeof(uint64_t) + sizeof(uint32_t), mr.combinedFlags[run]);
+}
+
+// whether two runs that start at the same page are the same
+static bool isSameRun(const MappedRegion &a, size_t runA, const MappedRegion &b, size_t runB)
+{
+    return a.runEnd(runA) == b.runEnd(runB) && a.useCounts[runA] == b.useCounts[runB] &&
+           a.combinedFlags[runA] == b.combinedFlags[runB];
+}
+
+bool PageInfoSerializer::writeRunData(size_t *bufPos)
+{
+    using namespace PageInfoProtocol;
+    const MappedRegion &mr = region(m_region);
+    if (m_run >= mr.runCount()) {
+        return true; // empty region
     }
 
-    // concept: use byte position in region (m_posInRegion) to find which member we're at, write the member,
-    //          repeat until end of data or end of buffer
+    const size_t space = recordSpace(*bufPos);
+    const size_t overhead = recordHeaderSize + dataRecordHeaderSize;
+    if (overhead + runSize > space) {
+        return false;
+    }
+    const size_t count = min((space - overhead) / runSize, mr.runCount() - m_run);
+    char *const payload = beginRecord(RunDataRecord, dataRecordHeaderSize + count * runSize, bufPos);
+    assert(payload);
+    writeValue(payload, m_regionId);
+    writeValue(payload + 4, uint32_t(0));
 
-    // note that we need to stop if we went through an iteration that didn't find enough room for the current
-    // member to write, but also did not fill the buffer completely
-    bool wrote = true;
-    while (wrote && size_t(m_region) < m_mappedRegions.size() && bufPos < chunkSize()) {
-        wrote = false;
-        const MappedRegion &mr = m_mappedRegions[m_region];
+    char *out = payload + dataRecordHeaderSize;
+    for (size_t i = 0; i < count; i++, out += runSize) {
+        writeRun(out, mr, m_run++);
+    }
+    return true;
+}
 
-        size_t regionMemberOffset = 0;
+bool PageInfoSerializer::writeRunEdits(size_t *bufPos)
+{
+    using namespace PageInfoProtocol;
+    const MappedRegion &mr = region(m_region);
+    const MappedRegion &previous = m_sent[m_previous[m_region]].region;
+    static const size_t maxCount = numeric_limits<uint32_t>::max();
 
-        // || wrote last to prevent short-circuit evaluation eliminating the call doing the actual write!
-        wrote = placePrimitiveTypeAt(mr.start, &bufPos, &regionMemberOffset) || wrote;
-        wrote = placePrimitiveTypeAt(mr.end, &bufPos, &regionMemberOffset) || wrote;
-        wrote = placeStringAt(mr.backingFile, &bufPos, &regionMemberOffset) || wrote;
+    // at least one edit with one run
+    const size_t space = recordSpace(*bufPos);
+    if (recordHeaderSize + dataRecordHeaderSize + runEditSize + runSize > space) {
+        return false;
+    }
+    // the record header is written at the end, when the payload size is known
+    char *const payload = m_buffer.data() + *bufPos + recordHeaderSize;
+    const size_t maxPayloadSize = space - recordHeaderSize;
+    size_t payloadSize = dataRecordHeaderSize;
+    writeValue(payload, m_regionId);
+    writeValue(payload + 4, uint32_t(0));
 
-        if (m_posInRegion >= regionMemberOffset) {
-            const size_t arraySize = (mr.end - mr.start) / PageInfo::pageSize * sizeof(uint32_t);
-            if (nextRegionIf(!arraySize)) {
-                wrote = true;
-                continue;
+    while (payloadSize + runEditSize + runSize <= maxPayloadSize) {
+        size_t keep = 0;
+        size_t drop = 0;
+        if (m_run >= m_editEnd) {
+            // Find the next change. Runs are compared after both region versions have run boundaries
+            // at the same page, which is the case at the start and after each edit.
+            while (m_previousRun + keep < previous.runCount() && keep < maxCount &&
+                   isSameRun(previous, m_previousRun + keep, mr, m_run + keep)) {
+                keep++;
             }
-
-            const bool isFlags = m_posInRegion >= regionMemberOffset + arraySize;
-            if (isFlags) {
-                regionMemberOffset += arraySize;
+            if (m_previousRun + keep >= previous.runCount()) {
+                // the rest is unchanged, which needs no edit
+                m_previousRun += keep;
+                m_run += keep;
+                break;
             }
-            const size_t arrayEnd = regionMemberOffset + arraySize;
-            assert(m_posInRegion < arrayEnd);
-
-            const char *const data = reinterpret_cast<const char*>(isFlags ? &mr.combinedFlags[0]
-                                                                           : &mr.useCounts[0])
-                                         + m_posInRegion - regionMemberOffset;
-
-            if (bufPos == 0 && m_posInRegion + chunkSize() <= arrayEnd) {
-                // zero-copy fast path!
-                m_posInRegion += chunkSize();
-                nextRegionIf(isFlags && m_posInRegion >= arrayEnd);
-                // it may or may not be a a good idea to send more than the usual chunkSize() in this case;
-                // it may not be a good idea because large write()s might use more buffer memory somewhere
-                return make_pair(data, chunkSize());
+            // find the end of the changed runs: the next point at which both versions have a run
+            // boundary and are followed by the same run (or the end)
+            size_t previousEnd = m_previousRun + keep;
+            size_t end = m_run + keep;
+            if (keep < maxCount) {
+                while (true) {
+                    const uint64_t previousRunEnd = previous.runEnd(previousEnd);
+                    const uint64_t runEnd = mr.runEnd(end);
+                    if (previousRunEnd < runEnd) {
+                        previousEnd++;
+                    } else if (runEnd < previousRunEnd) {
+                        end++;
+                    } else {
+                        previousEnd++;
+                        end++;
+                        if (previousEnd >= previous.runCount() || isSameRun(previous, previousEnd, mr, end)) {
+                            break;
+                        }
+                    }
+                }
             }
+            drop = previousEnd - m_previousRun - keep;
+            assert(drop <= maxCount && end - m_run - keep <= maxCount);
+            m_previousRun = previousEnd;
+            m_run += keep;
+            m_editEnd = end;
+        }
 
-            size_t amount = min(chunkSize() - bufPos, arrayEnd - m_posInRegion);
-            memcpy(m_buffer + bufPos, data, amount);
-            m_posInRegion += amount;
-            bufPos += amount;
-            wrote = true;
+        // the new runs of a large edit are split between records, as edits without keep and drop
+        const size_t count = min(m_editEnd - m_run, (maxPayloadSize - payloadSize - runEditSize) / runSize);
+        char *out = payload + payloadSize;
+        writeValue(out, uint32_t(keep));
+        writeValue(out + sizeof(uint32_t), uint32_t(drop));
+        writeValue(out + 2 * sizeof(uint32_t), uint32_t(count));
+        out += runEditSize;
+        for (size_t i = 0; i < count; i++, out += runSize) {
+            writeRun(out, mr, m_run++);
+        }
+        payloadSize = out - payload;
+    }
 
-            // if we just finished copying useCounts, we'll copy combinedFlags in the next while loop
-            // iteration using (and thus exercising) the resumable serialization that we do anyway.
+    if (payloadSize > dataRecordHeaderSize) {
+        char *const record = beginRecord(RunEditRecord, payloadSize, bufPos);
+        assert(record == payload);
+        (void)record;
+    }
+    return true;
+}
 
-            assert(m_posInRegion <= arrayEnd);
-            nextRegionIf(isFlags && m_posInRegion >= arrayEnd);
+bool PageInfoSerializer::writeMappingStats(size_t *bufPos)
+{
+    using namespace PageInfoProtocol;
+    const MappedRegion &mr = region(m_region);
+    if (m_previous[m_region] >= 0 && m_sent[m_previous[m_region]].region.stats == mr.stats) {
+        return true; // the receiver has them already
+    }
+    char *payload = beginRecord(MappingStatsRecord, mappingStatsRecordSize, bufPos);
+    if (!payload) {
+        return false;
+    }
+    writeValue(payload, m_regionId);
+    writeValue(payload + 4, uint32_t(MappingStats::FieldCount));
+    payload += 2 * sizeof(uint32_t);
+    for (size_t i = 0; i < MappingStats::FieldCount; i++) {
+        writeValue(payload + i * sizeof(uint64_t), mr.stats.bytes[i]);
+    }
+    return true;
+}
+
+bool PageInfoSerializer::isRegionDataDone() const
+{
+    const MappedRegion &mr = region(m_region);
+    if (m_previous[m_region] >= 0) {
+        return m_previousRun >= m_sent[m_previous[m_region]].region.runCount() && m_run >= m_editEnd;
+    }
+    return m_run >= mr.runCount();
+}
+
+void PageInfoSerializer::finishRegion()
+{
+    assert(m_run == region(m_region).runCount());
+    if (!m_useDeltas || m_replaying) {
+        return;
+    }
+    const MappedRegion &mr = region(m_region);
+    SentRegion sent;
+    if (m_previous[m_region] >= 0) {
+        // reuse the storage, it probably has about the right size already
+        sent = move(m_sent[m_previous[m_region]]);
+        sent.region.runStarts = mr.runStarts;
+        sent.region.useCounts = mr.useCounts;
+        sent.region.combinedFlags = mr.combinedFlags;
+        sent.region.stats = mr.stats;
+    } else {
+        sent.id = m_regionId;
+        sent.region = mr;
+    }
+    m_newSent.push_back(move(sent));
+}
+
+pair<const char*, size_t> PageInfoSerializer::serializeMore()
+{
+    using namespace PageInfoProtocol;
+    size_t bufPos = 0;
+
+    // fill the buffer with whole records until it is full or there is nothing more to send
+    while (true) {
+        bool wrote = true;
+        switch (m_stage) {
+        case FrameStartStage: {
+            char *const payload = beginRecord(FrameStartRecord, 2 * sizeof(uint32_t), &bufPos);
+            wrote = payload;
+            if (wrote) {
+                writeValue(payload, uint32_t(m_frameIsKeyframe ? Keyframe : DeltaFrame));
+                writeValue(payload + sizeof(uint32_t), uint32_t(regionCount()));
+                m_stage = RegionStage;
+            }
+            break;
+        }
+        case RegionStage:
+            if (m_region >= regionCount()) {
+                m_stage = FrameEndStage;
+                break;
+            }
+            wrote = writeRegionRecord(&bufPos);
+            if (wrote) {
+                m_run = 0;
+                m_previousRun = 0;
+                m_editEnd = 0;
+                m_stage = RegionDataStage;
+            }
+            break;
+        case RegionDataStage:
+            wrote = m_previous[m_region] >= 0 ? writeRunEdits(&bufPos) : writeRunData(&bufPos);
+            if (isRegionDataDone()) {
+                m_stage = RegionStatsStage;
+            }
+            break;
+        case RegionStatsStage:
+            wrote = writeMappingStats(&bufPos);
+            if (wrote) {
+                finishRegion();
+                m_region++;
+                m_stage = RegionStage;
+            }
+            break;
+        case FrameEndStage:
+            wrote = beginRecord(FrameEndRecord, 0, &bufPos);
+            if (wrote) {
+                if (!m_replaying) {
+                    m_sent.swap(m_newSent);
+                    m_newSent.clear();
+                }
+                m_mappedRegions = nullptr;
+                m_replaying = false;
+                m_stage = IdleStage;
+            }
+            break;
+        case IdleStage:
+            return make_pair(m_buffer.data(), bufPos);
+        }
+        if (!wrote) {
+            // buffer is full (enough)
+            assert(bufPos);
+            return make_pair(m_buffer.data(), bufPos);
         }
     }
+}
 
-    return make_pair(m_buffer, bufPos);
+pair<const char*, size_t> PageInfoSerializer::serializeCaptureStats(const CaptureStats &stats)
+{
+    assert(m_stage == IdleStage);
+    using namespace PageInfoProtocol;
+    size_t bufPos = 0;
+    char *payload = beginRecord(StatsRecord, statsRecordSize, &bufPos);
+    assert(payload);
+    writeValue(payload, uint32_t(CaptureStats::PhaseCount));
+    writeValue(payload + 4, uint32_t(stats.incremental ? 1 : 0));
+    payload += 2 * sizeof(uint32_t);
+    for (size_t i = 0; i < CaptureStats::PhaseCount; i++) {
+        writeValue(payload, stats.nanoseconds[i]);
+        writeValue(payload + 8, stats.syscalls[i]);
+        writeValue(payload + 16, stats.bytesRead[i]);
+        payload += 3 * sizeof(uint64_t);
+    }
+    return make_pair(m_buffer.data(), bufPos);
 }
@@ -0,0 +1,128 @@
+/*
+  pageinfoserializer.h
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PAGEINFOSERIALIZER_H
+#define PAGEINFOSERIALIZER_H
+
+#include "pageinfo.h"
+#include "pageinfoprotocol.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/*
+  PageInfoSerializer writes the format described in pageinfoprotocol.h.
+
+  Frames are sent as differences against the previous frame where possible: regions that are still
+  there (same start, end and backing file) are only referenced by id, and only the runs that changed
+  are sent for them. For that, the serializer keeps a copy of the regions it has sent last.
+ */
+
+class PageInfoSerializer
+{
+public:
+    // With useDeltas false, every frame is a keyframe and no copy of sent data is kept.
+    // serializeMore() returns chunks of up to chunkSize bytes; at least maxRecordSize.
+    explicit PageInfoSerializer(bool useDeltas = true, size_t chunkSize = PageInfoProtocol::maxRecordSize);
+
+    // pageInfo must stay unchanged until serializeMore() returns an empty chunk
+    void beginFrame(const PageInfo &pageInfo) { beginFrame(pageInfo.mappedRegions()); }
+    // the same for regions that don't come from a PageInfo, e.g. read back from a recording
+    void beginFrame(const std::vector<MappedRegion> &mappedRegions);
+    // Send the last frame again, as a keyframe with the same region ids, so that the next delta frame
+    // can be applied to it. For receivers that have missed frames. Needs useDeltas.
+    void beginKeyframeReplay();
+    // make the next frame a keyframe
+    void forceKeyframe() { m_keyframe = true; }
+    bool isKeyframe() const { return m_frameIsKeyframe; }
+    // The frame is done when the returned chunk is empty. The handshake is not part of any frame, see
+    // PageInfoProtocol::writeHandshake().
+    std::pair<const char*, size_t> serializeMore();
+    // a StatsRecord; only between frames, i.e. not after beginFrame() until the frame is done
+    std::pair<const char*, size_t> serializeCaptureStats(const CaptureStats &stats);
+
+private:
+    struct SentRegion
+    {
+        uint32_t id;
+        MappedRegion region;
+    };
+
+    enum Stage {
+        FrameStartStage,
+        RegionStage,
+        RegionDataStage,
+        RegionStatsStage,
+        FrameEndStage,
+        IdleStage
+    };
+
+    const MappedRegion &region(size_t i) const
+    {
+        return m_replaying ? m_sent[i].region : (*m_mappedRegions)[i];
+    }
+    size_t regionCount() const { return m_replaying ? m_sent.size() : m_mappedRegions->size(); }
+    char *beginRecord(PageInfoProtocol::RecordType type, size_t payloadSize, size_t *bufPos);
+    bool writeRegionRecord(size_t *bufPos);
+    bool writeRunData(size_t *bufPos);
+    bool writeRunEdits(size_t *bufPos);
+    bool writeMappingStats(size_t *bufPos);
+    bool isRegionDataDone() const;
+    void finishRegion();
+    size_t chunkSize() const { return m_buffer.size(); }
+    // how large the record at bufPos can be
+    size_t recordSpace(size_t bufPos) const
+    {
+        return std::min(chunkSize() - bufPos, PageInfoProtocol::maxRecordSize);
+    }
+
+    const bool m_useDeltas;
+    bool m_keyframe;
+    bool m_frameIsKeyframe;
+    bool m_replaying;
+    Stage m_stage;
+    const std::vector<MappedRegion> *m_mappedRegions;
+    uint32_t m_nextRegionId;
+    // regions as sent in the previous frame, sorted by start address like MappedRegions
+    std::vector<SentRegion> m_sent;
+    // regions as sent in the current frame, will replace m_sent at the end of it
+    std::vector<SentRegion> m_newSent;
+    // for each region in the frame, index of the same region in m_sent, or -1
+    std::vector<int64_t> m_previous;
+    size_t m_region;
+    uint32_t m_regionId;
+    size_t m_run; // next run of the current region to send
+    size_t m_previousRun; // next run of the region in the previous frame to compare against
+    size_t m_editEnd; // end of the new runs of the edit being sent, if it's split between records
+    std::vector<char> m_buffer; // records are never split between chunks
+};
+
+#endif // PAGEINFOSERIALIZER_H
@@ -0,0 +1,497 @@
+/*
+  pageinfoserver.cpp
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pageinfoserver.h"
+
+#include "pageinfoprotocol.h"
+#include "pagesummary.h"
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+using namespace std;
+
+// CPU time of all threads of this process, so capture threads (CaptureOptions::threadCount) are counted
+static chrono::nanoseconds processCpuTime()
+{
+    struct timespec ts;
+    if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0) {
+        return chrono::nanoseconds(0);
+    }
+    return chrono::seconds(ts.tv_sec) + chrono::nanoseconds(ts.tv_nsec);
+}
+
+PageInfoServer::PageInfoServer(uint pid, const CaptureOptions &captureOptions, const ServerOptions &options)
+   : m_pid(pid),
+     m_captureOptions(captureOptions),
+     m_options(options),
+     m_filter(captureOptions.filter),
+     m_serializer(options.useDeltas),
+     m_listenFd(-1),
+     m_epollFd(-1),
+     m_averageUpdateCost(0)
+{
+    shared_ptr<vector<char>> handshake = make_shared<vector<char>>(PageInfoProtocol::handshakeSize);
+    PageInfoProtocol::writeHandshake(handshake->data());
+    m_handshake = handshake;
+}
+
+PageInfoServer::~PageInfoServer()
+{
+    for (const pair<const int, Client> &client : m_clients) {
+        close(client.first);
+    }
+    if (m_listenFd >= 0) {
+        close(m_listenFd);
+    }
+    if (m_epollFd >= 0) {
+        close(m_epollFd);
+    }
+}
+
+bool PageInfoServer::listen(uint port)
+{
+    m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    m_listenFd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (m_epollFd < 0 || m_listenFd < 0) {
+        return false;
+    }
+    const int reuseAddr = 1;
+    setsockopt(m_listenFd, SOL_SOCKET, SO_REUSEADDR, &reuseAddr, sizeof(reuseAddr));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = m_listenFd;
+
+    bool ok = true;
+    ok = ok && (bind(m_listenFd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    ok = ok && (::listen(m_listenFd, /* max queued incoming connections */ 16) == 0);
+    ok = ok && (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, m_listenFd, &event) == 0);
+    return ok;
+}
+
+int PageInfoServer::run()
+{
+    m_nextUpdate = chrono::steady_clock::now();
+    static const int maxEvents = 32;
+    struct epoll_event events[maxEvents];
+
+    while (true) {
+        // no client that wants data: nothing to do until one connects or becomes ready
+        int timeout = -1;
+        const chrono::steady_clock::time_point wanted = nextFrameWanted();
+        if (wanted != chrono::steady_clock::time_point::max()) {
+            const chrono::steady_clock::time_point now = chrono::steady_clock::now();
+            const chrono::steady_clock::time_point next = max(m_nextUpdate, wanted);
+            if (now >= next) {
+                const chrono::nanoseconds cpuTimeBefore = processCpuTime();
+                update();
+                scheduleNextUpdate(now, processCpuTime() - cpuTimeBefore);
+                continue;
+            }
+            timeout = int(chrono::duration_cast<chrono::milliseconds>(next - now).count()) + 1;
+        }
+
+        const int eventCount = epoll_wait(m_epollFd, events, maxEvents, timeout);
+        if (eventCount < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            cerr << "epoll_wait() failed: " << strerror(errno) << '\n';
+            return 1;
+        }
+        for (int i = 0; i < eventCount; i++) {
+            const int fd = events[i].data.fd;
+            if (fd == m_listenFd) {
+                acceptClients();
+                continue;
+            }
+            auto it = m_clients.find(fd);
+            if (it == m_clients.end()) {
+                continue;
+            }
+            Client *const client = &it->second;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                removeClient(fd);
+                continue;
+            }
+            if ((events[i].events & EPOLLIN) && !readFromClient(client)) {
+                removeClient(fd);
+                continue;
+            }
+            if ((events[i].events & EPOLLOUT) && !sendToClient(client)) {
+                removeClient(fd);
+            }
+        }
+    }
+}
+
+void PageInfoServer::acceptClients()
+{
+    while (true) {
+        const int fd = accept4(m_listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return; // EAGAIN when there are no more connections waiting, or a real error
+        }
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(m_epollFd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            close(fd);
+            continue;
+        }
+
+        if (m_clients.empty()) {
+            // start updating right away, not after up to one interval of idling
+            m_nextUpdate = chrono::steady_clock::now();
+        }
+        Client &client = m_clients[fd];
+        client.fd = fd;
+        client.offset = 0;
+        client.needsKeyframe = true;
+        client.waitingForReady = false;
+        client.waitingForWritable = false;
+        client.hasView = false;
+        client.hasFilter = false;
+        client.pending.push_back(m_handshake);
+        cerr << "client connected, " << m_clients.size() << " client(s).\n";
+        if (!sendToClient(&client)) {
+            removeClient(fd);
+        }
+    }
+}
+
+bool PageInfoServer::readFromClient(Client *client)
+{
+    using namespace PageInfoProtocol;
+    char buffer[4096];
+    while (true) {
+        const ssize_t count = recv(client->fd, buffer, sizeof(buffer), 0);
+        if (count == 0) {
+            return false;
+        }
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        client->input.insert(client->input.end(), buffer, buffer + count);
+
+        // the records from clients are tiny and rare, no need to avoid copying them
+        size_t pos = 0;
+        while (client->input.size() - pos >= recordHeaderSize) {
+            uint32_t header[2];
+            memcpy(header, client->input.data() + pos, recordHeaderSize);
+            if (header[1] > maxRecordSize) {
+                cerr << "received invalid data from client.\n";
+                return false;
+            }
+            if (client->input.size() - pos < recordHeaderSize + header[1]) {
+                break;
+            }
+            if (header[0] == ReadyRecord) {
+                client->waitingForReady = false;
+            } else if (header[0] == FilterRecord) {
+                CaptureFilter filter;
+                if (!readFilterRecord(client->input.data() + pos + recordHeaderSize, header[1], &filter)) {
+                    cerr << "received invalid filter from client.\n";
+                    return false;
+                }
+                if (!client->serializer) {
+                    // the first frame of the new serializer is a keyframe, the client needs nothing else
+                    client->serializer.reset(new PageInfoSerializer(m_options.useDeltas));
+                    client->nextFrame = chrono::steady_clock::now();
+                }
+                client->filter = filter;
+                client->hasFilter = true;
+                updateCaptureFilter();
+            } else if (header[0] == ViewRecord) {
+                View view;
+                if (!readViewRecord(client->input.data() + pos + recordHeaderSize, header[1], &view)) {
+                    cerr << "received invalid view from client.\n";
+                    return false;
+                }
+                if (!client->serializer) {
+                    client->serializer.reset(new PageInfoSerializer(m_options.useDeltas));
+                    client->nextFrame = chrono::steady_clock::now();
+                }
+                client->view = view;
+                client->hasView = true;
+            }
+            pos += recordHeaderSize + header[1];
+        }
+        client->input.erase(client->input.begin(), client->input.begin() + pos);
+    }
+}
+
+bool PageInfoServer::sendToClient(Client *client)
+{
+    while (!client->pending.empty()) {
+        const vector<char> &buffer = *client->pending.front();
+        const ssize_t count = send(client->fd, buffer.data() + client->offset, buffer.size() - client->offset,
+                                   MSG_NOSIGNAL);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return false;
+            }
+            break;
+        }
+        client->offset += count;
+        if (client->offset == buffer.size()) {
+            client->pending.pop_front();
+            client->offset = 0;
+        }
+    }
+
+    // only ask for EPOLLOUT while there is something to send, otherwise it would fire all the time
+    const bool waitForWritable = !client->pending.empty();
+    if (waitForWritable != client->waitingForWritable) {
+        struct epoll_event event;
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | (waitForWritable ? uint32_t(EPOLLOUT) : 0);
+        event.data.fd = client->fd;
+        if (epoll_ctl(m_epollFd, EPOLL_CTL_MOD, client->fd, &event) != 0) {
+            return false;
+        }
+        client->waitingForWritable = waitForWritable;
+    }
+    return true;
+}
+
+chrono::steady_clock::time_point PageInfoServer::nextFrameWanted() const
+{
+    chrono::steady_clock::time_point ret = chrono::steady_clock::time_point::max();
+    for (const pair<const int, Client> &fdAndClient : m_clients) {
+        const Client &client = fdAndClient.second;
+        if (!client.isBusy()) {
+            ret = min(ret, client.hasView ? client.nextFrame : chrono::steady_clock::time_point::min());
+        }
+    }
+    return ret;
+}
+
+void PageInfoServer::removeClient(int fd)
+{
+    epoll_ctl(m_epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    m_clients.erase(fd);
+    cerr << "client disconnected, " << m_clients.size() << " client(s).\n";
+    updateCaptureFilter();
+}
+
+void PageInfoServer::updateCaptureFilter()
+{
+    // the filter of all clients if they agree, otherwise everything; without clients, the server's own
+    const CaptureFilter *common = nullptr;
+    bool agree = true;
+    for (const pair<const int, Client> &fdAndClient : m_clients) {
+        const CaptureFilter &filter = filterOf(fdAndClient.second);
+        agree = agree && (!common || filter == *common);
+        common = &filter;
+    }
+    const CaptureFilter filter = !common ? m_captureOptions.filter : agree ? *common : CaptureFilter();
+    if (!m_pageInfo) {
+        m_filter = filter;
+    } else if (m_pageInfo->filter() != filter) {
+        m_pageInfo->setFilter(filter);
+    }
+}
+
+const vector<MappedRegion> &PageInfoServer::regionsFor(const CaptureFilter &filter)
+{
+    if (filter == m_pageInfo->filter()) {
+        return m_pageInfo->mappedRegions();
+    }
+    for (const pair<CaptureFilter, vector<MappedRegion>> &filtered : m_filteredRegions) {
+        if (filtered.first == filter) {
+            return filtered.second;
+        }
+    }
+    m_filteredRegions.emplace_back(filter, filterRegions(m_pageInfo->mappedRegions(), filter));
+    return m_filteredRegions.back().second;
+}
+
+// returns the serialized frame; reuses the memory of *reusable if nobody else uses it anymore
+PageInfoServer::Buffer PageInfoServer::serializeFrame(PageInfoSerializer *serializer, Buffer *reusable)
+{
+    shared_ptr<vector<char>> frame;
+    if (reusable->use_count() == 1) {
+        // we have created all buffers as non-const, so this is safe
+        frame = const_pointer_cast<vector<char>>(*reusable);
+        frame->clear();
+    } else {
+        frame = make_shared<vector<char>>();
+    }
+    reusable->reset();
+    while (true) {
+        const pair<const char*, size_t> chunk = serializer->serializeMore();
+        if (chunk.second == 0) {
+            break;
+        }
+        frame->insert(frame->end(), chunk.first, chunk.first + chunk.second);
+    }
+    return frame;
+}
+
+void PageInfoServer::update()
+{
+    if (m_pageInfo) {
+        m_pageInfo->update();
+    } else {
+        CaptureOptions options = m_captureOptions;
+        options.filter = m_filter;
+        m_pageInfo.reset(new PageInfo(m_pid, options));
+    }
+    m_filteredRegions.clear();
+    const chrono::steady_clock::time_point now = chrono::steady_clock::now();
+    const CaptureStats &captureStats = m_pageInfo->captureStats();
+
+    // the shared frame, for the clients without a serializer; if none of them is ready, they all need a
+    // keyframe (replay) next time, so it doesn't matter if the serializer skips this update
+    bool needSharedFrame = false;
+    for (const pair<const int, Client> &fdAndClient : m_clients) {
+        needSharedFrame = needSharedFrame || (!fdAndClient.second.serializer && fdAndClient.second.wantsFrame(now));
+    }
+    bool isKeyframe = false;
+    Buffer statsBuffer;
+    if (needSharedFrame) {
+        m_serializer.beginFrame(regionsFor(m_captureOptions.filter));
+        isKeyframe = m_serializer.isKeyframe();
+        m_frame = serializeFrame(&m_serializer, &m_frame);
+        // the cost of serializing a keyframe replay for some clients, if needed below, is not included
+        CaptureStats stats = captureStats;
+        stats.nanoseconds[CaptureStats::SerializePhase] =
+            chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - now).count();
+        const pair<const char*, size_t> statsRecord = m_serializer.serializeCaptureStats(stats);
+        statsBuffer = make_shared<vector<char>>(statsRecord.first, statsRecord.first + statsRecord.second);
+    }
+    bool haveKeyframeReplay = false;
+
+    vector<int> failedClients;
+    for (pair<const int, Client> &fdAndClient : m_clients) {
+        Client *const client = &fdAndClient.second;
+        if (!client->wantsFrame(now)) {
+            // Still busy with an earlier frame; skip this one. Deltas against the skipped frame can't
+            // be applied, so it needs a keyframe next. Clients with their own serializer don't, it hasn't
+            // seen the skipped frame either.
+            if (!client->serializer) {
+                client->needsKeyframe = m_options.useDeltas;
+            }
+            continue;
+        }
+        if (client->serializer) {
+            sendOwnFrame(client, captureStats);
+            client->nextFrame = now + chrono::milliseconds(client->view.interval);
+        } else {
+            if (client->needsKeyframe && !isKeyframe) {
+                // a keyframe of this update, with the region ids that the next delta frame refers to
+                if (!haveKeyframeReplay) {
+                    m_serializer.beginKeyframeReplay();
+                    m_keyframeReplay = serializeFrame(&m_serializer, &m_keyframeReplay);
+                    haveKeyframeReplay = true;
+                }
+                client->pending.push_back(m_keyframeReplay);
+            } else {
+                client->pending.push_back(m_frame);
+            }
+            client->pending.push_back(statsBuffer);
+            client->needsKeyframe = false;
+        }
+        client->waitingForReady = true;
+        if (!sendToClient(client)) {
+            failedClients.push_back(client->fd);
+        }
+    }
+    for (int fd : failedClients) {
+        removeClient(fd);
+    }
+}
+
+// the regions that pass the client's filter; with a view, only those in the view with their runs, the
+// others without, pre-aggregated to its zoom level
+void PageInfoServer::sendOwnFrame(Client *client, CaptureStats stats)
+{
+    const chrono::steady_clock::time_point serializeStart = chrono::steady_clock::now();
+    const vector<MappedRegion> &filtered = regionsFor(filterOf(*client));
+    vector<MappedRegion> regions;
+    if (client->hasView) {
+        const PageInfoProtocol::View &view = client->view;
+        regions.reserve(filtered.size());
+        for (const MappedRegion &region : filtered) {
+            regions.push_back(viewOfRegion(region, view.start, view.end, view.zoomLevel));
+        }
+    }
+    client->serializer->beginFrame(client->hasView ? regions : filtered);
+    client->frame = serializeFrame(client->serializer.get(), &client->frame);
+    stats.nanoseconds[CaptureStats::SerializePhase] =
+        chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - serializeStart).count();
+    const pair<const char*, size_t> statsRecord = client->serializer->serializeCaptureStats(stats);
+    client->pending.push_back(client->frame);
+    client->pending.push_back(make_shared<vector<char>>(statsRecord.first, statsRecord.first + statsRecord.second));
+}
+
+void PageInfoServer::scheduleNextUpdate(chrono::steady_clock::time_point updateStart,
+                                        chrono::nanoseconds updateCost)
+{
+    // Smooth the cost a little so that one outlier (e.g. the first, full capture) doesn't stretch
+    // the interval for a long time, and random variations don't make the update rate jittery.
+    if (m_averageUpdateCost == chrono::nanoseconds(0)) {
+        m_averageUpdateCost = updateCost;
+    } else {
+        m_averageUpdateCost = (3 * m_averageUpdateCost + updateCost) / 4;
+    }
+
+    chrono::nanoseconds interval = chrono::milliseconds(m_options.interval);
+    if (m_options.maxCpuPercent) {
+        interval = max(interval, m_averageUpdateCost * 100 / m_options.maxCpuPercent);
+    }
+    // If the update took longer than the interval, the next one starts right away. There is no
+    // catching up on missed updates, though.
+    m_nextUpdate = updateStart + chrono::duration_cast<chrono::steady_clock::duration>(interval);
+}
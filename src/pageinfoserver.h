@@ -0,0 +1,140 @@
+/*
+  pageinfoserver.h
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PAGEINFOSERVER_H
+#define PAGEINFOSERVER_H
+
+#include "pageinfo.h"
+#include "pageinfoprotocol.h"
+#include "pageinfoserializer.h"
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+struct ServerOptions
+{
+    unsigned int interval = 50; // minimum milliseconds between the starts of two updates
+    // Upper limit for the CPU time spent on updates, in percent of one CPU core (like top).
+    // The interval is stretched as needed. 0 means no limit.
+    unsigned int maxCpuPercent = 0;
+    bool useDeltas = true;
+};
+
+// Serves any number of clients (qmemstat --client). Page information is captured once per update
+// interval while there are clients, serialized once, and the same frame is sent to all clients.
+// Sockets are non-blocking, and clients tell when they are done with a frame (ReadyRecord). A client
+// that hasn't received or processed the previous frame yet when a new one is ready skips the new one,
+// and gets a keyframe of the then current state when it has caught up. If no client is ready, the next
+// update is postponed. Clients that narrow down what they get with a FilterRecord, or that tell their view
+// with a ViewRecord, get frames of their own instead: only with what passes their filter, with runs only
+// for what they show, at the rate they ask for. What is captured is what all clients want if they want
+// the same, otherwise everything, which is then filtered for each client.
+class PageInfoServer
+{
+public:
+    PageInfoServer(unsigned int pid, const CaptureOptions &captureOptions, const ServerOptions &options);
+    ~PageInfoServer();
+    // returns false if listening on the port failed
+    bool listen(unsigned int port);
+    // never returns unless there is an error; returns the exit code for main() then
+    int run();
+
+private:
+    typedef std::shared_ptr<const std::vector<char>> Buffer;
+
+    struct Client
+    {
+        int fd;
+        std::deque<Buffer> pending; // the first one is partially sent, up to offset
+        size_t offset;
+        bool needsKeyframe; // delta frames can't be applied, e.g. because frames were skipped
+        bool waitingForReady; // the last frame hasn't been acknowledged with a ReadyRecord yet
+        bool waitingForWritable;
+        std::vector<char> input; // incomplete record from the client
+        // set by a ViewRecord or a FilterRecord; only then is there a serializer, for the frames of this
+        // client alone
+        bool hasView;
+        PageInfoProtocol::View view;
+        bool hasFilter;
+        CaptureFilter filter;
+        std::unique_ptr<PageInfoSerializer> serializer;
+        Buffer frame;
+        std::chrono::steady_clock::time_point nextFrame; // view.interval after the last one
+        bool isBusy() const { return !pending.empty() || waitingForReady; }
+        bool wantsFrame(std::chrono::steady_clock::time_point now) const
+        {
+            return !isBusy() && (!hasView || now >= nextFrame);
+        }
+    };
+    // what the client gets, the filter the server was started with if the client didn't send one
+    const CaptureFilter &filterOf(const Client &client) const
+    {
+        return client.hasFilter ? client.filter : m_captureOptions.filter;
+    }
+
+    void acceptClients();
+    // these return false if the client should be removed because of an error or disconnection
+    bool readFromClient(Client *client);
+    bool sendToClient(Client *client);
+    void removeClient(int fd);
+    // captures what all clients want, see filterOf()
+    void updateCaptureFilter();
+    // the earliest time at which a client wants a frame; time_point::max() if none does
+    std::chrono::steady_clock::time_point nextFrameWanted() const;
+    void update();
+    void sendOwnFrame(Client *client, CaptureStats stats);
+    // the regions of the last capture that pass the filter, see filterRegions()
+    const std::vector<MappedRegion> &regionsFor(const CaptureFilter &filter);
+    void scheduleNextUpdate(std::chrono::steady_clock::time_point updateStart,
+                            std::chrono::nanoseconds updateCost);
+    Buffer serializeFrame(PageInfoSerializer *serializer, Buffer *reusable);
+
+    unsigned int m_pid;
+    CaptureOptions m_captureOptions;
+    const ServerOptions m_options;
+    CaptureFilter m_filter; // until there is a PageInfo to pass it to
+    // the regions of the last capture for clients with other filters, with the filter they were made for
+    std::vector<std::pair<CaptureFilter, std::vector<MappedRegion>>> m_filteredRegions;
+    std::unique_ptr<PageInfo> m_pageInfo; // kept between updates, see PageInfo::update()
+    PageInfoSerializer m_serializer;
+    int m_listenFd;
+    int m_epollFd;
+    std::map<int, Client> m_clients;
+    Buffer m_handshake;
+    Buffer m_frame;
+    Buffer m_keyframeReplay;
+    std::chrono::steady_clock::time_point m_nextUpdate;
+    std::chrono::nanoseconds m_averageUpdateCost; // CPU time, smoothed over recent updates
+};
+
+#endif // PAGEINFOSERVER_H
@@ -0,0 +1,325 @@
+/*
+  pagesummary.cpp
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "pagesummary.h"
+
+#include <algorithm>
+#include <cassert>
+
+using namespace std;
+
+uint32_t PageSummary::presentPages() const
+{
+    uint32_t ret = 0;
+    for (unsigned int i = 0; i < PageCategoryCount; i++) {
+        ret += pages[i];
+    }
+    return ret - pages[NotPresentPage];
+}
+
+PageSummary &PageSummary::operator+=(const PageSummary &other)
+{
+    for (unsigned int i = 0; i < PageCategoryCount; i++) {
+        pages[i] += other.pages[i];
+    }
+    idlePages += other.idlePages;
+    return *this;
+}
+
+bool PageSummary::operator==(const PageSummary &other) const
+{
+    return equal(pages, pages + PageCategoryCount, other.pages) && idlePages == other.idlePages;
+}
+
+const unsigned int RegionSummary::maxLevel;
+
+// a use count and combined flags that pageCategory() puts into the category
+static void representativePage(PageCategory category, uint32_t *useCount, uint32_t *flags)
+{
+    const uint32_t file = PageFlags::present | (1 << KPF_MMAP);
+    const uint32_t anon = PageFlags::present | (1 << KPF_ANON);
+    switch (category) {
+    case NotPresentPage:
+        *useCount = 0;
+        *flags = 0;
+        break;
+    case FilePage:
+    case SharedFilePage:
+        *useCount = category == FilePage ? 1 : 2;
+        *flags = file;
+        break;
+    case ThpPage:
+        *useCount = 1;
+        *flags = anon | (1 << KPF_THP);
+        break;
+    case AnonPage:
+    case SharedAnonPage:
+        *useCount = category == AnonPage ? 1 : 2;
+        *flags = anon;
+        break;
+    case NoPage:
+        *useCount = 0;
+        *flags = PageFlags::present | (1 << KPF_NOPAGE);
+        break;
+    default:
+        *useCount = 0;
+        *flags = PageFlags::present;
+        break;
+    }
+    assert(pageCategory(*useCount, *flags) == category);
+}
+
+MappedRegion viewOfRegion(const MappedRegion &region, uint64_t viewStart, uint64_t viewEnd, unsigned int level)
+{
+    MappedRegion ret;
+    ret.start = region.start;
+    ret.end = region.end;
+    ret.backingFile = region.backingFile;
+    ret.stats = region.stats;
+    const uint64_t pageCount = region.pageCount();
+    if (region.runStarts.empty() || !pageCount) {
+        return ret;
+    }
+    level = min(level, RegionSummary::maxLevel);
+    // tiles are numbered from address 0, see RegionSummary
+    const uint64_t firstPage = region.start / PageInfo::pageSize;
+    const uint64_t endPage = firstPage + pageCount;
+    const uint64_t viewFirstPage = ((viewStart / PageInfo::pageSize) >> level) << level;
+    const uint64_t viewEndPage = viewEnd ? ((((viewEnd - 1) / PageInfo::pageSize) >> level) + 1) << level : 0;
+    if (viewFirstPage >= endPage || viewEndPage <= firstPage) {
+        ret.addPage(0, 0, 0);
+        return ret;
+    }
+    // the part in view, relative to the region like runStarts
+    const uint64_t first = max(viewFirstPage, firstPage) - firstPage;
+    const uint64_t end = min(viewEndPage, endPage) - firstPage;
+    auto tileEnd = [=](uint64_t page) { return min(endPage, (((firstPage + page) >> level) + 1) << level) - firstPage; };
+    if (first > 0) {
+        ret.addPage(0, 0, 0);
+    }
+    size_t run = region.runAt(first);
+    uint64_t page = first;
+    while (page < end) {
+        const uint64_t runEnd = region.runEnd(run);
+        const uint64_t pageTileEnd = tileEnd(page);
+        if (runEnd >= pageTileEnd) {
+            // the run covers the rest of the tile, and the tiles it covers completely need no summarizing
+            ret.addPage(page, region.useCounts[run], region.combinedFlags[run]);
+            page = min(runEnd, end);
+            run++;
+            continue;
+        }
+        // per category, not idle and idle
+        uint64_t categoryPages[PageCategoryCount][2] = {};
+        uint64_t categoryStart = page;
+        while (page < pageTileEnd) {
+            const uint64_t partEnd = min(region.runEnd(run), pageTileEnd);
+            const uint32_t flags = region.combinedFlags[run];
+            categoryPages[pageCategory(region.useCounts[run], flags)][(flags >> KPF_IDLE) & 1] += partEnd - page;
+            page = partEnd;
+            if (page == region.runEnd(run)) {
+                run++;
+            }
+        }
+        for (unsigned int category = 0; category < PageCategoryCount; category++) {
+            for (uint32_t idle = 0; idle < 2; idle++) {
+                if (categoryPages[category][idle]) {
+                    uint32_t useCount;
+                    uint32_t flags;
+                    representativePage(PageCategory(category), &useCount, &flags);
+                    ret.addPage(categoryStart, useCount, flags | (idle << KPF_IDLE));
+                    categoryStart += categoryPages[category][idle];
+                }
+            }
+        }
+    }
+    if (end < pageCount) {
+        ret.addPage(end, 0, 0);
+    }
+    return ret;
+}
+
+RegionSummary::RegionSummary(shared_ptr<const MappedRegion> region)
+   : m_region(move(region)),
+     m_firstPage(m_region->start / PageInfo::pageSize),
+     m_endPage(m_region->end / PageInfo::pageSize)
+{
+    if (m_endPage <= m_firstPage || m_region->runStarts.empty()) {
+        return;
+    }
+    m_runCategories.resize(m_region->runCount());
+    classifyPages(m_region->useCounts.data(), m_region->combinedFlags.data(), m_region->runCount(),
+                  m_runCategories.data());
+    buildBaseLevel();
+    for (unsigned int level = baseLevel; level < maxLevel && endTile(level) - firstTile(level) > 1; level++) {
+        buildNextLevel();
+    }
+}
+
+PageSummary RegionSummary::tile(unsigned int level, uint64_t tile) const
+{
+    assert(level <= maxLevel && tile >= firstTile(level) && tile < endTile(level));
+    if (level < baseLevel || m_levels.empty()) {
+        return summarizeRuns(tile << level, (tile + 1) << level);
+    }
+    if (level - baseLevel >= m_levels.size()) {
+        // the whole region is in one tile from the top level up
+        return m_levels.back().front().summary;
+    }
+    const vector<Span> &spans = m_levels[level - baseLevel];
+    const auto it = upper_bound(spans.begin(), spans.end(), tile,
+                                [](uint64_t lhs, const Span &rhs) { return lhs < rhs.firstTile; });
+    assert(it != spans.begin());
+    return (it - 1)->summary;
+}
+
+uint64_t RegionSummary::pageCount(unsigned int level, uint64_t tile) const
+{
+    return min((tile + 1) << level, m_endPage) - max(tile << level, m_firstPage);
+}
+
+static bool isIdle(const MappedRegion &region, size_t run)
+{
+    return region.combinedFlags[run] & (1 << KPF_IDLE);
+}
+
+PageSummary RegionSummary::summarizeRuns(uint64_t firstPage, uint64_t endPage) const
+{
+    PageSummary ret;
+    const MappedRegion &region = *m_region;
+    uint64_t page = max(firstPage, m_firstPage) - m_firstPage;
+    const uint64_t end = min(endPage, m_endPage) - m_firstPage;
+    if (page >= end || region.runStarts.empty()) {
+        return ret;
+    }
+    for (size_t run = region.runAt(page); page < end; run++) {
+        const uint64_t runEnd = min(region.runEnd(run), end);
+        ret.addPages(PageCategory(m_runCategories[run]), runEnd - page, isIdle(region, run));
+        page = runEnd;
+    }
+    return ret;
+}
+
+// appends a span unless it would have the same summary as the last one, in which case the last span
+// just extends over the new tiles
+void RegionSummary::appendSpan(vector<Span> *spans, uint64_t firstTile, const PageSummary &summary)
+{
+    if (spans->empty() || spans->back().summary != summary) {
+        Span span;
+        span.firstTile = firstTile;
+        span.summary = summary;
+        spans->push_back(span);
+    }
+}
+
+void RegionSummary::buildBaseLevel()
+{
+    static const unsigned int k = baseLevel;
+    const MappedRegion &region = *m_region;
+    vector<Span> spans;
+    // partial tile, at the start or end of a run
+    uint64_t partialTile = 0;
+    PageSummary partial;
+    bool havePartial = false;
+
+    for (size_t run = 0; run < region.runCount(); run++) {
+        const PageCategory category = PageCategory(m_runCategories[run]);
+        const bool idle = isIdle(region, run);
+        uint64_t page = m_firstPage + region.runStarts[run];
+        const uint64_t end = m_firstPage + region.runEnd(run);
+        while (page < end) {
+            const uint64_t tile = page >> k;
+            if (havePartial && tile != partialTile) {
+                appendSpan(&spans, partialTile, partial);
+                partial = PageSummary();
+                havePartial = false;
+            }
+            const uint64_t tileEnd = (tile + 1) << k;
+            if (page == tile << k && end >= tileEnd) {
+                // tiles that contain only pages of this run
+                PageSummary whole;
+                whole.addPages(category, 1 << k, idle);
+                appendSpan(&spans, tile, whole);
+                page = (end >> k) << k;
+            } else {
+                const uint64_t pageCount = min(end, tileEnd) - page;
+                partial.addPages(category, pageCount, idle);
+                partialTile = tile;
+                havePartial = true;
+                page += pageCount;
+            }
+        }
+    }
+    if (havePartial) {
+        appendSpan(&spans, partialTile, partial);
+    }
+    m_levels.push_back(move(spans));
+}
+
+void RegionSummary::buildNextLevel()
+{
+    const unsigned int lowerLevel = baseLevel + m_levels.size() - 1;
+    const vector<Span> &lower = m_levels.back();
+    const uint64_t lowerFirst = firstTile(lowerLevel);
+    const uint64_t lowerEnd = endTile(lowerLevel);
+    vector<Span> spans;
+
+    // the lower span that contains a tile, looked up with tiles in ascending order
+    size_t i = 0;
+    auto lowerTile = [&](uint64_t tile) -> PageSummary {
+        if (tile < lowerFirst || tile >= lowerEnd) {
+            return PageSummary();
+        }
+        while (i + 1 < lower.size() && lower[i + 1].firstTile <= tile) {
+            i++;
+        }
+        return lower[i].summary;
+    };
+
+    // Each tile at this level covers two lower tiles, and the tiles of a lower span that lie in pairs
+    // in it become one span. Only the first lower tile can be the second of a pair (when its index is
+    // odd), after that pairs are visited from the start.
+    for (uint64_t tile = lowerFirst; tile < lowerEnd; ) {
+        const PageSummary first = lowerTile(tile);
+        const uint64_t spanEnd = i + 1 < lower.size() ? lower[i + 1].firstTile : lowerEnd;
+        if (!(tile & 1) && spanEnd >= tile + 2) {
+            PageSummary pair = first;
+            pair += first;
+            appendSpan(&spans, tile >> 1, pair);
+            tile = (spanEnd >> 1) << 1;
+        } else {
+            PageSummary sum = first;
+            if (!(tile & 1)) {
+                sum += lowerTile(tile + 1);
+            }
+            appendSpan(&spans, tile >> 1, sum);
+            tile = ((tile >> 1) + 1) << 1;
+        }
+    }
+    m_levels.push_back(move(spans));
+}
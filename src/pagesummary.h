@@ -0,0 +1,112 @@
+/*
+  pagesummary.h
+
+  This file is part of QMemstat, a Qt GUI analyzer for program memory.
+  Copyright (C) 2016-2017 Klarälvdalens Datakonsult AB, a KDAB Group company, info@kdab.com
+
+  Initial Author: Andreas Hartmetz <andreas.hartmetz@kdab.com>
+  Maintainer: Christoph Sterz <christoph.sterz@kdab.com>
+
+  Licensees holding valid commercial KDAB QMemstat licenses may use this file in
+  accordance with QMemstat Commercial License Agreement provided with the Software.
+
+  Contact info@kdab.com if any conditions of this licensing are not clear to you.
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef PAGESUMMARY_H
+#define PAGESUMMARY_H
+
+#include "pagecategory.h"
+#include "pageinfo.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// What the pages of a tile of a zoomed out mosaic are: the number of pages in each PageCategory, and how
+// many of them are idle
+struct PageSummary
+{
+    PageSummary() : pages(), idlePages(0) {}
+    // idle: KPF_IDLE, see CaptureOptions::trackIdlePages
+    void addPages(PageCategory category, uint32_t pageCount, bool idle)
+    {
+        pages[category] += pageCount;
+        idlePages += idle ? pageCount : 0;
+    }
+    uint32_t presentPages() const;
+    PageSummary &operator+=(const PageSummary &other);
+    bool operator==(const PageSummary &other) const;
+    bool operator!=(const PageSummary &other) const { return !(*this == other); }
+
+    uint32_t pages[PageCategoryCount];
+    uint32_t idlePages;
+};
+
+// A pyramid of PageSummaries of a MappedRegion. At level k, tile t covers the pages from t << k to
+// (t + 1) << k, numbered from address 0 so that the tiles of different regions line up. A tile can
+// contain only a part of the region, and a tile at the start or end of the region only part of a tile.
+// Levels from baseLevel up are stored run-length encoded, so they take O(run count) memory even for
+// huge regions; below baseLevel, tiles are summarized from the runs of the region when asked for.
+class RegionSummary
+{
+public:
+    static const unsigned int baseLevel = 4;
+    static const unsigned int maxLevel = 31; // 2 ^ 31 pages for the largest tile still fit in uint32_t
+
+    // keeps a reference to the region
+    explicit RegionSummary(std::shared_ptr<const MappedRegion> region);
+
+    const std::shared_ptr<const MappedRegion> &region() const { return m_region; }
+    // the summary of the pages of the region in tile at level, which must contain pages of the region
+    PageSummary tile(unsigned int level, uint64_t tile) const;
+    // the number of pages of the region in tile at level
+    uint64_t pageCount(unsigned int level, uint64_t tile) const;
+    // the tiles at level that contain pages of the region, from firstTile to (not including) endTile
+    uint64_t firstTile(unsigned int level) const { return m_firstPage >> level; }
+    uint64_t endTile(unsigned int level) const
+    {
+        return m_endPage > m_firstPage ? ((m_endPage - 1) >> level) + 1 : firstTile(level);
+    }
+
+private:
+    // the tiles from firstTile up to the firstTile of the next span have the same summary
+    struct Span
+    {
+        uint64_t firstTile;
+        PageSummary summary;
+    };
+    static void appendSpan(std::vector<Span> *spans, uint64_t firstTile, const PageSummary &summary);
+    PageSummary summarizeRuns(uint64_t firstPage, uint64_t endPage) const;
+    void buildBaseLevel();
+    void buildNextLevel();
+
+    std::shared_ptr<const MappedRegion> m_region;
+    std::vector<uint8_t> m_runCategories; // the PageCategory of each run of the region
+    uint64_t m_firstPage;
+    uint64_t m_endPage;
+    std::vector<std::vector<Span>> m_levels; // from baseLevel up to a level with only one tile
+};
+
+// For a receiver that shows only the addresses from viewStart to viewEnd at a zoom level, like a remote
+// MosaicWidget: a copy of the region with the same RegionSummary tiles at that level in the view, but
+// usually far fewer runs. Outside the view (extended to whole tiles), all pages are not present. Inside,
+// at level 0 the runs are the same; above it, the pages of each tile that no single run covers are
+// replaced with one run per PageCategory and idle or not, with a use count and flags typical for it.
+// stats are copied.
+MappedRegion viewOfRegion(const MappedRegion &region, uint64_t viewStart, uint64_t viewEnd, unsigned int level);
+
+#endif // PAGESUMMARY_H
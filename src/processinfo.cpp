@@ -28,52 +28,219 @@
 
 #include "processinfo.h"
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
 #include <cstdlib>
-#include <fstream>
+#include <cstring>
 
 // POSIX specific, but this whole program only works on Linux anyway!
 #include <sys/types.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace std;
 
-vector<ProcessPid> readProcessList()
+// Iterates over the process directories of /proc; everything is read relative to the /proc file
+// descriptor, so no paths need to be built per process
+class ProcDirectory
 {
-    vector<ProcessPid> ret;
+public:
+    // from the start, whatever other ProcDirectories of procFd have read already
+    explicit ProcDirectory(int procFd)
+       : m_dir(nullptr)
+    {
+        const int fd = procFd >= 0 ? openat(procFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+        if (fd >= 0 && !(m_dir = fdopendir(fd))) {
+            close(fd);
+        }
+    }
+    ~ProcDirectory()
+    {
+        if (m_dir) {
+            closedir(m_dir);
+        }
+    }
+    bool isOpen() const { return m_dir; }
+    // false at the end
+    bool next(unsigned int *pid)
+    {
+        while (const dirent *entry = readdir(m_dir)) {
+            // zero is not a valid pid and also the error return value of strtoul...
+            *pid = strtoul(entry->d_name, nullptr, 10);
+            if (*pid) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    DIR *m_dir;
+};
+
+static int openProc()
+{
+    return open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+}
+
+// Reads /proc/<pid>/<file> into buffer, which is zero terminated; the length read, or -1 if the file could
+// not be read, probably a harmless race - the process went away
+static ssize_t readProcFile(int procFd, unsigned int pid, const char *file, char *buffer, size_t size)
+{
+    char path[32];
+    snprintf(path, sizeof(path), "%u/%s", pid, file);
+    const int fd = openat(procFd, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t length;
+    do {
+        length = read(fd, buffer, size - 1);
+    } while (length < 0 && errno == EINTR);
+    close(fd);
+    buffer[max(length, ssize_t(0))] = '\0';
+    return length;
+}
+
+// for /proc/<pid>/comm: the name as long as the kernel keeps it, a newline and the terminating zero
+static const size_t nameBufferSize = maxProcessNameLength + 2;
 
-    DIR *dp = opendir ("/proc");
-    if (!dp) {
-        perror ("Couldn't open the /proc directory");
-        exit(-1);
+// false if the name could not be read
+static bool readProcessName(int procFd, unsigned int pid, char (&buffer)[nameBufferSize], size_t *length)
+{
+    const ssize_t readLength = readProcFile(procFd, pid, "comm", buffer, sizeof(buffer));
+    if (readLength <= 0) {
+        return false;
     }
+    *length = buffer[readLength - 1] == '\n' ? readLength - 1 : readLength;
+    return true;
+}
 
-    const string procPrefix = "/proc/";
-    const string statSuffix = "/stat";
-    string nameFromStat;
-    ProcessPid pp;
-    // For scripts and in certain other situations, /proc/<pid>/cmdline should be considered which we don't
-    // do - see pidof.c from the procps-ng for how to do it 100% correctly. It can probably be said that
-    // pidof is correct by definition.
-    while (dirent *ep = readdir(dp)) {
-        // zero is not a valid pid and also the error return value of strtoul...
-        pp.pid = strtoul(ep->d_name, nullptr, 10);
-        if (!pp.pid) {
-            continue;
-        }
-        ifstream statFile(procPrefix + ep->d_name + statSuffix);
-        if (!statFile.is_open()) {
-            continue; // probably a harmless race - the process went away
+// whether the file name of the argument at arg, which ends at end or earlier with a zero, is name
+static bool isProgram(const char *arg, const char *end, const string &name)
+{
+    const char *const argEnd = find(arg, end, '\0');
+    const char *fileName = argEnd;
+    while (fileName > arg && fileName[-1] != '/') {
+        fileName--;
+    }
+    return size_t(argEnd - fileName) == name.length() && equal(fileName, argEnd, name.begin());
+}
+
+// For scripts and in certain other situations, the name in /proc/<pid>/cmdline is what users know the
+// process by. This is a part of what pidof -x from procps-ng checks; it can probably be said that pidof
+// is correct by definition.
+static bool isProgramInCommandLine(int procFd, unsigned int pid, const string &name)
+{
+    // enough for the first two arguments unless they are very long paths
+    char buffer[4096];
+    const ssize_t length = readProcFile(procFd, pid, "cmdline", buffer, sizeof(buffer));
+    if (length <= 0) {
+        return false; // also kernel threads, which have no command line
+    }
+    const char *const end = buffer + length;
+    if (isProgram(buffer, end, name)) {
+        return true;
+    }
+    const char *const second = find(static_cast<const char *>(buffer), end, '\0') + 1;
+    return second < end && isProgram(second, end, name);
+}
+
+unsigned int findProcess(const string &name, bool matchCommandLine)
+{
+    const int procFd = openProc();
+    ProcDirectory dir(procFd);
+    if (!dir.isOpen()) {
+        if (procFd >= 0) {
+            close(procFd);
         }
-        statFile >> /* throw away the first value */ nameFromStat >> nameFromStat;
-        if (nameFromStat.length() < 2) {
+        return 0;
+    }
+    const size_t nameLength = min(name.length(), size_t(maxProcessNameLength));
+    const unsigned int ownPid = getpid();
+    unsigned int ret = 0;
+    // The first process whose command line has the name as an argument. A match of the name is better,
+    // even at a higher PID: with e.g. "vim server.py" or "sudo bash" around, server.py or bash is meant.
+    unsigned int commandLineMatch = 0;
+    unsigned int pid = 0;
+    char buffer[nameBufferSize];
+    size_t length = 0;
+    while (!ret && dir.next(&pid)) {
+        if (pid == ownPid) {
             continue;
         }
-        // "(my_process)" -> "my_process"
-        pp.name = nameFromStat.substr(1, nameFromStat.length() - 2);
-        ret.push_back(pp);
+        if (readProcessName(procFd, pid, buffer, &length) && length == nameLength &&
+            memcmp(buffer, name.data(), length) == 0) {
+            ret = pid;
+        } else if (matchCommandLine && !commandLineMatch && isProgramInCommandLine(procFd, pid, name)) {
+            commandLineMatch = pid;
+        }
+    }
+    close(procFd);
+    return ret ? ret : commandLineMatch;
+}
+
+ProcessIndex::ProcessIndex()
+   : m_procFd(openProc())
+{
+}
+
+ProcessIndex::~ProcessIndex()
+{
+    if (m_procFd >= 0) {
+        close(m_procFd);
     }
+}
 
-    closedir (dp);
+bool ProcessIndex::refresh()
+{
+    ProcDirectory dir(m_procFd);
+    if (!dir.isOpen()) {
+        return false;
+    }
+    m_pids.clear();
+    unsigned int pid = 0;
+    while (dir.next(&pid)) {
+        m_pids.push_back(pid);
+    }
+    // /proc lists processes in PID order, but that is not promised anywhere
+    sort(m_pids.begin(), m_pids.end());
+
+    // both lists are sorted by PID, so there is no need to search
+    m_newProcesses.clear();
+    size_t iOld = 0;
+    char buffer[nameBufferSize];
+    size_t length = 0;
+    for (unsigned int pid : m_pids) {
+        // the name of a known process can have changed, with execve() or prctl(PR_SET_NAME)
+        if (!readProcessName(m_procFd, pid, buffer, &length)) {
+            continue; // the process went away
+        }
+        while (iOld < m_processes.size() && m_processes[iOld].pid < pid) {
+            iOld++;
+        }
+        if (iOld < m_processes.size() && m_processes[iOld].pid == pid) {
+            m_newProcesses.push_back(move(m_processes[iOld]));
+            string &name = m_newProcesses.back().name;
+            if (name.length() != length || memcmp(name.data(), buffer, length) != 0) {
+                name.assign(buffer, length);
+            }
+        } else {
+            ProcessPid pp;
+            pp.pid = pid;
+            pp.name.assign(buffer, length);
+            m_newProcesses.push_back(move(pp));
+        }
+    }
+    m_processes.swap(m_newProcesses);
+    return true;
+}
 
-    return ret;
+const string *ProcessIndex::name(unsigned int pid) const
+{
+    const auto it = lower_bound(m_processes.begin(), m_processes.end(), pid,
+                                [](const ProcessPid &pp, unsigned int pid) { return pp.pid < pid; });
+    return it != m_processes.end() && it->pid == pid ? &it->name : nullptr;
 }
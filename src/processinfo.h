@@ -33,14 +33,47 @@
 #include <string>
 #include <vector>
 
+// The kernel keeps the first 15 characters of a process name (TASK_COMM_LEN - 1)
+static const unsigned int maxProcessNameLength = 15;
+
 struct ProcessPid
 {
     unsigned int pid;
     std::string name;
 };
 
-// Not a map because there are several ways to match with certain special cases like for shellscripts,
-// so the "natural" interface is a list on which one can do arbitrary matching.
-std::vector<ProcessPid> readProcessList();
+// The PID of the first process other than this one whose name is name, as far as the kernel keeps it (see
+// maxProcessNameLength), 0 if there is none. With matchCommandLine and no such process, the first process
+// whose program or script is name: the file name of the first or the second argument in /proc/<pid>/cmdline,
+// which finds e.g. "python3 server.py" as server.py, and names longer than the kernel keeps. Stops at the
+// first match of the name and reads nothing else of the processes, so it is much cheaper than
+// ProcessIndex::refresh().
+unsigned int findProcess(const std::string &name, bool matchCommandLine = false);
+
+// The names of all processes by PID, for users that look up names repeatedly. refresh() reads the name of
+// every process again, because execve() and prctl(PR_SET_NAME) change it, but it reuses the list and the
+// names that did not change, so that a refresh allocates only for new processes and new names.
+class ProcessIndex
+{
+public:
+    ProcessIndex();
+    ~ProcessIndex();
+    ProcessIndex(const ProcessIndex &) = delete;
+    ProcessIndex &operator=(const ProcessIndex &) = delete;
+
+    // false if /proc can't be read
+    bool refresh();
+    // sorted by PID
+    const std::vector<ProcessPid> &processes() const { return m_processes; }
+    // null if there is no process with the PID, as of the last refresh()
+    const std::string *name(unsigned int pid) const;
+
+private:
+    int m_procFd;
+    std::vector<ProcessPid> m_processes;
+    // for refresh(), to avoid allocating every time
+    std::vector<unsigned int> m_pids;
+    std::vector<ProcessPid> m_newProcesses;
+};
 
 #endif // PROCESSINFO_H
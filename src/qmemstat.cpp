@@ -29,28 +29,94 @@
 #include "processinfo.h"
 
 #include "mainwindow.h"
+#include "pageinfo.h"
+#include "pageinforecording.h"
 
 #include <iostream>
+#include <memory>
+#include <vector>
 #include <linux/kernel-page-flags.h>
 #include "linux-pm-bits.h"
 #include <QApplication>
 #include <QByteArray>
 
-static const uint maxProcessNameLength = 15; // with the way we use to read it
-
 static const uint defaultPort = 5550;
 
+static const uint defaultUpdateInterval = 50; // milliseconds
+
 using namespace std;
 
 static void printUsage()
 {
-    cerr << "Usage: qmemstat <pid>/<process-name>\n"
-         << "       qmemstat --client <host> [<port>]\n";
+    cerr << "Usage: qmemstat <pid>/<process-name> [--cmdline] [--interval <ms>] [<capture options>]\n"
+         << "       qmemstat --client <host> [<port>] [--interval <ms>] [<capture options>]\n"
+         << "       qmemstat --replay <file recorded with memstat --record>, without other options\n"
+         << "In client mode, the default interval is the server's. --cmdline also matches the process name\n"
+         << "against the program or script in the command line of processes, like memstat --cmdline.\n"
+         << "Capture options, in client mode applied by the server to what it sends to this client:\n"
+         << "    --range <start>-<end>\n"
+         << "                       capture only the addresses in the range, in hexadecimal; can be given\n"
+         << "                       several times\n"
+         << "    --backing-file <pattern>\n"
+         << "                       capture only regions whose backing file matches the shell wildcard pattern\n"
+         << "    --anon-only        capture only regions without a backing file, including [heap] and [stack]\n"
+         << "    --file-only        capture only regions with a backing file\n"
+         << "    --idle-pages       find the pages that were not accessed between two updates, for the\n"
+         << "                       \"Accessed / idle\" colors; not in client mode, where memstat --server\n"
+         << "                       takes it\n"
+         << "    --numa             record the NUMA node of each present page and the swap area of each\n"
+         << "                       swapped out page, for the \"NUMA node / swap area\" colors; local mode\n"
+         << "                       only\n";
+}
+
+// Removes the options that live modes have from args, and puts them into *interval (0 if not given),
+// *matchCommandLine and *options; false if one is invalid
+static bool takeOptions(vector<char *> *args, uint *interval, bool *matchCommandLine, CaptureOptions *options)
+{
+    CaptureFilter *const filter = &options->filter;
+    vector<char *> rest;
+    for (size_t i = 0; i < args->size(); i++) {
+        const QByteArray arg((*args)[i]);
+        const bool haveValue = i + 1 < args->size();
+        if (arg == "--interval" && haveValue) {
+            *interval = strtoul((*args)[++i], nullptr, 10);
+            if (!*interval) {
+                cerr << "Invalid interval " << (*args)[i] << '\n';
+                return false;
+            }
+        } else if (arg == "--range" && haveValue) {
+            if (!filter->addAddressRange((*args)[++i])) {
+                cerr << "Invalid address range " << (*args)[i] << '\n';
+                return false;
+            }
+        } else if (arg == "--backing-file" && haveValue) {
+            filter->backingFilePattern = (*args)[++i];
+        } else if (arg == "--anon-only") {
+            filter->kind = CaptureFilter::AnonymousOnly;
+        } else if (arg == "--file-only") {
+            filter->kind = CaptureFilter::FileOnly;
+        } else if (arg == "--idle-pages") {
+            options->trackIdlePages = true;
+        } else if (arg == "--numa") {
+            options->recordPlacement = true;
+        } else if (arg == "--cmdline") {
+            *matchCommandLine = true;
+        } else {
+            rest.push_back((*args)[i]);
+        }
+    }
+    args->swap(rest);
+    return true;
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc < 2) {
+    // the remaining arguments are positional and checked by count
+    vector<char *> args(argv, argv + argc);
+    uint interval = 0;
+    bool matchCommandLine = false;
+    CaptureOptions options;
+    if (!takeOptions(&args, &interval, &matchCommandLine, &options) || args.size() < 2) {
         printUsage();
         return -1;
     }
@@ -58,39 +124,51 @@ int main(int argc, char *argv[])
     int pid = -1;
     QByteArray host;
     uint port = defaultPort;
+    unique_ptr<PageInfoRecording> recording;
 
-    if (QByteArray(argv[1]) != QByteArray("--client")) {
-        if (argc != 2) {
+    if (QByteArray(args[1]) == QByteArray("--replay")) {
+        // a recording has what memstat --record captured, the options of live modes don't apply
+        if (args.size() != 3 || interval || matchCommandLine || !options.filter.isEmpty() ||
+            options.trackIdlePages || options.recordPlacement) {
+            printUsage();
+            return -1;
+        }
+        recording.reset(new PageInfoRecording());
+        if (!recording->open(args[2])) {
+            cerr << recording->errorString() << '\n';
+            return -1;
+        }
+        if (!recording->frameCount()) {
+            cerr << "The recording " << args[2] << " has no frames.\n";
+            return -1;
+        }
+    } else if (QByteArray(args[1]) != QByteArray("--client")) {
+        if (args.size() != 2) {
             printUsage();
             return -1;
         }
 
-        pid = strtoul(argv[1], nullptr, 10);
+        pid = strtoul(args[1], nullptr, 10);
 
         if (!pid) {
-            const string procName = string(argv[1]).substr(0, maxProcessNameLength);
-            for (const ProcessPid &pp : readProcessList()) {
-                if (pp.name == procName) {
-                    pid = pp.pid;
-                    break;
-                }
-            }
+            pid = findProcess(args[1], matchCommandLine);
         }
         if (!pid) {
-            cerr << "Found no such PID or process " << argv[1] << "!\n";
+            cerr << "Found no such PID or process " << args[1] << "!\n";
             return -1;
         }
     } else {
-        if (argc < 3 || argc > 4) {
+        if (args.size() < 3 || args.size() > 4 || options.trackIdlePages || options.recordPlacement ||
+            matchCommandLine) {
             printUsage();
             return -1;
         }
-        host = QByteArray(argv[2]);
+        host = QByteArray(args[2]);
 
-        if (argc == 4) {
-            port = strtoul(argv[3], nullptr, 10);
+        if (args.size() == 4) {
+            port = strtoul(args[3], nullptr, 10);
             if (!port) {
-                cerr << "Invalid port number" << argv[3] << '\n';
+                cerr << "Invalid port number" << args[3] << '\n';
                 printUsage();
                 return -1;
             }
@@ -99,12 +177,15 @@ int main(int argc, char *argv[])
 
     QApplication app(argc, argv);
     MainWindow *mainWindow = nullptr;
-    if (pid > 0) {
+    if (recording) {
+        cerr << "replay mode.\n";
+        mainWindow = new MainWindow(move(recording));
+    } else if (pid > 0) {
         cerr << "local mode.\n";
-        mainWindow = new MainWindow(pid);
+        mainWindow = new MainWindow(pid, interval ? interval : defaultUpdateInterval, options);
     } else {
         cerr << "client mode.\n";
-        mainWindow = new MainWindow(host, port);
+        mainWindow = new MainWindow(host, port, interval, options.filter);
     }
     mainWindow->show();
     return app.exec();